@@ -0,0 +1,390 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+// Encoder benchmark: encodes generated frames as fast as possible over a matrix of
+// resolutions, frame rates and pipeline depths and reports throughput, latency, bitrate and memory use.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "latencyreport.hpp"
+#include "packetwriter.hpp"
+#include "utility.hpp"
+#include "videoencoder.hpp"
+#include "vulkancontext.hpp"
+
+struct Resolution {
+    const char *name;
+    uint32_t width;
+    uint32_t height;
+};
+
+const Resolution RESOLUTIONS[] = {
+    {"720p", 1280, 720}, {"1080p", 1920, 1080}, {"1440p", 2560, 1440}, {"4K", 3840, 2160}};
+const uint32_t FRAME_RATES[] = {30, 60};
+const uint32_t PIPELINE_DEPTHS[] = {1, 2, 4};
+// average bitrates, the maximum bitrate is twice the average
+const uint64_t BITRATES[] = {2000000, 8000000, 20000000};
+
+struct BenchResult {
+    double framesPerSecond;
+    double submitToPacketP50Ms;
+    double submitToPacketP99Ms;
+    double encodeP50Ms;
+    double encodeP99Ms;
+    uint64_t bitstreamBytes;
+    double bitrateKbps;  // at the nominal frame rate
+    double encoderMemoryMiB;
+};
+
+class EncoderBenchmark {
+   public:
+    uint32_t frameCount = 300;
+    bool writeFiles = false;
+    std::string csvFileName;
+    std::string cacheFileName;  // encode capabilities and pipeline cache of the EncoderDevice
+    VideoEncoder::Preset preset = VideoEncoder::Preset::DEFAULT;
+    Codec codec = Codec::H264;
+
+    void run() {
+        context.init();
+        if (codec == Codec::H265 && !context.videoEncodeH265Supported) {
+            throw std::runtime_error("Error: H.265 encoding is not supported by the device");
+        }
+        const QueueFamilyIndices &indices = context.queueFamilyIndices;
+        encoderDevice.init(context.physicalDevice, context.device, context.allocator, indices.graphicsFamily.value(),
+                           context.graphicsQueue, indices.videoEncodeFamily.value(), context.videoEncodeQueues,
+                           cacheFileName);
+        std::FILE *csv = nullptr;
+        if (!csvFileName.empty()) {
+            csv = std::fopen(csvFileName.c_str(), "w");
+            if (!csv) {
+                throw std::runtime_error("Error: failed to open file: " + csvFileName);
+            }
+            std::fprintf(csv,
+                         "resolution,width,height,fps,pipeline_depth,target_kbps,frames_per_second,"
+                         "submit_to_packet_p50_ms,"
+                         "submit_to_packet_p99_ms,encode_p50_ms,encode_p99_ms,bitstream_bytes,bitrate_kbps,"
+                         "encoder_memory_mib,status\n");
+        }
+
+        std::printf("%-6s %4s %5s %7s %9s %10s %10s %10s %10s %10s %9s\n", "res", "fps", "depth", "target",
+                    "frames/s", "s2p p50", "s2p p99", "enc p50", "enc p99", "kbit/s", "mem MiB");
+        for (const Resolution &resolution : RESOLUTIONS) {
+            for (uint32_t fps : FRAME_RATES) {
+                for (uint32_t depth : PIPELINE_DEPTHS) {
+                    for (uint64_t bitrate : BITRATES) {
+                        VideoEncoder::Config config;
+                        config.fps = fps;
+                        config.pipelineDepth = depth;
+                        config.averageBitrate = bitrate;
+                        config.maxBitrate = bitrate * 2;
+                        config.preset = preset;
+                        config.codec = codec;
+                        const unsigned targetKbps = static_cast<unsigned>(bitrate / 1000);
+                        BenchResult result;
+                        try {
+                            result = runConfig(resolution, config);
+                        } catch (const std::exception &e) {
+                            // e.g. the resolution is above the maximum coded extent of the encoder
+                            std::printf("%-6s %4u %5u %7u failed: %s\n", resolution.name, fps, depth, targetKbps,
+                                        e.what());
+                            if (!images.empty()) {
+                                destroyInputImages();
+                            }
+                            // the configuration stays in the CSV, without metrics
+                            if (csv) {
+                                std::fprintf(csv, "%s,%u,%u,%u,%u,%u,,,,,,,,,failed\n", resolution.name,
+                                             resolution.width, resolution.height, fps, depth, targetKbps);
+                            }
+                            continue;
+                        }
+                        std::printf("%-6s %4u %5u %7u %9.1f %10.3f %10.3f %10.3f %10.3f %10.0f %9.1f\n",
+                                    resolution.name, fps, depth, targetKbps, result.framesPerSecond,
+                                    result.submitToPacketP50Ms, result.submitToPacketP99Ms, result.encodeP50Ms,
+                                    result.encodeP99Ms, result.bitrateKbps, result.encoderMemoryMiB);
+                        if (csv) {
+                            std::fprintf(csv, "%s,%u,%u,%u,%u,%u,%.2f,%.4f,%.4f,%.4f,%.4f,%llu,%.1f,%.2f,ok\n",
+                                         resolution.name, resolution.width, resolution.height, fps, depth,
+                                         targetKbps, result.framesPerSecond, result.submitToPacketP50Ms,
+                                         result.submitToPacketP99Ms, result.encodeP50Ms, result.encodeP99Ms,
+                                         static_cast<unsigned long long>(result.bitstreamBytes), result.bitrateKbps,
+                                         result.encoderMemoryMiB);
+                        }
+                    }
+                }
+            }
+        }
+        if (csv) {
+            std::fclose(csv);
+        }
+        encoderDevice.printEncodeQueueStats(stdout);
+        encoderDevice.deinit();
+        context.deinit();
+    }
+
+   private:
+    VulkanContext context;
+    EncoderDevice encoderDevice;  // the conversion pipelines are created once for all configurations
+    std::vector<VkImage> images;
+    std::vector<VmaAllocation> imageAllocations;
+    std::vector<VkImageView> imageViews;
+    std::vector<VkCommandBuffer> commandBuffers;
+
+    BenchResult runConfig(const Resolution &resolution, const VideoEncoder::Config &config) {
+        // one more image than frames in the encoder pipeline, like in the sample application
+        createInputImages(resolution.width, resolution.height, config.pipelineDepth + 1);
+
+        const VkDeviceSize memoryBefore = getAllocatedBytes();
+        VideoEncoder videoEncoder;
+        videoEncoder.init(encoderDevice, images, imageViews, resolution.width, resolution.height, config);
+        const VkDeviceSize encoderMemory = getAllocatedBytes() - memoryBefore;
+
+        PacketWriter packetWriter;
+        if (writeFiles) {
+            packetWriter.open("bench_" + std::string(resolution.name) + "_" + std::to_string(config.fps) + "fps_d" +
+                              std::to_string(config.pipelineDepth) + "_" +
+                              std::to_string(config.averageBitrate / 1000) + "kbps" +
+                              (config.codec == Codec::H265 ? ".265" : ".264"));
+        }
+        LatencyReport latencyReport;
+        uint64_t bitstreamBytes = 0;
+        auto handlePacket = [&](EncodedPacket &&packet) {
+            bitstreamBytes += packet.size();
+            if (!packet.isParameterSet()) {
+                const FrameTimings &timings = packet.timings();
+                latencyReport.addFrame(FrameLatency{
+                    .frameIndex = packet.frameIndex(),
+                    .renderMs = NAN,
+                    .convertMs = timings.convertMs,
+                    .encodeQueueWaitMs = timings.encodeQueueWaitMs,
+                    .encodeMs = timings.encodeMs,
+                    .submitToPacketMs =
+                        std::chrono::duration<double, std::milli>(timings.readbackTime - timings.submitTime).count(),
+                    .glassToPacketMs = NAN});
+            }
+            if (writeFiles) {
+                packetWriter.write(std::move(packet));
+            }
+        };
+
+        const auto startTime = std::chrono::steady_clock::now();
+        EncodedPacket packet;
+        for (uint32_t frame = 0; frame < frameCount; frame++) {
+            const uint32_t imageIx = videoEncoder.acquireInputImage();
+            renderFrame(imageIx, frame, resolution.width, resolution.height);
+            while (videoEncoder.tryFinishEncode(packet)) {
+                handlePacket(std::move(packet));
+            }
+            while (videoEncoder.isPipelineFull()) {
+                videoEncoder.finishEncode(packet);
+                handlePacket(std::move(packet));
+            }
+            videoEncoder.queueEncode(imageIx);
+        }
+        while (videoEncoder.getPendingFrameCount() > 0) {
+            videoEncoder.finishEncode(packet);
+            handlePacket(std::move(packet));
+        }
+        packet.release();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+        packetWriter.close();
+        videoEncoder.deinit();
+        destroyInputImages();
+
+        return BenchResult{
+            .framesPerSecond = frameCount / seconds,
+            .submitToPacketP50Ms = latencyReport.percentile(&FrameLatency::submitToPacketMs, 50),
+            .submitToPacketP99Ms = latencyReport.percentile(&FrameLatency::submitToPacketMs, 99),
+            .encodeP50Ms = latencyReport.percentile(&FrameLatency::encodeMs, 50),
+            .encodeP99Ms = latencyReport.percentile(&FrameLatency::encodeMs, 99),
+            .bitstreamBytes = bitstreamBytes,
+            .bitrateKbps = bitstreamBytes * 8.0 * config.fps / frameCount / 1000.0,
+            .encoderMemoryMiB = encoderMemory / (1024.0 * 1024.0)};
+    }
+
+    // device memory allocated through VMA, which includes everything the encoder allocates
+    VkDeviceSize getAllocatedBytes() {
+        VmaTotalStatistics statistics;
+        vmaCalculateStatistics(context.allocator, &statistics);
+        return statistics.total.statistics.allocationBytes;
+    }
+
+    void createInputImages(uint32_t width, uint32_t height, uint32_t count) {
+        images.resize(count);
+        imageAllocations.resize(count);
+        imageViews.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            const VkImageCreateInfo imageCreateInfo{
+                .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                .imageType = VK_IMAGE_TYPE_2D,
+                .format = VK_FORMAT_R8G8B8A8_UNORM,
+                .extent = {width, height, 1},
+                .mipLevels = 1,
+                .arrayLayers = 1,
+                .samples = VK_SAMPLE_COUNT_1_BIT,
+                .tiling = VK_IMAGE_TILING_OPTIMAL,
+                .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
+                .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED};
+            const VmaAllocationCreateInfo allocCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, .usage = VMA_MEMORY_USAGE_AUTO, .priority = 1.0f};
+            VK_CHECK(vmaCreateImage(context.allocator, &imageCreateInfo, &allocCreateInfo, &images[i],
+                                    &imageAllocations[i], nullptr));
+
+            const VkImageViewCreateInfo viewInfo{.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                                                 .image = images[i],
+                                                 .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                                                 .format = VK_FORMAT_R8G8B8A8_UNORM,
+                                                 .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                                                      .baseMipLevel = 0,
+                                                                      .levelCount = 1,
+                                                                      .baseArrayLayer = 0,
+                                                                      .layerCount = 1}};
+            VK_CHECK(vkCreateImageView(context.device, &viewInfo, nullptr, &imageViews[i]));
+        }
+
+        commandBuffers.resize(count);
+        const VkCommandBufferAllocateInfo allocInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                                                    .commandPool = context.commandPool,
+                                                    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                                                    .commandBufferCount = count};
+        VK_CHECK(vkAllocateCommandBuffers(context.device, &allocInfo, commandBuffers.data()));
+    }
+
+    void destroyInputImages() {
+        // the encoder has waited for its frames, but the last render passes may still be running
+        VK_CHECK(vkQueueWaitIdle(context.graphicsQueue));
+        vkFreeCommandBuffers(context.device, context.commandPool, static_cast<uint32_t>(commandBuffers.size()),
+                             commandBuffers.data());
+        for (size_t i = 0; i < images.size(); i++) {
+            vkDestroyImageView(context.device, imageViews[i], nullptr);
+            vmaDestroyImage(context.allocator, images[i], imageAllocations[i]);
+        }
+        images.clear();
+        imageAllocations.clear();
+        imageViews.clear();
+        commandBuffers.clear();
+    }
+
+    // generates a frame without a graphics pipeline: a changing background with a moving box
+    void renderFrame(uint32_t imageIx, uint32_t frameNumber, uint32_t width, uint32_t height) {
+        VkCommandBuffer commandBuffer = commandBuffers[imageIx];
+        const VkCommandBufferBeginInfo beginInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                                                 .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
+        VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+        const VkImageMemoryBarrier2 imageMemoryBarrier{.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                                                       .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                                       .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
+                                                       .dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                                       .dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                                                       .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                                                       .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                                       .image = images[imageIx],
+                                                       .subresourceRange = {
+                                                           .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                                           .baseMipLevel = 0,
+                                                           .levelCount = 1,
+                                                           .baseArrayLayer = 0,
+                                                           .layerCount = 1,
+                                                       }};
+        const VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
+                                                 .imageMemoryBarrierCount = 1,
+                                                 .pImageMemoryBarriers = &imageMemoryBarrier};
+        vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+
+        const float t = frameNumber / 60.0f;
+        const VkRenderingAttachmentInfo colorAttachmentInfo{
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+            .imageView = imageViews[imageIx],
+            .imageLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .clearValue = {{0.5f + 0.5f * std::sin(t), 0.5f + 0.5f * std::sin(t * 1.3f), 0.5f, 1.0f}}};
+        const VkRenderingInfo renderInfo{
+            .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+            .renderArea = {{0, 0}, {width, height}},
+            .layerCount = 1,
+            .colorAttachmentCount = 1,
+            .pColorAttachments = &colorAttachmentInfo,
+        };
+        vkCmdBeginRendering(commandBuffer, &renderInfo);
+        const uint32_t boxSize = height / 4;
+        const VkClearAttachment boxAttachment{.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                              .colorAttachment = 0,
+                                              .clearValue = {{1.0f, 1.0f, 1.0f, 1.0f}}};
+        const VkClearRect boxRect{
+            .rect = {{static_cast<int32_t>((frameNumber * 8) % (width - boxSize)),
+                      static_cast<int32_t>((frameNumber * 4) % (height - boxSize))},
+                     {boxSize, boxSize}},
+            .baseArrayLayer = 0,
+            .layerCount = 1};
+        vkCmdClearAttachments(commandBuffer, 1, &boxAttachment, 1, &boxRect);
+        vkCmdEndRendering(commandBuffer);
+
+        VK_CHECK(vkEndCommandBuffer(commandBuffer));
+        const VkSubmitInfo submitInfo{
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO, .commandBufferCount = 1, .pCommandBuffers = &commandBuffer};
+        VK_CHECK(vkQueueSubmit(context.graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE));
+    }
+};
+
+int main(int argc, char *argv[]) {
+    EncoderBenchmark bench;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            bench.frameCount = static_cast<uint32_t>(std::atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--write") == 0) {
+            bench.writeFiles = true;
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            bench.csvFileName = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            bench.cacheFileName = argv[++i];
+        } else if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc &&
+                   VideoEncoder::parsePreset(argv[i + 1], bench.preset)) {
+            i++;
+        } else if (strcmp(argv[i], "--codec") == 0 && i + 1 < argc &&
+                   VideoEncoder::parseCodec(argv[i + 1], bench.codec)) {
+            i++;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--frames <count>] [--write] [--csv <file>] [--cache <file>]"
+                      << " [--preset <default|low-latency|high-quality>] [--codec <h264|h265>]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (bench.frameCount == 0) {
+        std::cerr << "frame count must be positive" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        bench.run();
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
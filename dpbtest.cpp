@@ -0,0 +1,378 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+// Reference picture management checks: runs h264::Dpb and h265::Dpb over P, long-term reference, B and temporal
+// layer sequences the way the codecs drive them and checks the marking operations, the RPS and the list order.
+// Needs no Vulkan device, returns non-zero if a check fails.
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <vector>
+
+#include "h264dpb.hpp"
+#include "h265dpb.hpp"
+
+static int failureCount = 0;
+
+#define CHECK(condition)                                                                 \
+    do {                                                                                 \
+        if (!(condition)) {                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failureCount++;                                                              \
+        }                                                                                \
+    } while (0)
+
+using Frames = std::vector<uint32_t>;
+
+// frame_num, POC and the reference marking as H264Codec handles them, the sequence starts with an IDR frame
+class H264Sequence {
+   public:
+    H264Sequence(uint32_t maxRefFrames, uint32_t maxLongTermRefFrames) {
+        m_log2MaxFrameNum = h264::Dpb::getLog2MaxFrameNum(maxRefFrames);
+        m_dpb.init(maxRefFrames + 1, maxRefFrames, maxLongTermRefFrames, m_log2MaxFrameNum);
+    }
+
+    void begin(uint32_t frameIndex, StdVideoH264PictureType type, bool isReference, uint32_t maxL0, uint32_t maxL1 = 0,
+               bool markLongTerm = false, uint32_t temporalId = 0) {
+        if (type == STD_VIDEO_H264_PICTURE_TYPE_IDR) {
+            m_frameNum = 0;
+        }
+        m_isReference = isReference;
+        m_dpb.beginPicture(m_frameNum, static_cast<int32_t>(frameIndex * 2), frameIndex, type, isReference,
+                           markLongTerm, temporalId);
+        m_dpb.getReferenceLists(maxL0, maxL1, lists);
+    }
+
+    void end() {
+        m_dpb.endPicture();
+        if (m_isReference) {
+            m_frameNum = (m_frameNum + 1) % (1u << m_log2MaxFrameNum);
+        }
+    }
+
+    // the frame indices in the lists of the current picture
+    Frames list0() const { return getFrames(lists.RefPicList0, lists.num_ref_idx_l0_active_minus1); }
+    Frames list1() const { return getFrames(lists.RefPicList1, lists.num_ref_idx_l1_active_minus1); }
+    // the frame indices of the references, oldest first
+    Frames references() const {
+        Frames frames;
+        for (uint32_t slot = 0; slot < m_dpb.getSlotCount(); slot++) {
+            if (m_dpb.getPicture(slot).isReference) {
+                frames.push_back(m_dpb.getPicture(slot).frameIndex);
+            }
+        }
+        std::sort(frames.begin(), frames.end());
+        return frames;
+    }
+    // true if no short-term reference has the frame_num of the current picture (7.4.3)
+    bool hasUniqueFrameNum() const {
+        for (uint32_t slot = 0; slot < m_dpb.getSlotCount(); slot++) {
+            const h264::Dpb::Picture& picture = m_dpb.getPicture(slot);
+            if (picture.isReference && !picture.isLongTerm && picture.frameNum == m_frameNum) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    h264::Dpb& dpb() { return m_dpb; }
+
+    StdVideoEncodeH264ReferenceListsInfo lists;
+
+   private:
+    Frames getFrames(const uint8_t* list, uint8_t activeMinus1) const {
+        Frames frames;
+        for (uint32_t i = 0; i <= activeMinus1 && list[i] != STD_VIDEO_H264_NO_REFERENCE_PICTURE; i++) {
+            frames.push_back(m_dpb.getPicture(list[i]).frameIndex);
+        }
+        return frames;
+    }
+
+    h264::Dpb m_dpb;
+    uint32_t m_log2MaxFrameNum;
+    uint32_t m_frameNum{0};
+    bool m_isReference{false};
+};
+
+static Frames getMarkingOps(const StdVideoEncodeH264ReferenceListsInfo& lists) {
+    Frames ops;
+    for (uint32_t i = 0; i < lists.refPicMarkingOpCount; i++) {
+        ops.push_back(static_cast<uint32_t>(lists.pRefPicMarkingOperations[i].memory_management_control_operation));
+    }
+    return ops;
+}
+
+// P frames with the largest DPB: the sliding window keeps the newest 16 frames, newest first in list 0, also after
+// frame_num has wrapped
+static void testH264SlidingWindow() {
+    const uint32_t refs = 16;
+    H264Sequence sequence(refs, 0);
+    for (uint32_t f = 0; f < 100; f++) {
+        sequence.begin(f, f == 0 ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P, true, refs);
+        CHECK(sequence.hasUniqueFrameNum());
+        Frames expected;
+        for (uint32_t r = 1; f > 0 && r <= std::min(f, refs); r++) {
+            expected.push_back(f - r);
+        }
+        CHECK(sequence.list0() == expected);
+        CHECK(sequence.lists.refPicMarkingOpCount == 0);
+        CHECK(sequence.lists.flags.ref_pic_list_modification_flag_l0 == 0);
+        sequence.end();
+    }
+}
+
+// long-term references: MMCO 4 once after the IDR frame, MMCO 6 for each long-term frame, MMCO 1 if the DPB is
+// full, long-term references after the short-term ones by LongTermPicNum
+static void testH264LongTerm() {
+    H264Sequence sequence(3, 2);
+    sequence.begin(0, STD_VIDEO_H264_PICTURE_TYPE_IDR, true, 3);
+    sequence.end();
+
+    sequence.begin(1, STD_VIDEO_H264_PICTURE_TYPE_P, true, 3, 0, true);
+    CHECK(sequence.dpb().isAdaptiveMarking());
+    CHECK(getMarkingOps(sequence.lists) == Frames({4, 6, 0}));
+    CHECK(sequence.lists.pRefPicMarkingOperations[0].max_long_term_frame_idx_plus1 == 2);
+    CHECK(sequence.lists.pRefPicMarkingOperations[1].long_term_frame_idx == 0);
+    CHECK(sequence.list0() == Frames({0}));
+    sequence.end();
+
+    sequence.begin(2, STD_VIDEO_H264_PICTURE_TYPE_P, true, 3);
+    CHECK(!sequence.dpb().isAdaptiveMarking());
+    CHECK(sequence.list0() == Frames({0, 1}));
+    sequence.end();
+
+    // the DPB is full, so the oldest short-term frame (0) is unmarked explicitly: frame_num 3 - PicNum 0 - 1
+    sequence.begin(3, STD_VIDEO_H264_PICTURE_TYPE_P, true, 3, 0, true);
+    CHECK(getMarkingOps(sequence.lists) == Frames({1, 6, 0}));
+    CHECK(sequence.lists.pRefPicMarkingOperations[0].difference_of_pic_nums_minus1 == 2);
+    CHECK(sequence.lists.pRefPicMarkingOperations[1].long_term_frame_idx == 1);
+    CHECK(sequence.list0() == Frames({2, 0, 1}));
+    sequence.end();
+    CHECK(sequence.references() == Frames({1, 2, 3}));
+
+    sequence.begin(4, STD_VIDEO_H264_PICTURE_TYPE_P, true, 3);
+    CHECK(sequence.list0() == Frames({2, 1, 3}));
+    sequence.end();
+    CHECK(sequence.references() == Frames({1, 3, 4}));
+
+    // the receiver lost frame 4: only the long-term references are left, newest first with list modification
+    CHECK(sequence.dpb().invalidateAfter(3));
+    sequence.begin(5, STD_VIDEO_H264_PICTURE_TYPE_P, true, 3);
+    CHECK(sequence.list0() == Frames({3, 1}));
+    CHECK(sequence.lists.flags.ref_pic_list_modification_flag_l0 == 1);
+    CHECK(sequence.lists.refList0ModOpCount == 3);
+    CHECK(sequence.lists.pRefList0ModOperations[0].modification_of_pic_nums_idc ==
+          STD_VIDEO_H264_MODIFICATION_OF_PIC_NUMS_IDC_LONG_TERM);
+    CHECK(sequence.lists.pRefList0ModOperations[0].long_term_pic_num == 1);
+    CHECK(sequence.lists.pRefList0ModOperations[1].long_term_pic_num == 0);
+    CHECK(sequence.lists.pRefList0ModOperations[2].modification_of_pic_nums_idc ==
+          STD_VIDEO_H264_MODIFICATION_OF_PIC_NUMS_IDC_END);
+    sequence.end();
+}
+
+// one B frame between the P frames, encoded after the following P frame: list 0 by descending and list 1 by
+// ascending POC around the B frame
+static void testH264BFrames() {
+    H264Sequence sequence(2, 0);
+    sequence.begin(0, STD_VIDEO_H264_PICTURE_TYPE_IDR, true, 2);
+    sequence.end();
+    sequence.begin(2, STD_VIDEO_H264_PICTURE_TYPE_P, true, 2);
+    CHECK(sequence.list0() == Frames({0}));
+    sequence.end();
+    sequence.begin(1, STD_VIDEO_H264_PICTURE_TYPE_B, false, 2, 1);
+    CHECK(sequence.list0() == Frames({0, 2}));
+    CHECK(sequence.list1() == Frames({2}));
+    CHECK(sequence.lists.flags.ref_pic_list_modification_flag_l0 == 0);
+    CHECK(sequence.lists.flags.ref_pic_list_modification_flag_l1 == 0);
+    sequence.end();
+    sequence.begin(4, STD_VIDEO_H264_PICTURE_TYPE_P, true, 2);
+    CHECK(sequence.list0() == Frames({2, 0}));
+    sequence.end();
+    CHECK(sequence.references() == Frames({2, 4}));
+    sequence.begin(3, STD_VIDEO_H264_PICTURE_TYPE_B, false, 2, 1);
+    CHECK(sequence.list0() == Frames({2, 4}));
+    CHECK(sequence.list1() == Frames({4}));
+    sequence.end();
+}
+
+static uint32_t getDyadicTemporalId(uint32_t frameIndex, uint32_t layerCount) {
+    const uint32_t position = frameIndex % (1u << (layerCount - 1));
+    return position == 0 ? 0 : layerCount - 1 - std::countr_zero(position);
+}
+
+// three dyadic temporal layers, the top one without references: a frame only references the same or lower layers,
+// which needs a list modification if a higher layer reference comes first
+static void testH264TemporalLayers() {
+    const uint32_t layerCount = 3;
+    const Frames expectedList0[] = {{}, {0}, {0}, {2, 0}, {0}, {4, 2}, {4, 2}, {6, 4}, {4}};
+    H264Sequence sequence(2, 0);
+    for (uint32_t f = 0; f < std::size(expectedList0); f++) {
+        const uint32_t temporalId = getDyadicTemporalId(f, layerCount);
+        sequence.begin(f, f == 0 ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P,
+                       temporalId < layerCount - 1, 2, 0, false, temporalId);
+        CHECK(sequence.list0() == expectedList0[f]);
+        if (f == 4 || f == 8) {
+            // frame_num 2 - PicNum 0 (frame 0) - 1 and 4 - 2 (frame 4) - 1
+            CHECK(sequence.lists.refList0ModOpCount == 2);
+            CHECK(sequence.lists.pRefList0ModOperations[0].modification_of_pic_nums_idc ==
+                  STD_VIDEO_H264_MODIFICATION_OF_PIC_NUMS_IDC_SHORT_TERM_SUBTRACT);
+            CHECK(sequence.lists.pRefList0ModOperations[0].abs_diff_pic_num_minus1 == 1);
+        } else {
+            CHECK(sequence.lists.flags.ref_pic_list_modification_flag_l0 == 0);
+        }
+        sequence.end();
+    }
+}
+
+// POC and the references as H265Codec handles them, the sequence starts with an IDR frame
+class H265Sequence {
+   public:
+    explicit H265Sequence(uint32_t maxRefPics) { m_dpb.init(maxRefPics + 1, maxRefPics); }
+
+    void begin(uint32_t frameIndex, StdVideoH265PictureType type, bool isReference, uint32_t maxL0, uint32_t maxL1 = 0,
+               uint32_t temporalId = 0) {
+        m_dpb.beginPicture(static_cast<int32_t>(frameIndex), frameIndex, type, isReference, temporalId);
+        m_dpb.getReferenceLists(maxL0, maxL1, lists, rps);
+    }
+
+    void end() { m_dpb.endPicture(); }
+
+    Frames list0() const { return getFrames(lists.RefPicList0, lists.num_ref_idx_l0_active_minus1); }
+    Frames list1() const { return getFrames(lists.RefPicList1, lists.num_ref_idx_l1_active_minus1); }
+    // delta_poc_s0_minus1 / delta_poc_s1_minus1 of the RPS
+    Frames negativeDeltas() const {
+        return Frames(rps.delta_poc_s0_minus1, rps.delta_poc_s0_minus1 + rps.num_negative_pics);
+    }
+    Frames positiveDeltas() const {
+        return Frames(rps.delta_poc_s1_minus1, rps.delta_poc_s1_minus1 + rps.num_positive_pics);
+    }
+
+    h265::Dpb& dpb() { return m_dpb; }
+
+    StdVideoEncodeH265ReferenceListsInfo lists;
+    StdVideoH265ShortTermRefPicSet rps;
+
+   private:
+    Frames getFrames(const uint8_t* list, uint8_t activeMinus1) const {
+        Frames frames;
+        for (uint32_t i = 0; i <= activeMinus1 && list[i] != STD_VIDEO_H265_NO_REFERENCE_PICTURE; i++) {
+            frames.push_back(m_dpb.getPicture(list[i]).frameIndex);
+        }
+        return frames;
+    }
+
+    h265::Dpb m_dpb;
+};
+
+// P frames: the RPS keeps the newest four frames, the first two are used by the current picture, newest first
+static void testH265PFrames() {
+    H265Sequence sequence(4);
+    for (uint32_t f = 0; f < 20; f++) {
+        sequence.begin(f, f == 0 ? STD_VIDEO_H265_PICTURE_TYPE_IDR : STD_VIDEO_H265_PICTURE_TYPE_P, true, 2);
+        const uint32_t refCount = std::min(f, 4u);
+        CHECK(sequence.negativeDeltas() == Frames(refCount, 0));
+        CHECK(sequence.rps.num_positive_pics == 0);
+        CHECK(sequence.rps.used_by_curr_pic_s0_flag == (1u << std::min(refCount, 2u)) - 1);
+        Frames expected;
+        for (uint32_t r = 1; f > 0 && r <= std::min(f, 2u); r++) {
+            expected.push_back(f - r);
+        }
+        CHECK(sequence.list0() == expected);
+        sequence.end();
+    }
+}
+
+// one B frame between the P frames, encoded after the following P frame
+static void testH265BFrames() {
+    H265Sequence sequence(2);
+    sequence.begin(0, STD_VIDEO_H265_PICTURE_TYPE_IDR, true, 2);
+    sequence.end();
+    sequence.begin(2, STD_VIDEO_H265_PICTURE_TYPE_P, true, 2);
+    CHECK(sequence.list0() == Frames({0}));
+    CHECK(sequence.negativeDeltas() == Frames({1}));
+    sequence.end();
+    sequence.begin(1, STD_VIDEO_H265_PICTURE_TYPE_B, false, 2, 1);
+    CHECK(sequence.list0() == Frames({0, 2}));
+    CHECK(sequence.list1() == Frames({2}));
+    CHECK(sequence.negativeDeltas() == Frames({0}));
+    CHECK(sequence.positiveDeltas() == Frames({0}));
+    CHECK(sequence.rps.used_by_curr_pic_s0_flag == 1 && sequence.rps.used_by_curr_pic_s1_flag == 1);
+    sequence.end();
+    sequence.begin(4, STD_VIDEO_H265_PICTURE_TYPE_P, true, 2);
+    CHECK(sequence.list0() == Frames({2, 0}));
+    CHECK(sequence.negativeDeltas() == Frames({1, 1}));
+    sequence.end();
+    // frame 0 was the oldest in encode order
+    sequence.begin(3, STD_VIDEO_H265_PICTURE_TYPE_B, false, 2, 1);
+    CHECK(sequence.list0() == Frames({2, 4}));
+    CHECK(sequence.list1() == Frames({4}));
+    CHECK(sequence.negativeDeltas() == Frames({0}));
+    CHECK(sequence.positiveDeltas() == Frames({0}));
+    sequence.end();
+}
+
+// three dyadic temporal sub-layers: references of higher sub-layers stay in the RPS but are not used
+static void testH265TemporalLayers() {
+    const uint32_t layerCount = 3;
+    const Frames expectedList0[] = {{}, {0}, {0}, {2, 0}, {0}, {4, 2}, {4, 2}, {6, 4}, {4}};
+    H265Sequence sequence(2);
+    for (uint32_t f = 0; f < std::size(expectedList0); f++) {
+        const uint32_t temporalId = getDyadicTemporalId(f, layerCount);
+        sequence.begin(f, f == 0 ? STD_VIDEO_H265_PICTURE_TYPE_IDR : STD_VIDEO_H265_PICTURE_TYPE_P,
+                       temporalId < layerCount - 1, 2, 0, temporalId);
+        CHECK(sequence.list0() == expectedList0[f]);
+        if (f == 4 || f == 8) {
+            CHECK(sequence.rps.num_negative_pics == 2);
+            CHECK(sequence.rps.used_by_curr_pic_s0_flag == 2);
+        }
+        sequence.end();
+    }
+}
+
+// loss recovery: the references after the acknowledged frame leave the RPS
+static void testH265Invalidation() {
+    H265Sequence sequence(3);
+    for (uint32_t f = 0; f < 4; f++) {
+        sequence.begin(f, f == 0 ? STD_VIDEO_H265_PICTURE_TYPE_IDR : STD_VIDEO_H265_PICTURE_TYPE_P, true, 3);
+        sequence.end();
+    }
+    CHECK(sequence.dpb().invalidateAfter(1));
+    sequence.begin(4, STD_VIDEO_H265_PICTURE_TYPE_P, true, 3);
+    CHECK(sequence.list0() == Frames({1}));
+    CHECK(sequence.negativeDeltas() == Frames({2}));
+    sequence.end();
+    CHECK(!sequence.dpb().invalidateAfter(0));
+}
+
+int main() {
+    testH264SlidingWindow();
+    testH264LongTerm();
+    testH264BFrames();
+    testH264TemporalLayers();
+    testH265PFrames();
+    testH265BFrames();
+    testH265TemporalLayers();
+    testH265Invalidation();
+    if (failureCount > 0) {
+        fprintf(stderr, "%d checks failed\n", failureCount);
+        return EXIT_FAILURE;
+    }
+    printf("all checks passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,577 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "encoderdevice.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "utility.hpp"
+
+// bumped when the layout of the cache file or of EncodeCapabilities changes
+static const uint32_t CACHE_FILE_VERSION = 4;
+
+static std::vector<VkVideoFormatPropertiesKHR> getVideoFormats(VkPhysicalDevice physicalDevice,
+                                                               const VkVideoProfileListInfoKHR& profileList,
+                                                               VkImageUsageFlags imageUsage) {
+    const VkPhysicalDeviceVideoFormatInfoKHR videoFormatInfo{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_FORMAT_INFO_KHR,
+        .pNext = &profileList,
+        .imageUsage = imageUsage};
+    uint32_t videoFormatPropertyCount;
+    VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(physicalDevice, &videoFormatInfo, &videoFormatPropertyCount,
+                                                         nullptr));
+    std::vector<VkVideoFormatPropertiesKHR> videoFormatProperties(
+        videoFormatPropertyCount, {.sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR});
+    VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(physicalDevice, &videoFormatInfo, &videoFormatPropertyCount,
+                                                         videoFormatProperties.data()));
+    return videoFormatProperties;
+}
+
+static EncoderDevice::EncodeCapabilities queryEncodeCapabilities(VkPhysicalDevice physicalDevice,
+                                                                 const EncoderDevice::EncodeProfile& profile) {
+    const VkVideoEncodeUsageInfoKHR usageInfo{.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_USAGE_INFO_KHR,
+                                              .videoUsageHints = profile.usageHints,
+                                              .videoContentHints = profile.contentHints,
+                                              .tuningMode = profile.tuningMode};
+    const bool isH265 = profile.codecOperation == VK_VIDEO_CODEC_OPERATION_ENCODE_H265_BIT_KHR;
+    const VkVideoEncodeH264ProfileInfoKHR h264ProfileInfo{
+        .sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_PROFILE_INFO_KHR,
+        .pNext = &usageInfo,
+        .stdProfileIdc = static_cast<StdVideoH264ProfileIdc>(profile.profileIdc)};
+    const VkVideoEncodeH265ProfileInfoKHR h265ProfileInfo{
+        .sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_PROFILE_INFO_KHR,
+        .pNext = &usageInfo,
+        .stdProfileIdc = static_cast<StdVideoH265ProfileIdc>(profile.profileIdc)};
+    const VkVideoProfileInfoKHR videoProfile{.sType = VK_STRUCTURE_TYPE_VIDEO_PROFILE_INFO_KHR,
+                                             .pNext = isH265 ? static_cast<const void*>(&h265ProfileInfo)
+                                                             : static_cast<const void*>(&h264ProfileInfo),
+                                             .videoCodecOperation = profile.codecOperation,
+                                             .chromaSubsampling = VK_VIDEO_CHROMA_SUBSAMPLING_420_BIT_KHR,
+                                             .lumaBitDepth = VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR,
+                                             .chromaBitDepth = VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR};
+    const VkVideoProfileListInfoKHR videoProfileList{
+        .sType = VK_STRUCTURE_TYPE_VIDEO_PROFILE_LIST_INFO_KHR, .profileCount = 1, .pProfiles = &videoProfile};
+
+    EncoderDevice::EncodeCapabilities caps{};
+    caps.h264Capabilities.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_CAPABILITIES_KHR;
+    caps.h265Capabilities.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_CAPABILITIES_KHR;
+    caps.encodeCapabilities.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_CAPABILITIES_KHR;
+    caps.encodeCapabilities.pNext =
+        isH265 ? static_cast<void*>(&caps.h265Capabilities) : static_cast<void*>(&caps.h264Capabilities);
+    caps.capabilities.sType = VK_STRUCTURE_TYPE_VIDEO_CAPABILITIES_KHR;
+    caps.capabilities.pNext = &caps.encodeCapabilities;
+#ifdef VK_KHR_video_encode_quantization_map
+    VkVideoEncodeQuantizationMapCapabilitiesKHR quantizationMapCapabilities{
+        .sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUANTIZATION_MAP_CAPABILITIES_KHR};
+    if (profile.quantizationMap) {
+        quantizationMapCapabilities.pNext = caps.encodeCapabilities.pNext;
+        caps.encodeCapabilities.pNext = &quantizationMapCapabilities;
+    }
+#endif
+    VK_CHECK(vkGetPhysicalDeviceVideoCapabilitiesKHR(physicalDevice, &videoProfile, &caps.capabilities));
+
+    const uint32_t qualityLevelCount =
+        std::min(caps.encodeCapabilities.maxQualityLevels, EncoderDevice::MAX_QUALITY_LEVELS);
+    for (uint32_t level = 0; level < qualityLevelCount; level++) {
+        const VkPhysicalDeviceVideoEncodeQualityLevelInfoKHR qualityLevelInfo{
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_ENCODE_QUALITY_LEVEL_INFO_KHR,
+            .pVideoProfile = &videoProfile,
+            .qualityLevel = level};
+        EncoderDevice::QualityLevelProperties& properties = caps.qualityLevels[level];
+        properties.h264Properties.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_QUALITY_LEVEL_PROPERTIES_KHR;
+        properties.h265Properties.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_QUALITY_LEVEL_PROPERTIES_KHR;
+        properties.properties.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUALITY_LEVEL_PROPERTIES_KHR;
+        properties.properties.pNext = isH265 ? static_cast<void*>(&properties.h265Properties)
+                                             : static_cast<void*>(&properties.h264Properties);
+        VK_CHECK(vkGetPhysicalDeviceVideoEncodeQualityLevelPropertiesKHR(physicalDevice, &qualityLevelInfo,
+                                                                         &properties.properties));
+        properties.properties.pNext = nullptr;
+    }
+
+    caps.srcImageFormat = VK_FORMAT_UNDEFINED;
+    for (const auto& formatProperties : getVideoFormats(physicalDevice, videoProfileList,
+                                                        VK_IMAGE_USAGE_VIDEO_ENCODE_SRC_BIT_KHR |
+                                                            VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+        if (formatProperties.format == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM ||
+            formatProperties.format == VK_FORMAT_G8_B8_R8_3PLANE_420_UNORM) {
+            // Nvidia driver supports mutable & extended usage, but is not returning those flags
+            caps.srcImageFormat = formatProperties.format;
+            break;
+        }
+    }
+    if (caps.srcImageFormat == VK_FORMAT_UNDEFINED)
+        throw std::runtime_error("Error: no supported video encode source image format");
+
+    const std::vector<VkVideoFormatPropertiesKHR> dpbVideoFormatProperties =
+        getVideoFormats(physicalDevice, videoProfileList, VK_IMAGE_USAGE_VIDEO_ENCODE_DPB_BIT_KHR);
+    if (dpbVideoFormatProperties.size() < 1)
+        throw std::runtime_error("Error: no supported video encode DPB image format");
+    caps.dpbImageFormat = dpbVideoFormatProperties[0].format;
+
+    caps.emphasisMapFormat = VK_FORMAT_UNDEFINED;
+#ifdef VK_KHR_video_encode_quantization_map
+    VkFormatProperties r8Properties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, VK_FORMAT_R8_UNORM, &r8Properties);
+    if (profile.quantizationMap &&
+        (caps.encodeCapabilities.flags & VK_VIDEO_ENCODE_CAPABILITY_EMPHASIS_MAP_BIT_KHR) != 0 &&
+        (r8Properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT) != 0) {
+        caps.maxQuantizationMapExtent = quantizationMapCapabilities.maxQuantizationMapExtent;
+        // the texel size is returned per format, the frame difference shader writes R8
+        const VkPhysicalDeviceVideoFormatInfoKHR videoFormatInfo{
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_FORMAT_INFO_KHR,
+            .pNext = &videoProfileList,
+            .imageUsage = VK_IMAGE_USAGE_VIDEO_ENCODE_EMPHASIS_MAP_BIT_KHR | VK_IMAGE_USAGE_STORAGE_BIT};
+        uint32_t formatCount;
+        VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(physicalDevice, &videoFormatInfo, &formatCount, nullptr));
+        std::vector<VkVideoFormatQuantizationMapPropertiesKHR> mapProperties(
+            formatCount, {.sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_QUANTIZATION_MAP_PROPERTIES_KHR});
+        std::vector<VkVideoFormatPropertiesKHR> formatProperties(formatCount);
+        for (uint32_t i = 0; i < formatCount; i++) {
+            formatProperties[i].sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
+            formatProperties[i].pNext = &mapProperties[i];
+        }
+        VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(physicalDevice, &videoFormatInfo, &formatCount,
+                                                             formatProperties.data()));
+        for (uint32_t i = 0; i < formatCount; i++) {
+            const VkExtent2D texelSize = mapProperties[i].quantizationMapTexelSize;
+            if (formatProperties[i].format == VK_FORMAT_R8_UNORM &&
+                (caps.emphasisMapFormat == VK_FORMAT_UNDEFINED ||
+                 texelSize.width * texelSize.height <
+                     caps.emphasisMapTexelSize.width * caps.emphasisMapTexelSize.height)) {
+                caps.emphasisMapFormat = VK_FORMAT_R8_UNORM;
+                caps.emphasisMapTexelSize = texelSize;
+            }
+        }
+    }
+#endif
+
+    // the cached copy must not point into this stack frame
+    caps.capabilities.pNext = nullptr;
+    caps.encodeCapabilities.pNext = nullptr;
+    return caps;
+}
+
+void EncoderDevice::init(VkPhysicalDevice physicalDevice, VkDevice device, VmaAllocator allocator,
+                         uint32_t computeQueueFamily, VkQueue computeQueue, uint32_t encodeQueueFamily,
+                         const std::vector<VkQueue>& encodeQueues, const std::string& cacheFileName) {
+    assert(!m_initialized);
+    if (encodeQueues.empty()) {
+        throw std::runtime_error("Error: no encode queue");
+    }
+    m_physicalDevice = physicalDevice;
+    m_device = device;
+    m_allocator = allocator;
+    m_computeQueueFamily = computeQueueFamily;
+    m_computeQueue = computeQueue;
+    m_encodeQueueFamily = encodeQueueFamily;
+    m_encodeQueues.clear();
+    for (VkQueue queue : encodeQueues) {
+        m_encodeQueues.push_back(std::make_unique<EncodeQueue>());
+        m_encodeQueues.back()->queue = queue;
+    }
+    m_cacheFileName = cacheFileName;
+    m_cacheChanged = false;
+    loadCache();
+    m_initTime = std::chrono::steady_clock::now();
+    m_initialized = true;
+}
+
+std::vector<char> EncoderDevice::getCacheKey() {
+    VkPhysicalDeviceIDProperties idProperties{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES};
+    VkPhysicalDeviceProperties2 properties{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+                                           .pNext = &idProperties};
+    vkGetPhysicalDeviceProperties2(m_physicalDevice, &properties);
+    const uint32_t header[] = {CACHE_FILE_VERSION, properties.properties.driverVersion,
+                               static_cast<uint32_t>(sizeof(EncodeCapabilities))};
+    std::vector<char> key(sizeof(header) + VK_UUID_SIZE);
+    memcpy(key.data(), header, sizeof(header));
+    memcpy(key.data() + sizeof(header), idProperties.deviceUUID, VK_UUID_SIZE);
+    return key;
+}
+
+void EncoderDevice::loadCache() {
+    // layout: key, capability count, (profile, capabilities) per profile, pipeline cache data
+    std::vector<char> data;
+    if (!m_cacheFileName.empty()) {
+        std::ifstream inputFile(m_cacheFileName, std::ios::binary);
+        if (inputFile) {
+            data.assign(std::istreambuf_iterator<char>(inputFile), {});
+        }
+    }
+    const std::vector<char> key = getCacheKey();
+    const size_t entrySize = sizeof(EncodeProfile) + sizeof(EncodeCapabilities);
+    uint32_t count = 0;
+    size_t offset = key.size() + sizeof(count);
+    if (data.size() >= offset && memcmp(data.data(), key.data(), key.size()) == 0) {
+        memcpy(&count, data.data() + key.size(), sizeof(count));
+    }
+    if (data.size() < offset + count * entrySize) {
+        // missing, of another device or driver, or truncated
+        data.clear();
+        count = 0;
+        offset = 0;
+    }
+    m_encodeCapabilities.clear();
+    for (uint32_t i = 0; i < count; i++, offset += entrySize) {
+        EncodeProfile profile;
+        EncodeCapabilities caps;
+        memcpy(&profile, data.data() + offset, sizeof(profile));
+        memcpy(&caps, data.data() + offset + sizeof(profile), sizeof(caps));
+        m_encodeCapabilities.emplace(profile, caps);
+    }
+
+    // the implementation checks the header of the pipeline cache data itself and ignores incompatible data
+    const VkPipelineCacheCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+                                               .initialDataSize = data.size() - offset,
+                                               .pInitialData = data.data() + offset};
+    VK_CHECK(vkCreatePipelineCache(m_device, &createInfo, nullptr, &m_pipelineCache));
+    m_loadedPipelineCacheSize = data.size() - offset;
+    if (!data.empty()) {
+        printf("Loaded %u encode capabilities and %zu bytes of pipeline cache from %s\n", count,
+               data.size() - offset, m_cacheFileName.c_str());
+    }
+}
+
+void EncoderDevice::saveCache() {
+    // called from deinit, a cache which cannot be written only costs startup time
+    size_t pipelineCacheSize = 0;
+    if (m_cacheFileName.empty() ||
+        vkGetPipelineCacheData(m_device, m_pipelineCache, &pipelineCacheSize, nullptr) != VK_SUCCESS) {
+        return;
+    }
+    // the pipeline cache only grows with new pipelines
+    if (!m_cacheChanged && pipelineCacheSize == m_loadedPipelineCacheSize) {
+        return;
+    }
+    std::vector<char> pipelineCacheData(pipelineCacheSize);
+    if (vkGetPipelineCacheData(m_device, m_pipelineCache, &pipelineCacheSize, pipelineCacheData.data()) !=
+        VK_SUCCESS) {
+        return;
+    }
+    const std::vector<char> key = getCacheKey();
+    std::FILE* file = std::fopen(m_cacheFileName.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "failed to write cache file: %s\n", m_cacheFileName.c_str());
+        return;
+    }
+    const uint32_t count = static_cast<uint32_t>(m_encodeCapabilities.size());
+    std::fwrite(key.data(), 1, key.size(), file);
+    std::fwrite(&count, sizeof(count), 1, file);
+    for (const auto& [profile, caps] : m_encodeCapabilities) {
+        std::fwrite(&profile, sizeof(profile), 1, file);
+        std::fwrite(&caps, sizeof(caps), 1, file);
+    }
+    std::fwrite(pipelineCacheData.data(), 1, pipelineCacheSize, file);
+    std::fclose(file);
+}
+
+const EncoderDevice::EncodeCapabilities& EncoderDevice::getEncodeCapabilities(const EncodeProfile& profile) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_encodeCapabilities.find(profile);
+    if (it != m_encodeCapabilities.end()) {
+        return it->second;
+    }
+    m_cacheChanged = true;
+    return m_encodeCapabilities.emplace(profile, queryEncodeCapabilities(m_physicalDevice, profile)).first->second;
+}
+
+const EncoderDevice::ConversionPipeline& EncoderDevice::getConversionPipeline(uint32_t planeCount) {
+    assert(planeCount == 2 || planeCount == 3);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_conversionPipelines.find(planeCount);
+    if (it != m_conversionPipelines.end()) {
+        return it->second;
+    }
+
+    const char* shaderFileName = planeCount == 2 ? "shaders/rgb-ycbcr-shader-2plane.comp.spv"
+                                                 : "shaders/rgb-ycbcr-shader-3plane.comp.spv";
+    // the RGB input and the YCbCr planes
+    const std::vector<VkDescriptorType> bindingTypes(1 + planeCount, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    return m_conversionPipelines
+        .emplace(planeCount, createComputePipeline(shaderFileName, bindingTypes, sizeof(ConversionParameters)))
+        .first->second;
+}
+
+const EncoderDevice::ConversionPipeline& EncoderDevice::getFrameDifferencePipeline() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_frameDifferencePipeline) {
+        m_frameDifferencePipeline = createComputePipeline(
+            "shaders/frame-difference.comp.spv",
+            {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+             VK_DESCRIPTOR_TYPE_STORAGE_BUFFER},
+            sizeof(FrameDifferenceParameters));
+    }
+    return *m_frameDifferencePipeline;
+}
+
+EncoderDevice::ConversionPipeline EncoderDevice::createComputePipeline(
+    const std::string& shaderFileName, const std::vector<VkDescriptorType>& bindingTypes, uint32_t pushConstantSize) {
+    printf("Using %s\n", shaderFileName.c_str());
+    auto computeShaderCode = readFile(shaderFileName);
+    VkShaderModuleCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+                                        .codeSize = computeShaderCode.size(),
+                                        .pCode = reinterpret_cast<const uint32_t*>(computeShaderCode.data())};
+    VkShaderModule computeShaderModule;
+    VK_CHECK(vkCreateShaderModule(m_device, &createInfo, nullptr, &computeShaderModule));
+    VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
+    computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    computeShaderStageInfo.module = computeShaderModule;
+    computeShaderStageInfo.pName = "main";
+
+    std::vector<VkDescriptorSetLayoutBinding> layoutBindings(bindingTypes.size());
+    for (uint32_t i = 0; i < layoutBindings.size(); i++) {
+        layoutBindings[i].binding = i;
+        layoutBindings[i].descriptorCount = 1;
+        layoutBindings[i].descriptorType = bindingTypes[i];
+        layoutBindings[i].pImmutableSamplers = nullptr;
+        layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    ConversionPipeline computePipeline;
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
+    layoutInfo.pBindings = layoutBindings.data();
+    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutInfo, nullptr, &computePipeline.descriptorSetLayout));
+
+    const VkPushConstantRange pushConstantRange{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT, .offset = 0, .size = pushConstantSize};
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &computePipeline.descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    VK_CHECK(vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &computePipeline.pipelineLayout));
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.layout = computePipeline.pipelineLayout;
+    pipelineInfo.stage = computeShaderStageInfo;
+    VK_CHECK(vkCreateComputePipelines(m_device, m_pipelineCache, 1, &pipelineInfo, nullptr,
+                                      &computePipeline.pipeline));
+
+    vkDestroyShaderModule(m_device, computeShaderModule, nullptr);
+    return computePipeline;
+}
+
+EncoderDevice::ConversionParameters EncoderDevice::getConversionParameters(VkSamplerYcbcrModelConversion model,
+                                                                          VkSamplerYcbcrRange range) {
+    // luma weights of red and blue
+    const bool bt709 = model == VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709;
+    const float kr = bt709 ? 0.2126f : 0.299f;
+    const float kb = bt709 ? 0.0722f : 0.114f;
+    const float kg = 1.0f - kr - kb;
+    // limited range: Y in [16, 235], Cb/Cr in [16, 240] of 255
+    const bool fullRange = range == VK_SAMPLER_YCBCR_RANGE_ITU_FULL;
+    const float yScale = fullRange ? 1.0f : 219.0f / 255.0f;
+    const float yOffset = fullRange ? 0.0f : 16.0f / 255.0f;
+    const float cScale = fullRange ? 1.0f : 224.0f / 255.0f;
+    const float cOffset = 128.0f / 255.0f;
+    // Cb = (B - Y) / (2 (1 - kb)), Cr = (R - Y) / (2 (1 - kr))
+    const float cb = cScale / (2.0f * (1.0f - kb));
+    const float cr = cScale / (2.0f * (1.0f - kr));
+    return {.yCoefficients = {kr * yScale, kg * yScale, kb * yScale, yOffset},
+            .cbCoefficients = {-kr * cb, -kg * cb, (1.0f - kb) * cb, cOffset},
+            .crCoefficients = {(1.0f - kr) * cr, -kg * cr, -kb * cr, cOffset}};
+}
+
+EncoderDevice::ExternalImage EncoderDevice::importImage(const ExternalImageInfo& info) {
+    // a dmabuf has the layout given by its producer, the layout of an opaque fd is the one of an optimal image
+    const bool dmaBuf = info.handleType == VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+    const VkSubresourceLayout planeLayout{.offset = info.offset, .rowPitch = info.rowPitch};
+    const VkImageDrmFormatModifierExplicitCreateInfoEXT modifierInfo{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+        .drmFormatModifier = info.drmFormatModifier,
+        .drmFormatModifierPlaneCount = 1,
+        .pPlaneLayouts = &planeLayout};
+    const VkExternalMemoryImageCreateInfo externalInfo{
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+        .pNext = dmaBuf ? &modifierInfo : nullptr,
+        .handleTypes = static_cast<VkExternalMemoryHandleTypeFlags>(info.handleType)};
+    const VkImageCreateInfo imageInfo{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .pNext = &externalInfo,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = info.format,
+        .extent = {info.width, info.height, 1},
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = dmaBuf ? VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT : VK_IMAGE_TILING_OPTIMAL,
+        .usage = info.usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    ExternalImage image{};
+    VK_CHECK(vkCreateImage(m_device, &imageInfo, nullptr, &image.image));
+
+    // a failed VK_CHECK must not leave the handles created so far behind; a duplicate of the fd is imported, so the
+    // caller keeps its fd until everything has succeeded
+    int importFd = -1;
+    try {
+        VkMemoryRequirements memoryRequirements;
+        vkGetImageMemoryRequirements(m_device, image.image, &memoryRequirements);
+        uint32_t memoryTypeBits = memoryRequirements.memoryTypeBits;
+        if (dmaBuf) {
+            VkMemoryFdPropertiesKHR fdProperties{.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR};
+            VK_CHECK(vkGetMemoryFdPropertiesKHR(m_device, info.handleType, info.fd, &fdProperties));
+            memoryTypeBits &= fdProperties.memoryTypeBits;
+        }
+        if (memoryTypeBits == 0) {
+            throw std::runtime_error("Error: no memory type to import the image");
+        }
+
+        importFd = dup(info.fd);
+        if (importFd < 0) {
+            throw std::runtime_error("Error: failed to duplicate the fd of the image");
+        }
+        const VkMemoryDedicatedAllocateInfo dedicatedInfo{.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+                                                          .image = image.image};
+        const VkImportMemoryFdInfoKHR importInfo{.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
+                                                 .pNext = &dedicatedInfo,
+                                                 .handleType = info.handleType,
+                                                 .fd = importFd};
+        const VkMemoryAllocateInfo allocInfo{
+            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            .pNext = &importInfo,
+            .allocationSize = info.allocationSize ? info.allocationSize : memoryRequirements.size,
+            .memoryTypeIndex = static_cast<uint32_t>(std::countr_zero(memoryTypeBits))};
+        VK_CHECK(vkAllocateMemory(m_device, &allocInfo, nullptr, &image.memory));
+        importFd = -1;  // owned by the memory
+        VK_CHECK(vkBindImageMemory(m_device, image.image, image.memory, 0));
+
+        const VkImageViewCreateInfo viewInfo{.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                                             .image = image.image,
+                                             .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                                             .format = info.format,
+                                             .subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}};
+        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &image.imageView));
+    } catch (...) {
+        if (importFd >= 0) {
+            close(importFd);
+        }
+        destroyImage(image);
+        throw;
+    }
+    close(info.fd);
+    return image;
+}
+
+void EncoderDevice::destroyImage(ExternalImage& image) {
+    vkDestroyImageView(m_device, image.imageView, nullptr);
+    vkDestroyImage(m_device, image.image, nullptr);
+    vkFreeMemory(m_device, image.memory, nullptr);
+    image = {};
+}
+
+uint32_t EncoderDevice::acquireEncodeQueue() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::min_element(m_encodeQueues.begin(), m_encodeQueues.end(),
+                               [](const auto& a, const auto& b) { return a->sessionCount < b->sessionCount; });
+    (*it)->sessionCount++;
+    return static_cast<uint32_t>(it - m_encodeQueues.begin());
+}
+
+void EncoderDevice::releaseEncodeQueue(uint32_t queueIx) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    assert(m_encodeQueues[queueIx]->sessionCount > 0);
+    m_encodeQueues[queueIx]->sessionCount--;
+}
+
+void EncoderDevice::submitCompute(const VkSubmitInfo2& submitInfo, VkFence fence) {
+    std::lock_guard<std::mutex> lock(m_computeSubmitMutex);
+    VK_CHECK(vkQueueSubmit2(m_computeQueue, 1, &submitInfo, fence));
+}
+
+void EncoderDevice::submitEncode(uint32_t queueIx, const VkSubmitInfo2& submitInfo, VkFence fence) {
+    EncodeQueue& encodeQueue = *m_encodeQueues[queueIx];
+    std::lock_guard<std::mutex> lock(encodeQueue.submitMutex);
+    VK_CHECK(vkQueueSubmit2(encodeQueue.queue, 1, &submitInfo, fence));
+    encodeQueue.submitCount++;
+}
+
+void EncoderDevice::addEncodeTime(uint32_t queueIx, double encodeMs) {
+    EncodeQueue& encodeQueue = *m_encodeQueues[queueIx];
+    encodeQueue.frameCount++;
+    encodeQueue.busyNs += static_cast<uint64_t>(encodeMs * 1e6);
+}
+
+std::vector<EncoderDevice::EncodeQueueStats> EncoderDevice::getEncodeQueueStats() {
+    const double elapsedMs =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_initTime).count();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<EncodeQueueStats> stats;
+    for (const auto& encodeQueue : m_encodeQueues) {
+        const double busyMs = encodeQueue->busyNs / 1e6;
+        stats.push_back({.sessionCount = encodeQueue->sessionCount,
+                         .submitCount = encodeQueue->submitCount,
+                         .frameCount = encodeQueue->frameCount,
+                         .busyMs = busyMs,
+                         .utilization = elapsedMs > 0.0 ? busyMs / elapsedMs : 0.0});
+    }
+    return stats;
+}
+
+void EncoderDevice::printEncodeQueueStats(FILE* file) {
+    const std::vector<EncodeQueueStats> stats = getEncodeQueueStats();
+    for (uint32_t i = 0; i < stats.size(); i++) {
+        // without encode timestamps only the submissions are known
+        if (stats[i].frameCount == 0) {
+            fprintf(file, "encode queue %u: %llu submits, utilization n/a\n", i,
+                    static_cast<unsigned long long>(stats[i].submitCount));
+            continue;
+        }
+        fprintf(file, "encode queue %u: %llu submits, %llu frames, busy %.1f ms, utilization %.1f%%\n", i,
+                static_cast<unsigned long long>(stats[i].submitCount),
+                static_cast<unsigned long long>(stats[i].frameCount), stats[i].busyMs, stats[i].utilization * 100.0);
+    }
+}
+
+void EncoderDevice::deinit() {
+    if (!m_initialized) {
+        return;
+    }
+    assert(std::all_of(m_encodeQueues.begin(), m_encodeQueues.end(),
+                       [](const auto& queue) { return queue->sessionCount == 0; }));
+    for (auto& [planeCount, conversionPipeline] : m_conversionPipelines) {
+        vkDestroyPipeline(m_device, conversionPipeline.pipeline, nullptr);
+        vkDestroyPipelineLayout(m_device, conversionPipeline.pipelineLayout, nullptr);
+        vkDestroyDescriptorSetLayout(m_device, conversionPipeline.descriptorSetLayout, nullptr);
+    }
+    m_conversionPipelines.clear();
+    if (m_frameDifferencePipeline) {
+        vkDestroyPipeline(m_device, m_frameDifferencePipeline->pipeline, nullptr);
+        vkDestroyPipelineLayout(m_device, m_frameDifferencePipeline->pipelineLayout, nullptr);
+        vkDestroyDescriptorSetLayout(m_device, m_frameDifferencePipeline->descriptorSetLayout, nullptr);
+        m_frameDifferencePipeline.reset();
+    }
+    saveCache();
+    vkDestroyPipelineCache(m_device, m_pipelineCache, nullptr);
+    m_encodeCapabilities.clear();
+    m_encodeQueues.clear();
+    m_initialized = false;
+}
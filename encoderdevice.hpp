@@ -0,0 +1,218 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#define VK_NO_PROTOTYPES
+#include <vma/vk_mem_alloc.h>
+#include <volk/volk.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <compare>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Device wide state shared by all VideoEncoder sessions on one device: the encode capabilities, the RGB->YCbCr
+// conversion pipelines and the queues. Each session is assigned to the encode queue with the fewest sessions,
+// submissions to a queue are serialized, so sessions may run on different threads (the application must not submit
+// to these queues while sessions are running on other threads). Must outlive its sessions.
+class EncoderDevice {
+   public:
+    // compute pipeline of the conversion shader and its layout
+    struct ConversionPipeline {
+        VkDescriptorSetLayout descriptorSetLayout;
+        VkPipelineLayout pipelineLayout;
+        VkPipeline pipeline;
+    };
+
+    // push constants of the conversion shader: RGB weights and offset of Y, Cb and Cr, normalized to [0, 1]
+    struct ConversionParameters {
+        std::array<float, 4> yCoefficients;
+        std::array<float, 4> cbCoefficients;
+        std::array<float, 4> crCoefficients;
+    };
+    // BT.601 or BT.709 matrix, full or limited (ITU narrow) range
+    static ConversionParameters getConversionParameters(VkSamplerYcbcrModelConversion model,
+                                                        VkSamplerYcbcrRange range);
+
+    // push constants of the frame difference shader
+    struct FrameDifferenceParameters {
+        std::array<int32_t, 2> extent;     // of the luma plane that is compared
+        std::array<int32_t, 2> blockSize;  // pixels per compared block and emphasis map texel
+        uint32_t threshold;                // sum of absolute 8 bit luma differences above which a block changed
+        uint32_t counterIndex;             // into the changed block counter buffer
+        uint32_t writeEmphasisMap;
+    };
+
+    // codec, codec profile and VkVideoEncodeUsageInfoKHR of the video profile
+    struct EncodeProfile {
+        VkVideoCodecOperationFlagBitsKHR codecOperation;
+        int32_t profileIdc;  // StdVideoH264ProfileIdc or StdVideoH265ProfileIdc
+        VkVideoEncodeUsageFlagsKHR usageHints;
+        VkVideoEncodeContentFlagsKHR contentHints;
+        VkVideoEncodeTuningModeKHR tuningMode;
+        // also query the emphasis map support, VK_KHR_video_encode_quantization_map must be enabled
+        VkBool32 quantizationMap;
+
+        auto operator<=>(const EncodeProfile&) const = default;
+    };
+    // settings the implementation recommends for a quality level
+    struct QualityLevelProperties {
+        VkVideoEncodeQualityLevelPropertiesKHR properties;
+        // only the one of the profile's codec is filled
+        VkVideoEncodeH264QualityLevelPropertiesKHR h264Properties;
+        VkVideoEncodeH265QualityLevelPropertiesKHR h265Properties;
+    };
+    static const uint32_t MAX_QUALITY_LEVELS = 8;
+    // results of the capability queries for one profile, pNext pointers are null
+    struct EncodeCapabilities {
+        VkVideoCapabilitiesKHR capabilities;
+        VkVideoEncodeCapabilitiesKHR encodeCapabilities;
+        // only the one of the profile's codec is filled
+        VkVideoEncodeH264CapabilitiesKHR h264Capabilities;
+        VkVideoEncodeH265CapabilitiesKHR h265Capabilities;
+        // of the first min(encodeCapabilities.maxQualityLevels, MAX_QUALITY_LEVELS) levels
+        std::array<QualityLevelProperties, MAX_QUALITY_LEVELS> qualityLevels;
+        VkFormat srcImageFormat;  // 2 or 3 plane 4:2:0 format usable as encode source and transfer destination
+        VkFormat dpbImageFormat;
+        // only with EncodeProfile::quantizationMap: R8 emphasis map format that is also a storage image format,
+        // VK_FORMAT_UNDEFINED if emphasis maps are not supported, its smallest texel size and the largest map
+        VkFormat emphasisMapFormat;
+        VkExtent2D emphasisMapTexelSize;
+        VkExtent2D maxQuantizationMapExtent;
+    };
+
+    // memory of another process or API holding a single plane RGB image, e.g. a dmabuf of a compositor or an opaque
+    // fd exported by another Vulkan device
+    struct ExternalImageInfo {
+        int fd;  // owned by the implementation after a successful import
+        // VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT or VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+        VkExternalMemoryHandleTypeFlagBits handleType;
+        VkFormat format;
+        uint32_t width;
+        uint32_t height;
+        VkImageUsageFlags usage{VK_IMAGE_USAGE_STORAGE_BIT};
+        VkDeviceSize allocationSize{0};  // 0: the size the image requires
+        // dmabuf only: layout of the plane
+        uint64_t drmFormatModifier{0};
+        VkDeviceSize offset{0};
+        VkDeviceSize rowPitch{0};
+    };
+    struct ExternalImage {
+        VkImage image;
+        VkImageView imageView;
+        VkDeviceMemory memory;
+    };
+
+    // counters of one encode queue since init
+    struct EncodeQueueStats {
+        uint32_t sessionCount;
+        uint64_t submitCount;
+        uint64_t frameCount;  // frames with a GPU encode time
+        double busyMs;        // sum of the GPU encode times of these frames
+        double utilization;   // busyMs / wall time since init
+    };
+
+    // With a cache file the capabilities and the pipeline cache are loaded from it if it was written by the same
+    // device (UUID) and driver version, and it is rewritten on deinit if something was added.
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, VmaAllocator allocator, uint32_t computeQueueFamily,
+              VkQueue computeQueue, uint32_t encodeQueueFamily, const std::vector<VkQueue>& encodeQueues,
+              const std::string& cacheFileName = {});
+    void deinit();
+
+    VkPhysicalDevice getPhysicalDevice() const { return m_physicalDevice; }
+    VkDevice getDevice() const { return m_device; }
+    VmaAllocator getAllocator() const { return m_allocator; }
+    uint32_t getComputeQueueFamily() const { return m_computeQueueFamily; }
+    uint32_t getEncodeQueueFamily() const { return m_encodeQueueFamily; }
+    uint32_t getEncodeQueueCount() const { return static_cast<uint32_t>(m_encodeQueues.size()); }
+
+    // queried on first use of the profile unless loaded from the cache file; valid until deinit
+    const EncodeCapabilities& getEncodeCapabilities(const EncodeProfile& profile);
+    VkPipelineCache getPipelineCache() const { return m_pipelineCache; }
+
+    // created on first use, for 2 or 3 YCbCr planes; valid until deinit
+    const ConversionPipeline& getConversionPipeline(uint32_t planeCount);
+    // created on first use: bindings are the luma plane, the previous luma and the emphasis map (storage images) and
+    // the changed block counters (storage buffer); valid until deinit
+    const ConversionPipeline& getFrameDifferencePipeline();
+
+    // Imports the memory without a copy (needs VK_KHR_external_memory_fd, for dmabufs also
+    // VK_EXT_external_memory_dma_buf and VK_EXT_image_drm_format_modifier), e.g. for
+    // VideoEncoder::registerInputImage with srcQueueFamily VK_QUEUE_FAMILY_EXTERNAL or VK_QUEUE_FAMILY_FOREIGN_EXT.
+    // If it throws, nothing is left to destroy and the fd is still owned by the caller.
+    ExternalImage importImage(const ExternalImageInfo& info);
+    void destroyImage(ExternalImage& image);
+
+    // returns the index of the encode queue with the fewest sessions for a new session
+    uint32_t acquireEncodeQueue();
+    void releaseEncodeQueue(uint32_t queueIx);
+
+    void submitCompute(const VkSubmitInfo2& submitInfo, VkFence fence = VK_NULL_HANDLE);
+    void submitEncode(uint32_t queueIx, const VkSubmitInfo2& submitInfo, VkFence fence = VK_NULL_HANDLE);
+
+    // called by the sessions for every frame with a GPU timestamp measurement
+    void addEncodeTime(uint32_t queueIx, double encodeMs);
+    std::vector<EncodeQueueStats> getEncodeQueueStats();
+    void printEncodeQueueStats(FILE* file);
+
+    ~EncoderDevice() { deinit(); }
+
+   private:
+    struct EncodeQueue {
+        VkQueue queue;
+        uint32_t sessionCount{0};  // guarded by m_mutex
+        std::mutex submitMutex;    // vkQueueSubmit2 needs external synchronization
+        std::atomic<uint64_t> submitCount{0};
+        std::atomic<uint64_t> frameCount{0};
+        std::atomic<uint64_t> busyNs{0};
+    };
+
+    bool m_initialized{false};
+    VkPhysicalDevice m_physicalDevice;
+    VkDevice m_device;
+    VmaAllocator m_allocator;
+    uint32_t m_computeQueueFamily;
+    VkQueue m_computeQueue;
+    std::mutex m_computeSubmitMutex;
+    uint32_t m_encodeQueueFamily;
+    std::vector<std::unique_ptr<EncodeQueue>> m_encodeQueues;
+    std::chrono::steady_clock::time_point m_initTime;
+
+    void loadCache();
+    void saveCache();
+    std::vector<char> getCacheKey();
+    ConversionPipeline createComputePipeline(const std::string& shaderFileName,
+                                             const std::vector<VkDescriptorType>& bindingTypes,
+                                             uint32_t pushConstantSize);
+
+    std::string m_cacheFileName;
+    VkPipelineCache m_pipelineCache;
+    size_t m_loadedPipelineCacheSize;
+    bool m_cacheChanged;  // capabilities were queried, guarded by m_mutex
+
+    std::mutex m_mutex;
+    std::map<uint32_t, ConversionPipeline> m_conversionPipelines;  // by plane count
+    std::optional<ConversionPipeline> m_frameDifferencePipeline;
+    std::map<EncodeProfile, EncodeCapabilities> m_encodeCapabilities;
+};
@@ -0,0 +1,68 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace h264 {
+
+enum NalUnitType : uint8_t {
+    NAL_UNIT_TYPE_SLICE = 1,
+    NAL_UNIT_TYPE_IDR_SLICE = 5,
+    NAL_UNIT_TYPE_SEI = 6,
+    NAL_UNIT_TYPE_SPS = 7,
+    NAL_UNIT_TYPE_PPS = 8,
+    NAL_UNIT_TYPE_AUD = 9,
+};
+
+// one NAL unit of an Annex B byte stream, offset and size exclude the start code
+struct NalUnit {
+    size_t offset;
+    size_t size;
+    uint8_t type;
+
+    bool isSlice() const { return type == NAL_UNIT_TYPE_SLICE || type == NAL_UNIT_TYPE_IDR_SLICE; }
+};
+
+// Splits an Annex B byte stream (as written by the encoder) at its 3 or 4 byte start codes.
+// Trailing zero bytes in front of a start code belong to the start code, not to the previous NAL unit.
+static std::vector<NalUnit> splitNalUnits(const uint8_t* data, size_t size) {
+    std::vector<NalUnit> nalUnits;
+    size_t zeros = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == 0) {
+            zeros++;
+            continue;
+        }
+        if (data[i] == 1 && zeros >= 2) {
+            if (!nalUnits.empty()) {
+                nalUnits.back().size = i - zeros - nalUnits.back().offset;
+            }
+            if (i + 1 < size) {
+                nalUnits.push_back({i + 1, 0, static_cast<uint8_t>(data[i + 1] & 0x1f)});
+            }
+        }
+        zeros = 0;
+    }
+    if (!nalUnits.empty()) {
+        nalUnits.back().size = size - nalUnits.back().offset;
+    }
+    return nalUnits;
+}
+
+};  // namespace h264
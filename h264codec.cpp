@@ -0,0 +1,185 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "h264codec.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+const VkExtensionProperties& H264Codec::getStdHeaderVersion() const {
+    static const VkExtensionProperties h264StdExtensionVersion = {VK_STD_VULKAN_VIDEO_CODEC_H264_ENCODE_EXTENSION_NAME,
+                                                                  VK_STD_VULKAN_VIDEO_CODEC_H264_ENCODE_SPEC_VERSION};
+    return h264StdExtensionVersion;
+}
+
+const void* H264Codec::getProfileInfo(int32_t profileIdc, const void* pNext) {
+    m_profileInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_PROFILE_INFO_KHR};
+    m_profileInfo.pNext = pNext;
+    m_profileInfo.stdProfileIdc = static_cast<StdVideoH264ProfileIdc>(profileIdc);
+    return &m_profileInfo;
+}
+
+VideoCodec::Limits H264Codec::getLimits(const EncoderDevice::EncodeCapabilities& caps) const {
+    const VkVideoEncodeH264CapabilitiesKHR& h264Capabilities = caps.h264Capabilities;
+    return {.minQp = h264Capabilities.minQp,
+            .maxQp = h264Capabilities.maxQp,
+            .maxPPictureL0ReferenceCount = h264Capabilities.maxPPictureL0ReferenceCount,
+            .maxBPictureL0ReferenceCount = h264Capabilities.maxBPictureL0ReferenceCount,
+            .maxL1ReferenceCount = h264Capabilities.maxL1ReferenceCount,
+            .maxTemporalLayerCount = h264Capabilities.maxTemporalLayerCount,
+            .maxSliceCount = h264Capabilities.maxSliceCount,
+            .differentSliceTypes =
+                (h264Capabilities.flags & VK_VIDEO_ENCODE_H264_CAPABILITY_DIFFERENT_SLICE_TYPE_BIT_KHR) != 0,
+            .blockSize = h264::H264MbSizeAlignment};
+}
+
+void H264Codec::init(const EncoderDevice::EncodeCapabilities& caps, const StreamConfig& config) {
+    const VkVideoEncodeH264CapabilitiesKHR& h264Capabilities = caps.h264Capabilities;
+    if (config.levelIdc > h264Capabilities.maxLevelIdc) {
+        throw std::runtime_error("Error: H.264 level not supported, maximum is " +
+                                 std::to_string(h264Capabilities.maxLevelIdc));
+    }
+    if (config.bFrameCount > 0 && config.profileIdc == STD_VIDEO_H264_PROFILE_IDC_BASELINE) {
+        throw std::runtime_error("Error: B frames are not supported by the H.264 Baseline profile");
+    }
+    m_config = config;
+    m_generatePrefixNalu = config.temporalLayerCount > 1 &&
+                           (h264Capabilities.flags & VK_VIDEO_ENCODE_H264_CAPABILITY_GENERATE_PREFIX_NALU_BIT_KHR);
+    m_log2MaxFrameNum = h264::Dpb::getLog2MaxFrameNum(config.referenceFrameCount);
+    m_dpb.init(config.dpbSlotCount, config.referenceFrameCount, config.longTermReferenceCount, m_log2MaxFrameNum);
+    m_stdReferenceInfos.assign(config.dpbSlotCount, {});
+    m_dpbSlotInfos.assign(config.dpbSlotCount, {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_DPB_SLOT_INFO_KHR});
+    m_frameInfo.reset();
+    m_frameNum = 0;
+    m_idrPicId = 0;
+}
+
+const void* H264Codec::getSessionParametersCreateInfo(uint32_t width, uint32_t height) {
+    // with B frames one frame is decoded before the frames preceding it in display order
+    m_vui = h264::getStdVideoH264SequenceParameterSetVui(m_config.fps, m_config.bFrameCount > 0 ? 1 : 0,
+                                                         m_config.referenceFrameCount);
+    h264::setStdVideoH264VuiColorDescription(m_vui, m_config.bt709, m_config.fullRange);
+    m_sps = h264::getStdVideoH264SequenceParameterSet(width, height,
+                                                      static_cast<StdVideoH264ProfileIdc>(m_config.profileIdc),
+                                                      static_cast<StdVideoH264LevelIdc>(m_config.levelIdc),
+                                                      m_config.referenceFrameCount, m_log2MaxFrameNum, &m_vui);
+    // a receiver dropping upper temporal layers sees gaps in the frame_num of the references
+    m_sps.flags.gaps_in_frame_num_value_allowed_flag = m_config.temporalLayerCount > 1 ? 1u : 0u;
+    m_pps = h264::getStdVideoH264PictureParameterSet();
+
+    m_sessionParametersAddInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_ADD_INFO_KHR};
+    m_sessionParametersAddInfo.pNext = nullptr;
+    m_sessionParametersAddInfo.stdSPSCount = 1;
+    m_sessionParametersAddInfo.pStdSPSs = &m_sps;
+    m_sessionParametersAddInfo.stdPPSCount = 1;
+    m_sessionParametersAddInfo.pStdPPSs = &m_pps;
+
+    m_sessionParametersCreateInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_CREATE_INFO_KHR};
+    m_sessionParametersCreateInfo.pNext = nullptr;
+    m_sessionParametersCreateInfo.maxStdSPSCount = 1;
+    m_sessionParametersCreateInfo.maxStdPPSCount = 1;
+    m_sessionParametersCreateInfo.pParametersAddInfo = &m_sessionParametersAddInfo;
+    return &m_sessionParametersCreateInfo;
+}
+
+const void* H264Codec::getSessionParametersGetInfo() {
+    m_sessionParametersGetInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_GET_INFO_KHR};
+    m_sessionParametersGetInfo.stdSPSId = 0;
+    m_sessionParametersGetInfo.stdPPSId = 0;
+    m_sessionParametersGetInfo.writeStdPPS = VK_TRUE;
+    m_sessionParametersGetInfo.writeStdSPS = VK_TRUE;
+    return &m_sessionParametersGetInfo;
+}
+
+void* H264Codec::getSessionParametersFeedbackInfo() {
+    m_sessionParametersFeedbackInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_FEEDBACK_INFO_KHR};
+    return &m_sessionParametersFeedbackInfo;
+}
+
+const void* H264Codec::getRateControlInfo(uint32_t gopFrameCount, uint32_t idrPeriod, uint32_t layerCount) {
+    m_rateControlInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_RATE_CONTROL_INFO_KHR};
+    // B frames and the top temporal layer are no references, so the pattern is only flat without them
+    m_rateControlInfo.flags = VK_VIDEO_ENCODE_H264_RATE_CONTROL_REGULAR_GOP_BIT_KHR;
+    if (m_config.temporalLayerCount > 1) {
+        m_rateControlInfo.flags |= VK_VIDEO_ENCODE_H264_RATE_CONTROL_TEMPORAL_LAYER_PATTERN_DYADIC_BIT_KHR;
+    } else if (m_config.bFrameCount == 0) {
+        m_rateControlInfo.flags |= VK_VIDEO_ENCODE_H264_RATE_CONTROL_REFERENCE_PATTERN_FLAT_BIT_KHR;
+    }
+    // UINT32_MAX means an infinite GOP for the rate control as well
+    m_rateControlInfo.gopFrameCount = gopFrameCount;
+    m_rateControlInfo.idrPeriod = idrPeriod;
+    m_rateControlInfo.consecutiveBFrameCount = m_config.bFrameCount;
+    m_rateControlInfo.temporalLayerCount = layerCount;
+    return &m_rateControlInfo;
+}
+
+const void* H264Codec::getRateControlLayerInfo(uint32_t layer) {
+    m_rateControlLayerInfos[layer] = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_RATE_CONTROL_LAYER_INFO_KHR};
+    return &m_rateControlLayerInfos[layer];
+}
+
+int32_t H264Codec::beginPicture(const Picture& picture) {
+    const StdVideoH264PictureType pictureType = picture.type == PictureType::IDR ? STD_VIDEO_H264_PICTURE_TYPE_IDR
+                                                : picture.type == PictureType::I ? STD_VIDEO_H264_PICTURE_TYPE_I
+                                                : picture.type == PictureType::B ? STD_VIDEO_H264_PICTURE_TYPE_B
+                                                                                 : STD_VIDEO_H264_PICTURE_TYPE_P;
+    m_isIdr = picture.type == PictureType::IDR;
+    m_isReference = picture.isReference;
+    if (m_isIdr) {
+        m_frameNum = 0;
+    }
+    // POC is kept in the int32_t range with a multiple of MaxPicOrderCntLsb
+    const int32_t picOrderCnt = static_cast<int32_t>((picture.framesSinceIdr % (1u << 29)) * 2);
+    const int32_t setupSlot = m_dpb.beginPicture(m_frameNum, picOrderCnt, picture.frameIndex, pictureType,
+                                                 picture.isReference, picture.markLongTerm, picture.temporalId);
+    m_dpb.getReferenceLists(picture.maxL0References, picture.maxL1References, m_referenceLists);
+    m_frameInfo.emplace(m_frameNum, picOrderCnt, m_idrPicId, m_pps, pictureType, picture.isReference,
+                        m_referenceLists, m_dpb.isAdaptiveMarking(), picture.constantQp, picture.sliceCount,
+                        picture.intraSliceIndex);
+    m_frameInfo->setTemporalId(picture.temporalId, m_generatePrefixNalu);
+    return setupSlot;
+}
+
+const void* H264Codec::getDpbSlotInfo(uint32_t slot) {
+    const bool isSetupSlot = static_cast<int32_t>(slot) == m_dpb.getCurrentSlot();
+    const h264::Dpb::Picture& picture = isSetupSlot ? m_dpb.getCurrentPicture() : m_dpb.getPicture(slot);
+    if (!isSetupSlot && !picture.isReference) {
+        return nullptr;
+    }
+    m_stdReferenceInfos[slot] = h264::Dpb::getStdReferenceInfo(picture);
+    m_dpbSlotInfos[slot].pStdReferenceInfo = &m_stdReferenceInfos[slot];
+    return &m_dpbSlotInfos[slot];
+}
+
+bool H264Codec::isReferenced(uint32_t slot) const {
+    const uint8_t* list0 = m_referenceLists.RefPicList0;
+    const uint8_t* list1 = m_referenceLists.RefPicList1;
+    return std::find(list0, list0 + STD_VIDEO_H264_MAX_NUM_LIST_REF, slot) != list0 + STD_VIDEO_H264_MAX_NUM_LIST_REF ||
+           std::find(list1, list1 + STD_VIDEO_H264_MAX_NUM_LIST_REF, slot) != list1 + STD_VIDEO_H264_MAX_NUM_LIST_REF;
+}
+
+const void* H264Codec::getPictureInfo() { return m_frameInfo->getEncodeH264FrameInfo(); }
+
+void H264Codec::endPicture() {
+    m_dpb.endPicture();
+    if (m_isIdr) {
+        m_idrPicId++;  // wraps at 65536, only consecutive IDR frames have to differ
+    }
+    if (m_isReference) {
+        m_frameNum = (m_frameNum + 1) % (1u << m_log2MaxFrameNum);
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#define VK_NO_PROTOTYPES
+#include <volk/volk.h>
+
+#include <array>
+#include <optional>
+#include <vector>
+
+#include "h264dpb.hpp"
+#include "h264parameterset.hpp"
+#include "videocodec.hpp"
+
+// H.264 (VK_KHR_video_encode_h264): SPS/PPS, frame_num and idr_pic_id, reference management with h264::Dpb
+class H264Codec : public VideoCodec {
+   public:
+    VkVideoCodecOperationFlagBitsKHR getCodecOperation() const override {
+        return VK_VIDEO_CODEC_OPERATION_ENCODE_H264_BIT_KHR;
+    }
+    const VkExtensionProperties& getStdHeaderVersion() const override;
+    const void* getProfileInfo(int32_t profileIdc, const void* pNext) override;
+    Limits getLimits(const EncoderDevice::EncodeCapabilities& caps) const override;
+    void init(const EncoderDevice::EncodeCapabilities& caps, const StreamConfig& config) override;
+
+    const void* getSessionParametersCreateInfo(uint32_t width, uint32_t height) override;
+    const void* getSessionParametersGetInfo() override;
+    void* getSessionParametersFeedbackInfo() override;
+    const void* getRateControlInfo(uint32_t gopFrameCount, uint32_t idrPeriod, uint32_t layerCount) override;
+    const void* getRateControlLayerInfo(uint32_t layer) override;
+
+    int32_t beginPicture(const Picture& picture) override;
+    const void* getDpbSlotInfo(uint32_t slot) override;
+    bool isReferenced(uint32_t slot) const override;
+    const void* getPictureInfo() override;
+    void endPicture() override;
+    bool invalidateAfter(uint32_t frameIndex) override { return m_dpb.invalidateAfter(frameIndex); }
+
+   private:
+    StreamConfig m_config;
+    bool m_generatePrefixNalu;  // temporal_id in the bitstream
+
+    VkVideoEncodeH264ProfileInfoKHR m_profileInfo;
+    StdVideoH264SequenceParameterSetVui m_vui;
+    StdVideoH264SequenceParameterSet m_sps;
+    StdVideoH264PictureParameterSet m_pps;
+    VkVideoEncodeH264SessionParametersAddInfoKHR m_sessionParametersAddInfo;
+    VkVideoEncodeH264SessionParametersCreateInfoKHR m_sessionParametersCreateInfo;
+    VkVideoEncodeH264SessionParametersGetInfoKHR m_sessionParametersGetInfo;
+    VkVideoEncodeH264SessionParametersFeedbackInfoKHR m_sessionParametersFeedbackInfo;
+    VkVideoEncodeH264RateControlInfoKHR m_rateControlInfo;
+    std::array<VkVideoEncodeH264RateControlLayerInfoKHR, MAX_TEMPORAL_LAYERS> m_rateControlLayerInfos;
+
+    h264::Dpb m_dpb;
+    uint32_t m_log2MaxFrameNum;  // of the SPS, from the reference frame count
+    uint32_t m_frameNum;         // frame_num, wraps at MaxFrameNum
+    uint16_t m_idrPicId;
+    // of the current picture
+    bool m_isIdr;
+    bool m_isReference;
+    StdVideoEncodeH264ReferenceListsInfo m_referenceLists;
+    std::optional<h264::FrameInfo> m_frameInfo;
+    std::vector<StdVideoEncodeH264ReferenceInfo> m_stdReferenceInfos;  // per DPB slot
+    std::vector<VkVideoEncodeH264DpbSlotInfoKHR> m_dpbSlotInfos;
+};
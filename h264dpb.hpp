@@ -0,0 +1,383 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <vector>
+
+#include "vk_video/vulkan_video_codec_h264std.h"
+#include "vk_video/vulkan_video_codec_h264std_encode.h"
+
+namespace h264 {
+
+// Encoder side reference picture management for frames (no fields), following H.264 8.2.4 and 8.2.5:
+// which DPB slot holds which reference picture, the short-term sliding window, long-term marking with memory
+// management control operations (MMCO) and the reference lists including the modification operations they need.
+class Dpb {
+   public:
+    struct Picture {
+        bool isReference{false};
+        bool isLongTerm{false};
+        bool usable{true};  // false if the picture must not be referenced anymore, e.g. the receiver lost it
+        uint32_t frameNum{0};
+        int32_t picOrderCnt{0};
+        uint32_t longTermFrameIdx{0};
+        uint32_t frameIndex{0};  // in display order
+        uint32_t temporalId{0};  // temporal layer, only references of the same or a lower layer are used
+        StdVideoH264PictureType pictureType{STD_VIDEO_H264_PICTURE_TYPE_P};
+    };
+
+    // smallest log2(MaxFrameNum) for which none of maxRefFrames short-term references has the frame_num of the
+    // current frame (7.4.3), otherwise FrameNumWrap cannot order them
+    static uint32_t getLog2MaxFrameNum(uint32_t maxRefFrames) {
+        uint32_t log2MaxFrameNum = 4;  // log2_max_frame_num_minus4 = 0
+        while ((1u << log2MaxFrameNum) <= maxRefFrames) {
+            log2MaxFrameNum++;
+        }
+        return log2MaxFrameNum;
+    }
+
+    // slotCount DPB slots hold up to maxRefFrames references (SPS max_num_ref_frames) plus the current picture,
+    // up to maxLongTermRefFrames of the references are long-term references
+    void init(uint32_t slotCount, uint32_t maxRefFrames, uint32_t maxLongTermRefFrames, uint32_t log2MaxFrameNum) {
+        assert(slotCount > maxRefFrames && maxLongTermRefFrames < maxRefFrames);
+        m_pictures.assign(slotCount, Picture());
+        m_maxRefFrames = maxRefFrames;
+        m_maxLongTermRefFrames = maxLongTermRefFrames;
+        m_maxFrameNum = 1u << log2MaxFrameNum;
+        m_longTermIdxLimitSet = false;
+        m_nextLongTermFrameIdx = 0;
+    }
+
+    // Starts the current picture and returns the DPB slot for its reconstruction, -1 for non-reference pictures.
+    // IDR pictures remove all references, markLongTerm keeps the picture as long-term reference (ignored for IDR
+    // pictures).
+    int32_t beginPicture(uint32_t frameNum, int32_t picOrderCnt, uint32_t frameIndex, StdVideoH264PictureType type,
+                         bool isReference, bool markLongTerm, uint32_t temporalId = 0) {
+        const bool isIdr = type == STD_VIDEO_H264_PICTURE_TYPE_IDR;
+        assert(isReference || !isIdr);
+        m_markingOps.clear();
+        if (isIdr) {
+            for (Picture& picture : m_pictures) {
+                picture.isReference = false;
+            }
+            m_longTermIdxLimitSet = false;
+            markLongTerm = false;
+        }
+        markLongTerm = markLongTerm && isReference && m_maxLongTermRefFrames > 0;
+
+        m_current = Picture();
+        m_current.isReference = isReference;
+        m_current.frameNum = frameNum;
+        m_current.picOrderCnt = picOrderCnt;
+        m_current.frameIndex = frameIndex;
+        m_current.pictureType = type;
+        m_current.temporalId = temporalId;
+        m_current.isLongTerm = markLongTerm;
+        m_adaptiveMarking = markLongTerm;
+        if (markLongTerm) {
+            m_current.longTermFrameIdx = m_nextLongTermFrameIdx;
+            m_nextLongTermFrameIdx = (m_nextLongTermFrameIdx + 1) % m_maxLongTermRefFrames;
+            if (!m_longTermIdxLimitSet) {
+                // after an IDR picture there are no long-term frame indices
+                StdVideoEncodeH264RefPicMarkingEntry op = {};
+                op.memory_management_control_operation = STD_VIDEO_H264_MEM_MGMT_CONTROL_OP_SET_MAX_LONG_TERM_INDEX;
+                op.max_long_term_frame_idx_plus1 = static_cast<uint16_t>(m_maxLongTermRefFrames);
+                m_markingOps.push_back(op);
+            }
+            // adaptive marking replaces the sliding window, so make room for the current picture explicitly
+            const int32_t replacedSlot = findLongTerm(m_current.longTermFrameIdx);
+            if (getReferenceCount() - (replacedSlot >= 0 ? 1 : 0) + 1 > m_maxRefFrames) {
+                const int32_t oldestSlot = findOldestShortTerm();
+                assert(oldestSlot >= 0);
+                StdVideoEncodeH264RefPicMarkingEntry op = {};
+                op.memory_management_control_operation = STD_VIDEO_H264_MEM_MGMT_CONTROL_OP_UNMARK_SHORT_TERM;
+                op.difference_of_pic_nums_minus1 =
+                    static_cast<uint16_t>(static_cast<int32_t>(frameNum) - getPicNum(oldestSlot) - 1);
+                m_markingOps.push_back(op);
+            }
+            StdVideoEncodeH264RefPicMarkingEntry op = {};
+            op.memory_management_control_operation = STD_VIDEO_H264_MEM_MGMT_CONTROL_OP_MARK_CURRENT_AS_LONG_TERM;
+            op.long_term_frame_idx = static_cast<uint16_t>(m_current.longTermFrameIdx);
+            m_markingOps.push_back(op);
+            StdVideoEncodeH264RefPicMarkingEntry endOp = {};
+            endOp.memory_management_control_operation = STD_VIDEO_H264_MEM_MGMT_CONTROL_OP_END;
+            m_markingOps.push_back(endOp);
+        }
+
+        // there is always a free slot, as at most maxRefFrames slots hold references
+        m_currentSlot = -1;
+        for (uint32_t i = 0; i < m_pictures.size() && isReference; i++) {
+            if (!m_pictures[i].isReference) {
+                m_currentSlot = static_cast<int32_t>(i);
+                break;
+            }
+        }
+        assert(m_currentSlot >= 0 || !isReference);
+        return m_currentSlot;
+    }
+
+    // Fills the reference lists of the current picture and its marking operations. P pictures use up to maxActiveL0
+    // usable references in the default order (short-term by descending PicNum, then long-term by ascending
+    // LongTermPicNum), B pictures up to maxActiveL0/maxActiveL1 in the default order by POC distance.
+    // The lists point into this object and stay valid until the next beginPicture.
+    void getReferenceLists(uint32_t maxActiveL0, uint32_t maxActiveL1, StdVideoEncodeH264ReferenceListsInfo& lists) {
+        lists = {};
+        std::fill_n(lists.RefPicList0, STD_VIDEO_H264_MAX_NUM_LIST_REF, STD_VIDEO_H264_NO_REFERENCE_PICTURE);
+        std::fill_n(lists.RefPicList1, STD_VIDEO_H264_MAX_NUM_LIST_REF, STD_VIDEO_H264_NO_REFERENCE_PICTURE);
+        m_list0ModOps.clear();
+        m_list1ModOps.clear();
+        lists.refPicMarkingOpCount = static_cast<uint8_t>(m_markingOps.size());
+        lists.pRefPicMarkingOperations = m_markingOps.data();
+        if (m_current.pictureType == STD_VIDEO_H264_PICTURE_TYPE_IDR ||
+            m_current.pictureType == STD_VIDEO_H264_PICTURE_TYPE_I) {
+            return;
+        }
+
+        const bool isB = m_current.pictureType == STD_VIDEO_H264_PICTURE_TYPE_B;
+        std::vector<int32_t> defaultList0, defaultList1;
+        if (isB) {
+            getDefaultListsB(defaultList0, defaultList1);
+        } else {
+            defaultList0 = getDefaultList0P();
+        }
+        std::vector<int32_t> list0 = getUsableList(defaultList0, maxActiveL0, !isB);
+        assert(!list0.empty());
+        std::copy(list0.begin(), list0.end(), lists.RefPicList0);
+        lists.num_ref_idx_l0_active_minus1 = static_cast<uint8_t>(list0.size() - 1);
+        if (!std::equal(list0.begin(), list0.end(), defaultList0.begin())) {
+            getModificationOps(list0, m_list0ModOps);
+            lists.flags.ref_pic_list_modification_flag_l0 = 1;
+            lists.refList0ModOpCount = static_cast<uint8_t>(m_list0ModOps.size());
+            lists.pRefList0ModOperations = m_list0ModOps.data();
+        }
+        if (isB) {
+            std::vector<int32_t> list1 = getUsableList(defaultList1, maxActiveL1, false);
+            assert(!list1.empty());
+            std::copy(list1.begin(), list1.end(), lists.RefPicList1);
+            lists.num_ref_idx_l1_active_minus1 = static_cast<uint8_t>(list1.size() - 1);
+            if (!std::equal(list1.begin(), list1.end(), defaultList1.begin())) {
+                getModificationOps(list1, m_list1ModOps);
+                lists.flags.ref_pic_list_modification_flag_l1 = 1;
+                lists.refList1ModOpCount = static_cast<uint8_t>(m_list1ModOps.size());
+                lists.pRefList1ModOperations = m_list1ModOps.data();
+            }
+        }
+    }
+
+    // true if the last getReferenceLists needs adaptive_ref_pic_marking_mode_flag
+    bool isAdaptiveMarking() const { return m_adaptiveMarking; }
+
+    // Applies the reference marking and stores the current picture as reference.
+    void endPicture() {
+        if (!m_current.isReference) {
+            return;
+        }
+        if (m_adaptiveMarking) {
+            const int32_t replacedSlot = findLongTerm(m_current.longTermFrameIdx);
+            if (replacedSlot >= 0) {
+                m_pictures[replacedSlot].isReference = false;
+            }
+            if (getReferenceCount() + 1 > m_maxRefFrames) {
+                m_pictures[findOldestShortTerm()].isReference = false;
+            }
+            m_longTermIdxLimitSet = true;
+        } else if (getReferenceCount() == m_maxRefFrames) {
+            // sliding window (8.2.5.3)
+            m_pictures[findOldestShortTerm()].isReference = false;
+        }
+        m_pictures[m_currentSlot] = m_current;
+    }
+
+    // Marks the references encoded after frameIndex as unusable, returns false if no usable reference of the base
+    // temporal layer (which all layers may use) is left.
+    bool invalidateAfter(uint32_t frameIndex) {
+        bool usableLeft = false;
+        for (Picture& picture : m_pictures) {
+            if (picture.isReference && picture.frameIndex > frameIndex) {
+                picture.usable = false;
+            }
+            usableLeft |= picture.isReference && picture.usable && picture.temporalId == 0;
+        }
+        return usableLeft;
+    }
+
+    uint32_t getSlotCount() const { return static_cast<uint32_t>(m_pictures.size()); }
+    int32_t getCurrentSlot() const { return m_currentSlot; }
+    const Picture& getPicture(uint32_t slot) const { return m_pictures[slot]; }
+    const Picture& getCurrentPicture() const { return m_current; }
+
+    static StdVideoEncodeH264ReferenceInfo getStdReferenceInfo(const Picture& picture) {
+        StdVideoEncodeH264ReferenceInfo info = {};
+        info.flags.used_for_long_term_reference = picture.isLongTerm ? 1 : 0;
+        info.primary_pic_type = picture.pictureType;
+        info.FrameNum = picture.frameNum;
+        info.PicOrderCnt = picture.picOrderCnt;
+        info.long_term_pic_num = static_cast<uint16_t>(picture.isLongTerm ? picture.longTermFrameIdx : 0);
+        info.long_term_frame_idx = static_cast<uint16_t>(picture.isLongTerm ? picture.longTermFrameIdx : 0);
+        info.temporal_id = static_cast<uint8_t>(picture.temporalId);
+        return info;
+    }
+
+   private:
+    uint32_t getReferenceCount() const {
+        return static_cast<uint32_t>(
+            std::count_if(m_pictures.begin(), m_pictures.end(), [](const Picture& p) { return p.isReference; }));
+    }
+
+    // PicNum of a short-term reference frame relative to the current picture (FrameNumWrap, 8.2.4.1)
+    int32_t getPicNum(int32_t slot) const {
+        const uint32_t frameNum = m_pictures[slot].frameNum;
+        return frameNum > m_current.frameNum ? static_cast<int32_t>(frameNum) - static_cast<int32_t>(m_maxFrameNum)
+                                             : static_cast<int32_t>(frameNum);
+    }
+
+    int32_t findOldestShortTerm() const {
+        int32_t oldest = -1;
+        for (uint32_t i = 0; i < m_pictures.size(); i++) {
+            if (m_pictures[i].isReference && !m_pictures[i].isLongTerm && i != static_cast<uint32_t>(m_currentSlot) &&
+                (oldest < 0 || getPicNum(i) < getPicNum(oldest))) {
+                oldest = static_cast<int32_t>(i);
+            }
+        }
+        return oldest;
+    }
+
+    int32_t findLongTerm(uint32_t longTermFrameIdx) const {
+        for (uint32_t i = 0; i < m_pictures.size(); i++) {
+            if (m_pictures[i].isReference && m_pictures[i].isLongTerm &&
+                m_pictures[i].longTermFrameIdx == longTermFrameIdx) {
+                return static_cast<int32_t>(i);
+            }
+        }
+        return -1;
+    }
+
+    // the usable references of a default list (not in a higher temporal layer), newest first if the default order
+    // cannot be kept anyway
+    std::vector<int32_t> getUsableList(const std::vector<int32_t>& defaultList, uint32_t maxActive,
+                                       bool reorderIfModified) const {
+        std::vector<int32_t> list;
+        std::copy_if(defaultList.begin(), defaultList.end(), std::back_inserter(list),
+                     [&](int32_t slot) {
+                         return m_pictures[slot].usable && m_pictures[slot].temporalId <= m_current.temporalId;
+                     });
+        const size_t activeCount = std::min<size_t>(list.size(), maxActive);
+        if (reorderIfModified && !std::equal(list.begin(), list.begin() + activeCount, defaultList.begin())) {
+            std::sort(list.begin(), list.end(),
+                      [&](int32_t a, int32_t b) { return m_pictures[a].frameIndex > m_pictures[b].frameIndex; });
+        }
+        list.resize(activeCount);
+        return list;
+    }
+
+    // ref_pic_list_modification (8.2.4.3) which turns the default list into the given one
+    void getModificationOps(const std::vector<int32_t>& list, std::vector<StdVideoEncodeH264RefListModEntry>& ops) {
+        const int32_t maxPicNum = static_cast<int32_t>(m_maxFrameNum);
+        int32_t picNumPredNoWrap = static_cast<int32_t>(m_current.frameNum);
+        for (int32_t slot : list) {
+            StdVideoEncodeH264RefListModEntry op = {};
+            if (m_pictures[slot].isLongTerm) {
+                op.modification_of_pic_nums_idc = STD_VIDEO_H264_MODIFICATION_OF_PIC_NUMS_IDC_LONG_TERM;
+                op.long_term_pic_num = static_cast<uint16_t>(m_pictures[slot].longTermFrameIdx);
+            } else {
+                const int32_t picNumNoWrap = (getPicNum(slot) + maxPicNum) % maxPicNum;
+                const int32_t diff = picNumNoWrap - picNumPredNoWrap;
+                op.modification_of_pic_nums_idc = diff < 0
+                                                      ? STD_VIDEO_H264_MODIFICATION_OF_PIC_NUMS_IDC_SHORT_TERM_SUBTRACT
+                                                      : STD_VIDEO_H264_MODIFICATION_OF_PIC_NUMS_IDC_SHORT_TERM_ADD;
+                op.abs_diff_pic_num_minus1 = static_cast<uint16_t>(std::abs(diff) - 1);
+                picNumPredNoWrap = picNumNoWrap;
+            }
+            ops.push_back(op);
+        }
+        StdVideoEncodeH264RefListModEntry endOp = {};
+        endOp.modification_of_pic_nums_idc = STD_VIDEO_H264_MODIFICATION_OF_PIC_NUMS_IDC_END;
+        ops.push_back(endOp);
+    }
+
+    std::vector<int32_t> getLongTermList() const {
+        std::vector<int32_t> longTerm;
+        for (uint32_t i = 0; i < m_pictures.size(); i++) {
+            if (m_pictures[i].isReference && m_pictures[i].isLongTerm) {
+                longTerm.push_back(static_cast<int32_t>(i));
+            }
+        }
+        std::sort(longTerm.begin(), longTerm.end(), [&](int32_t a, int32_t b) {
+            return m_pictures[a].longTermFrameIdx < m_pictures[b].longTermFrameIdx;
+        });
+        return longTerm;
+    }
+
+    // 8.2.4.2.3: short-term before the current picture by descending POC, then after it by ascending POC (swapped
+    // for list 1), then long-term
+    void getDefaultListsB(std::vector<int32_t>& list0, std::vector<int32_t>& list1) const {
+        std::vector<int32_t> before, after;
+        for (uint32_t i = 0; i < m_pictures.size(); i++) {
+            if (m_pictures[i].isReference && !m_pictures[i].isLongTerm) {
+                (m_pictures[i].picOrderCnt < m_current.picOrderCnt ? before : after).push_back(static_cast<int32_t>(i));
+            }
+        }
+        std::sort(before.begin(), before.end(),
+                  [&](int32_t a, int32_t b) { return m_pictures[a].picOrderCnt > m_pictures[b].picOrderCnt; });
+        std::sort(after.begin(), after.end(),
+                  [&](int32_t a, int32_t b) { return m_pictures[a].picOrderCnt < m_pictures[b].picOrderCnt; });
+        const std::vector<int32_t> longTerm = getLongTermList();
+        list0 = before;
+        list0.insert(list0.end(), after.begin(), after.end());
+        list0.insert(list0.end(), longTerm.begin(), longTerm.end());
+        list1 = after;
+        list1.insert(list1.end(), before.begin(), before.end());
+        list1.insert(list1.end(), longTerm.begin(), longTerm.end());
+        if (list1.size() > 1 && list1 == list0) {
+            std::swap(list1[0], list1[1]);
+        }
+    }
+
+    std::vector<int32_t> getDefaultList0P() const {
+        std::vector<int32_t> shortTerm;
+        for (uint32_t i = 0; i < m_pictures.size(); i++) {
+            if (m_pictures[i].isReference && !m_pictures[i].isLongTerm) {
+                shortTerm.push_back(static_cast<int32_t>(i));
+            }
+        }
+        std::sort(shortTerm.begin(), shortTerm.end(),
+                  [&](int32_t a, int32_t b) { return getPicNum(a) > getPicNum(b); });
+        const std::vector<int32_t> longTerm = getLongTermList();
+        shortTerm.insert(shortTerm.end(), longTerm.begin(), longTerm.end());
+        return shortTerm;
+    }
+
+    std::vector<Picture> m_pictures;  // indexed by DPB slot
+    uint32_t m_maxRefFrames{1};
+    uint32_t m_maxLongTermRefFrames{0};
+    uint32_t m_maxFrameNum{16};
+    bool m_longTermIdxLimitSet{false};  // MaxLongTermFrameIdx was set by MMCO 4 since the last IDR picture
+    uint32_t m_nextLongTermFrameIdx{0};
+
+    Picture m_current;
+    int32_t m_currentSlot{-1};
+    bool m_adaptiveMarking{false};
+    std::vector<StdVideoEncodeH264RefPicMarkingEntry> m_markingOps;
+    std::vector<StdVideoEncodeH264RefListModEntry> m_list0ModOps;
+    std::vector<StdVideoEncodeH264RefListModEntry> m_list1ModOps;
+};
+
+};  // namespace h264
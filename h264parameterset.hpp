@@ -1,6 +1,7 @@
 #pragma once
 #include <cassert>
 #include <cmath>
+#include <vector>
 
 #include "vk_video/vulkan_video_codec_h264std.h"
 #include "vk_video/vulkan_video_codecs_common.h"
@@ -16,20 +17,45 @@ static sizeType AlignSize(sizeType size, sizeType alignment) {
     return (size + alignment - 1) & ~(alignment - 1);
 }
 
-static StdVideoH264SequenceParameterSetVui getStdVideoH264SequenceParameterSetVui(uint32_t fps) {
+// maxNumReorderFrames > 0 (B frames) signals the reordering and the DPB size, so decoders can output frames early
+static StdVideoH264SequenceParameterSetVui getStdVideoH264SequenceParameterSetVui(uint32_t fps,
+                                                                                  uint32_t maxNumReorderFrames = 0,
+                                                                                  uint32_t maxDecFrameBuffering = 0) {
     StdVideoH264SpsVuiFlags vuiFlags = {};
     vuiFlags.timing_info_present_flag = 1u;
     vuiFlags.fixed_frame_rate_flag = 1u;
+    vuiFlags.bitstream_restriction_flag = maxNumReorderFrames > 0 ? 1u : 0u;
 
     StdVideoH264SequenceParameterSetVui vui = {};
     vui.flags = vuiFlags;
     vui.num_units_in_tick = 1;
     vui.time_scale = fps * 2;  // 2 fields
+    vui.max_num_reorder_frames = static_cast<uint8_t>(maxNumReorderFrames);
+    vui.max_dec_frame_buffering = static_cast<uint8_t>(maxDecFrameBuffering);
 
     return vui;
 }
 
+// colour description of the RGB->YCbCr conversion (BT.709 or BT.601, H.273 code points) and the chroma siting of its
+// 2x2 averaging, which is centered between the luma samples (type 1)
+static void setStdVideoH264VuiColorDescription(StdVideoH264SequenceParameterSetVui& vui, bool bt709, bool fullRange) {
+    vui.flags.video_signal_type_present_flag = 1u;
+    vui.flags.video_full_range_flag = fullRange ? 1u : 0u;
+    vui.flags.color_description_present_flag = 1u;
+    vui.video_format = 5;  // unspecified
+    vui.colour_primaries = bt709 ? 1 : 6;
+    vui.transfer_characteristics = bt709 ? 1 : 6;
+    vui.matrix_coefficients = bt709 ? 1 : 6;
+    vui.flags.chroma_loc_info_present_flag = 1u;
+    vui.chroma_sample_loc_type_top_field = 1;
+    vui.chroma_sample_loc_type_bottom_field = 1;
+}
+
 static StdVideoH264SequenceParameterSet getStdVideoH264SequenceParameterSet(uint32_t width, uint32_t height,
+                                                                            StdVideoH264ProfileIdc profileIdc,
+                                                                            StdVideoH264LevelIdc levelIdc,
+                                                                            uint32_t maxNumRefFrames,
+                                                                            uint32_t log2MaxFrameNum,
                                                                             StdVideoH264SequenceParameterSetVui* pVui) {
     StdVideoH264SpsFlags spsFlags = {};
     spsFlags.direct_8x8_inference_flag = 1u;
@@ -40,15 +66,15 @@ static StdVideoH264SequenceParameterSet getStdVideoH264SequenceParameterSet(uint
     const uint32_t mbAlignedHeight = AlignSize(height, H264MbSizeAlignment);
 
     StdVideoH264SequenceParameterSet sps = {};
-    sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_MAIN;
-    sps.level_idc = STD_VIDEO_H264_LEVEL_IDC_4_1;
+    sps.profile_idc = profileIdc;
+    sps.level_idc = levelIdc;
     sps.seq_parameter_set_id = 0u;
     sps.chroma_format_idc = STD_VIDEO_H264_CHROMA_FORMAT_IDC_420;
     sps.bit_depth_luma_minus8 = 0u;
     sps.bit_depth_chroma_minus8 = 0u;
-    sps.log2_max_frame_num_minus4 = 0u;
+    sps.log2_max_frame_num_minus4 = static_cast<uint8_t>(log2MaxFrameNum - 4);
     sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_0;
-    sps.max_num_ref_frames = 1u;
+    sps.max_num_ref_frames = static_cast<uint8_t>(maxNumRefFrames);
     sps.pic_width_in_mbs_minus1 = mbAlignedWidth / H264MbSizeAlignment - 1;
     sps.pic_height_in_map_units_minus1 = mbAlignedHeight / H264MbSizeAlignment - 1;
     sps.flags = spsFlags;
@@ -90,71 +116,84 @@ static StdVideoH264PictureParameterSet getStdVideoH264PictureParameterSet(void)
 
 class FrameInfo {
    public:
-    FrameInfo(uint32_t frameCount, uint32_t width, uint32_t height, StdVideoH264SequenceParameterSet sps,
-              StdVideoH264PictureParameterSet pps, uint32_t gopFrameCount, bool useConstantQp) {
-        bool isI = gopFrameCount == 0;
-        const uint32_t MaxPicOrderCntLsb = 1 << (sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
-
+    // frameNum and picOrderCnt are counted from the last IDR frame (frameNum wraps at MaxFrameNum),
+    // idrPicId has to differ between consecutive IDR frames,
+    // referenceLists come from the DPB management (h264::Dpb), B frames are no reference frames (isReference),
+    // constantQp is 0 with rate control,
+    // the slice intraSliceIndex of sliceCount slices of a P frame is coded as I slice (-1 for none, intra refresh)
+    FrameInfo(uint32_t frameNum, int32_t picOrderCnt, uint16_t idrPicId, const StdVideoH264PictureParameterSet& pps,
+              StdVideoH264PictureType pictureType, bool isReference,
+              const StdVideoEncodeH264ReferenceListsInfo& referenceLists, bool adaptiveRefPicMarking,
+              int32_t constantQp, uint32_t sliceCount = 1, int32_t intraSliceIndex = -1)
+        : m_sliceHeaders(sliceCount), m_sliceInfos(sliceCount) {
+        const bool isIdr = pictureType == STD_VIDEO_H264_PICTURE_TYPE_IDR;
+        const bool isI = isIdr || pictureType == STD_VIDEO_H264_PICTURE_TYPE_I;
+        const bool isB = pictureType == STD_VIDEO_H264_PICTURE_TYPE_B;
+        const StdVideoH264SliceType sliceType = isI   ? STD_VIDEO_H264_SLICE_TYPE_I
+                                                : isB ? STD_VIDEO_H264_SLICE_TYPE_B
+                                                      : STD_VIDEO_H264_SLICE_TYPE_P;
         m_sliceHeaderFlags.direct_spatial_mv_pred_flag = 1;
-        m_sliceHeaderFlags.num_ref_idx_active_override_flag = 0;
-
-        m_sliceHeader.flags = m_sliceHeaderFlags;
-        m_sliceHeader.slice_type = isI ? STD_VIDEO_H264_SLICE_TYPE_I : STD_VIDEO_H264_SLICE_TYPE_P;
-        m_sliceHeader.cabac_init_idc = (StdVideoH264CabacInitIdc)0;
-        m_sliceHeader.disable_deblocking_filter_idc = (StdVideoH264DisableDeblockingFilterIdc)0;
-        m_sliceHeader.slice_alpha_c0_offset_div2 = 0;
-        m_sliceHeader.slice_beta_offset_div2 = 0;
-
-        uint32_t picWidthInMbs = sps.pic_width_in_mbs_minus1 + 1;
-        uint32_t picHeightInMbs = sps.pic_height_in_map_units_minus1 + 1;
-        uint32_t iPicSizeInMbs = picWidthInMbs * picHeightInMbs;
-
-        m_sliceInfo.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_NALU_SLICE_INFO_KHR;
-        m_sliceInfo.pNext = NULL;
-        m_sliceInfo.pStdSliceHeader = &m_sliceHeader;
-        m_sliceInfo.constantQp = useConstantQp ? pps.pic_init_qp_minus26 + 26 : 0;
+        m_sliceHeaderFlags.num_ref_idx_active_override_flag =
+            !isI && (referenceLists.num_ref_idx_l0_active_minus1 != pps.num_ref_idx_l0_default_active_minus1 ||
+                     (isB && referenceLists.num_ref_idx_l1_active_minus1 != pps.num_ref_idx_l1_default_active_minus1));
+
+        for (uint32_t i = 0; i < sliceCount; i++) {
+            StdVideoEncodeH264SliceHeader& sliceHeader = m_sliceHeaders[i];
+            sliceHeader.flags = m_sliceHeaderFlags;
+            sliceHeader.slice_type =
+                static_cast<int32_t>(i) == intraSliceIndex ? STD_VIDEO_H264_SLICE_TYPE_I : sliceType;
+            sliceHeader.cabac_init_idc = (StdVideoH264CabacInitIdc)0;
+            sliceHeader.disable_deblocking_filter_idc = (StdVideoH264DisableDeblockingFilterIdc)0;
+            sliceHeader.slice_alpha_c0_offset_div2 = 0;
+            sliceHeader.slice_beta_offset_div2 = 0;
+
+            VkVideoEncodeH264NaluSliceInfoKHR& sliceInfo = m_sliceInfos[i];
+            sliceInfo.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_NALU_SLICE_INFO_KHR;
+            sliceInfo.pNext = NULL;
+            sliceInfo.pStdSliceHeader = &sliceHeader;
+            sliceInfo.constantQp = constantQp;
+        }
 
-        m_pictureInfoFlags.IdrPicFlag = isI ? 1 : 0;  // every I frame is an IDR frame
-        m_pictureInfoFlags.is_reference = 1;
-        m_pictureInfoFlags.adaptive_ref_pic_marking_mode_flag = 0;
-        m_pictureInfoFlags.no_output_of_prior_pics_flag = isI ? 1 : 0;
+        m_pictureInfoFlags.IdrPicFlag = isIdr ? 1 : 0;
+        m_pictureInfoFlags.is_reference = isReference ? 1 : 0;
+        m_pictureInfoFlags.adaptive_ref_pic_marking_mode_flag = adaptiveRefPicMarking ? 1 : 0;
+        m_pictureInfoFlags.no_output_of_prior_pics_flag = isIdr ? 1 : 0;
 
         m_stdPictureInfo.flags = m_pictureInfoFlags;
         m_stdPictureInfo.seq_parameter_set_id = 0;
         m_stdPictureInfo.pic_parameter_set_id = pps.pic_parameter_set_id;
-        m_stdPictureInfo.idr_pic_id = 0;
-        m_stdPictureInfo.primary_pic_type = isI ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P;
-        // m_stdPictureInfo.temporal_id = 1;
-
-        // frame_num is incremented for each reference frame transmitted.
-        // In our case, only the first frame (which is IDR) is a reference
-        // frame with frame_num == 0, and all others have frame_num == 1.
-        m_stdPictureInfo.frame_num = frameCount;
-
-        // POC is incremented by 2 for each coded frame.
-        m_stdPictureInfo.PicOrderCnt = (frameCount * 2) % MaxPicOrderCntLsb;
-        m_referenceLists.num_ref_idx_l0_active_minus1 = 0;
-        m_referenceLists.num_ref_idx_l1_active_minus1 = 0;
-        std::fill_n(m_referenceLists.RefPicList0, STD_VIDEO_H264_MAX_NUM_LIST_REF, STD_VIDEO_H264_NO_REFERENCE_PICTURE);
-        std::fill_n(m_referenceLists.RefPicList1, STD_VIDEO_H264_MAX_NUM_LIST_REF, STD_VIDEO_H264_NO_REFERENCE_PICTURE);
-        if (!isI) {
-            m_referenceLists.RefPicList0[0] = !(gopFrameCount & 1);
-        }
+        m_stdPictureInfo.idr_pic_id = idrPicId;
+        m_stdPictureInfo.primary_pic_type = pictureType;
+
+        // frame_num is incremented after each reference frame transmitted, a B frame gets the one of the next
+        // reference frame.
+        m_stdPictureInfo.frame_num = frameNum;
+
+        // POC is incremented by 2 for each frame in display order, the implementation writes it modulo
+        // MaxPicOrderCntLsb.
+        m_stdPictureInfo.PicOrderCnt = picOrderCnt;
+        m_referenceLists = referenceLists;
         m_stdPictureInfo.pRefLists = &m_referenceLists;
 
         m_encodeH264FrameInfo.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_PICTURE_INFO_KHR;
         m_encodeH264FrameInfo.pNext = NULL;
-        m_encodeH264FrameInfo.naluSliceEntryCount = 1;
-        m_encodeH264FrameInfo.pNaluSliceEntries = &m_sliceInfo;
+        m_encodeH264FrameInfo.naluSliceEntryCount = sliceCount;
+        m_encodeH264FrameInfo.pNaluSliceEntries = m_sliceInfos.data();
         m_encodeH264FrameInfo.pStdPictureInfo = &m_stdPictureInfo;
     }
 
+    // temporal layer of the frame, only written to the bitstream in prefix NAL units (H.264 Annex G)
+    void setTemporalId(uint32_t temporalId, bool generatePrefixNalu) {
+        m_stdPictureInfo.temporal_id = static_cast<uint8_t>(temporalId);
+        m_encodeH264FrameInfo.generatePrefixNalu = generatePrefixNalu ? VK_TRUE : VK_FALSE;
+    }
+
     inline VkVideoEncodeH264PictureInfoKHR* getEncodeH264FrameInfo() { return &m_encodeH264FrameInfo; };
 
    private:
     StdVideoEncodeH264SliceHeaderFlags m_sliceHeaderFlags = {};
-    StdVideoEncodeH264SliceHeader m_sliceHeader = {};
-    VkVideoEncodeH264NaluSliceInfoKHR m_sliceInfo = {};
+    std::vector<StdVideoEncodeH264SliceHeader> m_sliceHeaders;  // value initialized
+    std::vector<VkVideoEncodeH264NaluSliceInfoKHR> m_sliceInfos;
     StdVideoEncodeH264PictureInfoFlags m_pictureInfoFlags = {};
     StdVideoEncodeH264PictureInfo m_stdPictureInfo = {};
     VkVideoEncodeH264PictureInfoKHR m_encodeH264FrameInfo = {};
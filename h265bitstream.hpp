@@ -0,0 +1,62 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "h264bitstream.hpp"
+
+namespace h265 {
+
+enum NalUnitType : uint8_t {
+    NAL_UNIT_TYPE_TRAIL_N = 0,
+    NAL_UNIT_TYPE_TRAIL_R = 1,
+    NAL_UNIT_TYPE_IDR_W_RADL = 19,
+    NAL_UNIT_TYPE_IDR_N_LP = 20,
+    NAL_UNIT_TYPE_CRA = 21,
+    NAL_UNIT_TYPE_VPS = 32,
+    NAL_UNIT_TYPE_SPS = 33,
+    NAL_UNIT_TYPE_PPS = 34,
+    NAL_UNIT_TYPE_AUD = 35,
+    NAL_UNIT_TYPE_PREFIX_SEI = 39,
+};
+
+// one NAL unit of an Annex B byte stream, offset and size exclude the start code
+struct NalUnit {
+    size_t offset;
+    size_t size;
+    uint8_t type;
+    uint8_t temporalId;  // from the NAL unit header
+
+    // slice segments are the VCL NAL units
+    bool isSlice() const { return type < NAL_UNIT_TYPE_VPS; }
+};
+
+// Splits an Annex B byte stream at its start codes like h264::splitNalUnits, with the two byte H.265 header.
+static std::vector<NalUnit> splitNalUnits(const uint8_t* data, size_t size) {
+    std::vector<NalUnit> nalUnits;
+    for (const h264::NalUnit& nalUnit : h264::splitNalUnits(data, size)) {
+        const uint8_t* header = data + nalUnit.offset;
+        const uint8_t temporalIdPlus1 = nalUnit.size >= 2 ? header[1] & 0x07 : 1;
+        nalUnits.push_back({nalUnit.offset, nalUnit.size, static_cast<uint8_t>((header[0] >> 1) & 0x3f),
+                            static_cast<uint8_t>(temporalIdPlus1 > 0 ? temporalIdPlus1 - 1 : 0)});
+    }
+    return nalUnits;
+}
+
+};  // namespace h265
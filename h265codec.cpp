@@ -0,0 +1,203 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "h265codec.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+const VkExtensionProperties& H265Codec::getStdHeaderVersion() const {
+    static const VkExtensionProperties h265StdExtensionVersion = {VK_STD_VULKAN_VIDEO_CODEC_H265_ENCODE_EXTENSION_NAME,
+                                                                  VK_STD_VULKAN_VIDEO_CODEC_H265_ENCODE_SPEC_VERSION};
+    return h265StdExtensionVersion;
+}
+
+const void* H265Codec::getProfileInfo(int32_t profileIdc, const void* pNext) {
+    m_profileInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_PROFILE_INFO_KHR};
+    m_profileInfo.pNext = pNext;
+    m_profileInfo.stdProfileIdc = static_cast<StdVideoH265ProfileIdc>(profileIdc);
+    return &m_profileInfo;
+}
+
+uint32_t H265Codec::getLog2CtbSize(const VkVideoEncodeH265CapabilitiesKHR& h265Capabilities) {
+    // larger blocks code flat content with less overhead
+    if (h265Capabilities.ctbSizes & VK_VIDEO_ENCODE_H265_CTB_SIZE_64_BIT_KHR) {
+        return 6;
+    }
+    if (h265Capabilities.ctbSizes & VK_VIDEO_ENCODE_H265_CTB_SIZE_32_BIT_KHR) {
+        return 5;
+    }
+    if (h265Capabilities.ctbSizes & VK_VIDEO_ENCODE_H265_CTB_SIZE_16_BIT_KHR) {
+        return 4;
+    }
+    throw std::runtime_error("Error: no supported H.265 coding tree block size");
+}
+
+VideoCodec::Limits H265Codec::getLimits(const EncoderDevice::EncodeCapabilities& caps) const {
+    const VkVideoEncodeH265CapabilitiesKHR& h265Capabilities = caps.h265Capabilities;
+    return {.minQp = h265Capabilities.minQp,
+            .maxQp = h265Capabilities.maxQp,
+            .maxPPictureL0ReferenceCount = h265Capabilities.maxPPictureL0ReferenceCount,
+            .maxBPictureL0ReferenceCount = h265Capabilities.maxBPictureL0ReferenceCount,
+            .maxL1ReferenceCount = h265Capabilities.maxL1ReferenceCount,
+            .maxTemporalLayerCount = h265Capabilities.maxSubLayerCount,
+            .maxSliceCount = h265Capabilities.maxSliceSegmentCount,
+            .differentSliceTypes =
+                (h265Capabilities.flags & VK_VIDEO_ENCODE_H265_CAPABILITY_DIFFERENT_SLICE_SEGMENT_TYPE_BIT_KHR) != 0,
+            .blockSize = 1u << getLog2CtbSize(h265Capabilities)};
+}
+
+void H265Codec::init(const EncoderDevice::EncodeCapabilities& caps, const StreamConfig& config) {
+    const VkVideoEncodeH265CapabilitiesKHR& h265Capabilities = caps.h265Capabilities;
+    if (config.levelIdc > h265Capabilities.maxLevelIdc) {
+        throw std::runtime_error("Error: H.265 level not supported, maximum is " +
+                                 std::to_string(h265Capabilities.maxLevelIdc));
+    }
+    if (config.longTermReferenceCount > 0) {
+        throw std::runtime_error("Error: long-term references are only supported with H.264");
+    }
+    m_config = config;
+    m_log2CtbSize = getLog2CtbSize(h265Capabilities);
+    // the smallest and the largest supported transform block, which must not exceed the coding tree block
+    const VkVideoEncodeH265TransformBlockSizeFlagsKHR tbSizes = h265Capabilities.transformBlockSizes;
+    m_log2MinTbSize = (tbSizes & VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_4_BIT_KHR)    ? 2
+                      : (tbSizes & VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_8_BIT_KHR)  ? 3
+                      : (tbSizes & VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_16_BIT_KHR) ? 4
+                                                                                          : 5;
+    m_log2MaxTbSize = (tbSizes & VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_32_BIT_KHR)   ? 5
+                      : (tbSizes & VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_16_BIT_KHR) ? 4
+                      : (tbSizes & VK_VIDEO_ENCODE_H265_TRANSFORM_BLOCK_SIZE_8_BIT_KHR)  ? 3
+                                                                                          : 2;
+    m_log2MaxTbSize = std::min(m_log2MaxTbSize, m_log2CtbSize);
+    // the optional tools the implementation can encode with
+    const VkVideoEncodeH265StdFlagsKHR stdSyntaxFlags = h265Capabilities.stdSyntaxFlags;
+    m_sampleAdaptiveOffset =
+        (stdSyntaxFlags & VK_VIDEO_ENCODE_H265_STD_SAMPLE_ADAPTIVE_OFFSET_ENABLED_FLAG_SET_BIT_KHR) != 0;
+    m_cuQpDelta = (stdSyntaxFlags & VK_VIDEO_ENCODE_H265_STD_CU_QP_DELTA_ENABLED_FLAG_SET_BIT_KHR) != 0;
+    m_dpb.init(config.dpbSlotCount, config.referenceFrameCount);
+    m_stdReferenceInfos.assign(config.dpbSlotCount, {});
+    m_dpbSlotInfos.assign(config.dpbSlotCount, {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_DPB_SLOT_INFO_KHR});
+    m_frameInfo.reset();
+}
+
+const void* H265Codec::getSessionParametersCreateInfo(uint32_t width, uint32_t height) {
+    m_profileTierLevel =
+        h265::getStdVideoH265ProfileTierLevel(static_cast<StdVideoH265ProfileIdc>(m_config.profileIdc),
+                                              static_cast<StdVideoH265LevelIdc>(m_config.levelIdc));
+    // the references and the current picture, with B frames one frame is decoded before the frames preceding it in
+    // display order
+    m_decPicBufMgr =
+        h265::getStdVideoH265DecPicBufMgr(m_config.referenceFrameCount + 1, m_config.bFrameCount > 0 ? 1 : 0);
+    m_vps = h265::getStdVideoH265VideoParameterSet(m_config.fps, m_config.temporalLayerCount, &m_profileTierLevel,
+                                                   &m_decPicBufMgr);
+    m_vui = h265::getStdVideoH265SequenceParameterSetVui(m_config.fps);
+    h265::setStdVideoH265VuiColorDescription(m_vui, m_config.bt709, m_config.fullRange);
+    m_sps = h265::getStdVideoH265SequenceParameterSet(width, height, m_log2CtbSize, m_log2MinTbSize, m_log2MaxTbSize,
+                                                      m_config.temporalLayerCount, m_sampleAdaptiveOffset,
+                                                      &m_profileTierLevel, &m_decPicBufMgr, &m_vui);
+    m_pps = h265::getStdVideoH265PictureParameterSet(m_cuQpDelta);
+
+    m_sessionParametersAddInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_ADD_INFO_KHR};
+    m_sessionParametersAddInfo.pNext = nullptr;
+    m_sessionParametersAddInfo.stdVPSCount = 1;
+    m_sessionParametersAddInfo.pStdVPSs = &m_vps;
+    m_sessionParametersAddInfo.stdSPSCount = 1;
+    m_sessionParametersAddInfo.pStdSPSs = &m_sps;
+    m_sessionParametersAddInfo.stdPPSCount = 1;
+    m_sessionParametersAddInfo.pStdPPSs = &m_pps;
+
+    m_sessionParametersCreateInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_CREATE_INFO_KHR};
+    m_sessionParametersCreateInfo.pNext = nullptr;
+    m_sessionParametersCreateInfo.maxStdVPSCount = 1;
+    m_sessionParametersCreateInfo.maxStdSPSCount = 1;
+    m_sessionParametersCreateInfo.maxStdPPSCount = 1;
+    m_sessionParametersCreateInfo.pParametersAddInfo = &m_sessionParametersAddInfo;
+    return &m_sessionParametersCreateInfo;
+}
+
+const void* H265Codec::getSessionParametersGetInfo() {
+    m_sessionParametersGetInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_GET_INFO_KHR};
+    m_sessionParametersGetInfo.stdVPSId = 0;
+    m_sessionParametersGetInfo.stdSPSId = 0;
+    m_sessionParametersGetInfo.stdPPSId = 0;
+    m_sessionParametersGetInfo.writeStdVPS = VK_TRUE;
+    m_sessionParametersGetInfo.writeStdSPS = VK_TRUE;
+    m_sessionParametersGetInfo.writeStdPPS = VK_TRUE;
+    return &m_sessionParametersGetInfo;
+}
+
+void* H265Codec::getSessionParametersFeedbackInfo() {
+    m_sessionParametersFeedbackInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_SESSION_PARAMETERS_FEEDBACK_INFO_KHR};
+    return &m_sessionParametersFeedbackInfo;
+}
+
+const void* H265Codec::getRateControlInfo(uint32_t gopFrameCount, uint32_t idrPeriod, uint32_t layerCount) {
+    m_rateControlInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_RATE_CONTROL_INFO_KHR};
+    // B frames and the top temporal sub-layer are no references, so the pattern is only flat without them
+    m_rateControlInfo.flags = VK_VIDEO_ENCODE_H265_RATE_CONTROL_REGULAR_GOP_BIT_KHR;
+    if (m_config.temporalLayerCount > 1) {
+        m_rateControlInfo.flags |= VK_VIDEO_ENCODE_H265_RATE_CONTROL_TEMPORAL_SUB_LAYER_PATTERN_DYADIC_BIT_KHR;
+    } else if (m_config.bFrameCount == 0) {
+        m_rateControlInfo.flags |= VK_VIDEO_ENCODE_H265_RATE_CONTROL_REFERENCE_PATTERN_FLAT_BIT_KHR;
+    }
+    m_rateControlInfo.gopFrameCount = gopFrameCount;
+    m_rateControlInfo.idrPeriod = idrPeriod;
+    m_rateControlInfo.consecutiveBFrameCount = m_config.bFrameCount;
+    m_rateControlInfo.subLayerCount = layerCount;
+    return &m_rateControlInfo;
+}
+
+const void* H265Codec::getRateControlLayerInfo(uint32_t layer) {
+    m_rateControlLayerInfos[layer] = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_RATE_CONTROL_LAYER_INFO_KHR};
+    return &m_rateControlLayerInfos[layer];
+}
+
+int32_t H265Codec::beginPicture(const Picture& picture) {
+    const StdVideoH265PictureType pictureType = picture.type == PictureType::IDR ? STD_VIDEO_H265_PICTURE_TYPE_IDR
+                                                : picture.type == PictureType::I ? STD_VIDEO_H265_PICTURE_TYPE_I
+                                                : picture.type == PictureType::B ? STD_VIDEO_H265_PICTURE_TYPE_B
+                                                                                 : STD_VIDEO_H265_PICTURE_TYPE_P;
+    // POC is kept in the int32_t range with a multiple of MaxPicOrderCntLsb
+    const int32_t picOrderCnt = static_cast<int32_t>(picture.framesSinceIdr % (1u << 30));
+    const int32_t setupSlot =
+        m_dpb.beginPicture(picOrderCnt, picture.frameIndex, pictureType, picture.isReference, picture.temporalId);
+    m_dpb.getReferenceLists(picture.maxL0References, picture.maxL1References, m_referenceLists, m_shortTermRefPicSet);
+    m_frameInfo.emplace(pictureType, picOrderCnt, picture.temporalId, picture.isReference, m_referenceLists,
+                        m_shortTermRefPicSet, m_sps, m_pps, picture.constantQp, picture.sliceCount,
+                        picture.intraSliceIndex);
+    return setupSlot;
+}
+
+const void* H265Codec::getDpbSlotInfo(uint32_t slot) {
+    const bool isSetupSlot = static_cast<int32_t>(slot) == m_dpb.getCurrentSlot();
+    const h265::Dpb::Picture& picture = isSetupSlot ? m_dpb.getCurrentPicture() : m_dpb.getPicture(slot);
+    if (!isSetupSlot && !picture.isReference) {
+        return nullptr;
+    }
+    m_stdReferenceInfos[slot] = h265::Dpb::getStdReferenceInfo(picture);
+    m_dpbSlotInfos[slot].pStdReferenceInfo = &m_stdReferenceInfos[slot];
+    return &m_dpbSlotInfos[slot];
+}
+
+bool H265Codec::isReferenced(uint32_t slot) const {
+    const uint8_t* list0 = m_referenceLists.RefPicList0;
+    const uint8_t* list1 = m_referenceLists.RefPicList1;
+    return std::find(list0, list0 + STD_VIDEO_H265_MAX_NUM_LIST_REF, slot) != list0 + STD_VIDEO_H265_MAX_NUM_LIST_REF ||
+           std::find(list1, list1 + STD_VIDEO_H265_MAX_NUM_LIST_REF, slot) != list1 + STD_VIDEO_H265_MAX_NUM_LIST_REF;
+}
+
+const void* H265Codec::getPictureInfo() { return m_frameInfo->getEncodeH265FrameInfo(); }
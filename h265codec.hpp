@@ -0,0 +1,86 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#define VK_NO_PROTOTYPES
+#include <volk/volk.h>
+
+#include <array>
+#include <optional>
+#include <vector>
+
+#include "h265dpb.hpp"
+#include "h265parameterset.hpp"
+#include "videocodec.hpp"
+
+// H.265 (VK_KHR_video_encode_h265): VPS/SPS/PPS with the largest supported coding tree blocks, slice segment
+// headers and reference picture sets from h265::Dpb. Long-term references are not supported.
+class H265Codec : public VideoCodec {
+   public:
+    VkVideoCodecOperationFlagBitsKHR getCodecOperation() const override {
+        return VK_VIDEO_CODEC_OPERATION_ENCODE_H265_BIT_KHR;
+    }
+    const VkExtensionProperties& getStdHeaderVersion() const override;
+    const void* getProfileInfo(int32_t profileIdc, const void* pNext) override;
+    Limits getLimits(const EncoderDevice::EncodeCapabilities& caps) const override;
+    void init(const EncoderDevice::EncodeCapabilities& caps, const StreamConfig& config) override;
+
+    const void* getSessionParametersCreateInfo(uint32_t width, uint32_t height) override;
+    const void* getSessionParametersGetInfo() override;
+    void* getSessionParametersFeedbackInfo() override;
+    const void* getRateControlInfo(uint32_t gopFrameCount, uint32_t idrPeriod, uint32_t layerCount) override;
+    const void* getRateControlLayerInfo(uint32_t layer) override;
+
+    int32_t beginPicture(const Picture& picture) override;
+    const void* getDpbSlotInfo(uint32_t slot) override;
+    bool isReferenced(uint32_t slot) const override;
+    const void* getPictureInfo() override;
+    void endPicture() override { m_dpb.endPicture(); }
+    bool invalidateAfter(uint32_t frameIndex) override { return m_dpb.invalidateAfter(frameIndex); }
+
+   private:
+    // log2 of the largest coding tree block size the implementation supports
+    static uint32_t getLog2CtbSize(const VkVideoEncodeH265CapabilitiesKHR& h265Capabilities);
+
+    StreamConfig m_config;
+    uint32_t m_log2CtbSize;
+    uint32_t m_log2MinTbSize;  // transform block sizes
+    uint32_t m_log2MaxTbSize;
+    bool m_sampleAdaptiveOffset;
+    bool m_cuQpDelta;
+
+    VkVideoEncodeH265ProfileInfoKHR m_profileInfo;
+    StdVideoH265ProfileTierLevel m_profileTierLevel;
+    StdVideoH265DecPicBufMgr m_decPicBufMgr;
+    StdVideoH265VideoParameterSet m_vps;
+    StdVideoH265SequenceParameterSetVui m_vui;
+    StdVideoH265SequenceParameterSet m_sps;
+    StdVideoH265PictureParameterSet m_pps;
+    VkVideoEncodeH265SessionParametersAddInfoKHR m_sessionParametersAddInfo;
+    VkVideoEncodeH265SessionParametersCreateInfoKHR m_sessionParametersCreateInfo;
+    VkVideoEncodeH265SessionParametersGetInfoKHR m_sessionParametersGetInfo;
+    VkVideoEncodeH265SessionParametersFeedbackInfoKHR m_sessionParametersFeedbackInfo;
+    VkVideoEncodeH265RateControlInfoKHR m_rateControlInfo;
+    std::array<VkVideoEncodeH265RateControlLayerInfoKHR, MAX_TEMPORAL_LAYERS> m_rateControlLayerInfos;
+
+    h265::Dpb m_dpb;
+    // of the current picture
+    StdVideoEncodeH265ReferenceListsInfo m_referenceLists;
+    StdVideoH265ShortTermRefPicSet m_shortTermRefPicSet;
+    std::optional<h265::FrameInfo> m_frameInfo;
+    std::vector<StdVideoEncodeH265ReferenceInfo> m_stdReferenceInfos;  // per DPB slot
+    std::vector<VkVideoEncodeH265DpbSlotInfoKHR> m_dpbSlotInfos;
+};
@@ -0,0 +1,222 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "vk_video/vulkan_video_codec_h265std.h"
+#include "vk_video/vulkan_video_codec_h265std_encode.h"
+
+namespace h265 {
+
+// Encoder side reference picture management for short-term references, following H.265 8.3.2 and 8.3.4: which DPB
+// slot holds which reference picture, the reference picture set (RPS) each picture signals in its slice header and
+// the reference lists. There is no sliding window in H.265, a reference is dropped by leaving it out of the next RPS.
+class Dpb {
+   public:
+    struct Picture {
+        bool isReference{false};
+        bool usable{true};  // false if the picture must not be referenced anymore, e.g. the receiver lost it
+        int32_t picOrderCnt{0};
+        uint32_t frameIndex{0};   // in display order
+        uint32_t decodeIndex{0};  // in encode order
+        uint32_t temporalId{0};   // temporal sub-layer, only references of the same or a lower sub-layer are used
+        StdVideoH265PictureType pictureType{STD_VIDEO_H265_PICTURE_TYPE_P};
+    };
+
+    // slotCount DPB slots hold up to maxRefPics references (sps_max_dec_pic_buffering_minus1) plus the current
+    // picture
+    void init(uint32_t slotCount, uint32_t maxRefPics) {
+        assert(slotCount > maxRefPics && maxRefPics <= STD_VIDEO_H265_MAX_DPB_SIZE);
+        m_pictures.assign(slotCount, Picture());
+        m_maxRefPics = maxRefPics;
+        m_decodeIndex = 0;
+    }
+
+    // Starts the current picture and returns the DPB slot for its reconstruction, -1 for non-reference pictures.
+    // IDR pictures remove all references, unusable references are left out of the RPS and so removed as well.
+    int32_t beginPicture(int32_t picOrderCnt, uint32_t frameIndex, StdVideoH265PictureType type, bool isReference,
+                         uint32_t temporalId = 0) {
+        const bool isIdr = type == STD_VIDEO_H265_PICTURE_TYPE_IDR;
+        assert(isReference || !isIdr);
+        for (Picture& picture : m_pictures) {
+            if (isIdr || !picture.usable) {
+                picture.isReference = false;
+            }
+        }
+
+        m_current = Picture();
+        m_current.isReference = isReference;
+        m_current.picOrderCnt = picOrderCnt;
+        m_current.frameIndex = frameIndex;
+        m_current.decodeIndex = m_decodeIndex++;
+        m_current.temporalId = temporalId;
+        m_current.pictureType = type;
+
+        // there is always a free slot, as at most maxRefPics slots hold references
+        m_currentSlot = -1;
+        for (uint32_t i = 0; i < m_pictures.size() && isReference; i++) {
+            if (!m_pictures[i].isReference) {
+                m_currentSlot = static_cast<int32_t>(i);
+                break;
+            }
+        }
+        assert(m_currentSlot >= 0 || !isReference);
+        return m_currentSlot;
+    }
+
+    // Fills the reference lists and the RPS of the current picture. P pictures use up to maxActiveL0 usable
+    // references, B pictures up to maxActiveL0 before and maxActiveL1 after the current picture, nearest by POC
+    // first. Both lists keep the initial order of 8.3.4 (no list modification), all other references are kept in the
+    // RPS as not used by the current picture.
+    void getReferenceLists(uint32_t maxActiveL0, uint32_t maxActiveL1, StdVideoEncodeH265ReferenceListsInfo& lists,
+                           StdVideoH265ShortTermRefPicSet& rps) const {
+        lists = {};
+        rps = {};
+        std::fill_n(lists.RefPicList0, STD_VIDEO_H265_MAX_NUM_LIST_REF, STD_VIDEO_H265_NO_REFERENCE_PICTURE);
+        std::fill_n(lists.RefPicList1, STD_VIDEO_H265_MAX_NUM_LIST_REF, STD_VIDEO_H265_NO_REFERENCE_PICTURE);
+        if (m_current.pictureType == STD_VIDEO_H265_PICTURE_TYPE_IDR) {
+            return;
+        }
+
+        // the RPS lists all references, before the current picture by descending POC and after it by ascending POC
+        std::vector<int32_t> before, after;
+        for (uint32_t i = 0; i < m_pictures.size(); i++) {
+            if (m_pictures[i].isReference) {
+                (m_pictures[i].picOrderCnt < m_current.picOrderCnt ? before : after).push_back(static_cast<int32_t>(i));
+            }
+        }
+        std::sort(before.begin(), before.end(),
+                  [&](int32_t a, int32_t b) { return m_pictures[a].picOrderCnt > m_pictures[b].picOrderCnt; });
+        std::sort(after.begin(), after.end(),
+                  [&](int32_t a, int32_t b) { return m_pictures[a].picOrderCnt < m_pictures[b].picOrderCnt; });
+
+        const bool isI = m_current.pictureType == STD_VIDEO_H265_PICTURE_TYPE_I;
+        const bool isB = m_current.pictureType == STD_VIDEO_H265_PICTURE_TYPE_B;
+        std::vector<int32_t> usedBefore, usedAfter;
+        for (int32_t slot : before) {
+            if (!isI && usedBefore.size() < maxActiveL0 && m_pictures[slot].temporalId <= m_current.temporalId) {
+                usedBefore.push_back(slot);
+            }
+        }
+        const uint32_t maxAfter = isB ? maxActiveL1 : isI ? 0 : maxActiveL0 - static_cast<uint32_t>(usedBefore.size());
+        for (int32_t slot : after) {
+            if (usedAfter.size() < maxAfter && m_pictures[slot].temporalId <= m_current.temporalId) {
+                usedAfter.push_back(slot);
+            }
+        }
+
+        setStRps(before, usedBefore, rps.num_negative_pics, rps.delta_poc_s0_minus1, rps.used_by_curr_pic_s0_flag);
+        setStRps(after, usedAfter, rps.num_positive_pics, rps.delta_poc_s1_minus1, rps.used_by_curr_pic_s1_flag);
+        if (isI) {
+            return;
+        }
+
+        // RefPicListTemp0 / RefPicListTemp1 of 8.3.4
+        std::vector<int32_t> list0 = usedBefore, list1 = usedAfter;
+        list0.insert(list0.end(), usedAfter.begin(), usedAfter.end());
+        list1.insert(list1.end(), usedBefore.begin(), usedBefore.end());
+        assert(!list0.empty());
+        list0.resize(std::min<size_t>(list0.size(), maxActiveL0));
+        std::copy(list0.begin(), list0.end(), lists.RefPicList0);
+        lists.num_ref_idx_l0_active_minus1 = static_cast<uint8_t>(list0.size() - 1);
+        if (isB) {
+            list1.resize(std::min<size_t>(list1.size(), maxActiveL1));
+            assert(!list1.empty());
+            std::copy(list1.begin(), list1.end(), lists.RefPicList1);
+            lists.num_ref_idx_l1_active_minus1 = static_cast<uint8_t>(list1.size() - 1);
+        }
+    }
+
+    // Stores the current picture as reference, removing the oldest reference in encode order if the DPB is full.
+    void endPicture() {
+        if (!m_current.isReference) {
+            return;
+        }
+        if (getReferenceCount() == m_maxRefPics) {
+            int32_t oldest = -1;
+            for (uint32_t i = 0; i < m_pictures.size(); i++) {
+                if (m_pictures[i].isReference &&
+                    (oldest < 0 || m_pictures[i].decodeIndex < m_pictures[oldest].decodeIndex)) {
+                    oldest = static_cast<int32_t>(i);
+                }
+            }
+            m_pictures[oldest].isReference = false;
+        }
+        m_pictures[m_currentSlot] = m_current;
+    }
+
+    // Marks the references encoded after frameIndex as unusable, returns false if no usable reference of the base
+    // temporal sub-layer (which all sub-layers may use) is left.
+    bool invalidateAfter(uint32_t frameIndex) {
+        bool usableLeft = false;
+        for (Picture& picture : m_pictures) {
+            if (picture.isReference && picture.frameIndex > frameIndex) {
+                picture.usable = false;
+            }
+            usableLeft |= picture.isReference && picture.usable && picture.temporalId == 0;
+        }
+        return usableLeft;
+    }
+
+    uint32_t getSlotCount() const { return static_cast<uint32_t>(m_pictures.size()); }
+    int32_t getCurrentSlot() const { return m_currentSlot; }
+    const Picture& getPicture(uint32_t slot) const { return m_pictures[slot]; }
+    const Picture& getCurrentPicture() const { return m_current; }
+
+    static StdVideoEncodeH265ReferenceInfo getStdReferenceInfo(const Picture& picture) {
+        StdVideoEncodeH265ReferenceInfo info = {};
+        info.pic_type = picture.pictureType;
+        info.PicOrderCntVal = picture.picOrderCnt;
+        info.TemporalId = static_cast<uint8_t>(picture.temporalId);
+        return info;
+    }
+
+   private:
+    uint32_t getReferenceCount() const {
+        return static_cast<uint32_t>(
+            std::count_if(m_pictures.begin(), m_pictures.end(), [](const Picture& p) { return p.isReference; }));
+    }
+
+    // one half of st_ref_pic_set (7.3.7): the POC distances of the given references, each relative to the
+    // previous one, starting at the current picture
+    void setStRps(const std::vector<int32_t>& slots, const std::vector<int32_t>& used, uint8_t& numPics,
+                  uint16_t* deltaPocMinus1, uint16_t& usedByCurrPicFlags) const {
+        numPics = static_cast<uint8_t>(slots.size());
+        int32_t prevPicOrderCnt = m_current.picOrderCnt;
+        for (size_t i = 0; i < slots.size(); i++) {
+            const int32_t picOrderCnt = m_pictures[slots[i]].picOrderCnt;
+            deltaPocMinus1[i] = static_cast<uint16_t>(std::abs(picOrderCnt - prevPicOrderCnt) - 1);
+            if (std::find(used.begin(), used.end(), slots[i]) != used.end()) {
+                usedByCurrPicFlags |= static_cast<uint16_t>(1u << i);
+            }
+            prevPicOrderCnt = picOrderCnt;
+        }
+    }
+
+    std::vector<Picture> m_pictures;  // indexed by DPB slot
+    uint32_t m_maxRefPics{1};
+    uint32_t m_decodeIndex{0};
+
+    Picture m_current;
+    int32_t m_currentSlot{-1};
+};
+
+};  // namespace h265
@@ -0,0 +1,242 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "vk_video/vulkan_video_codec_h265std.h"
+#include "vk_video/vulkan_video_codec_h265std_encode.h"
+#include "vk_video/vulkan_video_codecs_common.h"
+
+namespace h265 {
+
+// the picture size has to be a multiple of the minimum coding block size, the rest is cropped
+static const uint32_t H265MinCbSizeAlignment = 8;
+
+template <typename sizeType>
+static sizeType AlignSize(sizeType size, sizeType alignment) {
+    assert((alignment & (alignment - 1)) == 0);
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static StdVideoH265ProfileTierLevel getStdVideoH265ProfileTierLevel(StdVideoH265ProfileIdc profileIdc,
+                                                                    StdVideoH265LevelIdc levelIdc) {
+    StdVideoH265ProfileTierLevel profileTierLevel = {};
+    profileTierLevel.flags.general_tier_flag = 0u;  // main tier
+    profileTierLevel.flags.general_progressive_source_flag = 1u;
+    profileTierLevel.flags.general_frame_only_constraint_flag = 1u;
+    profileTierLevel.general_profile_idc = profileIdc;
+    profileTierLevel.general_level_idc = levelIdc;
+    return profileTierLevel;
+}
+
+// the DPB holds maxDecPicBuffering pictures, maxNumReorderPics > 0 (B frames) lets decoders output frames early;
+// the same for every sub-layer
+static StdVideoH265DecPicBufMgr getStdVideoH265DecPicBufMgr(uint32_t maxDecPicBuffering, uint32_t maxNumReorderPics) {
+    StdVideoH265DecPicBufMgr decPicBufMgr = {};
+    for (uint32_t i = 0; i < STD_VIDEO_H265_SUBLAYERS_LIST_SIZE; i++) {
+        decPicBufMgr.max_dec_pic_buffering_minus1[i] = static_cast<uint8_t>(maxDecPicBuffering - 1);
+        decPicBufMgr.max_num_reorder_pics[i] = static_cast<uint8_t>(maxNumReorderPics);
+        decPicBufMgr.max_latency_increase_plus1[i] = 0;  // no limit
+    }
+    return decPicBufMgr;
+}
+
+// temporalIdNesting is only allowed if no picture references a picture of its layer or above preceding a picture of
+// a lower layer, which the DPB management does not guarantee with several sub-layers
+static StdVideoH265VideoParameterSet getStdVideoH265VideoParameterSet(
+    uint32_t fps, uint32_t subLayerCount, const StdVideoH265ProfileTierLevel* pProfileTierLevel,
+    const StdVideoH265DecPicBufMgr* pDecPicBufMgr) {
+    StdVideoH265VideoParameterSet vps = {};
+    vps.flags.vps_temporal_id_nesting_flag = subLayerCount == 1 ? 1u : 0u;
+    vps.flags.vps_sub_layer_ordering_info_present_flag = 0u;
+    vps.flags.vps_timing_info_present_flag = 1u;
+    vps.vps_video_parameter_set_id = 0u;
+    vps.vps_max_sub_layers_minus1 = static_cast<uint8_t>(subLayerCount - 1);
+    vps.vps_num_units_in_tick = 1;
+    vps.vps_time_scale = fps;
+    vps.pDecPicBufMgr = pDecPicBufMgr;
+    vps.pProfileTierLevel = pProfileTierLevel;
+    return vps;
+}
+
+static StdVideoH265SequenceParameterSetVui getStdVideoH265SequenceParameterSetVui(uint32_t fps) {
+    StdVideoH265SequenceParameterSetVui vui = {};
+    vui.flags.vui_timing_info_present_flag = 1u;
+    vui.vui_num_units_in_tick = 1;
+    vui.vui_time_scale = fps;
+    return vui;
+}
+
+// same colour description and chroma siting as h264::setStdVideoH264VuiColorDescription
+static void setStdVideoH265VuiColorDescription(StdVideoH265SequenceParameterSetVui& vui, bool bt709, bool fullRange) {
+    vui.flags.video_signal_type_present_flag = 1u;
+    vui.flags.video_full_range_flag = fullRange ? 1u : 0u;
+    vui.flags.colour_description_present_flag = 1u;
+    vui.video_format = 5;  // unspecified
+    vui.colour_primaries = bt709 ? 1 : 6;
+    vui.transfer_characteristics = bt709 ? 1 : 6;
+    vui.matrix_coeffs = bt709 ? 1 : 6;
+    vui.flags.chroma_loc_info_present_flag = 1u;
+    vui.chroma_sample_loc_type_top_field = 1;
+    vui.chroma_sample_loc_type_bottom_field = 1;
+}
+
+// 8 bit 4:2:0 with 8x8 minimum coding blocks, coding tree blocks of 2^log2CtbSize and transform blocks from
+// 2^log2MinTbSize to 2^log2MaxTbSize as supported by the implementation
+static StdVideoH265SequenceParameterSet getStdVideoH265SequenceParameterSet(
+    uint32_t width, uint32_t height, uint32_t log2CtbSize, uint32_t log2MinTbSize, uint32_t log2MaxTbSize,
+    uint32_t subLayerCount, bool sampleAdaptiveOffset, const StdVideoH265ProfileTierLevel* pProfileTierLevel,
+    const StdVideoH265DecPicBufMgr* pDecPicBufMgr, const StdVideoH265SequenceParameterSetVui* pVui) {
+    const uint32_t alignedWidth = AlignSize(width, H265MinCbSizeAlignment);
+    const uint32_t alignedHeight = AlignSize(height, H265MinCbSizeAlignment);
+
+    StdVideoH265SequenceParameterSet sps = {};
+    sps.flags.sps_temporal_id_nesting_flag = subLayerCount == 1 ? 1u : 0u;
+    sps.flags.sps_sub_layer_ordering_info_present_flag = 0u;
+    sps.flags.sample_adaptive_offset_enabled_flag = sampleAdaptiveOffset ? 1u : 0u;
+    sps.flags.vui_parameters_present_flag = (pVui == NULL) ? 0u : 1u;
+    sps.chroma_format_idc = STD_VIDEO_H265_CHROMA_FORMAT_IDC_420;
+    sps.pic_width_in_luma_samples = alignedWidth;
+    sps.pic_height_in_luma_samples = alignedHeight;
+    sps.sps_video_parameter_set_id = 0u;
+    sps.sps_max_sub_layers_minus1 = static_cast<uint8_t>(subLayerCount - 1);
+    sps.sps_seq_parameter_set_id = 0u;
+    sps.bit_depth_luma_minus8 = 0u;
+    sps.bit_depth_chroma_minus8 = 0u;
+    // picture order count values in the range [0, 255], as in H.264
+    sps.log2_max_pic_order_cnt_lsb_minus4 = 4u;
+    sps.log2_min_luma_coding_block_size_minus3 = 0u;
+    sps.log2_diff_max_min_luma_coding_block_size = static_cast<uint8_t>(log2CtbSize - 3);
+    sps.log2_min_luma_transform_block_size_minus2 = static_cast<uint8_t>(log2MinTbSize - 2);
+    sps.log2_diff_max_min_luma_transform_block_size = static_cast<uint8_t>(log2MaxTbSize - log2MinTbSize);
+    sps.max_transform_hierarchy_depth_inter = static_cast<uint8_t>(log2CtbSize - log2MinTbSize);
+    sps.max_transform_hierarchy_depth_intra = static_cast<uint8_t>(log2CtbSize - log2MinTbSize);
+    // each picture signals its short-term reference picture set in the slice header
+    sps.num_short_term_ref_pic_sets = 0u;
+    sps.num_long_term_ref_pics_sps = 0u;
+    sps.pProfileTierLevel = pProfileTierLevel;
+    sps.pDecPicBufMgr = pDecPicBufMgr;
+    sps.pSequenceParameterSetVui = pVui;
+
+    // the conformance window is given in chroma samples
+    if (alignedWidth != width || alignedHeight != height) {
+        sps.flags.conformance_window_flag = 1u;
+        sps.conf_win_right_offset = (alignedWidth - width) / 2;
+        sps.conf_win_bottom_offset = (alignedHeight - height) / 2;
+    }
+
+    return sps;
+}
+
+static StdVideoH265PictureParameterSet getStdVideoH265PictureParameterSet(bool cuQpDelta) {
+    StdVideoH265PictureParameterSet pps = {};
+    // lets the rate control adapt the QP within a picture
+    pps.flags.cu_qp_delta_enabled_flag = cuQpDelta ? 1u : 0u;
+    pps.flags.pps_loop_filter_across_slices_enabled_flag = 1u;
+    pps.pps_pic_parameter_set_id = 0u;
+    pps.pps_seq_parameter_set_id = 0u;
+    pps.sps_video_parameter_set_id = 0u;
+    pps.num_ref_idx_l0_default_active_minus1 = 0u;
+    pps.num_ref_idx_l1_default_active_minus1 = 0u;
+    return pps;
+}
+
+class FrameInfo {
+   public:
+    // picOrderCnt is counted from the last IDR frame, temporalId is written to the NAL unit headers,
+    // referenceLists and shortTermRefPicSet come from the DPB management (h265::Dpb), constantQp is 0 with rate
+    // control, the slice segment intraSliceIndex of sliceCount segments of a P frame is coded as I slice (-1 for
+    // none, intra refresh)
+    FrameInfo(StdVideoH265PictureType pictureType, int32_t picOrderCnt, uint32_t temporalId, bool isReference,
+              const StdVideoEncodeH265ReferenceListsInfo& referenceLists,
+              const StdVideoH265ShortTermRefPicSet& shortTermRefPicSet, const StdVideoH265SequenceParameterSet& sps,
+              const StdVideoH265PictureParameterSet& pps, int32_t constantQp, uint32_t sliceCount = 1,
+              int32_t intraSliceIndex = -1)
+        : m_sliceSegmentHeaders(sliceCount), m_sliceSegmentInfos(sliceCount) {
+        const bool isIdr = pictureType == STD_VIDEO_H265_PICTURE_TYPE_IDR;
+        const bool isI = isIdr || pictureType == STD_VIDEO_H265_PICTURE_TYPE_I;
+        const bool isB = pictureType == STD_VIDEO_H265_PICTURE_TYPE_B;
+        const StdVideoH265SliceType sliceType = isI   ? STD_VIDEO_H265_SLICE_TYPE_I
+                                                : isB ? STD_VIDEO_H265_SLICE_TYPE_B
+                                                      : STD_VIDEO_H265_SLICE_TYPE_P;
+        const bool sao = sps.flags.sample_adaptive_offset_enabled_flag;
+
+        for (uint32_t i = 0; i < sliceCount; i++) {
+            // every slice segment starts an independent slice
+            StdVideoEncodeH265SliceSegmentHeader& header = m_sliceSegmentHeaders[i];
+            header.flags.first_slice_segment_in_pic_flag = i == 0 ? 1 : 0;
+            header.flags.slice_sao_luma_flag = sao ? 1 : 0;
+            header.flags.slice_sao_chroma_flag = sao ? 1 : 0;
+            const bool l0Override =
+                referenceLists.num_ref_idx_l0_active_minus1 != pps.num_ref_idx_l0_default_active_minus1;
+            const bool l1Override =
+                isB && referenceLists.num_ref_idx_l1_active_minus1 != pps.num_ref_idx_l1_default_active_minus1;
+            header.flags.num_ref_idx_active_override_flag = !isI && (l0Override || l1Override);
+            header.flags.slice_loop_filter_across_slices_enabled_flag = 1;
+            header.slice_type = static_cast<int32_t>(i) == intraSliceIndex ? STD_VIDEO_H265_SLICE_TYPE_I : sliceType;
+            header.MaxNumMergeCand = 5;
+
+            VkVideoEncodeH265NaluSliceSegmentInfoKHR& sliceSegmentInfo = m_sliceSegmentInfos[i];
+            sliceSegmentInfo.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_NALU_SLICE_SEGMENT_INFO_KHR;
+            sliceSegmentInfo.pNext = NULL;
+            sliceSegmentInfo.pStdSliceSegmentHeader = &header;
+            sliceSegmentInfo.constantQp = constantQp;
+        }
+
+        // only IDR pictures are IRAP pictures, so B frames may reference the frames on both sides of an I frame;
+        // temporal motion vector prediction is off, so no picture depends on the motion of a lost one
+        m_stdPictureInfo.flags.is_reference = isReference ? 1 : 0;
+        m_stdPictureInfo.flags.IrapPicFlag = isIdr ? 1 : 0;
+        m_stdPictureInfo.flags.pic_output_flag = 1;
+        m_stdPictureInfo.flags.short_term_ref_pic_set_sps_flag = 0;
+        m_stdPictureInfo.flags.slice_temporal_mvp_enabled_flag = 0;
+        m_stdPictureInfo.pic_type = pictureType;
+        m_stdPictureInfo.sps_video_parameter_set_id = sps.sps_video_parameter_set_id;
+        m_stdPictureInfo.pps_seq_parameter_set_id = pps.pps_seq_parameter_set_id;
+        m_stdPictureInfo.pps_pic_parameter_set_id = pps.pps_pic_parameter_set_id;
+        m_stdPictureInfo.short_term_ref_pic_set_idx = 0;
+        // POC is incremented by 1 for each frame in display order, the implementation writes it modulo
+        // MaxPicOrderCntLsb.
+        m_stdPictureInfo.PicOrderCntVal = picOrderCnt;
+        m_stdPictureInfo.TemporalId = static_cast<uint8_t>(temporalId);
+        m_referenceLists = referenceLists;
+        m_shortTermRefPicSet = shortTermRefPicSet;
+        m_stdPictureInfo.pRefLists = &m_referenceLists;
+        m_stdPictureInfo.pShortTermRefPicSet = &m_shortTermRefPicSet;
+        m_stdPictureInfo.pLongTermRefPics = NULL;
+
+        m_encodeH265FrameInfo.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H265_PICTURE_INFO_KHR;
+        m_encodeH265FrameInfo.pNext = NULL;
+        m_encodeH265FrameInfo.naluSliceSegmentEntryCount = sliceCount;
+        m_encodeH265FrameInfo.pNaluSliceSegmentEntries = m_sliceSegmentInfos.data();
+        m_encodeH265FrameInfo.pStdPictureInfo = &m_stdPictureInfo;
+    }
+
+    inline VkVideoEncodeH265PictureInfoKHR* getEncodeH265FrameInfo() { return &m_encodeH265FrameInfo; };
+
+   private:
+    std::vector<StdVideoEncodeH265SliceSegmentHeader> m_sliceSegmentHeaders;  // value initialized
+    std::vector<VkVideoEncodeH265NaluSliceSegmentInfoKHR> m_sliceSegmentInfos;
+    StdVideoEncodeH265PictureInfo m_stdPictureInfo = {};
+    VkVideoEncodeH265PictureInfoKHR m_encodeH265FrameInfo = {};
+    StdVideoEncodeH265ReferenceListsInfo m_referenceLists = {};
+    StdVideoH265ShortTermRefPicSet m_shortTermRefPicSet = {};
+};
+
+};  // namespace h265
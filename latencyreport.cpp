@@ -0,0 +1,100 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "latencyreport.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+static const struct {
+    const char* name;
+    double FrameLatency::*value;
+} METRICS[] = {
+    {"render", &FrameLatency::renderMs},
+    {"convert", &FrameLatency::convertMs},
+    {"encode_queue_wait", &FrameLatency::encodeQueueWaitMs},
+    {"encode", &FrameLatency::encodeMs},
+    {"submit_to_packet", &FrameLatency::submitToPacketMs},
+    {"glass_to_packet", &FrameLatency::glassToPacketMs},
+};
+
+// nearest rank percentile of sorted values
+static double percentileOfSorted(const std::vector<double>& sorted, double p) {
+    const size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+// the measured values of one metric, sorted
+static std::vector<double> sortedValues(const std::vector<FrameLatency>& frames, double FrameLatency::*metric) {
+    std::vector<double> values;
+    for (const FrameLatency& frame : frames) {
+        if (!std::isnan(frame.*metric)) {
+            values.push_back(frame.*metric);
+        }
+    }
+    std::sort(values.begin(), values.end());
+    return values;
+}
+
+double LatencyReport::percentile(double FrameLatency::*metric, double p) const {
+    const std::vector<double> values = sortedValues(m_frames, metric);
+    return values.empty() ? NAN : percentileOfSorted(values, p);
+}
+
+void LatencyReport::printSummary(std::FILE* out) const {
+    std::fprintf(out, "%-18s %8s %8s %8s %8s %8s  (ms, %zu frames)\n", "stage", "mean", "p50", "p90", "p99", "max",
+                 m_frames.size());
+    for (const auto& metric : METRICS) {
+        const std::vector<double> values = sortedValues(m_frames, metric.value);
+        if (values.empty()) {
+            std::fprintf(out, "%-18s %8s\n", metric.name, "n/a");
+            continue;
+        }
+        double sum = 0.0;
+        for (double value : values) {
+            sum += value;
+        }
+        std::fprintf(out, "%-18s %8.3f %8.3f %8.3f %8.3f %8.3f\n", metric.name, sum / values.size(),
+                     percentileOfSorted(values, 50), percentileOfSorted(values, 90), percentileOfSorted(values, 99),
+                     values.back());
+    }
+}
+
+void LatencyReport::writeCsv(const std::string& fileName) const {
+    std::FILE* out = std::fopen(fileName.c_str(), "w");
+    if (!out) {
+        throw std::runtime_error("failed to open file: " + fileName);
+    }
+    std::fprintf(out, "frame");
+    for (const auto& metric : METRICS) {
+        std::fprintf(out, ",%s_ms", metric.name);
+    }
+    std::fprintf(out, "\n");
+    for (const FrameLatency& frame : m_frames) {
+        std::fprintf(out, "%u", frame.frameIndex);
+        for (const auto& metric : METRICS) {
+            // empty fields for values which were not measured
+            if (std::isnan(frame.*metric.value)) {
+                std::fprintf(out, ",");
+            } else {
+                std::fprintf(out, ",%.4f", frame.*metric.value);
+            }
+        }
+        std::fprintf(out, "\n");
+    }
+    std::fclose(out);
+}
@@ -0,0 +1,45 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// all durations of one frame in milliseconds, NAN if not measured
+struct FrameLatency {
+    uint32_t frameIndex;
+    double renderMs;            // GPU: render pass
+    double convertMs;           // GPU: RGB->YCbCr conversion
+    double encodeQueueWaitMs;   // GPU: end of conversion until start of encoding
+    double encodeMs;            // GPU: vkCmdEncodeVideoKHR
+    double submitToPacketMs;    // host: queueEncode until the packet was read back
+    double glassToPacketMs;     // host: render submit until the packet was read back
+};
+
+// Collects per frame latencies and prints percentiles or writes them as CSV trace.
+class LatencyReport {
+   public:
+    void addFrame(const FrameLatency& frame) { m_frames.push_back(frame); }
+    // nearest rank percentile of one metric over all frames, NAN if it was never measured
+    double percentile(double FrameLatency::*metric, double p) const;
+    void printSummary(std::FILE* out) const;
+    void writeCsv(const std::string& fileName) const;
+
+   private:
+    std::vector<FrameLatency> m_frames;
+};
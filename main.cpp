@@ -16,57 +16,87 @@
  * See the LICENSE file in the project root for full license information.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <exception>
 #include <iostream>
 #include <iterator>
-#include <optional>
-#include <set>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
-#define VK_NO_PROTOTYPES
-#define VMA_STATIC_VULKAN_FUNCTIONS 0
-#define VMA_DYNAMIC_VULKAN_FUNCTIONS 1
-#define VMA_IMPLEMENTATION
-#include <vma/vk_mem_alloc.h>
-#define VOLK_IMPLEMENTATION
-#include <volk/volk.h>
-
+#include "latencyreport.hpp"
+#include "packetwriter.hpp"
+#include "rawfilesource.hpp"
+#include "rtpsender.hpp"
 #include "utility.hpp"
 #include "videoencoder.hpp"
+#include "vulkancontext.hpp"
 
 const uint32_t NUM_FRAMES_TO_WRITE = 300;
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
-const size_t IMAGE_INFLIGHT_COUNT = 2;
-
-const std::vector<const char *> deviceExtensions = {
-    VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME, VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
-    VK_KHR_VIDEO_ENCODE_QUEUE_EXTENSION_NAME, VK_KHR_VIDEO_ENCODE_H264_EXTENSION_NAME};
-
-struct QueueFamilyIndices {
-    std::optional<uint32_t> graphicsFamily;
-    std::optional<uint32_t> videoEncodeFamily;
-
-    bool isComplete() { return graphicsFamily.has_value() && videoEncodeFamily.has_value(); }
+const uint32_t ENCODE_PIPELINE_DEPTH = 3;
+// one more image than frames in the encoder pipeline, so the renderer rarely waits for the encoder's input pool;
+// also the number of frames the render timestamps are kept for
+const size_t IMAGE_INFLIGHT_COUNT = ENCODE_PIPELINE_DEPTH + 1;
+// frames per closed GOP in the offline mode
+const uint32_t OFFLINE_GOP_FRAME_COUNT = 30;
+
+// push constants of triangle-ycbcr-*.comp
+struct DirectRenderPushConstants {
+    EncoderDevice::ConversionParameters conversion;
+    uint32_t currentFrameNumber;
 };
 
 class VulkanApplication {
    public:
+    // optional per frame CSV trace of the latencies, empty for none
+    std::string latencyCsvFileName;
+    std::string cacheFileName;  // encode capabilities and pipeline cache of the EncoderDevice
+    VideoEncoder::Preset preset = VideoEncoder::Preset::DEFAULT;
+    Codec codec = Codec::H264;  // the output is written to hwenc.264 or hwenc.265
+    bool mp4 = false;           // fragmented MP4 output to hwenc.mp4 instead of the elementary stream
+    // the packets are also sent as RTP to this address, empty for none
+    std::string rtpHost;
+    uint16_t rtpPort = 0;
+    // content adaptive encoding, see VideoEncoder::Config::maxStaticFrameSkip and emphasisMap
+    uint32_t maxStaticFrameSkip = 0;
+    bool emphasisMap = false;
+    // Prometheus text file of the encoder metrics, rewritten every second, empty for none
+    std::string metricsFileName;
+    // offline mode: the frames are split into closed GOPs which are encoded in parallel by several sessions
+    bool offline = false;
+    uint32_t offlineSessionCount = 0;  // 0 for one session per encode queue
+    // direct mode: a compute pass renders the frames into the YCbCr images of the encoder, without RGB images and
+    // the conversion pass
+    bool direct = false;
+    // raw mode: the frames of a raw file are encoded instead of rendered ones, empty for none
+    std::string rawFileName;
+    RawFileSource::Format rawFormat;
+    uint32_t rawWidth;
+    uint32_t rawHeight;
+
     void run() {
         initVulkan();
-        mainLoop();
+        if (offline) {
+            offlineLoop();
+        } else {
+            mainLoop();
+        }
         cleanup();
     }
 
    private:
-    VkInstance instance;
-    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
-    VkDevice device;
-    VmaAllocator allocator;
-    VkQueue graphicsQueue;
-    VkQueue videoEncodeQueue;
+    VulkanContext context;
 
     std::vector<VkImage> images;
     std::vector<VmaAllocation> imageAllocations;
@@ -75,155 +105,291 @@ class VulkanApplication {
     VkPipelineLayout pipelineLayout;
     VkPipeline graphicsPipeline;
 
-    VkCommandPool commandPool;
     std::vector<VkCommandBuffer> commandBuffers;
 
+    EncoderDevice encoderDevice;
     VideoEncoder videoEncoder;
-    std::ofstream outfile;
+    PacketWriter packetWriter;
+    RtpSender rtpSender;
+    RawFileSource rawFileSource;
+
+    // two timestamps around the render pass per frame, by frame number % IMAGE_INFLIGHT_COUNT
+    VkQueryPool renderTimestampQueryPool = VK_NULL_HANDLE;
+    uint64_t renderTimestampMask;
+    float timestampPeriod;
+    std::vector<std::chrono::steady_clock::time_point> renderSubmitTimes;
+    std::chrono::steady_clock::time_point metricsWriteTime;
+    LatencyReport latencyReport;
+
+    // direct mode
+    VkDescriptorSetLayout directDescriptorSetLayout;
+    VkPipelineLayout directPipelineLayout;
+    VkPipeline directPipeline;
+    VkDescriptorPool directDescriptorPool;
+    std::vector<VkDescriptorSet> directDescriptorSets;  // per YCbCr image of the encoder, created on first use
+
+    // GOPs of the offline mode, encoded by the sessions in any order and written in order
+    struct OfflineGops {
+        uint32_t count;
+        std::atomic<uint32_t> next{0};  // next GOP to be taken by a session
+        std::mutex mutex;
+        std::condition_variable done;
+        std::vector<std::vector<char>> data;  // elementary stream of each GOP, guarded by mutex
+        std::vector<bool> finished;
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+    };
 
     void initVulkan() {
-        volkInitialize();
-        createInstance();
-        volkLoadInstance(instance);
-        pickPhysicalDevice();
-        createLogicalDevice();
-        volkLoadDevice(device);
-        createAllocator();
-        createImages();
-        createImageViews();
+        context.init();
+        if (codec == Codec::H265 && !context.videoEncodeH265Supported) {
+            throw std::runtime_error("Error: H.265 encoding is not supported by the device");
+        }
+        if (emphasisMap && !context.videoEncodeQuantizationMapSupported) {
+            throw std::runtime_error("Error: emphasis maps are not supported by the device");
+        }
         createGraphicsPipeline();
-        createCommandPool();
-        createCommandBuffers();
+        const QueueFamilyIndices &indices = context.queueFamilyIndices;
+        encoderDevice.init(context.physicalDevice, context.device, context.allocator, indices.graphicsFamily.value(),
+                           context.graphicsQueue, indices.videoEncodeFamily.value(), context.videoEncodeQueues,
+                           cacheFileName);
+        if (offline) {
+            // the sessions create their own images
+            return;
+        }
+        if (!rawFileName.empty()) {
+            // the source uploads YCbCr frames directly into the encoder, RGBA frames into its own input images
+            VideoEncoder::Config config = getEncoderConfig();
+            config.directYCbCrInput = rawFormat != RawFileSource::Format::RGBA;
+            videoEncoder.init(encoderDevice, {}, {}, rawWidth, rawHeight, config);
+            openOutput(rawWidth, rawHeight, config.fps);
+            rawFileSource.open(encoderDevice, videoEncoder, rawFileName, rawFormat, rawWidth, rawHeight);
+            std::cout << "Encoding " << rawFileSource.getFrameCount() << " frames of " << rawFileName << "\n";
+            return;
+        }
+        if (direct) {
+            // one command buffer per YCbCr image of the encoder
+            createCommandBuffers(context.commandPool, ENCODE_PIPELINE_DEPTH, commandBuffers);
+            initVideoEncoder();
+            createDirectPipeline();
+            return;
+        }
+        createImages(images, imageAllocations);
+        createImageViews(images, imageViews);
+        createCommandBuffers(context.commandPool, images.size(), commandBuffers);
+        createRenderTimestampQueryPool();
 
         initVideoEncoder();
     }
 
     void mainLoop() {
+        if (!rawFileName.empty()) {
+            for (uint32_t frameIndex = 0; frameIndex < rawFileSource.getFrameCount(); frameIndex++) {
+                writeFinishedFrames();
+                rawFileSource.queueFrame(frameIndex);
+            }
+            return;
+        }
         for (uint32_t currentFrameNumber = 0; currentFrameNumber < NUM_FRAMES_TO_WRITE; currentFrameNumber++) {
-            const uint32_t currentImageIx = currentFrameNumber % images.size();
+            if (direct) {
+                encodeDirectFrame(currentFrameNumber);
+                continue;
+            }
+            // an image the encoder is done reading
+            const uint32_t currentImageIx = videoEncoder.acquireInputImage();
             drawFrame(currentImageIx, currentFrameNumber);
             encodeFrame(currentImageIx);
         }
     }
 
-    void cleanup() {
-        videoEncoder.deinit();
-        outfile.close();
-        std::cout << "wrote H.264 content to ./hwenc.264\n";
-        vkDestroyCommandPool(device, commandPool, nullptr);
-        vkDestroyPipeline(device, graphicsPipeline, nullptr);
-        vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-        for (auto imageView : imageViews) {
-            vkDestroyImageView(device, imageView, nullptr);
-        }
-        for (int i = 0; i < images.size(); i++) {
-            vmaDestroyImage(allocator, images[i], imageAllocations[i]);
+    // Splits the frames into closed GOPs, each starting with an IDR frame, which the sessions take one after the
+    // other, so they encode in parallel on all encode queues. The GOPs are concatenated in order to one elementary
+    // stream.
+    void offlineLoop() {
+        const auto startTime = std::chrono::steady_clock::now();
+        OfflineGops gops;
+        gops.count = (NUM_FRAMES_TO_WRITE + OFFLINE_GOP_FRAME_COUNT - 1) / OFFLINE_GOP_FRAME_COUNT;
+        gops.data.resize(gops.count);
+        gops.finished.resize(gops.count, false);
+        const uint32_t sessionCount =
+            offlineSessionCount > 0 ? offlineSessionCount : encoderDevice.getEncodeQueueCount();
+        std::vector<std::thread> sessions;
+        for (uint32_t i = 0; i < sessionCount; i++) {
+            sessions.emplace_back([this, &gops]() {
+                try {
+                    encodeOfflineGops(gops);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(gops.mutex);
+                    if (!gops.error) {
+                        gops.error = std::current_exception();
+                    }
+                    gops.failed = true;
+                    gops.done.notify_all();
+                }
+            });
         }
-        vmaDestroyAllocator(allocator);
-        vkDestroyDevice(device, nullptr);
-        vkDestroyInstance(instance, nullptr);
-    }
-
-    void createInstance() {
-        const VkApplicationInfo appInfo{.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
-                                        .pApplicationName = "Vulkan Sample",
-                                        .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
-                                        .pEngineName = "No Engine",
-                                        .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-                                        .apiVersion = VK_API_VERSION_1_3};
 
-        auto extensions = getRequiredExtensions();
-        const VkInstanceCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-                                              .pApplicationInfo = &appInfo,
-                                              .enabledExtensionCount = static_cast<uint32_t>(extensions.size()),
-                                              .ppEnabledExtensionNames = extensions.data()};
-
-        VK_CHECK(vkCreateInstance(&createInfo, nullptr, &instance));
-    }
-
-    void pickPhysicalDevice() {
-        uint32_t deviceCount = 0;
-        vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
-
-        if (deviceCount == 0) {
-            throw std::runtime_error("failed to find GPUs with Vulkan support!");
+        std::FILE *file = std::fopen(getOutputFileName(), "wb");
+        bool writeFailed = !file;
+        if (!file) {
+            // let the sessions stop after their current GOP
+            std::lock_guard<std::mutex> lock(gops.mutex);
+            gops.failed = true;
+            gops.done.notify_all();
         }
-
-        std::vector<VkPhysicalDevice> devices(deviceCount);
-        vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
-
-        for (const auto &device : devices) {
-            if (isDeviceSuitable(device)) {
-                physicalDevice = device;
+        for (uint32_t gop = 0; gop < gops.count && file; gop++) {
+            std::vector<char> data;
+            {
+                std::unique_lock<std::mutex> lock(gops.mutex);
+                gops.done.wait(lock, [&]() { return gops.finished[gop] || gops.failed; });
+                if (!gops.finished[gop]) {
+                    break;
+                }
+                data = std::move(gops.data[gop]);
+            }
+            if (std::fwrite(data.data(), 1, data.size(), file) != data.size()) {
+                writeFailed = true;
+                std::lock_guard<std::mutex> lock(gops.mutex);
+                gops.failed = true;
+                gops.done.notify_all();
                 break;
             }
         }
-
-        if (physicalDevice == VK_NULL_HANDLE) {
-            throw std::runtime_error("failed to find a suitable GPU!");
+        for (std::thread &session : sessions) {
+            session.join();
         }
-
-        VkPhysicalDeviceProperties properties;
-        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
-
-        std::cout << "Using device: " << properties.deviceName << "\n";
+        if (file && std::fclose(file) != 0) {
+            writeFailed = true;
+        }
+        if (gops.error) {
+            std::rethrow_exception(gops.error);
+        }
+        if (writeFailed) {
+            throw std::runtime_error(std::string("Error: failed to write ") + getOutputFileName());
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        printf("encoded %u frames in %u GOPs with %u sessions, %.1f frames/s\n", NUM_FRAMES_TO_WRITE, gops.count,
+               sessionCount, NUM_FRAMES_TO_WRITE / seconds);
     }
 
-    void createLogicalDevice() {
-        QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
-        const std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(),
-                                                        indices.videoEncodeFamily.value()};
-        const float queuePriority = 1.0f;
-        std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-        for (uint32_t queueFamily : uniqueQueueFamilies) {
-            const VkDeviceQueueCreateInfo queueCreateInfo{.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                                                          .queueFamilyIndex = queueFamily,
-                                                          .queueCount = 1,
-                                                          .pQueuePriorities = &queuePriority};
-            queueCreateInfos.push_back(queueCreateInfo);
+    // one offline session: renders and encodes GOPs until none is left
+    void encodeOfflineGops(OfflineGops &gops) {
+        std::vector<VkImage> sessionImages;
+        std::vector<VmaAllocation> sessionImageAllocations;
+        std::vector<VkImageView> sessionImageViews;
+        createImages(sessionImages, sessionImageAllocations);
+        createImageViews(sessionImages, sessionImageViews);
+        // command pools must not be used by several threads
+        const VkCommandPoolCreateInfo poolInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                                               .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+                                               .queueFamilyIndex = context.queueFamilyIndices.graphicsFamily.value()};
+        VkCommandPool commandPool;
+        VK_CHECK(vkCreateCommandPool(context.device, &poolInfo, nullptr, &commandPool));
+        std::vector<VkCommandBuffer> sessionCommandBuffers;
+        createCommandBuffers(commandPool, sessionImages.size(), sessionCommandBuffers);
+
+        // the GOP structure comes from the keyframe requests
+        VideoEncoder::Config config = getEncoderConfig();
+        config.gopLength = OFFLINE_GOP_FRAME_COUNT;
+        config.idrPeriod = VideoEncoder::INFINITE_GOP;
+        VideoEncoder encoder;
+        encoder.init(encoderDevice, sessionImages, sessionImageViews, WIDTH, HEIGHT, config);
+
+        std::vector<char> data;
+        auto appendPacket = [&]() {
+            EncodedPacket packet;
+            encoder.finishEncode(packet);
+            data.insert(data.end(), packet.data(), packet.data() + packet.size());
+        };
+        for (uint32_t gop = gops.next++; gop < gops.count && !gops.failed; gop = gops.next++) {
+            const uint32_t firstFrame = gop * OFFLINE_GOP_FRAME_COUNT;
+            const uint32_t endFrame = std::min(firstFrame + OFFLINE_GOP_FRAME_COUNT, NUM_FRAMES_TO_WRITE);
+            encoder.requestKeyframe();
+            for (uint32_t frameNumber = firstFrame; frameNumber < endFrame; frameNumber++) {
+                const uint32_t imageIx = encoder.acquireInputImage();
+                recordCommandBuffer(sessionCommandBuffers[imageIx], sessionImages[imageIx], sessionImageViews[imageIx],
+                                    VK_NULL_HANDLE, 0, frameNumber);
+                submitRender(sessionCommandBuffers[imageIx]);
+                while (encoder.isPipelineFull()) {
+                    appendPacket();
+                }
+                encoder.queueEncode(imageIx);
+            }
+            // the GOP has to be complete, without B frames held back for the next one
+            encoder.flush();
+            while (encoder.getPendingFrameCount() > 0) {
+                appendPacket();
+            }
+            std::lock_guard<std::mutex> lock(gops.mutex);
+            gops.data[gop] = std::move(data);
+            gops.finished[gop] = true;
+            gops.done.notify_all();
+            data.clear();
         }
 
-        const VkPhysicalDeviceFeatures deviceFeatures{};
-        VkPhysicalDeviceSynchronization2Features synchronization2_features{
-            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES, .synchronization2 = VK_TRUE};
-
-        const VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering_features{
-            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR,
-            .pNext = &synchronization2_features,
-            .dynamicRendering = VK_TRUE};
-
-        const VkDeviceCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-                                            .pNext = &dynamic_rendering_features,
-                                            .queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size()),
-                                            .pQueueCreateInfos = queueCreateInfos.data(),
-                                            .enabledLayerCount = 0,
-                                            .enabledExtensionCount = static_cast<unsigned int>(deviceExtensions.size()),
-                                            .ppEnabledExtensionNames = deviceExtensions.data(),
-                                            .pEnabledFeatures = &deviceFeatures};
-
-        VK_CHECK(vkCreateDevice(physicalDevice, &createInfo, nullptr, &device));
-
-        vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
-        vkGetDeviceQueue(device, indices.videoEncodeFamily.value(), 0, &videoEncodeQueue);
+        encoder.deinit();
+        vkDestroyCommandPool(context.device, commandPool, nullptr);
+        for (size_t i = 0; i < sessionImages.size(); i++) {
+            vkDestroyImageView(context.device, sessionImageViews[i], nullptr);
+            vmaDestroyImage(context.allocator, sessionImages[i], sessionImageAllocations[i]);
+        }
     }
 
-    void createAllocator() {
-        const VmaVulkanFunctions vulkanFunctions = {.vkGetInstanceProcAddr = vkGetInstanceProcAddr,
-                                                    .vkGetDeviceProcAddr = vkGetDeviceProcAddr};
-
-        const VmaAllocatorCreateInfo allocatorInfo{.physicalDevice = physicalDevice,
-                                                   .device = device,
-                                                   .pVulkanFunctions = &vulkanFunctions,
-                                                   .instance = instance,
-                                                   .vulkanApiVersion = VK_API_VERSION_1_3};
-
-        VK_CHECK(vmaCreateAllocator(&allocatorInfo, &allocator));
+    void cleanup() {
+        if (!offline) {
+            writeEncodedFrames(true);
+            // the writer holds packets of the encoder, so it has to finish first
+            packetWriter.close();
+            rtpSender.close();
+            rawFileSource.close();
+            const VideoEncoder::Metrics metrics = videoEncoder.getMetrics();
+            if (metrics.framesSkipped > 0) {
+                std::cout << "skipped " << metrics.framesSkipped << " static frames\n";
+            }
+            if (metrics.encodeFailures > 0) {
+                std::cerr << metrics.encodeFailures << " frames failed to encode, "
+                          << metrics.insufficientBufferFailures << " of them did not fit into their bitstream region\n";
+            }
+            if (!metricsFileName.empty()) {
+                writeMetrics();
+            }
+            videoEncoder.deinit();
+        }
+        encoderDevice.printEncodeQueueStats(stdout);
+        encoderDevice.deinit();
+        std::cout << "wrote " << (codec == Codec::H265 ? "H.265" : "H.264") << " content to ./" << getOutputFileName()
+                  << "\n";
+        if (!offline && !direct && rawFileName.empty()) {
+            latencyReport.printSummary(stdout);
+            if (!latencyCsvFileName.empty()) {
+                latencyReport.writeCsv(latencyCsvFileName);
+                std::cout << "wrote latency trace to " << latencyCsvFileName << "\n";
+            }
+        }
+        if (renderTimestampQueryPool) {
+            vkDestroyQueryPool(context.device, renderTimestampQueryPool, nullptr);
+        }
+        if (direct) {
+            vkDestroyDescriptorPool(context.device, directDescriptorPool, nullptr);
+            vkDestroyPipeline(context.device, directPipeline, nullptr);
+            vkDestroyPipelineLayout(context.device, directPipelineLayout, nullptr);
+            vkDestroyDescriptorSetLayout(context.device, directDescriptorSetLayout, nullptr);
+        }
+        vkDestroyPipeline(context.device, graphicsPipeline, nullptr);
+        vkDestroyPipelineLayout(context.device, pipelineLayout, nullptr);
+        for (auto imageView : imageViews) {
+            vkDestroyImageView(context.device, imageView, nullptr);
+        }
+        for (int i = 0; i < images.size(); i++) {
+            vmaDestroyImage(context.allocator, images[i], imageAllocations[i]);
+        }
+        context.deinit();
     }
 
-    void createImages() {
-        images.resize(IMAGE_INFLIGHT_COUNT);
-        imageAllocations.resize(images.size());
-        for (int i = 0; i < images.size(); i++) {
+    void createImages(std::vector<VkImage> &inputImages, std::vector<VmaAllocation> &allocations) {
+        inputImages.resize(IMAGE_INFLIGHT_COUNT);
+        allocations.resize(inputImages.size());
+        for (int i = 0; i < inputImages.size(); i++) {
             const VkImageCreateInfo imageCreateInfo{
                 .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
                 .imageType = VK_IMAGE_TYPE_2D,
@@ -239,16 +405,16 @@ class VulkanApplication {
             const VmaAllocationCreateInfo allocCreateInfo{
                 .flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, .usage = VMA_MEMORY_USAGE_AUTO, .priority = 1.0f};
 
-            VK_CHECK(vmaCreateImage(allocator, &imageCreateInfo, &allocCreateInfo, &images[i], &imageAllocations[i],
-                                    nullptr));
+            VK_CHECK(vmaCreateImage(context.allocator, &imageCreateInfo, &allocCreateInfo, &inputImages[i],
+                                    &allocations[i], nullptr));
         }
     }
 
-    void createImageViews() {
-        imageViews.resize(images.size());
-        for (int i = 0; i < images.size(); i++) {
+    void createImageViews(const std::vector<VkImage> &inputImages, std::vector<VkImageView> &views) {
+        views.resize(inputImages.size());
+        for (int i = 0; i < inputImages.size(); i++) {
             const VkImageViewCreateInfo viewInfo{.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-                                                 .image = images[i],
+                                                 .image = inputImages[i],
                                                  .viewType = VK_IMAGE_VIEW_TYPE_2D,
                                                  .format = VK_FORMAT_R8G8B8A8_UNORM,
                                                  .subresourceRange = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -257,7 +423,7 @@ class VulkanApplication {
                                                                       .baseArrayLayer = 0,
                                                                       .layerCount = 1}};
 
-            VK_CHECK(vkCreateImageView(device, &viewInfo, nullptr, &imageViews[i]));
+            VK_CHECK(vkCreateImageView(context.device, &viewInfo, nullptr, &views[i]));
         }
     }
 
@@ -291,7 +457,7 @@ class VulkanApplication {
                                                             .pushConstantRangeCount = 1,
                                                             .pPushConstantRanges = &pushConstantRange};
 
-        VK_CHECK(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout));
+        VK_CHECK(vkCreatePipelineLayout(context.device, &pipelineLayoutInfo, nullptr, &pipelineLayout));
 
         const VkPipelineVertexInputStateCreateInfo vertexInputInfo{
             .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO};
@@ -386,69 +552,215 @@ class VulkanApplication {
                                                   .basePipelineHandle = VK_NULL_HANDLE,
                                                   .basePipelineIndex = -1};
 
-        VK_CHECK(vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline));
+        VK_CHECK(
+            vkCreateGraphicsPipelines(context.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline));
 
-        vkDestroyShaderModule(device, fragShaderModule, nullptr);
-        vkDestroyShaderModule(device, vertShaderModule, nullptr);
+        vkDestroyShaderModule(context.device, fragShaderModule, nullptr);
+        vkDestroyShaderModule(context.device, vertShaderModule, nullptr);
     }
 
-    void createCommandPool() {
-        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
-
-        const VkCommandPoolCreateInfo poolInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-                                               .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-                                               .queueFamilyIndex = queueFamilyIndices.graphicsFamily.value()};
+    void createCommandBuffers(VkCommandPool commandPool, size_t count, std::vector<VkCommandBuffer> &buffers) {
+        buffers.resize(count);
+        VkCommandBufferAllocateInfo allocInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                                              .commandPool = commandPool,
+                                              .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                                              .commandBufferCount = static_cast<uint32_t>(buffers.size())};
 
-        VK_CHECK(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+        VK_CHECK(vkAllocateCommandBuffers(context.device, &allocInfo, buffers.data()));
     }
 
-    bool isDeviceSuitable(VkPhysicalDevice device) {
-        QueueFamilyIndices indices = findQueueFamilies(device);
+    void createRenderTimestampQueryPool() {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(context.physicalDevice, &properties);
+        timestampPeriod = properties.limits.timestampPeriod;
 
-        bool extensionsSupported = checkDeviceExtensionSupport(device);
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(context.physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(context.physicalDevice, &queueFamilyCount, queueFamilies.data());
+        const uint32_t graphicsFamily = context.queueFamilyIndices.graphicsFamily.value();
+        const uint32_t validBits = queueFamilies[graphicsFamily].timestampValidBits;
+        renderTimestampMask = validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+
+        renderSubmitTimes.resize(IMAGE_INFLIGHT_COUNT);
+        renderTimestampQueryPool = VK_NULL_HANDLE;
+        if (validBits == 0) {
+            return;
+        }
+        const VkQueryPoolCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                                               .queryType = VK_QUERY_TYPE_TIMESTAMP,
+                                               .queryCount = static_cast<uint32_t>(IMAGE_INFLIGHT_COUNT) * 2};
+        VK_CHECK(vkCreateQueryPool(context.device, &createInfo, nullptr, &renderTimestampQueryPool));
+    }
 
-        return indices.isComplete() && extensionsSupported;
+    VideoEncoder::Config getEncoderConfig() {
+        VideoEncoder::Config config;
+        config.fps = 30;
+        config.pipelineDepth = ENCODE_PIPELINE_DEPTH;
+        config.preset = preset;
+        config.codec = codec;
+        config.maxStaticFrameSkip = maxStaticFrameSkip;
+        config.emphasisMap = emphasisMap;
+        return config;
     }
 
-    bool checkDeviceExtensionSupport(VkPhysicalDevice device) {
-        uint32_t extensionCount;
-        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+    const char *getOutputFileName() const {
+        if (mp4) {
+            return "hwenc.mp4";
+        }
+        return codec == Codec::H265 ? "hwenc.265" : "hwenc.264";
+    }
 
-        std::vector<VkExtensionProperties> availableExtensions(extensionCount);
-        vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+    void initVideoEncoder() {
+        VideoEncoder::Config config = getEncoderConfig();
+        config.directYCbCrInput = direct;
+        videoEncoder.init(encoderDevice, images, imageViews, WIDTH, HEIGHT, config);
 
-        std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+        openOutput(WIDTH, HEIGHT, config.fps);
+    }
 
-        for (const auto &extension : availableExtensions) {
-            requiredExtensions.erase(extension.extensionName);
+    void openOutput(uint32_t width, uint32_t height, uint32_t fps) {
+        const Mp4Muxer::Format mp4Format{.codec = codec, .width = width, .height = height, .fps = fps};
+        packetWriter.open(getOutputFileName(), 0, 64, mp4 ? &mp4Format : nullptr);
+        if (!rtpHost.empty()) {
+            rtpSender.open(rtpHost, rtpPort, codec, fps);
+            std::FILE *sdp = std::fopen("hwenc.sdp", "w");
+            if (!sdp) {
+                throw std::runtime_error("Error: failed to open file hwenc.sdp");
+            }
+            std::fputs(rtpSender.getSdp().c_str(), sdp);
+            std::fclose(sdp);
+            std::cout << "Sending RTP to " << rtpHost << ":" << rtpPort << ", session description in ./hwenc.sdp\n";
         }
-
-        return requiredExtensions.empty();
     }
 
-    void createCommandBuffers() {
-        commandBuffers.resize(images.size());
-        VkCommandBufferAllocateInfo allocInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-                                              .commandPool = commandPool,
-                                              .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-                                              .commandBufferCount = static_cast<uint32_t>(commandBuffers.size())};
+    // compute pipeline rendering into the YCbCr planes of the encoder
+    void createDirectPipeline() {
+        const uint32_t planeCount = videoEncoder.getYCbCrPlaneCount();
+        const VkShaderModule shaderModule = createShaderModule(readFile(
+            planeCount == 2 ? "shaders/triangle-ycbcr-2plane.comp.spv" : "shaders/triangle-ycbcr-3plane.comp.spv"));
+
+        std::vector<VkDescriptorSetLayoutBinding> bindings(planeCount);
+        for (uint32_t i = 0; i < planeCount; i++) {
+            bindings[i] = {.binding = i,
+                           .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                           .descriptorCount = 1,
+                           .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT};
+        }
+        const VkDescriptorSetLayoutCreateInfo layoutInfo{.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                                                         .bindingCount = planeCount,
+                                                         .pBindings = bindings.data()};
+        VK_CHECK(vkCreateDescriptorSetLayout(context.device, &layoutInfo, nullptr, &directDescriptorSetLayout));
 
-        VK_CHECK(vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()));
+        const VkPushConstantRange pushConstantRange{
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT, .offset = 0, .size = sizeof(DirectRenderPushConstants)};
+        const VkPipelineLayoutCreateInfo pipelineLayoutInfo{.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                                                            .setLayoutCount = 1,
+                                                            .pSetLayouts = &directDescriptorSetLayout,
+                                                            .pushConstantRangeCount = 1,
+                                                            .pPushConstantRanges = &pushConstantRange};
+        VK_CHECK(vkCreatePipelineLayout(context.device, &pipelineLayoutInfo, nullptr, &directPipelineLayout));
+
+        const VkComputePipelineCreateInfo pipelineInfo{
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage = {.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                      .module = shaderModule,
+                      .pName = "main"},
+            .layout = directPipelineLayout};
+        VK_CHECK(vkCreateComputePipelines(context.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &directPipeline));
+        vkDestroyShaderModule(context.device, shaderModule, nullptr);
+
+        const VkDescriptorPoolSize poolSize{.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                            .descriptorCount = planeCount * ENCODE_PIPELINE_DEPTH};
+        const VkDescriptorPoolCreateInfo poolInfo{.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+                                                  .maxSets = ENCODE_PIPELINE_DEPTH,
+                                                  .poolSizeCount = 1,
+                                                  .pPoolSizes = &poolSize};
+        VK_CHECK(vkCreateDescriptorPool(context.device, &poolInfo, nullptr, &directDescriptorPool));
+        directDescriptorSets.assign(ENCODE_PIPELINE_DEPTH, VK_NULL_HANDLE);
     }
 
-    void initVideoEncoder() {
-        QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
-        const int fps = 30;
-        videoEncoder.init(physicalDevice, device, allocator, indices.graphicsFamily.value(), graphicsQueue, commandPool,
-                          indices.videoEncodeFamily.value(), videoEncodeQueue, images, imageViews, WIDTH, HEIGHT, fps);
+    void recordDirectCommandBuffer(VkCommandBuffer commandBuffer, const VideoEncoder::YCbCrInputFrame &frame,
+                                   uint32_t currentFrameNumber) {
+        VkDescriptorSet &descriptorSet = directDescriptorSets[frame.index];
+        if (!descriptorSet) {
+            // the images of the encoder stay the same during the session
+            const VkDescriptorSetAllocateInfo allocInfo{.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                                                        .descriptorPool = directDescriptorPool,
+                                                        .descriptorSetCount = 1,
+                                                        .pSetLayouts = &directDescriptorSetLayout};
+            VK_CHECK(vkAllocateDescriptorSets(context.device, &allocInfo, &descriptorSet));
+            std::vector<VkDescriptorImageInfo> imageInfos(frame.planeViews.size());
+            std::vector<VkWriteDescriptorSet> descriptorWrites(frame.planeViews.size());
+            for (uint32_t i = 0; i < frame.planeViews.size(); i++) {
+                imageInfos[i] = {.imageView = frame.planeViews[i], .imageLayout = VK_IMAGE_LAYOUT_GENERAL};
+                descriptorWrites[i] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                       .dstSet = descriptorSet,
+                                       .dstBinding = i,
+                                       .descriptorCount = 1,
+                                       .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                       .pImageInfo = &imageInfos[i]};
+            }
+            vkUpdateDescriptorSets(context.device, static_cast<uint32_t>(descriptorWrites.size()),
+                                   descriptorWrites.data(), 0, nullptr);
+        }
+
+        VkCommandBufferBeginInfo beginInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                                           .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
+        VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+
+        // the previous frame of this image is encoded, its content is not needed
+        VkImageAspectFlags aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT | VK_IMAGE_ASPECT_PLANE_1_BIT;
+        if (frame.planeViews.size() >= 3) {
+            aspectMask |= VK_IMAGE_ASPECT_PLANE_2_BIT;
+        }
+        const VkImageMemoryBarrier2 imageMemoryBarrier{.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                                                       .srcStageMask = VK_PIPELINE_STAGE_2_NONE,
+                                                       .srcAccessMask = VK_ACCESS_2_NONE,
+                                                       .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                                       .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                                                       .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                                                       .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+                                                       .image = frame.image,
+                                                       .subresourceRange = {
+                                                           .aspectMask = aspectMask,
+                                                           .baseMipLevel = 0,
+                                                           .levelCount = 1,
+                                                           .baseArrayLayer = 0,
+                                                           .layerCount = 1,
+                                                       }};
+        const VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
+                                                 .imageMemoryBarrierCount = 1,
+                                                 .pImageMemoryBarriers = &imageMemoryBarrier};
+        vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
 
-        outfile.open("hwenc.264", std::ios::binary);
+        const VideoEncoder::Config config = getEncoderConfig();
+        const DirectRenderPushConstants pushConstants{
+            .conversion = EncoderDevice::getConversionParameters(config.yCbCrModel, config.yCbCrRange),
+            .currentFrameNumber = currentFrameNumber};
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, directPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, directPipelineLayout, 0, 1,
+                                &descriptorSet, 0, nullptr);
+        vkCmdPushConstants(commandBuffer, directPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants),
+                           &pushConstants);
+        // one invocation per 2x2 pixels, work group size 16x16
+        vkCmdDispatch(commandBuffer, (WIDTH + 31) / 32, (HEIGHT + 31) / 32, 1);
+
+        VK_CHECK(vkEndCommandBuffer(commandBuffer));
     }
 
-    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t currentImageIx, uint32_t currentFrameNumber) {
-        VkCommandBufferBeginInfo beginInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+    // writes two timestamps from query firstQuery on into timestampQueryPool, if it is not VK_NULL_HANDLE
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, VkImage image, VkImageView imageView,
+                             VkQueryPool timestampQueryPool, uint32_t firstQuery, uint32_t currentFrameNumber) {
+        VkCommandBufferBeginInfo beginInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                                           .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
 
         VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+        if (timestampQueryPool) {
+            vkCmdResetQueryPool(commandBuffer, timestampQueryPool, firstQuery, 2);
+            vkCmdWriteTimestamp2(commandBuffer, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, timestampQueryPool, firstQuery);
+        }
 
         VkImageMemoryBarrier2 imageMemoryBarrier{.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
                                                  .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
@@ -457,7 +769,7 @@ class VulkanApplication {
                                                  .dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
                                                  .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
                                                  .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-                                                 .image = images[currentImageIx],
+                                                 .image = image,
                                                  .subresourceRange = {
                                                      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
                                                      .baseMipLevel = 0,
@@ -471,7 +783,7 @@ class VulkanApplication {
         vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
 
         const VkRenderingAttachmentInfo colorAttachmentInfo{.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-                                                            .imageView = imageViews[currentImageIx],
+                                                            .imageView = imageView,
                                                             .imageLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL,
                                                             .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
                                                             .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
@@ -491,67 +803,123 @@ class VulkanApplication {
                            &currentFrameNumber);
         vkCmdDraw(commandBuffer, 3, 1, 0, 0);
         vkCmdEndRendering(commandBuffer);
+        if (timestampQueryPool) {
+            vkCmdWriteTimestamp2(commandBuffer, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, timestampQueryPool,
+                                 firstQuery + 1);
+        }
 
         VK_CHECK(vkEndCommandBuffer(commandBuffer));
     }
 
     void drawFrame(uint32_t currentImageIx, uint32_t currentFrameNumber) {
-        vkResetCommandBuffer(commandBuffers[currentImageIx], 0);
-        recordCommandBuffer(commandBuffers[currentImageIx], currentImageIx, currentFrameNumber);
+        // vkBeginCommandBuffer implicitly resets the command buffer
+        const uint32_t renderIx = currentFrameNumber % IMAGE_INFLIGHT_COUNT;
+        recordCommandBuffer(commandBuffers[currentImageIx], images[currentImageIx], imageViews[currentImageIx],
+                            renderTimestampQueryPool, renderIx * 2, currentFrameNumber);
 
-        VkSubmitInfo submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                                .commandBufferCount = 1,
-                                .pCommandBuffers = &commandBuffers[currentImageIx]};
-
-        VK_CHECK(vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE));
+        renderSubmitTimes[renderIx] = std::chrono::steady_clock::now();
+        submitRender(commandBuffers[currentImageIx]);
     }
 
-    QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device) {
-        QueueFamilyIndices indices;
-
-        uint32_t queueFamilyCount = 0;
-        vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+    // the graphics queue is the conversion queue of the encoder device, which serializes the submissions
+    void submitRender(VkCommandBuffer commandBuffer) {
+        const VkCommandBufferSubmitInfo commandBufferInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                                                          .commandBuffer = commandBuffer};
+        const VkSubmitInfo2 submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                                       .commandBufferInfoCount = 1,
+                                       .pCommandBufferInfos = &commandBufferInfo};
+        encoderDevice.submitCompute(submitInfo);
+    }
 
-        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
-        vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
+    void encodeFrame(uint32_t currentImageIx) {
+        writeFinishedFrames();
 
-        int i = 0;
-        for (const auto &queueFamily : queueFamilies) {
-            if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-                indices.graphicsFamily = i;
-            }
+        // queue the next frame for encoding
+        videoEncoder.queueEncode(currentImageIx);
+    }
 
-            if (queueFamily.queueFlags & VK_QUEUE_VIDEO_ENCODE_BIT_KHR) {
-                indices.videoEncodeFamily = i;
-            }
+    void encodeDirectFrame(uint32_t currentFrameNumber) {
+        writeFinishedFrames();
 
-            if (indices.isComplete()) {
-                break;
-            }
+        // render into the source image of the next frame and queue it for encoding
+        const VideoEncoder::YCbCrInputFrame frame = videoEncoder.acquireYCbCrInputFrame();
+        recordDirectCommandBuffer(commandBuffers[frame.index], frame, currentFrameNumber);
+        submitRender(commandBuffers[frame.index]);
+        videoEncoder.queueYCbCrEncode();
+    }
 
-            i++;
+    void writeFinishedFrames() {
+        // write out every frame the GPU has already finished, without waiting
+        EncodedPacket packet;
+        while (videoEncoder.tryFinishEncode(packet)) {
+            handlePacket(std::move(packet));
+        }
+        // finish encoding the oldest frame if all encoder slots are still in use
+        writeEncodedFrames(false);
+        if (!metricsFileName.empty() &&
+            std::chrono::steady_clock::now() - metricsWriteTime >= std::chrono::seconds(1)) {
+            writeMetrics();
         }
-
-        return indices;
     }
 
-    void encodeFrame(uint32_t currentImageIx) {
-        // finish encoding the previous frame
-        size_t packetSize;
-        do {
-            const char *packetData;
-            videoEncoder.finishEncode(packetData, packetSize);
-            outfile.write(packetData, packetSize);
-        } while (packetSize > 0);
+    // written to a temporary file and renamed, so a collector (e.g. the textfile collector of the Prometheus node
+    // exporter) never reads a partial file
+    void writeMetrics() {
+        const std::string text = VideoEncoder::formatPrometheus({{"session=\"0\"", videoEncoder.getMetrics()}});
+        const std::string tmpFileName = metricsFileName + ".tmp";
+        FILE *file = fopen(tmpFileName.c_str(), "w");
+        if (!file) {
+            throw std::runtime_error("Error: failed to open " + tmpFileName);
+        }
+        fwrite(text.data(), 1, text.size(), file);
+        fclose(file);
+        if (std::rename(tmpFileName.c_str(), metricsFileName.c_str()) != 0) {
+            throw std::runtime_error("Error: failed to write " + metricsFileName);
+        }
+        metricsWriteTime = std::chrono::steady_clock::now();
+    }
 
-        // queue the next frame for encoding
-        videoEncoder.queueEncode(currentImageIx);
+    void writeEncodedFrames(bool all) {
+        while (all ? videoEncoder.getPendingFrameCount() > 0 : videoEncoder.isPipelineFull()) {
+            EncodedPacket packet;
+            videoEncoder.finishEncode(packet);
+            handlePacket(std::move(packet));
+        }
     }
 
-    std::vector<const char *> getRequiredExtensions() {
-        std::vector<const char *> extensions;
+    void handlePacket(EncodedPacket &&packet) {
+        // the latencies are measured from the rendering into the RGB images
+        if (!packet.isParameterSet() && !direct && rawFileName.empty()) {
+            recordLatency(packet);
+        }
+        // sent first, the writer releases the packet
+        if (rtpSender.isOpen()) {
+            rtpSender.send(packet);
+        }
+        packetWriter.write(std::move(packet));
+    }
 
-        return extensions;
+    // must be called before IMAGE_INFLIGHT_COUNT more frames are rendered, which finishing the frames in order
+    // before each queueEncode ensures
+    void recordLatency(const EncodedPacket &packet) {
+        using Milliseconds = std::chrono::duration<double, std::milli>;
+        const uint32_t renderIx = packet.frameIndex() % IMAGE_INFLIGHT_COUNT;
+        const FrameTimings &timings = packet.timings();
+        FrameLatency frame{.frameIndex = packet.frameIndex(),
+                           .renderMs = NAN,
+                           .convertMs = timings.convertMs,
+                           .encodeQueueWaitMs = timings.encodeQueueWaitMs,
+                           .encodeMs = timings.encodeMs,
+                           .submitToPacketMs = Milliseconds(timings.readbackTime - timings.submitTime).count(),
+                           .glassToPacketMs = Milliseconds(timings.readbackTime - renderSubmitTimes[renderIx]).count()};
+        if (renderTimestampQueryPool) {
+            // the frame is encoded, so its rendering has finished long ago
+            uint64_t timestamps[2];
+            VK_CHECK(vkGetQueryPoolResults(context.device, renderTimestampQueryPool, renderIx * 2, 2,
+                                           sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT));
+            frame.renderMs = ((timestamps[1] - timestamps[0]) & renderTimestampMask) * timestampPeriod / 1e6;
+        }
+        latencyReport.addFrame(frame);
     }
 
     VkShaderModule createShaderModule(const std::vector<char> &code) {
@@ -560,14 +928,77 @@ class VulkanApplication {
                                             .pCode = reinterpret_cast<const uint32_t *>(code.data())};
 
         VkShaderModule shaderModule;
-        VK_CHECK(vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule));
+        VK_CHECK(vkCreateShaderModule(context.device, &createInfo, nullptr, &shaderModule));
 
         return shaderModule;
     }
 };
 
-int main() {
+// <host>:<port>, IPv6 addresses in brackets
+static bool parseHostPort(const std::string &address, std::string &host, uint16_t &port) {
+    const size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    const unsigned long value = std::strtoul(address.c_str() + colon + 1, nullptr, 10);
+    if (value == 0 || value > UINT16_MAX) {
+        return false;
+    }
+    host = address.substr(0, colon);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    port = static_cast<uint16_t>(value);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
     VulkanApplication app;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--latency-csv") == 0 && i + 1 < argc) {
+            app.latencyCsvFileName = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            app.cacheFileName = argv[++i];
+        } else if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc &&
+                   VideoEncoder::parsePreset(argv[i + 1], app.preset)) {
+            i++;
+        } else if (strcmp(argv[i], "--codec") == 0 && i + 1 < argc &&
+                   VideoEncoder::parseCodec(argv[i + 1], app.codec)) {
+            i++;
+        } else if (strcmp(argv[i], "--mp4") == 0 && !app.offline) {
+            app.mp4 = true;
+        } else if (strcmp(argv[i], "--rtp") == 0 && i + 1 < argc && !app.offline &&
+                   parseHostPort(argv[i + 1], app.rtpHost, app.rtpPort)) {
+            i++;
+        } else if (strcmp(argv[i], "--skip-static") == 0 && i + 1 < argc) {
+            app.maxStaticFrameSkip = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--emphasis-map") == 0) {
+            app.emphasisMap = true;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc && !app.offline) {
+            app.metricsFileName = argv[++i];
+        } else if (strcmp(argv[i], "--offline") == 0 && !app.direct && app.rawFileName.empty() && !app.mp4 &&
+                   app.rtpHost.empty() && app.metricsFileName.empty()) {
+            app.offline = true;
+        } else if (strcmp(argv[i], "--direct") == 0 && !app.offline && app.rawFileName.empty()) {
+            app.direct = true;
+        } else if (strcmp(argv[i], "--raw") == 0 && i + 3 < argc && !app.offline && !app.direct &&
+                   RawFileSource::parseFormat(argv[i + 2], app.rawFormat) &&
+                   sscanf(argv[i + 3], "%ux%u", &app.rawWidth, &app.rawHeight) == 2) {
+            app.rawFileName = argv[i + 1];
+            i += 3;
+        } else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            app.offlineSessionCount = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--latency-csv <file>] [--cache <file>] [--preset <default|low-latency|high-quality>]"
+                         " [--codec <h264|h265>] [--mp4] [--rtp <host>:<port>] [--skip-static <max>] [--emphasis-map]"
+                         " [--metrics <file>]"
+                         " [--offline [--sessions <count>] | --direct |"
+                         " --raw <file> <nv12|i420|rgba> <width>x<height>]"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
 
     try {
         app.run();
@@ -0,0 +1,451 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "mp4muxer.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "h264bitstream.hpp"
+#include "h265bitstream.hpp"
+
+// the only track of the file
+static const uint32_t TRACK_ID = 1;
+
+// sample_flags of the track fragment run: I/IDR frames depend on no other sample, all other frames are no sync samples
+static const uint32_t SAMPLE_FLAGS_SYNC = 0x02000000;
+static const uint32_t SAMPLE_FLAGS_NON_SYNC = 0x01010000;
+
+// trun: data offset, sample duration, size, flags and composition time offset present
+static const uint32_t TRUN_FLAGS = 0x000f01;
+// tfhd: the data offsets are relative to the moof box
+static const uint32_t TFHD_DEFAULT_BASE_IS_MOOF = 0x020000;
+
+static const uint32_t UNITY_MATRIX[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+
+static void putU8(std::vector<uint8_t>& out, uint8_t value) { out.push_back(value); }
+
+static void putU16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static void putU32(std::vector<uint8_t>& out, uint32_t value) {
+    putU16(out, static_cast<uint16_t>(value >> 16));
+    putU16(out, static_cast<uint16_t>(value));
+}
+
+static void putU64(std::vector<uint8_t>& out, uint64_t value) {
+    putU32(out, static_cast<uint32_t>(value >> 32));
+    putU32(out, static_cast<uint32_t>(value));
+}
+
+static void putZeros(std::vector<uint8_t>& out, size_t count) { out.insert(out.end(), count, 0); }
+
+static void putType(std::vector<uint8_t>& out, const char* type) {
+    assert(strlen(type) == 4);
+    out.insert(out.end(), type, type + 4);
+}
+
+static void patchU32(std::vector<uint8_t>& out, size_t offset, uint32_t value) {
+    out[offset] = static_cast<uint8_t>(value >> 24);
+    out[offset + 1] = static_cast<uint8_t>(value >> 16);
+    out[offset + 2] = static_cast<uint8_t>(value >> 8);
+    out[offset + 3] = static_cast<uint8_t>(value);
+}
+
+// returns the offset of the box, its size is set by endBox
+static size_t beginBox(std::vector<uint8_t>& out, const char* type) {
+    const size_t offset = out.size();
+    putU32(out, 0);
+    putType(out, type);
+    return offset;
+}
+
+static size_t beginFullBox(std::vector<uint8_t>& out, const char* type, uint8_t version, uint32_t flags) {
+    const size_t offset = beginBox(out, type);
+    putU32(out, (static_cast<uint32_t>(version) << 24) | flags);
+    return offset;
+}
+
+static void endBox(std::vector<uint8_t>& out, size_t offset) {
+    patchU32(out, offset, static_cast<uint32_t>(out.size() - offset));
+}
+
+static void putMatrix(std::vector<uint8_t>& out) {
+    for (uint32_t value : UNITY_MATRIX) {
+        putU32(out, value);
+    }
+}
+
+// the NAL units of a buffer of 4 byte length prefixed NAL units
+static std::vector<Mp4Muxer::Chunk> getNalUnits(const std::vector<uint8_t>& lengthPrefixed) {
+    std::vector<Mp4Muxer::Chunk> nalUnits;
+    size_t offset = 0;
+    while (offset + 4 <= lengthPrefixed.size()) {
+        const uint8_t* p = lengthPrefixed.data() + offset;
+        const size_t size = (size_t(p[0]) << 24) | (size_t(p[1]) << 16) | (size_t(p[2]) << 8) | p[3];
+        nalUnits.push_back({p + 4, size});
+        offset += 4 + size;
+    }
+    return nalUnits;
+}
+
+// removes the emulation prevention bytes (00 00 03), so the syntax elements of a NAL unit can be read
+static std::vector<uint8_t> getRbsp(const Mp4Muxer::Chunk& nalUnit) {
+    std::vector<uint8_t> rbsp;
+    rbsp.reserve(nalUnit.size);
+    size_t zeros = 0;
+    for (size_t i = 0; i < nalUnit.size; i++) {
+        if (zeros >= 2 && nalUnit.data[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nalUnit.data[i] == 0 ? zeros + 1 : 0;
+        rbsp.push_back(nalUnit.data[i]);
+    }
+    return rbsp;
+}
+
+void Mp4Muxer::init(const Format& format) {
+    assert(format.fps > 0);
+    m_format = format;
+    m_boxes.clear();
+    m_pieces.clear();
+    m_pendingParameterSets.clear();
+    m_initWritten = false;
+    m_sequenceNumber = 0;
+    m_firstDts = 0;
+}
+
+void Mp4Muxer::addPackets(const EncodedPacket* packets, size_t count, std::vector<Chunk>& chunks) {
+    m_boxes.clear();
+    m_pieces.clear();
+    size_t i = 0;
+    while (i < count) {
+        if (packets[i].isParameterSet()) {
+            // a copy, the header of the encoder may be replaced on resize before the frame is written
+            m_pendingParameterSets.clear();
+            const uint8_t* data = reinterpret_cast<const uint8_t*>(packets[i].data());
+            for (const h264::NalUnit& nalUnit : h264::splitNalUnits(data, packets[i].size())) {
+                putU32(m_pendingParameterSets, static_cast<uint32_t>(nalUnit.size));
+                m_pendingParameterSets.insert(m_pendingParameterSets.end(), data + nalUnit.offset,
+                                              data + nalUnit.offset + nalUnit.size);
+            }
+            i++;
+            continue;
+        }
+        // the frames up to the next header or IDR frame
+        size_t end = i + 1;
+        while (end < count && !packets[end].isParameterSet() && !packets[end].isIdr()) {
+            end++;
+        }
+        writeFragment(packets + i, end - i);
+        i = end;
+    }
+    for (const Piece& piece : m_pieces) {
+        chunks.push_back({piece.external ? piece.external : m_boxes.data() + piece.offset, piece.size});
+    }
+}
+
+void Mp4Muxer::addOwnedPiece(size_t offset) {
+    const size_t size = m_boxes.size() - offset;
+    if (!m_pieces.empty() && !m_pieces.back().external &&
+        m_pieces.back().offset + m_pieces.back().size == offset) {
+        m_pieces.back().size += size;
+        return;
+    }
+    m_pieces.push_back({nullptr, offset, size});
+}
+
+void Mp4Muxer::writeInitSegment() {
+    const size_t start = m_boxes.size();
+    const size_t ftyp = beginBox(m_boxes, "ftyp");
+    putType(m_boxes, "iso6");
+    putU32(m_boxes, 0);
+    putType(m_boxes, "iso6");
+    putType(m_boxes, "mp41");
+    endBox(m_boxes, ftyp);
+
+    const size_t moov = beginBox(m_boxes, "moov");
+    const size_t mvhd = beginFullBox(m_boxes, "mvhd", 0, 0);
+    putU32(m_boxes, 0);  // creation and modification time
+    putU32(m_boxes, 0);
+    putU32(m_boxes, m_format.fps);
+    putU32(m_boxes, 0);  // duration, given by the fragments
+    putU32(m_boxes, 0x00010000);  // rate 1.0
+    putU16(m_boxes, 0x0100);      // volume 1.0
+    putZeros(m_boxes, 10);
+    putMatrix(m_boxes);
+    putZeros(m_boxes, 24);
+    putU32(m_boxes, TRACK_ID + 1);  // next track ID
+    endBox(m_boxes, mvhd);
+
+    const size_t trak = beginBox(m_boxes, "trak");
+    const size_t tkhd = beginFullBox(m_boxes, "tkhd", 0, 0x000003);  // enabled, in movie
+    putU32(m_boxes, 0);
+    putU32(m_boxes, 0);
+    putU32(m_boxes, TRACK_ID);
+    putU32(m_boxes, 0);
+    putU32(m_boxes, 0);  // duration
+    putZeros(m_boxes, 8);
+    putU16(m_boxes, 0);  // layer
+    putU16(m_boxes, 0);  // alternate group
+    putU16(m_boxes, 0);  // volume
+    putU16(m_boxes, 0);
+    putMatrix(m_boxes);
+    putU32(m_boxes, m_format.width << 16);
+    putU32(m_boxes, m_format.height << 16);
+    endBox(m_boxes, tkhd);
+
+    const size_t mdia = beginBox(m_boxes, "mdia");
+    const size_t mdhd = beginFullBox(m_boxes, "mdhd", 0, 0);
+    putU32(m_boxes, 0);
+    putU32(m_boxes, 0);
+    putU32(m_boxes, m_format.fps);
+    putU32(m_boxes, 0);
+    putU16(m_boxes, 0x55c4);  // language "und"
+    putU16(m_boxes, 0);
+    endBox(m_boxes, mdhd);
+    const size_t hdlr = beginFullBox(m_boxes, "hdlr", 0, 0);
+    putU32(m_boxes, 0);
+    putType(m_boxes, "vide");
+    putZeros(m_boxes, 12);
+    const char handlerName[] = "VideoHandler";
+    m_boxes.insert(m_boxes.end(), handlerName, handlerName + sizeof(handlerName));
+    endBox(m_boxes, hdlr);
+
+    const size_t minf = beginBox(m_boxes, "minf");
+    const size_t vmhd = beginFullBox(m_boxes, "vmhd", 0, 1);
+    putZeros(m_boxes, 8);  // graphics mode and opcolor
+    endBox(m_boxes, vmhd);
+    const size_t dinf = beginBox(m_boxes, "dinf");
+    const size_t dref = beginFullBox(m_boxes, "dref", 0, 0);
+    putU32(m_boxes, 1);
+    endBox(m_boxes, beginFullBox(m_boxes, "url ", 0, 1));  // the data is in this file
+    endBox(m_boxes, dref);
+    endBox(m_boxes, dinf);
+
+    // the sample tables are empty, all samples are in the fragments
+    const size_t stbl = beginBox(m_boxes, "stbl");
+    const size_t stsd = beginFullBox(m_boxes, "stsd", 0, 0);
+    putU32(m_boxes, 1);
+    writeSampleEntry();
+    endBox(m_boxes, stsd);
+    const size_t stts = beginFullBox(m_boxes, "stts", 0, 0);
+    putU32(m_boxes, 0);
+    endBox(m_boxes, stts);
+    const size_t stsc = beginFullBox(m_boxes, "stsc", 0, 0);
+    putU32(m_boxes, 0);
+    endBox(m_boxes, stsc);
+    const size_t stsz = beginFullBox(m_boxes, "stsz", 0, 0);
+    putU32(m_boxes, 0);
+    putU32(m_boxes, 0);
+    endBox(m_boxes, stsz);
+    const size_t stco = beginFullBox(m_boxes, "stco", 0, 0);
+    putU32(m_boxes, 0);
+    endBox(m_boxes, stco);
+    endBox(m_boxes, stbl);
+    endBox(m_boxes, minf);
+    endBox(m_boxes, mdia);
+    endBox(m_boxes, trak);
+
+    const size_t mvex = beginBox(m_boxes, "mvex");
+    const size_t trex = beginFullBox(m_boxes, "trex", 0, 0);
+    putU32(m_boxes, TRACK_ID);
+    putU32(m_boxes, 1);  // sample description index
+    putU32(m_boxes, 0);
+    putU32(m_boxes, 0);
+    putU32(m_boxes, 0);
+    endBox(m_boxes, trex);
+    endBox(m_boxes, mvex);
+    endBox(m_boxes, moov);
+    addOwnedPiece(start);
+    m_initWritten = true;
+}
+
+// avc3/hev1 visual sample entry with the decoder configuration record of the first parameter sets
+void Mp4Muxer::writeSampleEntry() {
+    const bool h265 = m_format.codec == Codec::H265;
+    const uint8_t spsType =
+        h265 ? static_cast<uint8_t>(h265::NAL_UNIT_TYPE_SPS) : static_cast<uint8_t>(h264::NAL_UNIT_TYPE_SPS);
+    const uint8_t ppsType =
+        h265 ? static_cast<uint8_t>(h265::NAL_UNIT_TYPE_PPS) : static_cast<uint8_t>(h264::NAL_UNIT_TYPE_PPS);
+    std::vector<Chunk> vps, sps, pps;
+    for (const Chunk& nalUnit : getNalUnits(m_pendingParameterSets)) {
+        if (nalUnit.size == 0) {
+            continue;
+        }
+        const uint8_t type = h265 ? (nalUnit.data[0] >> 1) & 0x3f : nalUnit.data[0] & 0x1f;
+        if (h265 && type == h265::NAL_UNIT_TYPE_VPS) {
+            vps.push_back(nalUnit);
+        } else if (type == spsType) {
+            sps.push_back(nalUnit);
+        } else if (type == ppsType) {
+            pps.push_back(nalUnit);
+        }
+    }
+    // profile, tier and level are read from the fixed part at the start of the SPS
+    const std::vector<uint8_t> spsRbsp = sps.empty() ? std::vector<uint8_t>() : getRbsp(sps.front());
+    if (spsRbsp.size() < (h265 ? 15u : 4u) || pps.empty() || (h265 && vps.empty())) {
+        throw std::runtime_error("Error: the parameter set header is incomplete");
+    }
+
+    const size_t entry = beginBox(m_boxes, h265 ? "hev1" : "avc3");
+    putZeros(m_boxes, 6);
+    putU16(m_boxes, 1);  // data reference index
+    putZeros(m_boxes, 16);
+    putU16(m_boxes, static_cast<uint16_t>(m_format.width));
+    putU16(m_boxes, static_cast<uint16_t>(m_format.height));
+    putU32(m_boxes, 0x00480000);  // 72 dpi
+    putU32(m_boxes, 0x00480000);
+    putU32(m_boxes, 0);
+    putU16(m_boxes, 1);     // frame count
+    putZeros(m_boxes, 32);  // compressor name
+    putU16(m_boxes, 0x0018);
+    putU16(m_boxes, 0xffff);
+
+    auto putNalUnit = [this](const Chunk& nalUnit) {
+        putU16(m_boxes, static_cast<uint16_t>(nalUnit.size));
+        m_boxes.insert(m_boxes.end(), nalUnit.data, nalUnit.data + nalUnit.size);
+    };
+    if (!h265) {
+        const size_t avcC = beginBox(m_boxes, "avcC");
+        putU8(m_boxes, 1);
+        putU8(m_boxes, spsRbsp[1]);  // profile_idc
+        putU8(m_boxes, spsRbsp[2]);  // constraint flags
+        putU8(m_boxes, spsRbsp[3]);  // level_idc
+        putU8(m_boxes, 0xff);        // 4 byte NAL unit lengths
+        putU8(m_boxes, static_cast<uint8_t>(0xe0 | sps.size()));
+        for (const Chunk& nalUnit : sps) {
+            putNalUnit(nalUnit);
+        }
+        putU8(m_boxes, static_cast<uint8_t>(pps.size()));
+        for (const Chunk& nalUnit : pps) {
+            putNalUnit(nalUnit);
+        }
+        const uint8_t profileIdc = spsRbsp[1];
+        if (profileIdc == 100 || profileIdc == 110 || profileIdc == 122 || profileIdc == 144) {
+            putU8(m_boxes, 0xfc | 1);  // 4:2:0
+            putU8(m_boxes, 0xf8);      // 8 bit luma and chroma
+            putU8(m_boxes, 0xf8);
+            putU8(m_boxes, 0);
+        }
+        endBox(m_boxes, avcC);
+    } else {
+        const size_t hvcC = beginBox(m_boxes, "hvcC");
+        putU8(m_boxes, 1);
+        // general_profile_space ... general_level_idc of the profile_tier_level of the SPS
+        m_boxes.insert(m_boxes.end(), spsRbsp.begin() + 3, spsRbsp.begin() + 15);
+        putU16(m_boxes, 0xf000);  // min_spatial_segmentation_idc
+        putU8(m_boxes, 0xfc);     // parallelismType
+        putU8(m_boxes, 0xfc | 1);  // 4:2:0
+        putU8(m_boxes, 0xf8);      // 8 bit luma and chroma
+        putU8(m_boxes, 0xf8);
+        putU16(m_boxes, 0);  // avgFrameRate
+        const uint8_t subLayerCount = ((spsRbsp[2] >> 1) & 0x07) + 1;
+        const uint8_t temporalIdNesting = spsRbsp[2] & 0x01;
+        putU8(m_boxes, static_cast<uint8_t>((subLayerCount << 3) | (temporalIdNesting << 2) | 0x03));
+        putU8(m_boxes, 3);  // VPS, SPS and PPS arrays
+        const std::pair<uint8_t, const std::vector<Chunk>*> arrays[] = {
+            {h265::NAL_UNIT_TYPE_VPS, &vps}, {h265::NAL_UNIT_TYPE_SPS, &sps}, {h265::NAL_UNIT_TYPE_PPS, &pps}};
+        for (const auto& [type, nalUnits] : arrays) {
+            putU8(m_boxes, type);  // array_completeness 0, later parameter sets are in band
+            putU16(m_boxes, static_cast<uint16_t>(nalUnits->size()));
+            for (const Chunk& nalUnit : *nalUnits) {
+                putNalUnit(nalUnit);
+            }
+        }
+        endBox(m_boxes, hvcC);
+    }
+    endBox(m_boxes, entry);
+}
+
+// one moof box with a track run of the frames and an mdat box which references their NAL units in place
+void Mp4Muxer::writeFragment(const EncodedPacket* packets, size_t count) {
+    if (!m_initWritten) {
+        if (m_pendingParameterSets.empty()) {
+            throw std::runtime_error("Error: the stream does not start with a parameter set header");
+        }
+        writeInitSegment();
+        m_firstDts = packets[0].dts();
+    }
+    m_nalUnits.resize(count);
+    std::vector<uint32_t> sampleSizes(count);
+    uint64_t mdatSize = 8;
+    for (size_t i = 0; i < count; i++) {
+        m_nalUnits[i] = packets[i].nalUnits();
+        sampleSizes[i] = i == 0 ? static_cast<uint32_t>(m_pendingParameterSets.size()) : 0;
+        for (const h264::NalUnit& nalUnit : m_nalUnits[i]) {
+            sampleSizes[i] += 4 + static_cast<uint32_t>(nalUnit.size);
+        }
+        mdatSize += sampleSizes[i];
+    }
+
+    const size_t start = m_boxes.size();
+    const size_t moof = beginBox(m_boxes, "moof");
+    const size_t mfhd = beginFullBox(m_boxes, "mfhd", 0, 0);
+    putU32(m_boxes, ++m_sequenceNumber);
+    endBox(m_boxes, mfhd);
+    const size_t traf = beginBox(m_boxes, "traf");
+    const size_t tfhd = beginFullBox(m_boxes, "tfhd", 0, TFHD_DEFAULT_BASE_IS_MOOF);
+    putU32(m_boxes, TRACK_ID);
+    endBox(m_boxes, tfhd);
+    // with B frames the first dts is -1, the decode times start at 0 and the composition offsets make up for it
+    const size_t tfdt = beginFullBox(m_boxes, "tfdt", 1, 0);
+    putU64(m_boxes, static_cast<uint64_t>(packets[0].dts() - m_firstDts));
+    endBox(m_boxes, tfdt);
+    const size_t trun = beginFullBox(m_boxes, "trun", 1, TRUN_FLAGS);  // version 1: signed composition offsets
+    putU32(m_boxes, static_cast<uint32_t>(count));
+    const size_t dataOffset = m_boxes.size();
+    putU32(m_boxes, 0);
+    for (size_t i = 0; i < count; i++) {
+        // in units of 1 / fps, skipped static frames lengthen the frame before them; the tfdt of the next fragment
+        // places its first frame, so the last one gets a single frame
+        const int64_t duration = i + 1 < count ? packets[i + 1].dts() - packets[i].dts() : 1;
+        putU32(m_boxes, static_cast<uint32_t>(duration));
+        putU32(m_boxes, sampleSizes[i]);
+        putU32(m_boxes, packets[i].isIdr() ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NON_SYNC);
+        const int64_t compositionOffset = static_cast<int64_t>(packets[i].pts()) - packets[i].dts() + m_firstDts;
+        putU32(m_boxes, static_cast<uint32_t>(static_cast<int32_t>(compositionOffset)));
+    }
+    endBox(m_boxes, trun);
+    endBox(m_boxes, traf);
+    endBox(m_boxes, moof);
+    patchU32(m_boxes, dataOffset, static_cast<uint32_t>(m_boxes.size() - moof + 8));
+    putU32(m_boxes, static_cast<uint32_t>(mdatSize));
+    putType(m_boxes, "mdat");
+    addOwnedPiece(start);
+
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 && !m_pendingParameterSets.empty()) {
+            // in band, in front of the frame they belong to
+            const size_t offset = m_boxes.size();
+            m_boxes.insert(m_boxes.end(), m_pendingParameterSets.begin(), m_pendingParameterSets.end());
+            addOwnedPiece(offset);
+            m_pendingParameterSets.clear();
+        }
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(packets[i].data());
+        for (const h264::NalUnit& nalUnit : m_nalUnits[i]) {
+            const size_t offset = m_boxes.size();
+            putU32(m_boxes, static_cast<uint32_t>(nalUnit.size));
+            addOwnedPiece(offset);
+            m_pieces.push_back({data + nalUnit.offset, 0, nalUnit.size});
+        }
+    }
+}
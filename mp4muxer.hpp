@@ -0,0 +1,73 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "h264bitstream.hpp"
+#include "videoencoder.hpp"
+
+// Turns the Annex B packets of the encoder into a fragmented MP4 (ISO BMFF) stream, which players can open while
+// it is still being written. The moov box is written in front of the first fragment, each fragment (moof + mdat)
+// holds the frames of one call to addPackets and a new one starts at every IDR frame.
+// The parameter sets stay in band (avc3/hev1 sample entries), so resize and new SPS/PPS need no new moov box.
+class Mp4Muxer {
+   public:
+    struct Format {
+        Codec codec{Codec::H264};
+        uint32_t width{0};
+        uint32_t height{0};
+        uint32_t fps{30};  // the timescale of the track, pts and dts of the packets are in units of 1 / fps
+    };
+
+    // a piece of the output stream, either the box headers of the muxer or the payload of a packet
+    struct Chunk {
+        const uint8_t* data;
+        size_t size;
+    };
+
+    void init(const Format& format);
+    // Appends the output for packets[0..count) to chunks. The NAL units are referenced in place (only the Annex B
+    // start codes are replaced by their lengths), so the packets must not be released before the chunks are written.
+    // The chunks of the muxer stay valid until the next call.
+    void addPackets(const EncodedPacket* packets, size_t count, std::vector<Chunk>& chunks);
+
+   private:
+    // a chunk with an offset into m_boxes, which can grow while the fragment is built
+    struct Piece {
+        const uint8_t* external;
+        size_t offset;
+        size_t size;
+    };
+
+    void writeInitSegment();
+    void writeSampleEntry();
+    void writeFragment(const EncodedPacket* packets, size_t count);
+    // adds m_boxes from offset on as a piece, or extends the last piece if it ends there
+    void addOwnedPiece(size_t offset);
+
+    Format m_format;
+    std::vector<uint8_t> m_boxes;
+    std::vector<Piece> m_pieces;
+    std::vector<std::vector<h264::NalUnit>> m_nalUnits;  // of each frame of the current fragment
+    // length prefixed parameter sets of the last header packet, they go in front of the next frame
+    std::vector<uint8_t> m_pendingParameterSets;
+    bool m_initWritten{false};
+    uint32_t m_sequenceNumber{0};
+    int64_t m_firstDts{0};
+};
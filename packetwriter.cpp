@@ -0,0 +1,186 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "packetwriter.hpp"
+
+#include <array>
+#include <cassert>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#endif
+
+// maximum number of packets combined into one write call
+static const size_t MAX_BATCH_SIZE = 16;
+
+void PacketWriter::open(const std::string& fileName, uint64_t preallocateSize, size_t queueCapacity,
+                        const Mp4Muxer::Format* mp4Format) {
+    if (m_thread.joinable()) {
+        throw std::runtime_error("packet writer already open");
+    }
+#ifdef _WIN32
+    m_file = std::fopen(fileName.c_str(), "wb");
+    if (!m_file) {
+        throw std::runtime_error("failed to open file: " + fileName);
+    }
+#else
+    m_fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0) {
+        throw std::runtime_error("failed to open file: " + fileName + ": " + strerror(errno));
+    }
+    if (preallocateSize > 0) {
+        // not fatal, the file just grows on demand then
+        posix_fallocate(m_fd, 0, static_cast<off_t>(preallocateSize));
+    }
+#endif
+    m_mp4 = mp4Format != nullptr;
+    if (m_mp4) {
+        m_muxer.init(*mp4Format);
+    }
+    m_preallocateSize = preallocateSize;
+    m_bytesWritten = 0;
+    m_error = nullptr;
+    m_failed = false;
+    m_queue = std::make_unique<SpscQueue<EncodedPacket>>(queueCapacity);
+    m_thread = std::thread(&PacketWriter::run, this);
+}
+
+void PacketWriter::write(EncodedPacket&& packet) {
+    assert(m_queue);
+    if (!packet) {
+        // empty packets are the end marker of the queue
+        return;
+    }
+    m_queue->push(std::move(packet));
+    if (m_failed.load(std::memory_order_acquire)) {
+        std::rethrow_exception(m_error);
+    }
+}
+
+void PacketWriter::close() {
+    if (!m_thread.joinable()) {
+        return;
+    }
+    m_queue->push(EncodedPacket());
+    m_thread.join();
+    m_queue.reset();
+#ifdef _WIN32
+    std::fclose(m_file);
+    m_file = nullptr;
+#else
+    if (m_preallocateSize > 0) {
+        // drop the unused part of the preallocated space
+        if (ftruncate(m_fd, static_cast<off_t>(m_bytesWritten.load())) != 0 && !m_error) {
+            m_error = std::make_exception_ptr(std::runtime_error(std::string("ftruncate failed: ") + strerror(errno)));
+        }
+    }
+    ::close(m_fd);
+    m_fd = -1;
+#endif
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+}
+
+void PacketWriter::run() {
+    std::array<EncodedPacket, MAX_BATCH_SIZE> batch;
+    bool finished = false;
+    while (!finished) {
+        m_queue->waitForElements();
+        size_t count = 0;
+        while (count < batch.size() && m_queue->tryPop(batch[count])) {
+            if (!batch[count]) {
+                finished = true;
+                break;
+            }
+            count++;
+        }
+        if (!m_failed.load(std::memory_order_relaxed)) {
+            try {
+                writeBatch(batch.data(), count);
+            } catch (const std::exception&) {
+                // keep consuming, so the encoder does not block on pinned packets
+                m_error = std::current_exception();
+                m_failed.store(true, std::memory_order_release);
+            }
+        }
+        // hand the bitstream regions back to the encoder
+        for (size_t i = 0; i < count; i++) {
+            batch[i].release();
+        }
+    }
+}
+
+void PacketWriter::writeBatch(EncodedPacket* packets, size_t count) {
+    m_chunks.clear();
+    if (m_mp4) {
+        m_muxer.addPackets(packets, count, m_chunks);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            m_chunks.push_back({reinterpret_cast<const uint8_t*>(packets[i].data()), packets[i].size()});
+        }
+    }
+#ifdef _WIN32
+    for (const Mp4Muxer::Chunk& chunk : m_chunks) {
+        if (std::fwrite(chunk.data, 1, chunk.size, m_file) != chunk.size) {
+            throw std::runtime_error("failed to write packet");
+        }
+        m_bytesWritten += chunk.size;
+    }
+    std::fflush(m_file);
+#else
+    m_iov.resize(m_chunks.size());
+    size_t remaining = 0;
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+        m_iov[i].iov_base = const_cast<uint8_t*>(m_chunks[i].data);
+        m_iov[i].iov_len = m_chunks[i].size;
+        remaining += m_chunks[i].size;
+    }
+    iovec* first = m_iov.data();
+    int iovCount = static_cast<int>(m_iov.size());
+    while (remaining > 0) {
+        // an MP4 fragment with many slices can have more buffers than a single call takes
+        const ssize_t written = writev(m_fd, first, std::min(iovCount, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("writev failed: ") + strerror(errno));
+        }
+        m_bytesWritten += written;
+        remaining -= written;
+        // skip the fully written buffers and continue with the partially written one
+        size_t skip = static_cast<size_t>(written);
+        while (iovCount > 0 && skip >= first->iov_len) {
+            skip -= first->iov_len;
+            first++;
+            iovCount--;
+        }
+        if (iovCount > 0) {
+            first->iov_base = static_cast<char*>(first->iov_base) + skip;
+            first->iov_len -= skip;
+        }
+    }
+#endif
+}
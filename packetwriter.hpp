@@ -0,0 +1,81 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#include "mp4muxer.hpp"
+#include "spscqueue.hpp"
+#include "videoencoder.hpp"
+
+// Writes encoded packets to a file on its own thread, so slow storage does not stall the encoder.
+// Packets are written in batches with a single writev call and released afterwards.
+// With an Mp4Muxer::Format the file is a fragmented MP4, muxed on the writer thread with one fragment per batch.
+// write is called from one producer thread only.
+class PacketWriter {
+   public:
+    // preallocateSize reserves file space up front (POSIX only), the file is truncated to the written size on close
+    // mp4Format selects the fragmented MP4 container, the file is an Annex B elementary stream without it
+    void open(const std::string& fileName, uint64_t preallocateSize = 0, size_t queueCapacity = 64,
+              const Mp4Muxer::Format* mp4Format = nullptr);
+    // blocks if the queue is full, rethrows a previous write error
+    void write(EncodedPacket&& packet);
+    // writes all queued packets and closes the file
+    void close();
+
+    uint64_t getBytesWritten() const { return m_bytesWritten; }
+
+    ~PacketWriter() {
+        if (m_thread.joinable()) {
+            try {
+                close();
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+   private:
+    void run();
+    void writeBatch(EncodedPacket* packets, size_t count);
+
+    std::unique_ptr<SpscQueue<EncodedPacket>> m_queue;
+    bool m_mp4{false};
+    Mp4Muxer m_muxer;
+    std::vector<Mp4Muxer::Chunk> m_chunks;  // of the current batch, only used by the writer thread
+    std::thread m_thread;
+    // set by the writer thread, m_error is only read after m_failed was seen
+    std::exception_ptr m_error;
+    std::atomic<bool> m_failed{false};
+#ifdef _WIN32
+    std::FILE* m_file{nullptr};
+#else
+    int m_fd{-1};
+    std::vector<iovec> m_iov;
+#endif
+    uint64_t m_preallocateSize{0};
+    std::atomic<uint64_t> m_bytesWritten{0};
+};
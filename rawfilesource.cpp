@@ -0,0 +1,381 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "rawfilesource.hpp"
+
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+#include "utility.hpp"
+
+// plane offsets in the staging buffers, for the copy commands
+static const VkDeviceSize STAGING_PLANE_ALIGNMENT = 16;
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+bool RawFileSource::parseFormat(const std::string& name, Format& format) {
+    if (name == "nv12") {
+        format = Format::NV12;
+    } else if (name == "i420") {
+        format = Format::I420;
+    } else if (name == "rgba") {
+        format = Format::RGBA;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+size_t RawFileSource::getFrameSize(Format format, uint32_t width, uint32_t height) {
+    const size_t pixelCount = static_cast<size_t>(width) * height;
+    return format == Format::RGBA ? pixelCount * 4 : pixelCount * 3 / 2;
+}
+
+void RawFileSource::open(EncoderDevice& encoderDevice, VideoEncoder& encoder, const std::string& fileName,
+                         Format format, uint32_t width, uint32_t height, uint32_t stagingBufferCount) {
+    if (m_open) {
+        throw std::runtime_error("raw file source already open");
+    }
+    if (format != Format::RGBA && (width % 2 != 0 || height % 2 != 0)) {
+        throw std::runtime_error("Error: 4:2:0 frames need an even width and height");
+    }
+    assert(stagingBufferCount > 0);
+    m_encoderDevice = &encoderDevice;
+    m_encoder = &encoder;
+    m_device = encoderDevice.getDevice();
+    m_allocator = encoderDevice.getAllocator();
+    m_format = format;
+    m_width = width;
+    m_height = height;
+    m_frameSize = getFrameSize(format, width, height);
+
+    // the staging buffers have the plane layout of the target image
+    const VkDeviceSize lumaSize = static_cast<VkDeviceSize>(width) * height;
+    std::vector<VkDeviceSize> planeSizes;
+    if (format == Format::RGBA) {
+        planeSizes = {lumaSize * 4};
+    } else if (encoder.getYCbCrPlaneCount() == 2) {
+        planeSizes = {lumaSize, lumaSize / 2};
+    } else {
+        planeSizes = {lumaSize, lumaSize / 4, lumaSize / 4};
+    }
+    m_planeCount = static_cast<uint32_t>(planeSizes.size());
+    m_planeOffsets.resize(m_planeCount);
+    VkDeviceSize stagingSize = 0;
+    for (uint32_t p = 0; p < m_planeCount; p++) {
+        m_planeOffsets[p] = alignUp(stagingSize, STAGING_PLANE_ALIGNMENT);
+        stagingSize = m_planeOffsets[p] + planeSizes[p];
+    }
+
+    mapFile(fileName);
+    m_frameCount = static_cast<uint32_t>(m_fileSize / m_frameSize);
+
+    // the upload command buffers are recorded for each frame
+    const VkCommandPoolCreateInfo poolInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                                           .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+                                           .queueFamilyIndex = encoderDevice.getComputeQueueFamily()};
+    VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_commandPool));
+    m_stagingBuffers.resize(stagingBufferCount);
+    for (StagingBuffer& staging : m_stagingBuffers) {
+        createStagingBuffer(staging, stagingSize);
+    }
+    m_nextStagingBuffer = 0;
+    m_open = true;
+}
+
+void RawFileSource::createStagingBuffer(StagingBuffer& staging, VkDeviceSize size) {
+    const VkBufferCreateInfo bufferInfo{.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                                        .size = size,
+                                        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                        .sharingMode = VK_SHARING_MODE_EXCLUSIVE};
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &bufferInfo, &allocInfo, &staging.buffer, &staging.allocation, nullptr));
+    VK_CHECK(vmaMapMemory(m_allocator, staging.allocation, reinterpret_cast<void**>(&staging.data)));
+
+    const VkCommandBufferAllocateInfo commandBufferInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                                                        .commandPool = m_commandPool,
+                                                        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                                                        .commandBufferCount = 1};
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &commandBufferInfo, &staging.commandBuffer));
+    const VkFenceCreateInfo fenceInfo{.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &staging.fence));
+    staging.submitted = false;
+
+    if (m_format != Format::RGBA) {
+        return;
+    }
+    // RGBA frames are uploaded into an input image of the conversion per staging buffer
+    const VkImageCreateInfo imageInfo{.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                                      .imageType = VK_IMAGE_TYPE_2D,
+                                      .format = VK_FORMAT_R8G8B8A8_UNORM,
+                                      .extent = {m_width, m_height, 1},
+                                      .mipLevels = 1,
+                                      .arrayLayers = 1,
+                                      .samples = VK_SAMPLE_COUNT_1_BIT,
+                                      .tiling = VK_IMAGE_TILING_OPTIMAL,
+                                      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
+                                      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                                      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED};
+    VmaAllocationCreateInfo imageAllocInfo = {};
+    imageAllocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    VK_CHECK(vmaCreateImage(m_allocator, &imageInfo, &imageAllocInfo, &staging.image, &staging.imageAllocation,
+                            nullptr));
+    const VkImageViewCreateInfo viewInfo{.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                                         .image = staging.image,
+                                         .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                                         .format = VK_FORMAT_R8G8B8A8_UNORM,
+                                         .subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}};
+    VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &staging.imageView));
+    staging.inputIx = m_encoder->registerInputImage({.image = staging.image,
+                                                     .imageView = staging.imageView,
+                                                     .layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                     .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                                     .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT});
+}
+
+void RawFileSource::queueFrame(uint32_t frameIndex) {
+    assert(m_open && frameIndex < m_frameCount);
+    StagingBuffer& staging = m_stagingBuffers[m_nextStagingBuffer];
+    m_nextStagingBuffer = (m_nextStagingBuffer + 1) % m_stagingBuffers.size();
+    if (staging.submitted) {
+        VK_CHECK(vkWaitForFences(m_device, 1, &staging.fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+        VK_CHECK(vkResetFences(m_device, 1, &staging.fence));
+        staging.submitted = false;
+    }
+    copyFrame(m_fileData + static_cast<size_t>(frameIndex) * m_frameSize, staging.data);
+    VK_CHECK(vmaFlushAllocation(m_allocator, staging.allocation, 0, VK_WHOLE_SIZE));
+
+    if (m_format == Format::RGBA) {
+        // the conversion of queueEncode is submitted after the upload to the same queue
+        uploadFrame(staging, staging.image);
+        m_encoder->queueEncode(staging.inputIx);
+    } else {
+        const VideoEncoder::YCbCrInputFrame frame = m_encoder->acquireYCbCrInputFrame();
+        uploadFrame(staging, frame.image);
+        m_encoder->queueYCbCrEncode();
+    }
+}
+
+void RawFileSource::copyFrame(const uint8_t* src, uint8_t* dst) const {
+    if (m_format == Format::RGBA) {
+        memcpy(dst, src, m_frameSize);
+        return;
+    }
+    const size_t lumaSize = static_cast<size_t>(m_width) * m_height;
+    const size_t chromaSize = lumaSize / 4;  // of one chroma component
+    const uint8_t* srcChroma = src + lumaSize;
+    memcpy(dst, src, lumaSize);
+    if (m_format == Format::NV12 && m_planeCount == 2) {
+        memcpy(dst + m_planeOffsets[1], srcChroma, chromaSize * 2);
+    } else if (m_format == Format::I420 && m_planeCount == 3) {
+        memcpy(dst + m_planeOffsets[1], srcChroma, chromaSize);
+        memcpy(dst + m_planeOffsets[2], srcChroma + chromaSize, chromaSize);
+    } else if (m_format == Format::I420) {
+        // interleave Cb and Cr for the 2 plane image
+        uint8_t* cbCr = dst + m_planeOffsets[1];
+        for (size_t i = 0; i < chromaSize; i++) {
+            cbCr[2 * i] = srcChroma[i];
+            cbCr[2 * i + 1] = srcChroma[chromaSize + i];
+        }
+    } else {
+        // split the interleaved chroma for the 3 plane image
+        uint8_t* cb = dst + m_planeOffsets[1];
+        uint8_t* cr = dst + m_planeOffsets[2];
+        for (size_t i = 0; i < chromaSize; i++) {
+            cb[i] = srcChroma[2 * i];
+            cr[i] = srcChroma[2 * i + 1];
+        }
+    }
+}
+
+void RawFileSource::uploadFrame(StagingBuffer& staging, VkImage image) {
+    VkCommandBuffer cmdBuf = staging.commandBuffer;
+    VK_CHECK(vkResetCommandBuffer(cmdBuf, 0));
+    const VkCommandBufferBeginInfo beginInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                                             .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT};
+    VK_CHECK(vkBeginCommandBuffer(cmdBuf, &beginInfo));
+
+    // The previous content is not needed: the previous frame of a YCbCr image is encoded, an RGBA image may
+    // still be read by the conversion of an earlier frame on this queue. The YCbCr images are written in the
+    // general layout the encoder expects.
+    const bool rgba = m_format == Format::RGBA;
+    const VkImageLayout layout = rgba ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+    const std::array<VkImageAspectFlags, 3> planeAspects = {VK_IMAGE_ASPECT_PLANE_0_BIT, VK_IMAGE_ASPECT_PLANE_1_BIT,
+                                                            VK_IMAGE_ASPECT_PLANE_2_BIT};
+    VkImageAspectFlags aspectMask = rgba ? VK_IMAGE_ASPECT_COLOR_BIT : 0;
+    for (uint32_t p = 0; p < m_planeCount && !rgba; p++) {
+        aspectMask |= planeAspects[p];
+    }
+    const VkImageMemoryBarrier2 imageMemoryBarrier{
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .srcStageMask = rgba ? VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_2_NONE,
+        .srcAccessMask = VK_ACCESS_2_NONE,
+        .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = layout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange = {
+            .aspectMask = aspectMask,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        }};
+    const VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
+                                             .imageMemoryBarrierCount = 1,
+                                             .pImageMemoryBarriers = &imageMemoryBarrier};
+    vkCmdPipelineBarrier2(cmdBuf, &dependencyInfo);
+
+    // one region per plane, the chroma planes have half the size
+    std::array<VkBufferImageCopy, 3> regions{};
+    for (uint32_t p = 0; p < m_planeCount; p++) {
+        regions[p].bufferOffset = m_planeOffsets[p];
+        regions[p].imageSubresource = {rgba ? VK_IMAGE_ASPECT_COLOR_BIT : planeAspects[p], 0, 0, 1};
+        regions[p].imageExtent = p == 0 ? VkExtent3D{m_width, m_height, 1} : VkExtent3D{m_width / 2, m_height / 2, 1};
+    }
+    vkCmdCopyBufferToImage(cmdBuf, staging.buffer, image, layout, m_planeCount, regions.data());
+    VK_CHECK(vkEndCommandBuffer(cmdBuf));
+
+    const VkCommandBufferSubmitInfo commandBufferInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                                                      .commandBuffer = cmdBuf};
+    const VkSubmitInfo2 submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                                   .commandBufferInfoCount = 1,
+                                   .pCommandBufferInfos = &commandBufferInfo};
+    m_encoderDevice->submitCompute(submitInfo, staging.fence);
+    staging.submitted = true;
+}
+
+void RawFileSource::close() {
+    if (!m_open) {
+        return;
+    }
+    for (StagingBuffer& staging : m_stagingBuffers) {
+        if (staging.submitted) {
+            VK_CHECK(vkWaitForFences(m_device, 1, &staging.fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+        }
+        if (m_format == Format::RGBA) {
+            // waits for the last conversion from the image
+            m_encoder->unregisterInputImage(staging.inputIx);
+            vkDestroyImageView(m_device, staging.imageView, nullptr);
+            vmaDestroyImage(m_allocator, staging.image, staging.imageAllocation);
+        }
+        vkDestroyFence(m_device, staging.fence, nullptr);
+        vmaUnmapMemory(m_allocator, staging.allocation);
+        vmaDestroyBuffer(m_allocator, staging.buffer, staging.allocation);
+    }
+    m_stagingBuffers.clear();
+    // frees the command buffers
+    vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+    unmapFile();
+    m_open = false;
+}
+
+void RawFileSource::mapFile(const std::string& fileName) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("failed to open file: " + fileName);
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw std::runtime_error("failed to get the size of file: " + fileName);
+    }
+    m_fileHandle = file;
+    m_fileSize = static_cast<size_t>(size.QuadPart);
+    if (m_fileSize == 0) {
+        // empty files cannot be mapped
+        return;
+    }
+    m_mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mappingHandle) {
+        m_fileData = static_cast<const uint8_t*>(MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (!m_fileData) {
+        unmapFile();
+        throw std::runtime_error("failed to map file: " + fileName);
+    }
+#else
+    const int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("failed to open file: " + fileName + ": " + strerror(errno));
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        ::close(fd);
+        throw std::runtime_error("failed to stat file: " + fileName + ": " + strerror(errno));
+    }
+    m_fileSize = static_cast<size_t>(fileStat.st_size);
+    if (m_fileSize == 0) {
+        // empty files cannot be mapped
+        ::close(fd);
+        return;
+    }
+    void* data = mmap(nullptr, m_fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid without the descriptor
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("failed to map file: " + fileName + ": " + strerror(errno));
+    }
+    // the frames are read once from front to back, not fatal if the hint is not supported
+    madvise(data, m_fileSize, MADV_SEQUENTIAL);
+    m_fileData = static_cast<const uint8_t*>(data);
+#endif
+}
+
+void RawFileSource::unmapFile() {
+#ifdef _WIN32
+    if (m_fileData) {
+        UnmapViewOfFile(m_fileData);
+    }
+    if (m_mappingHandle) {
+        CloseHandle(m_mappingHandle);
+    }
+    if (m_fileHandle) {
+        CloseHandle(m_fileHandle);
+    }
+    m_mappingHandle = nullptr;
+    m_fileHandle = nullptr;
+#else
+    if (m_fileData) {
+        munmap(const_cast<uint8_t*>(m_fileData), m_fileSize);
+    }
+#endif
+    m_fileData = nullptr;
+    m_fileSize = 0;
+}
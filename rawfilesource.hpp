@@ -0,0 +1,101 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#define VK_NO_PROTOTYPES
+#include <vma/vk_mem_alloc.h>
+#include <volk/volk.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "encoderdevice.hpp"
+#include "videoencoder.hpp"
+
+// Encodes the raw frames of a file. The file is memory mapped, each frame is copied into one of a ring of
+// persistently mapped staging buffers and uploaded on the compute queue, so the copy of the next frame on the host
+// overlaps the upload, conversion and encoding of the previous ones. NV12 and I420 frames are uploaded into the
+// YCbCr source images of the encoder (Config::directYCbCrInput, the chroma planes are (de)interleaved while copying
+// into the staging buffer if the encoder uses the other layout), RGBA frames into input images of the conversion.
+class RawFileSource {
+   public:
+    enum class Format { NV12, I420, RGBA };
+
+    // "nv12", "i420" or "rgba", returns false for any other name
+    static bool parseFormat(const std::string& name, Format& format);
+    static size_t getFrameSize(Format format, uint32_t width, uint32_t height);
+
+    // The encoder is initialized with the size of the frames and without input images, with
+    // Config::directYCbCrInput for NV12 and I420. Both have to outlive the source.
+    void open(EncoderDevice& encoderDevice, VideoEncoder& encoder, const std::string& fileName, Format format,
+              uint32_t width, uint32_t height, uint32_t stagingBufferCount = 4);
+    // complete frames in the file
+    uint32_t getFrameCount() const { return m_frameCount; }
+    // Uploads the frame and queues it for encoding, blocks while its staging buffer is still being uploaded.
+    // Like VideoEncoder::queueEncode it must not be called while the pipeline of the encoder is full.
+    void queueFrame(uint32_t frameIndex);
+    // waits for the uploads and conversions, must be called before the encoder is deinitialized
+    void close();
+
+    ~RawFileSource() { close(); }
+
+   private:
+    struct StagingBuffer {
+        VkBuffer buffer;
+        VmaAllocation allocation;
+        uint8_t* data;  // persistently mapped
+        VkCommandBuffer commandBuffer;
+        VkFence fence;
+        bool submitted{false};
+        // RGBA only: the input image of the conversion the buffer is uploaded into
+        VkImage image;
+        VmaAllocation imageAllocation;
+        VkImageView imageView;
+        uint32_t inputIx;
+    };
+
+    void mapFile(const std::string& fileName);
+    void unmapFile();
+    void createStagingBuffer(StagingBuffer& staging, VkDeviceSize size);
+    void copyFrame(const uint8_t* src, uint8_t* dst) const;
+    // records and submits the copy of the staging buffer into the image
+    void uploadFrame(StagingBuffer& staging, VkImage image);
+
+    bool m_open{false};
+    EncoderDevice* m_encoderDevice;
+    VideoEncoder* m_encoder;
+    VkDevice m_device;
+    VmaAllocator m_allocator;
+    Format m_format;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_planeCount;  // of the staging layout: 2 or 3 YCbCr planes as the encoder uses them, 1 for RGBA
+    std::vector<VkDeviceSize> m_planeOffsets;  // in the staging buffer
+    size_t m_frameSize;                        // in the file
+    uint32_t m_frameCount;
+
+    const uint8_t* m_fileData{nullptr};
+    size_t m_fileSize{0};
+#ifdef _WIN32
+    void* m_fileHandle{nullptr};
+    void* m_mappingHandle{nullptr};
+#endif
+
+    VkCommandPool m_commandPool;
+    std::vector<StagingBuffer> m_stagingBuffers;
+    uint32_t m_nextStagingBuffer{0};
+};
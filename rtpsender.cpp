@@ -0,0 +1,196 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "rtpsender.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+#include "h264bitstream.hpp"
+
+static const uint8_t RTP_PAYLOAD_TYPE = 96;
+static const uint32_t RTP_CLOCK_RATE = 90000;
+static const size_t RTP_HEADER_SIZE = 12;
+
+// NAL unit types of the fragmentation units
+static const uint8_t H264_FU_A = 28;
+static const uint8_t H265_FU = 49;
+
+void RtpSender::open(const std::string& host, uint16_t port, Codec codec, uint32_t fps, size_t mtu) {
+#ifdef _WIN32
+    throw std::runtime_error("Error: RTP output is not supported on Windows");
+#else
+    assert(fps > 0);
+    if (m_fd >= 0) {
+        throw std::runtime_error("RTP sender already open");
+    }
+    // leaves room for the headers and at least one byte of payload in every fragment
+    if (mtu <= RTP_HEADER_SIZE + 3) {
+        throw std::runtime_error("Error: the RTP MTU is too small");
+    }
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* addresses = nullptr;
+    const int result = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+    if (result != 0) {
+        throw std::runtime_error("failed to resolve " + host + ": " + gai_strerror(result));
+    }
+    for (addrinfo* address = addresses; address && m_fd < 0; address = address->ai_next) {
+        m_fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (m_fd >= 0 && connect(m_fd, address->ai_addr, address->ai_addrlen) != 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (m_fd < 0) {
+        throw std::runtime_error("failed to open UDP socket to " + host + ": " + strerror(errno));
+    }
+    m_host = host;
+    m_port = port;
+    m_codec = codec;
+    m_fps = fps;
+    m_mtu = mtu;
+    // random start values as recommended by RFC 3550
+    std::random_device random;
+    m_sequenceNumber = static_cast<uint16_t>(random());
+    m_ssrc = random();
+    m_packetsSent = 0;
+#endif
+}
+
+void RtpSender::close() {
+#ifndef _WIN32
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+#endif
+}
+
+std::string RtpSender::getSdp() const {
+    const bool ipv6 = m_host.find(':') != std::string::npos;
+    const char* encoding = m_codec == Codec::H265 ? "H265" : "H264";
+    std::string sdp = "v=0\r\n";
+    sdp += std::string("o=- 0 0 IN ") + (ipv6 ? "IP6 " : "IP4 ") + m_host + "\r\n";
+    sdp += "s=hwenc\r\n";
+    sdp += std::string("c=IN ") + (ipv6 ? "IP6 " : "IP4 ") + m_host + "\r\n";
+    sdp += "t=0 0\r\n";
+    sdp += "m=video " + std::to_string(m_port) + " RTP/AVP " + std::to_string(RTP_PAYLOAD_TYPE) + "\r\n";
+    sdp += "a=rtpmap:" + std::to_string(RTP_PAYLOAD_TYPE) + " " + encoding + "/" + std::to_string(RTP_CLOCK_RATE) +
+           "\r\n";
+    if (m_codec == Codec::H264) {
+        sdp += "a=fmtp:" + std::to_string(RTP_PAYLOAD_TYPE) + " packetization-mode=1\r\n";
+    }
+    return sdp;
+}
+
+void RtpSender::send(const EncodedPacket& packet) {
+    assert(m_fd >= 0);
+    // the parameter sets carry the pts of the frame they belong to
+    const uint32_t timestamp = static_cast<uint32_t>(packet.pts() * RTP_CLOCK_RATE / m_fps);
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(packet.data());
+    const std::vector<h264::NalUnit> nalUnits = packet.nalUnits();
+    const size_t nalHeaderSize = m_codec == Codec::H265 ? 2 : 1;
+    const size_t maxPayloadSize = m_mtu - RTP_HEADER_SIZE;
+    for (size_t i = 0; i < nalUnits.size(); i++) {
+        const uint8_t* nal = data + nalUnits[i].offset;
+        const size_t nalSize = nalUnits[i].size;
+        if (nalSize < nalHeaderSize) {
+            continue;
+        }
+        // the last packet of a frame ends the access unit
+        const bool lastNalUnit = i + 1 == nalUnits.size() && !packet.isParameterSet();
+        if (nalSize <= maxPayloadSize) {
+            sendPacket(nullptr, 0, nal, nalSize, timestamp, lastNalUnit);
+            continue;
+        }
+        // fragmentation unit: payload header, FU header with the start and end bits, the NAL unit without its header
+        uint8_t fuHeaders[3];
+        size_t fuHeaderSize;
+        if (m_codec == Codec::H265) {
+            fuHeaders[0] = static_cast<uint8_t>((nal[0] & 0x81) | (H265_FU << 1));
+            fuHeaders[1] = nal[1];
+            fuHeaders[2] = (nal[0] >> 1) & 0x3f;
+            fuHeaderSize = 3;
+        } else {
+            fuHeaders[0] = static_cast<uint8_t>((nal[0] & 0xe0) | H264_FU_A);
+            fuHeaders[1] = nal[0] & 0x1f;
+            fuHeaderSize = 2;
+        }
+        const uint8_t nalType = fuHeaders[fuHeaderSize - 1];
+        const size_t fragmentSize = maxPayloadSize - fuHeaderSize;
+        for (size_t offset = nalHeaderSize; offset < nalSize; offset += fragmentSize) {
+            const size_t size = std::min(fragmentSize, nalSize - offset);
+            const bool start = offset == nalHeaderSize;
+            const bool end = offset + size == nalSize;
+            fuHeaders[fuHeaderSize - 1] = static_cast<uint8_t>((start ? 0x80 : 0) | (end ? 0x40 : 0) | nalType);
+            sendPacket(fuHeaders, fuHeaderSize, nal + offset, size, timestamp, end && lastNalUnit);
+        }
+    }
+}
+
+void RtpSender::sendPacket(const uint8_t* payloadHeader, size_t payloadHeaderSize, const uint8_t* payload,
+                           size_t payloadSize, uint32_t timestamp, bool marker) {
+#ifndef _WIN32
+    uint8_t header[RTP_HEADER_SIZE + 3];
+    header[0] = 0x80;  // version 2
+    header[1] = static_cast<uint8_t>((marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE);
+    header[2] = static_cast<uint8_t>(m_sequenceNumber >> 8);
+    header[3] = static_cast<uint8_t>(m_sequenceNumber);
+    for (int i = 0; i < 4; i++) {
+        header[4 + i] = static_cast<uint8_t>(timestamp >> (24 - 8 * i));
+        header[8 + i] = static_cast<uint8_t>(m_ssrc >> (24 - 8 * i));
+    }
+    assert(payloadHeaderSize <= 3);
+    if (payloadHeaderSize > 0) {
+        memcpy(header + RTP_HEADER_SIZE, payloadHeader, payloadHeaderSize);
+    }
+    iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = RTP_HEADER_SIZE + payloadHeaderSize;
+    iov[1].iov_base = const_cast<uint8_t*>(payload);
+    iov[1].iov_len = payloadSize;
+    msghdr message = {};
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+    while (sendmsg(m_fd, &message, 0) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        // ICMP port unreachable of an earlier packet, the receiver is not running (yet)
+        if (errno == ECONNREFUSED) {
+            break;
+        }
+        throw std::runtime_error(std::string("sendmsg failed: ") + strerror(errno));
+    }
+    m_sequenceNumber++;
+    m_packetsSent++;
+#endif
+}
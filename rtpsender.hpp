@@ -0,0 +1,57 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "videoencoder.hpp"
+
+// Sends the packets of the encoder as RTP over UDP: RFC 6184 (H.264, packetization mode 1) or RFC 7798 (H.265),
+// payload type 96 with the 90 kHz clock derived from the pts. NAL units which fit into the MTU are sent as single
+// NAL unit packets, larger ones as fragmentation units. The payload is sent from the packet buffer with sendmsg,
+// only the RTP and fragmentation unit headers are written by the sender.
+// send is called from one thread only, POSIX only.
+class RtpSender {
+   public:
+    // mtu is the maximum size of an RTP packet, without the IP and UDP headers
+    void open(const std::string& host, uint16_t port, Codec codec, uint32_t fps, size_t mtu = 1200);
+    void send(const EncodedPacket& packet);
+    void close();
+
+    bool isOpen() const { return m_fd >= 0; }
+    // session description for receivers, e.g. ffplay -protocol_whitelist file,udp,rtp hwenc.sdp
+    std::string getSdp() const;
+    uint64_t getPacketsSent() const { return m_packetsSent; }
+
+    ~RtpSender() { close(); }
+
+   private:
+    // payloadHeader are the fragmentation unit headers in front of the payload, if any
+    void sendPacket(const uint8_t* payloadHeader, size_t payloadHeaderSize, const uint8_t* payload,
+                    size_t payloadSize, uint32_t timestamp, bool marker);
+
+    int m_fd{-1};
+    std::string m_host;
+    uint16_t m_port{0};
+    Codec m_codec{Codec::H264};
+    uint32_t m_fps{30};
+    size_t m_mtu{1200};
+    uint16_t m_sequenceNumber{0};
+    uint32_t m_ssrc{0};
+    uint64_t m_packetsSent{0};
+};
@@ -0,0 +1,70 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// The counters are only ever increased, their difference is the number of queued elements.
+// Both sides can block on them with std::atomic::wait.
+template <typename T>
+class SpscQueue {
+   public:
+    explicit SpscQueue(size_t capacity) : m_elements(capacity) { assert(capacity > 0); }
+
+    size_t capacity() const { return m_elements.size(); }
+
+    // producer side
+    bool tryPush(T&& element) {
+        const size_t pushed = m_pushed.load(std::memory_order_relaxed);
+        if (pushed - m_popped.load(std::memory_order_acquire) == m_elements.size()) {
+            return false;
+        }
+        m_elements[pushed % m_elements.size()] = std::move(element);
+        m_pushed.store(pushed + 1, std::memory_order_release);
+        m_pushed.notify_one();
+        return true;
+    }
+    void push(T&& element) {
+        while (!tryPush(std::move(element))) {
+            // wait until the consumer has taken something out
+            m_popped.wait(m_pushed.load(std::memory_order_relaxed) - m_elements.size(), std::memory_order_acquire);
+        }
+    }
+
+    // consumer side
+    bool tryPop(T& element) {
+        const size_t popped = m_popped.load(std::memory_order_relaxed);
+        if (popped == m_pushed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        element = std::move(m_elements[popped % m_elements.size()]);
+        m_popped.store(popped + 1, std::memory_order_release);
+        m_popped.notify_one();
+        return true;
+    }
+    // blocks until the queue is not empty
+    void waitForElements() { m_pushed.wait(m_popped.load(std::memory_order_relaxed), std::memory_order_acquire); }
+
+   private:
+    std::vector<T> m_elements;
+    alignas(64) std::atomic<size_t> m_pushed{0};
+    alignas(64) std::atomic<size_t> m_popped{0};
+};
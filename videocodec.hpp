@@ -0,0 +1,113 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#define VK_NO_PROTOTYPES
+#include <volk/volk.h>
+
+#include <cstdint>
+
+#include "encoderdevice.hpp"
+
+// video coding standard of a VideoEncoder session
+enum class Codec { H264, H265 };
+
+// Codec specific part of a VideoEncoder session (H264Codec, H265Codec): the codec profile, the parameter sets, the
+// rate control structures, the picture syntax and the reference picture management. The encoder decides the picture
+// types, the references and the slices, the codec turns them into the structures of its Vulkan extension.
+// The returned structures point into the codec and stay valid until the same method is called again.
+class VideoCodec {
+   public:
+    static const uint32_t MAX_TEMPORAL_LAYERS = 4;
+
+    enum class PictureType { IDR, I, P, B };
+
+    // stream parameters of the session, validated by the encoder
+    struct StreamConfig {
+        int32_t profileIdc;  // StdVideoH264ProfileIdc or StdVideoH265ProfileIdc
+        int32_t levelIdc;    // StdVideoH264LevelIdc or StdVideoH265LevelIdc
+        uint32_t fps;
+        uint32_t dpbSlotCount;  // the references and the picture being encoded
+        uint32_t referenceFrameCount;
+        uint32_t longTermReferenceCount;
+        uint32_t bFrameCount;
+        uint32_t temporalLayerCount;
+        bool bt709;  // BT.709 or BT.601 colour description
+        bool fullRange;
+    };
+
+    // codec capabilities of the implementation
+    struct Limits {
+        int32_t minQp;
+        int32_t maxQp;
+        uint32_t maxPPictureL0ReferenceCount;
+        uint32_t maxBPictureL0ReferenceCount;
+        uint32_t maxL1ReferenceCount;
+        uint32_t maxTemporalLayerCount;
+        uint32_t maxSliceCount;
+        bool differentSliceTypes;  // I and P slices in one picture, for intra refresh
+        uint32_t blockSize;        // height of the block rows slices consist of (macroblocks, coding tree blocks)
+    };
+
+    // one frame as decided by the encoder
+    struct Picture {
+        PictureType type;
+        bool isReference;
+        bool markLongTerm;
+        uint32_t frameIndex;      // in display order
+        uint32_t framesSinceIdr;  // in display order, the picture order count is derived from it
+        uint32_t temporalId;
+        int32_t constantQp;  // 0 with rate control
+        uint32_t sliceCount;
+        int32_t intraSliceIndex;  // slice coded as I slice in a P picture, -1 for none
+        uint32_t maxL0References;
+        uint32_t maxL1References;  // B pictures only
+    };
+
+    virtual ~VideoCodec() = default;
+
+    virtual VkVideoCodecOperationFlagBitsKHR getCodecOperation() const = 0;
+    virtual const VkExtensionProperties& getStdHeaderVersion() const = 0;
+    // codec profile info of the video profile, chained in front of pNext
+    virtual const void* getProfileInfo(int32_t profileIdc, const void* pNext) = 0;
+    virtual Limits getLimits(const EncoderDevice::EncodeCapabilities& caps) const = 0;
+    // starts a session, throws if the codec cannot encode the stream
+    virtual void init(const EncoderDevice::EncodeCapabilities& caps, const StreamConfig& config) = 0;
+
+    // parameter sets of the coded size as VkVideoSessionParametersCreateInfoKHR chain
+    virtual const void* getSessionParametersCreateInfo(uint32_t width, uint32_t height) = 0;
+    // chains of vkGetEncodedVideoSessionParametersKHR, all parameter sets are written
+    virtual const void* getSessionParametersGetInfo() = 0;
+    virtual void* getSessionParametersFeedbackInfo() = 0;
+    // VkVideoEncodeRateControlInfoKHR chain with layerCount rate control layers (0 without rate control) and the
+    // one of each layer; they are referenced by every frame of the session
+    virtual const void* getRateControlInfo(uint32_t gopFrameCount, uint32_t idrPeriod, uint32_t layerCount) = 0;
+    virtual const void* getRateControlLayerInfo(uint32_t layer) = 0;
+
+    // Starts a picture and returns the DPB slot for its reconstruction, -1 for non-reference pictures.
+    virtual int32_t beginPicture(const Picture& picture) = 0;
+    // DPB slot info of a slot holding a reference or of the setup slot of the current picture, nullptr otherwise
+    virtual const void* getDpbSlotInfo(uint32_t slot) = 0;
+    // true if a reference list of the current picture contains the slot
+    virtual bool isReferenced(uint32_t slot) const = 0;
+    // VkVideoEncodeInfoKHR chain of the current picture
+    virtual const void* getPictureInfo() = 0;
+    // stores the current picture as reference once it is recorded
+    virtual void endPicture() = 0;
+    // Loss recovery: marks the references after frameIndex as unusable, returns false if no usable reference of the
+    // base temporal layer is left.
+    virtual bool invalidateAfter(uint32_t frameIndex) = 0;
+};
@@ -16,118 +16,584 @@
 
 #include "videoencoder.hpp"
 
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
+#include <cmath>
+#include <cstdio>
 
+#include "h264codec.hpp"
+#include "h265codec.hpp"
 #include "utility.hpp"
 
-void VideoEncoder::init(VkPhysicalDevice physicalDevice, VkDevice device, VmaAllocator allocator,
-                        uint32_t computeQueueFamily, VkQueue computeQueue, VkCommandPool computeCommandPool,
-                        uint32_t encodeQueueFamily, VkQueue encodeQueue, const std::vector<VkImage>& inputImages,
+static void addStageDuration(VideoEncoder::StageDuration& stage, double ms) {
+    if (!std::isnan(ms)) {
+        stage.count++;
+        stage.sumMs += ms;
+    }
+}
+
+static std::unique_ptr<VideoCodec> createVideoCodec(Codec codec) {
+    switch (codec) {
+        case Codec::H264:
+            return std::make_unique<H264Codec>();
+        case Codec::H265:
+            return std::make_unique<H265Codec>();
+    }
+    throw std::runtime_error("Error: unknown codec");
+}
+
+bool VideoEncoder::parsePreset(const std::string& name, Preset& preset) {
+    if (name == "default") {
+        preset = Preset::DEFAULT;
+    } else if (name == "low-latency") {
+        preset = Preset::LOW_LATENCY;
+    } else if (name == "high-quality") {
+        preset = Preset::HIGH_QUALITY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool VideoEncoder::parseCodec(const std::string& name, Codec& codec) {
+    if (name == "h264") {
+        codec = Codec::H264;
+    } else if (name == "h265") {
+        codec = Codec::H265;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void VideoEncoder::init(EncoderDevice& encoderDevice, const std::vector<VkImage>& inputImages,
                         const std::vector<VkImageView>& inputImageViews, uint32_t width, uint32_t height,
-                        uint32_t fps) {
-    assert(!m_running);
+                        const Config& config) {
+    assert(m_pendingSlots.empty() && m_reorderSlots.empty() && m_staticCandidateSlot < 0);
+    if (config.pipelineDepth == 0 || config.fps == 0) {
+        throw std::runtime_error("Error: pipeline depth and fps must not be 0");
+    }
 
     if (m_initialized) {
-        if ((width & ~1) == m_width && (height & ~1) == m_height) {
-            // nothing changed
+        if (&encoderDevice == m_encoderDevice && (width & ~1) <= m_maxWidth && (height & ~1) <= m_maxHeight &&
+            config == m_config) {
+            // at most the size changed, within the allocated one
+            resize(width, height);
+            // a rate control changed by setRateControl returns to the one of the config
+            std::lock_guard<std::mutex> lock(m_rateControlMutex);
+            if (m_averageBitrate != config.averageBitrate || m_maxBitrate != config.maxBitrate ||
+                m_rateControlFps != config.fps || m_rateControlPending) {
+                m_pendingAverageBitrate = config.averageBitrate;
+                m_pendingMaxBitrate = config.maxBitrate;
+                m_pendingFps = config.fps;
+                m_rateControlPending = true;
+            }
             return;
         }
 
-        // resolution changed
+        // resolution or configuration changed
         deinit();
     }
 
-    m_physicalDevice = physicalDevice;
-    m_device = device;
-    m_allocator = allocator;
-    m_computeQueue = computeQueue;
-    m_encodeQueue = encodeQueue;
-    m_computeQueueFamily = computeQueueFamily;
-    m_encodeQueueFamily = encodeQueueFamily;
-    m_computeCommandPool = computeCommandPool;
-    m_inputImages = inputImages;
+    m_encoderDevice = &encoderDevice;
+    m_physicalDevice = encoderDevice.getPhysicalDevice();
+    m_device = encoderDevice.getDevice();
+    m_allocator = encoderDevice.getAllocator();
+    m_computeQueueFamily = encoderDevice.getComputeQueueFamily();
+    m_encodeQueueFamily = encoderDevice.getEncodeQueueFamily();
+    m_encodeQueueIx = encoderDevice.acquireEncodeQueue();
     m_width = width & ~1;
     m_height = height & ~1;
+    m_config = config;
+    m_averageBitrate = config.averageBitrate;
+    m_maxBitrate = config.maxBitrate;
+    m_rateControlFps = config.fps;
+    m_maxWidth = std::max(m_width, config.maxWidth & ~1);
+    m_maxHeight = std::max(m_height, config.maxHeight & ~1);
+    m_slots.resize(m_config.pipelineDepth);
+    for (FrameSlot& slot : m_slots) {
+        slot.inUse = false;
+        slot.pinned = false;
+    }
 
-    createEncodeCommandPool();
+    createCommandPools();
     createVideoSession();
     allocateVideoSessionMemory();
-    createVideoSessionParameters(fps);
+    createVideoSessionParameters();
     readBitstreamHeader();
     allocateOutputBitStream();
-    allocateReferenceImages(2);
-    allocateIntermediateImage();
+    allocateReferenceImages();
+    allocateIntermediateImages();
     createOutputQueryPool();
-    createYCbCrConversionPipeline(inputImageViews);
+    // with direct YCbCr input the application writes the YCbCr images
+    assert(!m_config.directYCbCrInput || inputImages.empty());
+    m_conversionPipeline =
+        m_config.directYCbCrInput ? nullptr : &m_encoderDevice->getConversionPipeline(m_yCbCrPlaneCount);
+    // before the conversions are recorded, they run the frame difference pass
+    createFrameDifference();
+    m_inputs.clear();
+    for (size_t i = 0; i < inputImages.size(); i++) {
+        registerInputImage({.image = inputImages[i], .imageView = inputImageViews[i]});
+    }
+    allocateEncodeCommandBuffers();
 
+    VkSemaphoreTypeCreateInfo timelineCreateInfo = {};
+    timelineCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timelineCreateInfo.initialValue = 0;
     VkSemaphoreCreateInfo semaphoreInfo = {};
     semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_interQueueSemaphore));
-    VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_interQueueSemaphore2));
-    VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_interQueueSemaphore3));
-    VkFenceCreateInfo fenceInfo = {};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-    VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &m_encodeFinishedFence));
+    semaphoreInfo.pNext = &timelineCreateInfo;
+    VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_computeTimelineSemaphore));
+    VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &m_encodeTimelineSemaphore));
 
-    // Submit initial initialization commands and wait for finish
-    VkCommandBuffer cmdBuffer;
+    // Submit initial initialization commands, the frames wait for them on the encode queue
     VkCommandBufferAllocateInfo allocInfo = {};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
     allocInfo.commandPool = m_encodeCommandPool;
     allocInfo.commandBufferCount = 1;
-    VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &cmdBuffer));
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &m_initCommandBuffer));
     VkCommandBufferBeginInfo beginInfo = {};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    VK_CHECK(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
+    VK_CHECK(vkBeginCommandBuffer(m_initCommandBuffer, &beginInfo));
 
-    initRateControl(cmdBuffer, fps);
-    transitionImagesInitial(cmdBuffer);
+    initRateControl(m_initCommandBuffer);
+    transitionImagesInitial(m_initCommandBuffer);
 
-    VK_CHECK(vkEndCommandBuffer(cmdBuffer));
-    VkSubmitInfo submitInfo{
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO, .commandBufferCount = 1, .pCommandBuffers = &cmdBuffer};
-    VK_CHECK(vkResetFences(m_device, 1, &m_encodeFinishedFence));
-    VK_CHECK(vkQueueSubmit(m_encodeQueue, 1, &submitInfo, m_encodeFinishedFence));
-    VK_CHECK(vkWaitForFences(m_device, 1, &m_encodeFinishedFence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
-    vkFreeCommandBuffers(device, m_encodeCommandPool, 1, &cmdBuffer);
+    VK_CHECK(vkEndCommandBuffer(m_initCommandBuffer));
+    const VkCommandBufferSubmitInfo commandBufferInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                                                      .commandBuffer = m_initCommandBuffer};
+    const VkSubmitInfo2 submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                                   .commandBufferInfoCount = 1,
+                                   .pCommandBufferInfos = &commandBufferInfo};
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &m_initFence));
+    m_encoderDevice->submitEncode(m_encodeQueueIx, submitInfo, m_initFence);
 
     m_frameCount = 0;
+    m_encodeCount = 0;
+    m_framesSinceIdr = 0;
+    m_intraRefreshPosition = 0;
+    m_keyframeRequested = false;
+    m_acknowledgedFrameCount = 0;
+    m_recoveryRequested = false;
+    m_intraRefreshRequested = false;
+    m_staticFrameCount = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_metricsMutex);
+        m_metrics = Metrics();
+        m_metrics.targetBitrate = getTargetBitrate();
+        m_lastPacketTime = std::chrono::steady_clock::now();
+        m_bitrateWindow.clear();
+    }
     m_initialized = true;
 }
 
-void VideoEncoder::queueEncode(uint32_t currentImageIx) {
-    assert(!m_running);
-    convertRGBtoYCbCr(currentImageIx);
-    encodeVideoFrame();
-    m_running = true;
+void VideoEncoder::queueEncode(uint32_t currentImageIx, VkSemaphore waitSemaphore) {
+    assert(!m_config.directYCbCrInput && m_inputs[currentImageIx].registered);
+    const uint32_t slotIx = acquireSlot();
+    convertRGBtoYCbCr(slotIx, currentImageIx, waitSemaphore);
+    m_inputs[currentImageIx].queuedFrameCount = m_slots[slotIx].frameCount + 1;
+    m_inputs[currentImageIx].acquired = false;
+    queueSlot(slotIx);
 }
 
-void VideoEncoder::finishEncode(const char*& data, size_t& size) {
-    if (!m_running) {
-        size = 0;
+void VideoEncoder::resize(uint32_t width, uint32_t height) {
+    assert(m_initialized && m_acquiredSlot < 0);
+    width &= ~1;
+    height &= ~1;
+    if (width == m_width && height == m_height) {
         return;
     }
-    if (m_bitStreamHeaderPending) {
-        data = m_bitStreamHeader.data();
-        size = m_bitStreamHeader.size();
-        m_bitStreamHeaderPending = false;
+    if (width > m_maxWidth || height > m_maxHeight || width < m_minCodedExtent.width ||
+        height < m_minCodedExtent.height) {
+        throw std::runtime_error("Error: resolution " + std::to_string(width) + "x" + std::to_string(height) +
+                                 " outside of the allocated " + std::to_string(m_maxWidth) + "x" +
+                                 std::to_string(m_maxHeight));
+    }
+    // the held B frames reference frames of the old size
+    flush();
+    const uint32_t oldWidth = m_width;
+    const uint32_t oldHeight = m_height;
+    m_width = width;
+    m_height = height;
+    try {
+        updateSliceCount();
+    } catch (const std::exception&) {
+        m_width = oldWidth;
+        m_height = oldHeight;
+        updateSliceCount();
+        throw;
+    }
+
+    // the frames in flight still use the old parameters
+    destroyRetiredSessionParameters(false);
+    m_retiredSessionParameters.emplace_back(m_videoSessionParameters, m_encodeCount);
+    createVideoSessionParameters();
+    readBitstreamHeader();
+
+    // the conversions are recorded with the size of the dispatch
+    waitForConversion(m_frameCount);
+    for (InputImage& input : m_inputs) {
+        if (input.registered) {
+            vkFreeCommandBuffers(m_device, m_computeCommandPool, static_cast<uint32_t>(input.commandBuffers.size()),
+                                 input.commandBuffers.data());
+            recordConversionCommandBuffers(input);
+        }
+    }
+
+    // the next frame starts a new GOP with the new parameter sets
+    m_intraRefreshPosition = 0;
+    m_keyframeRequested = true;
+}
+
+void VideoEncoder::destroyRetiredSessionParameters(bool all) {
+    uint64_t encodedCount = 0;
+    if (!all) {
+        VK_CHECK(vkGetSemaphoreCounterValue(m_device, m_encodeTimelineSemaphore, &encodedCount));
+    }
+    // all is only used when no frame is in flight
+    std::erase_if(m_retiredSessionParameters, [&](const auto& retired) {
+        if (!all && encodedCount < retired.second) {
+            return false;
+        }
+        vkDestroyVideoSessionParametersKHR(m_device, retired.first, nullptr);
+        return true;
+    });
+}
+
+uint32_t VideoEncoder::registerInputImage(const InputImageInfo& info) {
+    assert(!m_config.directYCbCrInput);
+    // reuse the index of an unregistered image
+    auto it = std::find_if(m_inputs.begin(), m_inputs.end(), [](const InputImage& input) { return !input.registered; });
+    if (it == m_inputs.end()) {
+        it = m_inputs.emplace(m_inputs.end());
+    }
+    it->info = info;
+    it->queuedFrameCount = 0;
+    it->acquired = false;
+    createInputConversion(*it);
+    it->registered = true;
+    return static_cast<uint32_t>(it - m_inputs.begin());
+}
+
+void VideoEncoder::unregisterInputImage(uint32_t inputIx) {
+    InputImage& input = m_inputs[inputIx];
+    assert(input.registered);
+    // the command buffers and descriptor sets are in use until the last conversion from the image is done
+    waitForConversion(input.queuedFrameCount);
+    destroyInputConversion(input);
+    input.registered = false;
+}
+
+uint32_t VideoEncoder::acquireInputImage() {
+    uint64_t convertedCount;
+    VK_CHECK(vkGetSemaphoreCounterValue(m_device, m_computeTimelineSemaphore, &convertedCount));
+    // take a free image right away, otherwise wait for the one queued first
+    int32_t oldestIx = -1;
+    for (uint32_t inputIx = 0; inputIx < m_inputs.size(); inputIx++) {
+        InputImage& input = m_inputs[inputIx];
+        if (!input.registered || input.acquired) {
+            continue;
+        }
+        if (input.queuedFrameCount <= convertedCount) {
+            input.acquired = true;
+            return inputIx;
+        }
+        if (oldestIx < 0 || input.queuedFrameCount < m_inputs[oldestIx].queuedFrameCount) {
+            oldestIx = static_cast<int32_t>(inputIx);
+        }
+    }
+    if (oldestIx < 0) {
+        throw std::runtime_error("Error: all input images are acquired");
+    }
+    InputImage& input = m_inputs[oldestIx];
+    waitForConversion(input.queuedFrameCount);
+    input.acquired = true;
+    return static_cast<uint32_t>(oldestIx);
+}
+
+void VideoEncoder::releaseInputImage(uint32_t inputIx) {
+    assert(m_inputs[inputIx].registered && m_inputs[inputIx].acquired);
+    m_inputs[inputIx].acquired = false;
+}
+
+void VideoEncoder::waitForConversion(uint32_t frameCount) {
+    if (frameCount == 0) {
         return;
     }
+    const uint64_t value = timelineValue(frameCount - 1);
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &m_computeTimelineSemaphore;
+    waitInfo.pValues = &value;
+    VK_CHECK(vkWaitSemaphores(m_device, &waitInfo, std::numeric_limits<uint64_t>::max()));
+}
+
+VideoEncoder::YCbCrInputFrame VideoEncoder::acquireYCbCrInputFrame() {
+    assert(m_config.directYCbCrInput && m_acquiredSlot < 0);
+    const uint32_t slotIx = acquireSlot();
+    m_acquiredSlot = static_cast<int32_t>(slotIx);
+    return {.index = slotIx, .image = m_slots[slotIx].yCbCrImage, .planeViews = m_slots[slotIx].yCbCrImagePlaneViews};
+}
+
+void VideoEncoder::queueYCbCrEncode() {
+    assert(m_acquiredSlot >= 0);
+    const uint32_t slotIx = static_cast<uint32_t>(std::exchange(m_acquiredSlot, -1));
+    m_slots[slotIx].submitTime = std::chrono::steady_clock::now();
+    signalYCbCrInput(slotIx);
+    queueSlot(slotIx);
+}
 
-    getOutputVideoPacket(data, size);
+uint32_t VideoEncoder::acquireSlot() {
+    assert(!isPipelineFull());
+    // with B frames the slots are not finished in the order they were queued, so take any free one
+    uint32_t slotIx = 0;
+    {
+        // the encoder must not overwrite a bitstream region that a consumer is still reading
+        std::unique_lock<std::mutex> lock(m_slotMutex);
+        m_slotReleased.wait(lock, [&] {
+            for (slotIx = 0; slotIx < m_slots.size(); slotIx++) {
+                if (!m_slots[slotIx].inUse && !m_slots[slotIx].pinned) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+    FrameSlot& slot = m_slots[slotIx];
+    slot.inUse = true;
+    slot.frameCount = m_frameCount;
+    slot.submitTime = std::chrono::steady_clock::now();
+    return slotIx;
+}
 
-    vkFreeCommandBuffers(m_device, m_computeCommandPool, 1, &m_computeCommandBuffer);
-    vkFreeCommandBuffers(m_device, m_encodeCommandPool, 1, &m_encodeCommandBuffer);
+void VideoEncoder::queueSlot(uint32_t slotIx) {
     m_frameCount++;
+    {
+        std::lock_guard<std::mutex> lock(m_metricsMutex);
+        m_metrics.framesQueued++;
+    }
+    // the previous frame's conversion was submitted a frame earlier, so this rarely waits
+    decideStaticCandidate();
+
+    // loss recovery continues from the newest frame the receiver has acknowledged or with an IDR frame,
+    // the held B frames still reference the frames before
+    if (m_recoveryRequested.exchange(false)) {
+        flush();
+        const uint32_t acknowledgedFrameCount = m_acknowledgedFrameCount;
+        if (acknowledgedFrameCount == 0 || !m_codec->invalidateAfter(acknowledgedFrameCount - 1)) {
+            m_keyframeRequested = true;
+        }
+    }
+    // position in the GOP structure (in display order);
+    // a requested keyframe restarts the GOP structure
+    if (m_keyframeRequested.exchange(false) ||
+        (m_config.idrPeriod != INFINITE_GOP && m_framesSinceIdr == m_config.idrPeriod)) {
+        m_framesSinceIdr = 0;
+    }
+    // IDR frames (also requested ones) and the frame after the longest allowed run are always encoded, any other
+    // frame waits for the result of its frame difference pass until the next frame is queued
+    if (m_config.maxStaticFrameSkip > 0 && m_framesSinceIdr != 0 &&
+        m_staticFrameCount < m_config.maxStaticFrameSkip) {
+        m_staticCandidateSlot = static_cast<int32_t>(slotIx);
+        return;
+    }
+    m_staticFrameCount = 0;
+    scheduleSlot(slotIx);
+}
+
+void VideoEncoder::decideStaticCandidate() {
+    if (m_staticCandidateSlot < 0) {
+        return;
+    }
+    const uint32_t slotIx = static_cast<uint32_t>(std::exchange(m_staticCandidateSlot, -1));
+    waitForConversion(m_slots[slotIx].frameCount + 1);
+    VK_CHECK(vmaInvalidateAllocation(m_allocator, m_changedBlockBufferAllocation, slotIx * sizeof(uint32_t),
+                                     sizeof(uint32_t)));
+    if (m_changedBlockCounts[slotIx] == 0) {
+        // nothing to encode, the slot is free again and the GOP position stays
+        m_staticFrameCount++;
+        m_slots[slotIx].inUse = false;
+        std::lock_guard<std::mutex> lock(m_metricsMutex);
+        m_metrics.framesSkipped++;
+        return;
+    }
+    m_staticFrameCount = 0;
+    scheduleSlot(slotIx);
+}
+
+void VideoEncoder::scheduleSlot(uint32_t slotIx) {
+    FrameSlot& slot = m_slots[slotIx];
+    const bool isIdr = m_framesSinceIdr == 0;
+    const bool isI = m_config.gopLength == INFINITE_GOP ? isIdr : m_framesSinceIdr % m_config.gopLength == 0;
+    const bool isB = !isI && m_framesSinceIdr % (m_config.bFrameCount + 1) != 0;
+    slot.pictureType = isIdr ? VideoCodec::PictureType::IDR
+                       : isI ? VideoCodec::PictureType::I
+                       : isB ? VideoCodec::PictureType::B
+                             : VideoCodec::PictureType::P;
+    slot.framesSinceIdr = m_framesSinceIdr;
+    slot.temporalId = getTemporalId(m_framesSinceIdr);
+    m_framesSinceIdr++;
+
+    if (isB) {
+        // encoded after the next I/P frame, which it references in list 1
+        m_reorderSlots.push_back(slotIx);
+        return;
+    }
+    if (isIdr) {
+        // the held B frames belong to the previous GOP
+        flush();
+    }
+    encodeAnchorFrame(slotIx);
+}
+
+void VideoEncoder::encodeAnchorFrame(uint32_t slotIx) {
+    encodeVideoFrame(slotIx);
+    for (uint32_t heldSlotIx : m_reorderSlots) {
+        encodeVideoFrame(heldSlotIx);
+    }
+    m_reorderSlots.clear();
+}
+
+void VideoEncoder::flush() {
+    decideStaticCandidate();
+    if (m_reorderSlots.empty()) {
+        return;
+    }
+    // there is no following I/P frame yet, so the B frames before the last one reference it instead
+    const uint32_t slotIx = m_reorderSlots.back();
+    m_reorderSlots.pop_back();
+    m_slots[slotIx].pictureType = VideoCodec::PictureType::P;
+    encodeAnchorFrame(slotIx);
+}
+
+// Returns the parameter set header first and then the packets of the oldest frame in flight.
+// The packet pins the bitstream region of its frame until it is released.
+bool VideoEncoder::finishEncode(EncodedPacket& packet) { return finishOldestFrame(packet, true); }
+
+bool VideoEncoder::tryFinishEncode(EncodedPacket& packet) { return finishOldestFrame(packet, false); }
+
+bool VideoEncoder::finishOldestFrame(EncodedPacket& packet, bool wait) {
+    packet.release();
+    if (m_pendingSlots.empty() && wait) {
+        flush();
+    }
+    if (m_pendingSlots.empty()) {
+        return false;
+    }
+    FrameSlot& slot = m_slots[m_pendingSlots.front()];
+    if (slot.headerPending) {
+        // the header lives as long as the encoder, so it does not pin a slot
+        packet.m_codec = m_config.codec;
+        packet.m_data = slot.header->data();
+        packet.m_size = slot.header->size();
+        packet.m_frameIndex = slot.frameCount;
+        packet.m_pts = slot.frameCount;
+        packet.m_dts = getDts(slot);
+        packet.m_isIdr = false;
+        packet.m_temporalId = 0;
+        packet.m_isParameterSet = true;
+        packet.m_status = VK_QUERY_RESULT_STATUS_COMPLETE_KHR;
+        slot.headerPending = false;
+        std::lock_guard<std::mutex> lock(m_metricsMutex);
+        m_metrics.bytesOut += packet.m_size;
+        addToBitrateWindow(packet.m_dts, packet.m_size);
+        return true;
+    }
 
-    m_running = false;
+    const uint32_t slotIx = m_pendingSlots.front();
+    if (!getOutputVideoPacket(slotIx, packet, wait)) {
+        return false;
+    }
+    m_pendingSlots.pop_front();
+    m_slots[slotIx].inUse = false;
+    return true;
+}
+
+void EncodedPacket::release() {
+    if (m_encoder) {
+        m_encoder->releaseSlot(m_slotIx);
+        m_encoder = nullptr;
+    }
+    m_data = nullptr;
+    m_size = 0;
+}
+
+void VideoEncoder::releaseSlot(uint32_t slotIx) {
+    {
+        std::lock_guard<std::mutex> lock(m_slotMutex);
+        assert(m_slots[slotIx].pinned);
+        m_slots[slotIx].pinned = false;
+    }
+    m_slotReleased.notify_all();
 }
 
-void VideoEncoder::createEncodeCommandPool() {
+int32_t VideoEncoder::findSlot(uint32_t frameIndex) const {
+    for (uint32_t i = 0; i < m_slots.size(); i++) {
+        if (m_slots[i].inUse && m_slots[i].frameCount == frameIndex) {
+            return static_cast<int32_t>(i);
+        }
+    }
+    return -1;
+}
+
+void VideoEncoder::waitForFrame(uint32_t frameIndex) {
+    assert(frameIndex < m_frameCount);
+    const int32_t slotIx = findSlot(frameIndex);
+    if (slotIx < 0) {
+        // already handed out, so it is encoded
+        return;
+    }
+    if (slotIx == m_staticCandidateSlot ||
+        std::find(m_reorderSlots.begin(), m_reorderSlots.end(), slotIx) != m_reorderSlots.end()) {
+        flush();
+        if (findSlot(frameIndex) < 0) {
+            // skipped as static frame
+            return;
+        }
+    }
+    waitForSlot(slotIx);
+}
+
+bool VideoEncoder::isFrameEncoded(uint32_t frameIndex) {
+    const int32_t slotIx = findSlot(frameIndex);
+    if (slotIx < 0) {
+        return frameIndex < m_frameCount;
+    }
+    return slotIx != m_staticCandidateSlot &&
+           std::find(m_reorderSlots.begin(), m_reorderSlots.end(), slotIx) == m_reorderSlots.end() &&
+           isSlotEncoded(slotIx);
+}
+
+void VideoEncoder::waitForSlot(uint32_t slotIx) {
+    const uint64_t value = timelineValue(m_slots[slotIx].encodeCount);
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &m_encodeTimelineSemaphore;
+    waitInfo.pValues = &value;
+    VK_CHECK(vkWaitSemaphores(m_device, &waitInfo, std::numeric_limits<uint64_t>::max()));
+}
+
+bool VideoEncoder::isSlotEncoded(uint32_t slotIx) {
+    uint64_t value;
+    VK_CHECK(vkGetSemaphoreCounterValue(m_device, m_encodeTimelineSemaphore, &value));
+    return value >= timelineValue(m_slots[slotIx].encodeCount);
+}
+
+void VideoEncoder::createCommandPools() {
+    // the conversion command buffers are recorded once, the encode command buffers are reset for each frame
+    const VkCommandPoolCreateInfo computePoolInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                                                  .queueFamilyIndex = m_computeQueueFamily};
+    VK_CHECK(vkCreateCommandPool(m_device, &computePoolInfo, nullptr, &m_computeCommandPool));
+
     const VkCommandPoolCreateInfo poolInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
                                            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
                                            .queueFamilyIndex = m_encodeQueueFamily};
@@ -135,117 +601,269 @@ void VideoEncoder::createEncodeCommandPool() {
     VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_encodeCommandPool));
 }
 
+void VideoEncoder::allocateEncodeCommandBuffers() {
+    // the encode command buffers are re-recorded for every frame, but only allocated once
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = m_encodeCommandPool;
+    allocInfo.commandBufferCount = 1;
+    for (FrameSlot& slot : m_slots) {
+        VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &slot.encodeCommandBuffer));
+    }
+}
+
 void VideoEncoder::createVideoSession() {
-    m_encodeH264ProfileInfoExt = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_PROFILE_INFO_KHR};
-    m_encodeH264ProfileInfoExt.stdProfileIdc = STD_VIDEO_H264_PROFILE_IDC_MAIN;
+    m_encodeUsageInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_USAGE_INFO_KHR};
+    if (m_config.preset == Preset::LOW_LATENCY) {
+        m_encodeUsageInfo.videoUsageHints = VK_VIDEO_ENCODE_USAGE_STREAMING_BIT_KHR;
+        m_encodeUsageInfo.tuningMode = VK_VIDEO_ENCODE_TUNING_MODE_LOW_LATENCY_KHR;
+    } else if (m_config.preset == Preset::HIGH_QUALITY) {
+        m_encodeUsageInfo.videoUsageHints = VK_VIDEO_ENCODE_USAGE_RECORDING_BIT_KHR;
+        m_encodeUsageInfo.tuningMode = VK_VIDEO_ENCODE_TUNING_MODE_HIGH_QUALITY_KHR;
+    }
+
+    m_codec = createVideoCodec(m_config.codec);
+    const bool isH265 = m_config.codec == Codec::H265;
+    const int32_t profileIdc = isH265 ? m_config.h265ProfileIdc : m_config.profileIdc;
+    const int32_t levelIdc = isH265 ? m_config.h265LevelIdc : m_config.levelIdc;
 
     m_videoProfile = {VK_STRUCTURE_TYPE_VIDEO_PROFILE_INFO_KHR};
-    m_videoProfile.videoCodecOperation = VK_VIDEO_CODEC_OPERATION_ENCODE_H264_BIT_KHR;
+    m_videoProfile.videoCodecOperation = m_codec->getCodecOperation();
     m_videoProfile.chromaSubsampling = VK_VIDEO_CHROMA_SUBSAMPLING_420_BIT_KHR;
     m_videoProfile.chromaBitDepth = VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR;
     m_videoProfile.lumaBitDepth = VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR;
-    m_videoProfile.pNext = &m_encodeH264ProfileInfoExt;
+    m_videoProfile.pNext = m_codec->getProfileInfo(profileIdc, &m_encodeUsageInfo);
 
     m_videoProfileList = {VK_STRUCTURE_TYPE_VIDEO_PROFILE_LIST_INFO_KHR};
     m_videoProfileList.profileCount = 1;
     m_videoProfileList.pProfiles = &m_videoProfile;
 
-    VkVideoEncodeH264CapabilitiesKHR h264capabilities = {};
-    h264capabilities.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_CAPABILITIES_KHR;
+    // probed once per device and profile
+    const EncoderDevice::EncodeCapabilities& caps = m_encoderDevice->getEncodeCapabilities(
+        {.codecOperation = m_codec->getCodecOperation(),
+         .profileIdc = profileIdc,
+         .usageHints = m_encodeUsageInfo.videoUsageHints,
+         .contentHints = m_encodeUsageInfo.videoContentHints,
+         .tuningMode = m_encodeUsageInfo.tuningMode,
+         .quantizationMap = m_config.emphasisMap});
+    m_minBitstreamBufferOffsetAlignment = caps.capabilities.minBitstreamBufferOffsetAlignment;
+    m_minBitstreamBufferSizeAlignment = caps.capabilities.minBitstreamBufferSizeAlignment;
+
+    const uint32_t maxQualityLevels = caps.encodeCapabilities.maxQualityLevels;
+    if (m_config.qualityLevel >= 0) {
+        m_qualityLevel = static_cast<uint32_t>(m_config.qualityLevel);
+    } else {
+        m_qualityLevel = m_config.preset == Preset::HIGH_QUALITY ? maxQualityLevels - 1 : 0;
+    }
+    if (m_qualityLevel >= maxQualityLevels) {
+        throw std::runtime_error("Error: quality level must be below " + std::to_string(maxQualityLevels));
+    }
+    validateConfig(caps.capabilities, caps.encodeCapabilities, m_codec->getLimits(caps),
+                   m_qualityLevel < EncoderDevice::MAX_QUALITY_LEVELS ? &caps.qualityLevels[m_qualityLevel] : nullptr);
+    m_codec->init(caps, {.profileIdc = profileIdc,
+                         .levelIdc = levelIdc,
+                         .fps = m_config.fps,
+                         .dpbSlotCount = m_dpbSlotCount,
+                         .referenceFrameCount = m_config.referenceFrameCount,
+                         .longTermReferenceCount = m_config.longTermReferenceCount,
+                         .bFrameCount = m_config.bFrameCount,
+                         .temporalLayerCount = m_config.temporalLayerCount,
+                         .bt709 = m_config.yCbCrModel == VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709,
+                         .fullRange = m_config.yCbCrRange == VK_SAMPLER_YCBCR_RANGE_ITU_FULL});
+    m_chosenSrcImageFormat = caps.srcImageFormat;
+    m_chosenDpbImageFormat = caps.dpbImageFormat;
+
+    // one emphasis map texel per compared block
+    m_emphasisMapFormat = VK_FORMAT_UNDEFINED;
+    m_differenceBlockSize = {16, 16};
+    if (m_config.emphasisMap) {
+        if (caps.emphasisMapFormat == VK_FORMAT_UNDEFINED) {
+            throw std::runtime_error("Error: emphasis maps are not supported by the encoder");
+        }
+        const VkExtent2D texelSize = caps.emphasisMapTexelSize;
+        if ((m_maxWidth + texelSize.width - 1) / texelSize.width > caps.maxQuantizationMapExtent.width ||
+            (m_maxHeight + texelSize.height - 1) / texelSize.height > caps.maxQuantizationMapExtent.height) {
+            throw std::runtime_error("Error: resolution too large for the emphasis map");
+        }
+        m_emphasisMapFormat = caps.emphasisMapFormat;
+        m_differenceBlockSize = texelSize;
+    }
+
+    VkVideoSessionCreateInfoKHR createInfo = {VK_STRUCTURE_TYPE_VIDEO_SESSION_CREATE_INFO_KHR};
+    createInfo.pVideoProfile = &m_videoProfile;
+    createInfo.queueFamilyIndex = m_encodeQueueFamily;
+    createInfo.pictureFormat = m_chosenSrcImageFormat;
+    createInfo.maxCodedExtent = {m_maxWidth, m_maxHeight};
+    createInfo.maxDpbSlots = m_dpbSlotCount;
+    createInfo.maxActiveReferencePictures = m_maxActiveReferences;
+    createInfo.referencePictureFormat = m_chosenDpbImageFormat;
+    createInfo.pStdHeaderVersion = &m_codec->getStdHeaderVersion();
+#ifdef VK_KHR_video_encode_quantization_map
+    if (m_emphasisMapFormat != VK_FORMAT_UNDEFINED) {
+        createInfo.flags |= VK_VIDEO_SESSION_CREATE_ALLOW_ENCODE_EMPHASIS_MAP_BIT_KHR;
+    }
+#endif
 
-    VkVideoEncodeCapabilitiesKHR encodeCapabilities = {};
-    encodeCapabilities.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_CAPABILITIES_KHR;
-    encodeCapabilities.pNext = &h264capabilities;
+    VK_CHECK(vkCreateVideoSessionKHR(m_device, &createInfo, nullptr, &m_videoSession));
+}
 
-    VkVideoCapabilitiesKHR capabilities = {};
-    capabilities.sType = VK_STRUCTURE_TYPE_VIDEO_CAPABILITIES_KHR;
-    capabilities.pNext = &encodeCapabilities;
+void VideoEncoder::validateConfig(const VkVideoCapabilitiesKHR& capabilities,
+                                  const VkVideoEncodeCapabilitiesKHR& encodeCapabilities,
+                                  const VideoCodec::Limits& limits,
+                                  const EncoderDevice::QualityLevelProperties* qualityLevelProperties) {
+    m_minCodedExtent = capabilities.minCodedExtent;
+    if (m_width < capabilities.minCodedExtent.width || m_height < capabilities.minCodedExtent.height ||
+        m_maxWidth > capabilities.maxCodedExtent.width || m_maxHeight > capabilities.maxCodedExtent.height) {
+        throw std::runtime_error("Error: resolution " + std::to_string(m_maxWidth) + "x" +
+                                 std::to_string(m_maxHeight) + " not supported by the encoder");
+    }
 
-    VK_CHECK(vkGetPhysicalDeviceVideoCapabilitiesKHR(m_physicalDevice, &m_videoProfile, &capabilities));
-    
     m_chosenRateControlMode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR;
-    if (encodeCapabilities.rateControlModes & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR) {
-        m_chosenRateControlMode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR;
-    } else if (encodeCapabilities.rateControlModes & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR) {
-        m_chosenRateControlMode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR;
-    } else if (encodeCapabilities.rateControlModes & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR) {
-        m_chosenRateControlMode = VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR;
-    }
-
-    VkPhysicalDeviceVideoEncodeQualityLevelInfoKHR qualityLevelInfo = {};
-    qualityLevelInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_ENCODE_QUALITY_LEVEL_INFO_KHR;
-    qualityLevelInfo.pVideoProfile = &m_videoProfile;
-    qualityLevelInfo.qualityLevel = 0;
-
-    VkVideoEncodeH264QualityLevelPropertiesKHR h264QualityLevelProperties = {};
-    h264QualityLevelProperties.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_QUALITY_LEVEL_PROPERTIES_KHR;
-    VkVideoEncodeQualityLevelPropertiesKHR qualityLevelProperties = {};
-    qualityLevelProperties.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUALITY_LEVEL_PROPERTIES_KHR;
-    qualityLevelProperties.pNext = &h264QualityLevelProperties;
-
-    VK_CHECK(vkGetPhysicalDeviceVideoEncodeQualityLevelPropertiesKHR(m_physicalDevice, &qualityLevelInfo,
-                                                                  &qualityLevelProperties));
-
-    VkPhysicalDeviceVideoFormatInfoKHR videoFormatInfo = {};
-    videoFormatInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_FORMAT_INFO_KHR;
-    videoFormatInfo.pNext = &m_videoProfileList;
-    videoFormatInfo.imageUsage =
-        VK_IMAGE_USAGE_VIDEO_ENCODE_SRC_BIT_KHR | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    uint32_t videoFormatPropertyCount;
-    VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(m_physicalDevice, &videoFormatInfo, &videoFormatPropertyCount,
-                                                nullptr));
-    std::vector<VkVideoFormatPropertiesKHR> srcVideoFormatProperties(videoFormatPropertyCount);
-    for (uint32_t i = 0; i < videoFormatPropertyCount; i++) {
-        memset(&srcVideoFormatProperties[i], 0, sizeof(VkVideoFormatPropertiesKHR));
-        srcVideoFormatProperties[i].sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
-    }
-    VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(m_physicalDevice, &videoFormatInfo, &videoFormatPropertyCount,
-                                                         srcVideoFormatProperties.data()));
-
-    m_chosenSrcImageFormat = VK_FORMAT_UNDEFINED;
-    for (const auto& formatProperties: srcVideoFormatProperties) {
-        if (formatProperties.format == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM ||
-            formatProperties.format == VK_FORMAT_G8_B8_R8_3PLANE_420_UNORM) {
-            // Nvidia driver supports mutable & extended usage, but is not returning those flags
-            //constexpr VkImageCreateFlags neededCreateFlags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
-            //if ((formatProperties.imageCreateFlags & neededCreateFlags) != neededCreateFlags) {
-            //    printf("Skipping format %d, imageCreateFlags not supported\n", formatProperties.format);
-            //    continue;
-            //}
-            m_chosenSrcImageFormat = formatProperties.format;
+    const auto& modes = m_config.rateControlModes;
+    for (VkVideoEncodeRateControlModeFlagBitsKHR mode : modes) {
+        if (encodeCapabilities.rateControlModes & mode) {
+            m_chosenRateControlMode = mode;
             break;
         }
     }
-    if (m_chosenSrcImageFormat == VK_FORMAT_UNDEFINED)
-        throw std::runtime_error("Error: no supported video encode source image format");
+    if (m_config.preset != Preset::DEFAULT && qualityLevelProperties) {
+        // the mode the implementation recommends for the quality level, if it is configured
+        const VkVideoEncodeRateControlModeFlagBitsKHR preferredMode =
+            qualityLevelProperties->properties.preferredRateControlMode;
+        if (std::find(modes.begin(), modes.end(), preferredMode) != modes.end() &&
+            (encodeCapabilities.rateControlModes & preferredMode)) {
+            m_chosenRateControlMode = preferredMode;
+        }
+    }
+    if (m_chosenRateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR) {
+        throw std::runtime_error("Error: none of the configured rate control modes is supported");
+    }
+    if (m_chosenRateControlMode != VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR) {
+        m_maxSupportedBitrate = encodeCapabilities.maxBitrate;
+        if (m_config.maxBitrate > encodeCapabilities.maxBitrate ||
+            m_config.averageBitrate > m_config.maxBitrate || m_config.averageBitrate == 0) {
+            throw std::runtime_error("Error: bitrate must be in the range (0, " +
+                                     std::to_string(encodeCapabilities.maxBitrate) +
+                                     "] with average bitrate <= max bitrate");
+        }
+        if (m_config.initialVirtualBufferSizeInMs > m_config.virtualBufferSizeInMs) {
+            throw std::runtime_error("Error: initial virtual buffer size larger than virtual buffer size");
+        }
+    } else if (static_cast<int32_t>(m_config.constantQp) < limits.minQp ||
+               static_cast<int32_t>(m_config.constantQp) > limits.maxQp) {
+        throw std::runtime_error("Error: constant QP must be in the range [" + std::to_string(limits.minQp) + ", " +
+                                 std::to_string(limits.maxQp) + "]");
+    }
 
-    videoFormatInfo.imageUsage = VK_IMAGE_USAGE_VIDEO_ENCODE_DPB_BIT_KHR;
-    VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(m_physicalDevice, &videoFormatInfo, &videoFormatPropertyCount,
-                                                         nullptr));
-    std::vector<VkVideoFormatPropertiesKHR> dpbVideoFormatProperties(videoFormatPropertyCount);
-    for (uint32_t i = 0; i < videoFormatPropertyCount; i++) {
-        memset(&dpbVideoFormatProperties[i], 0, sizeof(VkVideoFormatPropertiesKHR));
-        dpbVideoFormatProperties[i].sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
+    if (m_config.gopLength == 0 || m_config.idrPeriod == 0 ||
+        (m_config.idrPeriod != INFINITE_GOP &&
+         (m_config.gopLength == INFINITE_GOP || m_config.idrPeriod % m_config.gopLength != 0))) {
+        throw std::runtime_error("Error: the IDR period must be a multiple of the GOP length");
     }
-    VK_CHECK(vkGetPhysicalDeviceVideoFormatPropertiesKHR(m_physicalDevice, &videoFormatInfo, &videoFormatPropertyCount,
-                                                         dpbVideoFormatProperties.data()));
-    if (dpbVideoFormatProperties.size() < 1)
-        throw std::runtime_error("Error: no supported video encode DPB image format");
-    m_chosenDpbImageFormat = dpbVideoFormatProperties[0].format;
 
-    static const VkExtensionProperties h264StdExtensionVersion = {VK_STD_VULKAN_VIDEO_CODEC_H264_ENCODE_EXTENSION_NAME,
-                                                                  VK_STD_VULKAN_VIDEO_CODEC_H264_ENCODE_SPEC_VERSION};
-    VkVideoSessionCreateInfoKHR createInfo = {VK_STRUCTURE_TYPE_VIDEO_SESSION_CREATE_INFO_KHR};
-    createInfo.pVideoProfile = &m_videoProfile;
-    createInfo.queueFamilyIndex = m_encodeQueueFamily;
-    createInfo.pictureFormat = m_chosenSrcImageFormat;
-    createInfo.maxCodedExtent = {m_width, m_height};
-    createInfo.maxDpbSlots = 16;
-    createInfo.maxActiveReferencePictures = 16;
-    createInfo.referencePictureFormat = m_chosenDpbImageFormat;
-    createInfo.pStdHeaderVersion = &h264StdExtensionVersion;
+    // the DPB holds the references and the picture being encoded
+    m_dpbSlotCount = m_config.referenceFrameCount + 1;
+    m_maxActiveReferences = std::min(m_config.referenceFrameCount, capabilities.maxActiveReferencePictures);
+    m_maxL0References = std::min(m_maxActiveReferences, limits.maxPPictureL0ReferenceCount);
+    if (m_config.referenceFrameCount == 0 || m_config.referenceFrameCount > 16 ||
+        m_dpbSlotCount > capabilities.maxDpbSlots || m_maxL0References == 0) {
+        throw std::runtime_error("Error: reference frame count must be in the range [1, " +
+                                 std::to_string(std::min(capabilities.maxDpbSlots - 1, 16u)) +
+                                 "] and P frames have to be supported");
+    }
+    // B frames reference the frames on both sides and share the active references between the two lists
+    m_maxBL0References = 0;
+    m_maxL1References = 0;
+    if (m_config.bFrameCount > 0) {
+        m_maxBL0References = std::min(m_maxActiveReferences - 1, limits.maxBPictureL0ReferenceCount);
+        m_maxL1References = std::min(m_maxActiveReferences - m_maxBL0References, limits.maxL1ReferenceCount);
+        if (m_config.bFrameCount >= m_config.pipelineDepth || m_maxBL0References == 0 || m_maxL1References == 0 ||
+            m_config.intraRefreshPeriod > 0 ||
+            (m_config.gopLength != INFINITE_GOP && m_config.gopLength % (m_config.bFrameCount + 1) != 0)) {
+            throw std::runtime_error("Error: B frames need a pipeline depth above the B frame count, 2 active "
+                                     "references, a GOP length which is a multiple of the B frame count + 1, "
+                                     "no intra refresh and a profile and implementation supporting them");
+        }
+    }
+    if (m_config.temporalLayerCount == 0 || m_config.temporalLayerCount > MAX_TEMPORAL_LAYERS ||
+        m_config.temporalLayerCount > limits.maxTemporalLayerCount ||
+        (m_chosenRateControlMode != VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR &&
+         m_config.temporalLayerCount > encodeCapabilities.maxRateControlLayers)) {
+        throw std::runtime_error("Error: temporal layer count must be in the range [1, " +
+                                 std::to_string(std::min(limits.maxTemporalLayerCount, MAX_TEMPORAL_LAYERS)) +
+                                 "]");
+    }
+    // every reference of a temporal layer period has to stay until the next frame of layer 0
+    const uint32_t temporalLayerPeriod = 1u << (m_config.temporalLayerCount - 1);
+    if (m_config.temporalLayerCount > 1 &&
+        (m_config.bFrameCount > 0 || m_config.referenceFrameCount < temporalLayerPeriod / 2 ||
+         (m_config.gopLength != INFINITE_GOP && m_config.gopLength % temporalLayerPeriod != 0))) {
+        throw std::runtime_error("Error: temporal layers need " + std::to_string(temporalLayerPeriod / 2) +
+                                 " reference frames, a GOP length which is a multiple of " +
+                                 std::to_string(temporalLayerPeriod) + " and no B frames");
+    }
+    const std::vector<uint32_t>& percents = m_config.temporalLayerBitratePercent;
+    if (!percents.empty() && (percents.size() != m_config.temporalLayerCount || percents.back() != 100 ||
+                              percents.front() == 0 || !std::is_sorted(percents.begin(), percents.end()))) {
+        throw std::runtime_error("Error: temporal layer bitrate percents must increase to 100, one per layer");
+    }
 
-    VK_CHECK(vkCreateVideoSessionKHR(m_device, &createInfo, nullptr, &m_videoSession));
+    if (m_config.longTermReferenceCount >= m_config.referenceFrameCount ||
+        (m_config.longTermReferenceCount > 0 && m_config.longTermReferenceInterval == 0)) {
+        throw std::runtime_error("Error: long-term reference count must be below the reference frame count and "
+                                 "needs an interval");
+    }
+
+    // the frame difference pass runs after the conversion
+    if ((m_config.maxStaticFrameSkip > 0 || m_config.emphasisMap) && m_config.directYCbCrInput) {
+        throw std::runtime_error("Error: static frame skipping and emphasis maps need the RGB input conversion");
+    }
+    if (m_config.maxStaticFrameSkip > 0 && m_config.bFrameCount > 0) {
+        throw std::runtime_error("Error: static frame skipping does not support B frames");
+    }
+    if (m_config.emphasisMap && m_chosenRateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR) {
+        throw std::runtime_error("Error: emphasis maps need CBR or VBR rate control");
+    }
+
+    m_maxSliceCount = limits.maxSliceCount;
+    m_blockSize = limits.blockSize;
+    updateSliceCount();
+    if (m_config.intraRefreshPeriod > 0 && !limits.differentSliceTypes) {
+        throw std::runtime_error("Error: intra refresh needs different slice types in a picture");
+    }
+
+    if ((m_config.yCbCrModel != VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_601 &&
+         m_config.yCbCrModel != VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709) ||
+        (m_config.yCbCrRange != VK_SAMPLER_YCBCR_RANGE_ITU_FULL &&
+         m_config.yCbCrRange != VK_SAMPLER_YCBCR_RANGE_ITU_NARROW)) {
+        throw std::runtime_error("Error: only the BT.601 and BT.709 YCbCr conversions are supported");
+    }
+}
+
+void VideoEncoder::updateSliceCount() {
+    // the implementation places the slice boundaries, on block rows unless it supports row unaligned slices
+    const uint32_t mbRows = (m_height + m_blockSize - 1) / m_blockSize;
+    const uint32_t maxSliceCount = std::min(m_maxSliceCount, mbRows);
+    m_sliceCount = 1;
+    if (m_config.mbRowsPerSlice > 0) {
+        m_sliceCount = (mbRows + m_config.mbRowsPerSlice - 1) / m_config.mbRowsPerSlice;
+        if (m_sliceCount > maxSliceCount) {
+            throw std::runtime_error("Error: " + std::to_string(m_config.mbRowsPerSlice) +
+                                     " block rows per slice result in more than " + std::to_string(maxSliceCount) +
+                                     " slices");
+        }
+    }
+    if (m_config.intraRefreshPeriod > 0) {
+        // one slice per frame of the cycle, mixing I and P slices in a picture has to be supported
+        if (m_config.mbRowsPerSlice == 0) {
+            m_sliceCount = m_config.intraRefreshPeriod;
+        }
+        if (m_config.intraRefreshPeriod > maxSliceCount || m_config.intraRefreshPeriod != m_sliceCount) {
+            throw std::runtime_error("Error: intra refresh period must be the slice count and must not exceed " +
+                                     std::to_string(maxSliceCount) + " frames");
+        }
+    }
 }
 
 void VideoEncoder::allocateVideoSessionMemory() {
@@ -286,65 +904,77 @@ void VideoEncoder::allocateVideoSessionMemory() {
                                          encodeSessionBindMemory.data()));
 }
 
-void VideoEncoder::createVideoSessionParameters(uint32_t fps) {
-    m_vui = h264::getStdVideoH264SequenceParameterSetVui(fps);
-    m_sps = h264::getStdVideoH264SequenceParameterSet(m_width, m_height, &m_vui);
-    m_pps = h264::getStdVideoH264PictureParameterSet();
-
-    VkVideoEncodeH264SessionParametersAddInfoKHR encodeH264SessionParametersAddInfo = {
-        VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_ADD_INFO_KHR};
-    encodeH264SessionParametersAddInfo.pNext = nullptr;
-    encodeH264SessionParametersAddInfo.stdSPSCount = 1;
-    encodeH264SessionParametersAddInfo.pStdSPSs = &m_sps;
-    encodeH264SessionParametersAddInfo.stdPPSCount = 1;
-    encodeH264SessionParametersAddInfo.pStdPPSs = &m_pps;
-
-    VkVideoEncodeH264SessionParametersCreateInfoKHR encodeH264SessionParametersCreateInfo = {
-        VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_CREATE_INFO_KHR};
-    encodeH264SessionParametersCreateInfo.pNext = nullptr;
-    encodeH264SessionParametersCreateInfo.maxStdSPSCount = 1;
-    encodeH264SessionParametersCreateInfo.maxStdPPSCount = 1;
-    encodeH264SessionParametersCreateInfo.pParametersAddInfo = &encodeH264SessionParametersAddInfo;
+void VideoEncoder::createVideoSessionParameters() {
+    // the parameters are optimized for the quality level the session encodes with
+    VkVideoEncodeQualityLevelInfoKHR qualityLevelInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUALITY_LEVEL_INFO_KHR};
+    qualityLevelInfo.pNext = m_codec->getSessionParametersCreateInfo(m_width, m_height);
+    qualityLevelInfo.qualityLevel = m_qualityLevel;
 
     VkVideoSessionParametersCreateInfoKHR sessionParametersCreateInfo = {
         VK_STRUCTURE_TYPE_VIDEO_SESSION_PARAMETERS_CREATE_INFO_KHR};
-    sessionParametersCreateInfo.pNext = &encodeH264SessionParametersCreateInfo;
+    sessionParametersCreateInfo.pNext = &qualityLevelInfo;
     sessionParametersCreateInfo.videoSessionParametersTemplate = nullptr;
     sessionParametersCreateInfo.videoSession = m_videoSession;
+#ifdef VK_KHR_video_encode_quantization_map
+    // the emphasis maps can only be used with parameters created for their texel size
+    VkVideoEncodeQuantizationMapSessionParametersCreateInfoKHR quantizationMapInfo = {
+        VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUANTIZATION_MAP_SESSION_PARAMETERS_CREATE_INFO_KHR};
+    if (m_emphasisMapFormat != VK_FORMAT_UNDEFINED) {
+        quantizationMapInfo.pNext = sessionParametersCreateInfo.pNext;
+        quantizationMapInfo.quantizationMapTexelSize = m_differenceBlockSize;
+        sessionParametersCreateInfo.pNext = &quantizationMapInfo;
+        sessionParametersCreateInfo.flags |= VK_VIDEO_SESSION_PARAMETERS_CREATE_QUANTIZATION_MAP_COMPATIBLE_BIT_KHR;
+    }
+#endif
 
     VK_CHECK(
         vkCreateVideoSessionParametersKHR(m_device, &sessionParametersCreateInfo, nullptr, &m_videoSessionParameters));
 }
 
 void VideoEncoder::readBitstreamHeader() {
-    VkVideoEncodeH264SessionParametersGetInfoKHR h264getInfo = {};
-    h264getInfo.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_GET_INFO_KHR;
-    h264getInfo.stdSPSId = 0;
-    h264getInfo.stdPPSId = 0;
-    h264getInfo.writeStdPPS = VK_TRUE;
-    h264getInfo.writeStdSPS = VK_TRUE;
     VkVideoEncodeSessionParametersGetInfoKHR getInfo = {};
     getInfo.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_SESSION_PARAMETERS_GET_INFO_KHR;
-    getInfo.pNext = &h264getInfo;
+    getInfo.pNext = m_codec->getSessionParametersGetInfo();
     getInfo.videoSessionParameters = m_videoSessionParameters;
 
-    VkVideoEncodeH264SessionParametersFeedbackInfoKHR h264feedback = {};
-    h264feedback.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_SESSION_PARAMETERS_FEEDBACK_INFO_KHR;
     VkVideoEncodeSessionParametersFeedbackInfoKHR feedback = {};
     feedback.sType = VK_STRUCTURE_TYPE_VIDEO_ENCODE_SESSION_PARAMETERS_FEEDBACK_INFO_KHR;
-    feedback.pNext = &h264feedback;
+    feedback.pNext = m_codec->getSessionParametersFeedbackInfo();
     size_t datalen = 1024;
     VK_CHECK(vkGetEncodedVideoSessionParametersKHR(m_device, &getInfo, nullptr, &datalen, nullptr));
-    m_bitStreamHeader.resize(datalen);
-    VK_CHECK(vkGetEncodedVideoSessionParametersKHR(m_device, &getInfo, &feedback, &datalen, m_bitStreamHeader.data()));
-    m_bitStreamHeader.resize(datalen);
-    m_bitStreamHeaderPending = true;
+    std::vector<char>& header = m_bitStreamHeaders.emplace_back(datalen);
+    VK_CHECK(vkGetEncodedVideoSessionParametersKHR(m_device, &getInfo, &feedback, &datalen, header.data()));
+    header.resize(datalen);
+}
+
+VkDeviceSize VideoEncoder::getBitStreamRegionSize(uint64_t maxBitrate, uint32_t fps) const {
+    // an uncompressed 4:2:0 frame plus some room for headers is the upper bound for a coded frame
+    const VkDeviceSize rawFrameSize = VkDeviceSize(m_maxWidth) * m_maxHeight * 3 / 2 + 64 * 1024;
+    VkDeviceSize regionSize = rawFrameSize;
+    if (m_chosenRateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR ||
+        m_chosenRateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR) {
+        // with rate control a frame stays well below that; leave room for IDR frames being much larger than average
+        const VkDeviceSize IDR_FRAME_FACTOR = 10;
+        const VkDeviceSize rateControlledFrameSize = maxBitrate / 8 / fps * IDR_FRAME_FACTOR;
+        regionSize = std::min(rawFrameSize, std::max<VkDeviceSize>(rateControlledFrameSize, 256 * 1024));
+    }
+    // every region has to start at a valid dstBufferOffset and span a valid dstBufferRange
+    const VkDeviceSize alignment =
+        std::max<VkDeviceSize>({m_minBitstreamBufferOffsetAlignment, m_minBitstreamBufferSizeAlignment, 1});
+    return (regionSize + alignment - 1) / alignment * alignment;
 }
 
 void VideoEncoder::allocateOutputBitStream() {
+    m_bitStreamRegionSize = getBitStreamRegionSize(m_config.maxBitrate, m_config.fps);
+
+    // one region of the bitstream buffer per frame slot
+    for (uint32_t i = 0; i < m_slots.size(); i++) {
+        m_slots[i].bitStreamOffset = i * m_bitStreamRegionSize;
+    }
+
     VkBufferCreateInfo bufferInfo = {};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferInfo.size = 4 * 1024 * 1024;
+    bufferInfo.size = m_bitStreamRegionSize * m_slots.size();
     bufferInfo.usage = VK_BUFFER_USAGE_VIDEO_ENCODE_DST_BIT_KHR;
     bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     bufferInfo.pNext = &m_videoProfileList;
@@ -356,58 +986,59 @@ void VideoEncoder::allocateOutputBitStream() {
     VK_CHECK(vmaMapMemory(m_allocator, m_bitStreamBufferAllocation, reinterpret_cast<void**>(&m_bitStreamData)));
 }
 
-void VideoEncoder::allocateReferenceImages(uint32_t count) {
-    m_dpbImages.resize(count);
-    m_dpbImageAllocations.resize(count);
-    m_dpbImageViews.resize(count);
-    for (uint32_t i = 0; i < count; i++) {
-        VkImageCreateInfo tmpImgCreateInfo;
-        tmpImgCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        tmpImgCreateInfo.pNext = &m_videoProfileList;
-        tmpImgCreateInfo.imageType = VK_IMAGE_TYPE_2D;
-        tmpImgCreateInfo.format = m_chosenDpbImageFormat;
-        tmpImgCreateInfo.extent = {m_width, m_height, 1};
-        tmpImgCreateInfo.mipLevels = 1;
-        tmpImgCreateInfo.arrayLayers = 1;
-        tmpImgCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-        tmpImgCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-        tmpImgCreateInfo.usage = VK_IMAGE_USAGE_VIDEO_ENCODE_DPB_BIT_KHR;  // DPB ONLY
-        tmpImgCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        tmpImgCreateInfo.queueFamilyIndexCount = 1;
-        tmpImgCreateInfo.pQueueFamilyIndices = &m_encodeQueueFamily;
-        tmpImgCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        tmpImgCreateInfo.flags = 0;
-        VmaAllocationCreateInfo allocInfo = {};
-        allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-        VK_CHECK(vmaCreateImage(m_allocator, &tmpImgCreateInfo, &allocInfo, &m_dpbImages[i], &m_dpbImageAllocations[i],
-                                nullptr));
-        VkImageViewCreateInfo viewInfo = {};
-        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        viewInfo.image = m_dpbImages[i];
-        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        viewInfo.format = m_chosenDpbImageFormat;
-        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        viewInfo.subresourceRange.baseMipLevel = 0;
-        viewInfo.subresourceRange.levelCount = 1;
-        viewInfo.subresourceRange.baseArrayLayer = 0;
-        viewInfo.subresourceRange.layerCount = 1;
-        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_dpbImageViews[i]));
-    }
+void VideoEncoder::allocateReferenceImages() {
+    // one layered image works with and without VK_VIDEO_CAPABILITY_SEPARATE_REFERENCE_IMAGES_BIT_KHR
+    VkImageCreateInfo tmpImgCreateInfo;
+    tmpImgCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    tmpImgCreateInfo.pNext = &m_videoProfileList;
+    tmpImgCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    tmpImgCreateInfo.format = m_chosenDpbImageFormat;
+    tmpImgCreateInfo.extent = {m_maxWidth, m_maxHeight, 1};
+    tmpImgCreateInfo.mipLevels = 1;
+    tmpImgCreateInfo.arrayLayers = m_dpbSlotCount;
+    tmpImgCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    tmpImgCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    tmpImgCreateInfo.usage = VK_IMAGE_USAGE_VIDEO_ENCODE_DPB_BIT_KHR;  // DPB ONLY
+    tmpImgCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    tmpImgCreateInfo.queueFamilyIndexCount = 1;
+    tmpImgCreateInfo.pQueueFamilyIndices = &m_encodeQueueFamily;
+    tmpImgCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    tmpImgCreateInfo.flags = 0;
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    VK_CHECK(
+        vmaCreateImage(m_allocator, &tmpImgCreateInfo, &allocInfo, &m_dpbImage, &m_dpbImageAllocation, nullptr));
+    VkImageViewCreateInfo viewInfo = {};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = m_dpbImage;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    viewInfo.format = m_chosenDpbImageFormat;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = m_dpbSlotCount;
+    VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_dpbImageView));
 }
 
-void VideoEncoder::allocateIntermediateImage() {
+void VideoEncoder::allocateIntermediateImages() {
+    m_yCbCrPlaneCount = (m_chosenSrcImageFormat == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM) ? 2 : 3;
     uint32_t queueFamilies[] = {m_computeQueueFamily, m_encodeQueueFamily};
     VkImageCreateInfo tmpImgCreateInfo;
     tmpImgCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     tmpImgCreateInfo.pNext = &m_videoProfileList;
     tmpImgCreateInfo.imageType = VK_IMAGE_TYPE_2D;
     tmpImgCreateInfo.format = m_chosenSrcImageFormat;
-    tmpImgCreateInfo.extent = {m_width, m_height, 1};
+    tmpImgCreateInfo.extent = {m_maxWidth, m_maxHeight, 1};
     tmpImgCreateInfo.mipLevels = 1;
     tmpImgCreateInfo.arrayLayers = 1;
     tmpImgCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
     tmpImgCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
     tmpImgCreateInfo.usage = VK_IMAGE_USAGE_VIDEO_ENCODE_SRC_BIT_KHR | VK_IMAGE_USAGE_STORAGE_BIT;
+    if (m_config.directYCbCrInput) {
+        // the application may also upload the frames with copy commands
+        tmpImgCreateInfo.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    }
     if (m_computeQueueFamily == m_encodeQueueFamily) {
         tmpImgCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
         tmpImgCreateInfo.queueFamilyIndexCount = 0;
@@ -423,43 +1054,50 @@ void VideoEncoder::allocateIntermediateImage() {
     tmpImgCreateInfo.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
     VmaAllocationCreateInfo allocInfo = {};
     allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
-    VK_CHECK(
-        vmaCreateImage(m_allocator, &tmpImgCreateInfo, &allocInfo, &m_yCbCrImage, &m_yCbCrImageAllocation, nullptr));
-
-    VkImageViewUsageCreateInfo viewUsageInfo = {};
-    viewUsageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO;
-    viewUsageInfo.usage = VK_IMAGE_USAGE_VIDEO_ENCODE_SRC_BIT_KHR;
-    VkImageViewCreateInfo viewInfo = {};
-    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    viewInfo.pNext = &viewUsageInfo;
-    viewInfo.image = m_yCbCrImage;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    viewInfo.format = m_chosenSrcImageFormat;
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
-    viewInfo.subresourceRange.baseArrayLayer = 0;
-    viewInfo.subresourceRange.layerCount = 1;
-    VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_yCbCrImageView));
 
-    viewUsageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
-    uint32_t numPlanes = (m_chosenSrcImageFormat == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM) ? 2 : 3;
-    m_yCbCrImagePlaneViews.resize(numPlanes);
-    viewInfo.format = VK_FORMAT_R8_UNORM;
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT;
-    VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_yCbCrImagePlaneViews[0]));
+    // every frame slot gets its own YCbCr image, so conversion and encoding of different frames can overlap
+    for (FrameSlot& slot : m_slots) {
+        VK_CHECK(vmaCreateImage(m_allocator, &tmpImgCreateInfo, &allocInfo, &slot.yCbCrImage,
+                                &slot.yCbCrImageAllocation, nullptr));
 
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT;
-    if (numPlanes == 2) {
-        viewInfo.format = VK_FORMAT_R8G8_UNORM;
-        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_yCbCrImagePlaneViews[1]));
-    } else {
-        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_yCbCrImagePlaneViews[1]));
-        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_2_BIT;
-        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_yCbCrImagePlaneViews[2]));
+        VkImageViewUsageCreateInfo viewUsageInfo = {};
+        viewUsageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO;
+        viewUsageInfo.usage = VK_IMAGE_USAGE_VIDEO_ENCODE_SRC_BIT_KHR;
+        VkImageViewCreateInfo viewInfo = {};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.pNext = &viewUsageInfo;
+        viewInfo.image = slot.yCbCrImage;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = m_chosenSrcImageFormat;
+        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        viewInfo.subresourceRange.baseMipLevel = 0;
+        viewInfo.subresourceRange.levelCount = 1;
+        viewInfo.subresourceRange.baseArrayLayer = 0;
+        viewInfo.subresourceRange.layerCount = 1;
+        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &slot.yCbCrImageView));
+
+        viewUsageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+        slot.yCbCrImagePlaneViews.resize(m_yCbCrPlaneCount);
+        viewInfo.format = VK_FORMAT_R8_UNORM;
+        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT;
+        VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &slot.yCbCrImagePlaneViews[0]));
+
+        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT;
+        if (m_yCbCrPlaneCount == 2) {
+            viewInfo.format = VK_FORMAT_R8G8_UNORM;
+            VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &slot.yCbCrImagePlaneViews[1]));
+        } else {
+            VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &slot.yCbCrImagePlaneViews[1]));
+            viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_PLANE_2_BIT;
+            VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &slot.yCbCrImagePlaneViews[2]));
+        }
     }
 }
 
+static uint64_t timestampMask(uint32_t validBits) {
+    return validBits == 0 ? 0 : validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+}
+
 void VideoEncoder::createOutputQueryPool() {
     VkQueryPoolVideoEncodeFeedbackCreateInfoKHR queryPoolVideoEncodeFeedbackCreateInfo = {
         VK_STRUCTURE_TYPE_QUERY_POOL_VIDEO_ENCODE_FEEDBACK_CREATE_INFO_KHR};
@@ -469,97 +1107,74 @@ void VideoEncoder::createOutputQueryPool() {
     queryPoolVideoEncodeFeedbackCreateInfo.pNext = &m_videoProfile;
     VkQueryPoolCreateInfo queryPoolCreateInfo = {VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
     queryPoolCreateInfo.queryType = VK_QUERY_TYPE_VIDEO_ENCODE_FEEDBACK_KHR;
-    queryPoolCreateInfo.queryCount = 1;
+    queryPoolCreateInfo.queryCount = static_cast<uint32_t>(m_slots.size());  // one query per frame slot
     queryPoolCreateInfo.pNext = &queryPoolVideoEncodeFeedbackCreateInfo;
     VK_CHECK(vkCreateQueryPool(m_device, &queryPoolCreateInfo, NULL, &m_queryPool));
+
+    // timestamps for measuring the GPU time of conversion and encoding
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+    m_timestampPeriod = properties.limits.timestampPeriod;
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &queueFamilyCount, queueFamilies.data());
+    m_computeTimestampMask = timestampMask(queueFamilies[m_computeQueueFamily].timestampValidBits);
+    m_encodeTimestampMask = timestampMask(queueFamilies[m_encodeQueueFamily].timestampValidBits);
+    m_timestampQueryPool = VK_NULL_HANDLE;
+    if (m_computeTimestampMask == 0) {
+        m_encodeTimestampMask = 0;  // the queue wait time needs both
+        return;
+    }
+    VkQueryPoolCreateInfo timestampPoolCreateInfo = {VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    timestampPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    timestampPoolCreateInfo.queryCount = static_cast<uint32_t>(m_slots.size()) * TIMESTAMPS_PER_SLOT;
+    VK_CHECK(vkCreateQueryPool(m_device, &timestampPoolCreateInfo, NULL, &m_timestampQueryPool));
 }
 
-void VideoEncoder::createYCbCrConversionPipeline(const std::vector<VkImageView>& inputImageViews) {
-    const char* shaderFileName = m_yCbCrImagePlaneViews.size() == 2 ? "shaders/rgb-ycbcr-shader-2plane.comp.spv"
-                                                                    : "shaders/rgb-ycbcr-shader-3plane.comp.spv";
-    printf("Using %s\n", shaderFileName);
-    auto computeShaderCode = readFile(shaderFileName);
-    VkShaderModuleCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-                                        .codeSize = computeShaderCode.size(),
-                                        .pCode = reinterpret_cast<const uint32_t*>(computeShaderCode.data())};
-    VkShaderModule computeShaderModule;
-    VK_CHECK(vkCreateShaderModule(m_device, &createInfo, nullptr, &computeShaderModule));
-    VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
-    computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    computeShaderStageInfo.module = computeShaderModule;
-    computeShaderStageInfo.pName = "main";
-
-    std::array<VkDescriptorSetLayoutBinding, 4> layoutBindings{};
-    for (uint32_t i = 0; i < layoutBindings.size(); i++) {
-        layoutBindings[i].binding = i;
-        layoutBindings[i].descriptorCount = 1;
-        layoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-        layoutBindings[i].pImmutableSamplers = nullptr;
-        layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-    }
-
-    VkDescriptorSetLayoutCreateInfo layoutInfo{};
-    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutInfo.bindingCount = 1 + m_yCbCrImagePlaneViews.size();
-    layoutInfo.pBindings = layoutBindings.data();
-    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &layoutInfo, nullptr, &m_computeDescriptorSetLayout));
-
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &m_computeDescriptorSetLayout;
-    VK_CHECK(vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &m_computePipelineLayout));
-
-    VkComputePipelineCreateInfo pipelineInfo{};
-    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-    pipelineInfo.layout = m_computePipelineLayout;
-    pipelineInfo.stage = computeShaderStageInfo;
-    VK_CHECK(vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_computePipeline));
-
-    vkDestroyShaderModule(m_device, computeShaderModule, nullptr);
-
-    const int maxFramesCount = static_cast<uint32_t>(inputImageViews.size());
+void VideoEncoder::createInputConversion(InputImage& input) {
+    // one descriptor set for each frame slot
+    const uint32_t setCount = static_cast<uint32_t>(m_slots.size());
     std::array<VkDescriptorPoolSize, 1> poolSizes{};
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    poolSizes[0].descriptorCount = 4 * maxFramesCount;
+    poolSizes[0].descriptorCount = 4 * setCount;
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = (uint32_t)poolSizes.size();
     poolInfo.pPoolSizes = poolSizes.data();
-    poolInfo.maxSets = maxFramesCount;
-    VK_CHECK(vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_descriptorPool));
+    poolInfo.maxSets = setCount;
+    VK_CHECK(vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &input.descriptorPool));
 
-    std::vector<VkDescriptorSetLayout> layouts(maxFramesCount, m_computeDescriptorSetLayout);
+    std::vector<VkDescriptorSetLayout> layouts(setCount, m_conversionPipeline->descriptorSetLayout);
     VkDescriptorSetAllocateInfo descAllocInfo{};
     descAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descAllocInfo.descriptorPool = m_descriptorPool;
-    descAllocInfo.descriptorSetCount = maxFramesCount;
+    descAllocInfo.descriptorPool = input.descriptorPool;
+    descAllocInfo.descriptorSetCount = setCount;
     descAllocInfo.pSetLayouts = layouts.data();
+    input.descriptorSets.resize(setCount);
+    VK_CHECK(vkAllocateDescriptorSets(m_device, &descAllocInfo, input.descriptorSets.data()));
 
-    m_computeDescriptorSets.resize(maxFramesCount);
-    VK_CHECK(vkAllocateDescriptorSets(m_device, &descAllocInfo, m_computeDescriptorSets.data()));
-    for (size_t i = 0; i < maxFramesCount; i++) {
+    for (uint32_t slotIx = 0; slotIx < setCount; slotIx++) {
         std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
         std::array<VkDescriptorImageInfo, 4> imageInfos{};
 
-        imageInfos[0].imageView = inputImageViews[i];
+        imageInfos[0].imageView = input.info.imageView;
         imageInfos[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
         imageInfos[0].sampler = VK_NULL_HANDLE;
         descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrites[0].dstSet = m_computeDescriptorSets[i];
+        descriptorWrites[0].dstSet = input.descriptorSets[slotIx];
         descriptorWrites[0].dstBinding = 0;
         descriptorWrites[0].dstArrayElement = 0;
         descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
         descriptorWrites[0].descriptorCount = 1;
         descriptorWrites[0].pImageInfo = &imageInfos[0];
 
-        for (uint32_t p = 0; p < m_yCbCrImagePlaneViews.size(); ++p) {
-            imageInfos[p + 1].imageView = m_yCbCrImagePlaneViews[p];
+        for (uint32_t p = 0; p < m_yCbCrPlaneCount; ++p) {
+            imageInfos[p + 1].imageView = m_slots[slotIx].yCbCrImagePlaneViews[p];
             imageInfos[p + 1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
             imageInfos[p + 1].sampler = VK_NULL_HANDLE;
             descriptorWrites[p + 1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrites[p + 1].dstSet = m_computeDescriptorSets[i];
+            descriptorWrites[p + 1].dstSet = input.descriptorSets[slotIx];
             descriptorWrites[p + 1].dstBinding = p + 1;
             descriptorWrites[p + 1].dstArrayElement = 0;
             descriptorWrites[p + 1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
@@ -567,48 +1182,54 @@ void VideoEncoder::createYCbCrConversionPipeline(const std::vector<VkImageView>&
             descriptorWrites[p + 1].pImageInfo = &imageInfos[p + 1];
         }
 
-        vkUpdateDescriptorSets(m_device, 1 + m_yCbCrImagePlaneViews.size(), descriptorWrites.data(), 0, nullptr);
+        vkUpdateDescriptorSets(m_device, 1 + m_yCbCrPlaneCount, descriptorWrites.data(), 0, nullptr);
     }
+
+    recordConversionCommandBuffers(input);
+}
+
+void VideoEncoder::destroyInputConversion(InputImage& input) {
+    vkFreeCommandBuffers(m_device, m_computeCommandPool, static_cast<uint32_t>(input.commandBuffers.size()),
+                         input.commandBuffers.data());
+    input.commandBuffers.clear();
+    vkDestroyDescriptorPool(m_device, input.descriptorPool, nullptr);
+    input.descriptorSets.clear();
 }
 
-void VideoEncoder::initRateControl(VkCommandBuffer cmdBuf, uint32_t fps) {
+void VideoEncoder::initRateControl(VkCommandBuffer cmdBuf) {
     VkVideoBeginCodingInfoKHR encodeBeginInfo = {VK_STRUCTURE_TYPE_VIDEO_BEGIN_CODING_INFO_KHR};
     encodeBeginInfo.videoSession = m_videoSession;
     encodeBeginInfo.videoSessionParameters = m_videoSessionParameters;
 
-    m_encodeRateControlLayerInfo.pNext = &m_encodeH264RateControlLayerInfo;
-    m_encodeRateControlLayerInfo.frameRateNumerator = fps;
-    m_encodeRateControlLayerInfo.frameRateDenominator = 1;
-    m_encodeRateControlLayerInfo.averageBitrate = 5000000;
-    m_encodeRateControlLayerInfo.maxBitrate = 20000000;
-
-    m_encodeH264RateControlInfo.flags = VK_VIDEO_ENCODE_H264_RATE_CONTROL_REGULAR_GOP_BIT_KHR |
-                                        VK_VIDEO_ENCODE_H264_RATE_CONTROL_REFERENCE_PATTERN_FLAT_BIT_KHR;
-    m_encodeH264RateControlInfo.gopFrameCount = 16;
-    m_encodeH264RateControlInfo.idrPeriod = 16;
-    m_encodeH264RateControlInfo.consecutiveBFrameCount = 0;
-    m_encodeH264RateControlInfo.temporalLayerCount = 1;
+    for (uint32_t i = 0; i < MAX_TEMPORAL_LAYERS; i++) {
+        m_encodeRateControlLayerInfos[i] = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_RATE_CONTROL_LAYER_INFO_KHR};
+        m_encodeRateControlLayerInfos[i].pNext = m_codec->getRateControlLayerInfo(i);
+    }
+    setRateControlLayers();
 
     m_encodeRateControlInfo.rateControlMode = m_chosenRateControlMode;
-    m_encodeRateControlInfo.pNext = &m_encodeH264RateControlInfo;
-    m_encodeRateControlInfo.layerCount = 1;
-    m_encodeRateControlInfo.pLayers = &m_encodeRateControlLayerInfo;
-    m_encodeRateControlInfo.initialVirtualBufferSizeInMs = 100;
-    m_encodeRateControlInfo.virtualBufferSizeInMs = 200;
+    m_encodeRateControlInfo.layerCount = m_config.temporalLayerCount;
+    m_encodeRateControlInfo.pLayers = m_encodeRateControlLayerInfos.data();
+    m_encodeRateControlInfo.initialVirtualBufferSizeInMs = m_config.initialVirtualBufferSizeInMs;
+    m_encodeRateControlInfo.virtualBufferSizeInMs = m_config.virtualBufferSizeInMs;
+
+    VkVideoEncodeQualityLevelInfoKHR qualityLevelInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUALITY_LEVEL_INFO_KHR};
+    qualityLevelInfo.pNext = &m_encodeRateControlInfo;
+    qualityLevelInfo.qualityLevel = m_qualityLevel;
 
     VkVideoCodingControlInfoKHR codingControlInfo = {VK_STRUCTURE_TYPE_VIDEO_CODING_CONTROL_INFO_KHR};
-    codingControlInfo.flags =
-        VK_VIDEO_CODING_CONTROL_RESET_BIT_KHR | VK_VIDEO_CODING_CONTROL_ENCODE_RATE_CONTROL_BIT_KHR;
-    codingControlInfo.pNext = &m_encodeRateControlInfo;
+    codingControlInfo.flags = VK_VIDEO_CODING_CONTROL_RESET_BIT_KHR |
+                              VK_VIDEO_CODING_CONTROL_ENCODE_RATE_CONTROL_BIT_KHR |
+                              VK_VIDEO_CODING_CONTROL_ENCODE_QUALITY_LEVEL_BIT_KHR;
+    codingControlInfo.pNext = &qualityLevelInfo;
 
-    if (m_encodeRateControlInfo.rateControlMode & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR) {
-        m_encodeRateControlLayerInfo.averageBitrate = m_encodeRateControlLayerInfo.maxBitrate;
-    }
     if (m_encodeRateControlInfo.rateControlMode & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR ||
         m_encodeRateControlInfo.rateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DEFAULT_KHR) {
-        m_encodeH264RateControlInfo.temporalLayerCount = 0;
         m_encodeRateControlInfo.layerCount = 0;
     }
+    // UINT32_MAX (INFINITE_GOP) means an infinite GOP for the rate control as well
+    m_encodeRateControlInfo.pNext =
+        m_codec->getRateControlInfo(m_config.gopLength, m_config.idrPeriod, m_encodeRateControlInfo.layerCount);
 
     VkVideoEndCodingInfoKHR encodeEndInfo = {VK_STRUCTURE_TYPE_VIDEO_END_CODING_INFO_KHR};
 
@@ -616,26 +1237,91 @@ void VideoEncoder::initRateControl(VkCommandBuffer cmdBuf, uint32_t fps) {
     vkCmdBeginVideoCodingKHR(cmdBuf, &encodeBeginInfo);
     vkCmdControlVideoCodingKHR(cmdBuf, &codingControlInfo);
     vkCmdEndVideoCodingKHR(cmdBuf, &encodeEndInfo);
+
+    std::lock_guard<std::mutex> lock(m_rateControlMutex);
+    m_rateControlPending = false;
+}
+
+void VideoEncoder::setRateControlLayers() {
+    // layer i describes the stream of the layers up to i, which has 1 / 2^(layerCount - 1 - i) of the frame rate
+    const uint32_t layerCount = m_config.temporalLayerCount;
+    for (uint32_t i = 0; i < layerCount; i++) {
+        const uint64_t percent = m_config.temporalLayerBitratePercent.empty()
+                                     ? (i + 1) * 100 / layerCount
+                                     : m_config.temporalLayerBitratePercent[i];
+        VkVideoEncodeRateControlLayerInfoKHR& layer = m_encodeRateControlLayerInfos[i];
+        layer.frameRateNumerator = m_rateControlFps;
+        layer.frameRateDenominator = 1u << (layerCount - 1 - i);
+        layer.averageBitrate = m_averageBitrate * percent / 100;
+        layer.maxBitrate = m_maxBitrate * percent / 100;
+        if (m_chosenRateControlMode & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR) {
+            layer.averageBitrate = layer.maxBitrate;
+        }
+    }
+}
+
+uint32_t VideoEncoder::getTemporalId(uint32_t framesSinceIdr) const {
+    // dyadic: layer 0 at the start of each period of 2^(layerCount - 1) frames, the odd frames in the top layer
+    const uint32_t position = framesSinceIdr % (1u << (m_config.temporalLayerCount - 1));
+    return position == 0 ? 0 : m_config.temporalLayerCount - 1 - std::countr_zero(position);
+}
+
+void VideoEncoder::requestIntraRefresh() {
+    if (m_config.intraRefreshPeriod == 0) {
+        requestKeyframe();
+        return;
+    }
+    m_intraRefreshRequested = true;
+}
+
+void VideoEncoder::acknowledgeFrame(uint32_t frameIndex) {
+    // acknowledgements may arrive out of order, keep the newest
+    uint32_t count = m_acknowledgedFrameCount;
+    while (frameIndex + 1 > count && !m_acknowledgedFrameCount.compare_exchange_weak(count, frameIndex + 1)) {
+    }
+}
+
+void VideoEncoder::setRateControl(uint64_t averageBitrate, uint64_t maxBitrate, uint32_t fps) {
+    assert(m_initialized);
+    if (m_chosenRateControlMode != VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR &&
+        m_chosenRateControlMode != VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR) {
+        throw std::runtime_error("Error: rate control is disabled");
+    }
+    if (fps == 0 || averageBitrate == 0 || averageBitrate > maxBitrate || maxBitrate > m_maxSupportedBitrate) {
+        throw std::runtime_error("Error: bitrate must be in the range (0, " + std::to_string(m_maxSupportedBitrate) +
+                                 "] with average bitrate <= max bitrate and fps must not be 0");
+    }
+    // the bitstream regions are sized in init, a larger frame would be truncated
+    if (getBitStreamRegionSize(maxBitrate, fps) > m_bitStreamRegionSize) {
+        throw std::runtime_error("Error: max bitrate per frame above the one of the initial config, init again");
+    }
+
+    std::lock_guard<std::mutex> lock(m_rateControlMutex);
+    m_pendingAverageBitrate = averageBitrate;
+    m_pendingMaxBitrate = maxBitrate;
+    m_pendingFps = fps;
+    m_rateControlPending = true;
 }
 
 void VideoEncoder::transitionImagesInitial(VkCommandBuffer cmdBuf) {
     std::vector<VkImageMemoryBarrier2> barriers;
     VkImageMemoryBarrier2 imageMemoryBarrier{.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
                                              .srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-                                             .dstStageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                             // the host does not wait, the first frames of the session do
+                                             .dstStageMask = VK_PIPELINE_STAGE_2_VIDEO_ENCODE_BIT_KHR,
+                                             .dstAccessMask = VK_ACCESS_2_VIDEO_ENCODE_READ_BIT_KHR |
+                                                              VK_ACCESS_2_VIDEO_ENCODE_WRITE_BIT_KHR,
                                              .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
                                              .subresourceRange = {
                                                  .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
                                                  .baseMipLevel = 0,
                                                  .levelCount = 1,
                                                  .baseArrayLayer = 0,
-                                                 .layerCount = 1,
+                                                 .layerCount = m_dpbSlotCount,
                                              }};
-    for (auto& dpbImage : m_dpbImages) {
-        imageMemoryBarrier.image = dpbImage;
-        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_VIDEO_ENCODE_DPB_KHR;
-        barriers.push_back(imageMemoryBarrier);
-    }
+    imageMemoryBarrier.image = m_dpbImage;
+    imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_VIDEO_ENCODE_DPB_KHR;
+    barriers.push_back(imageMemoryBarrier);
 
     VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
                                        .imageMemoryBarrierCount = static_cast<uint32_t>(barriers.size()),
@@ -643,144 +1329,528 @@ void VideoEncoder::transitionImagesInitial(VkCommandBuffer cmdBuf) {
     vkCmdPipelineBarrier2(cmdBuf, &dependencyInfo);
 }
 
-void VideoEncoder::convertRGBtoYCbCr(uint32_t currentImageIx) {
-    // begin command buffer for compute shader
+void VideoEncoder::recordConversionCommandBuffers(InputImage& input) {
+    // the conversion does not change from frame to frame, so it is recorded once per slot and input image
+    const EncoderDevice::ConversionParameters conversionParameters =
+        EncoderDevice::getConversionParameters(m_config.yCbCrModel, m_config.yCbCrRange);
+    input.commandBuffers.resize(m_slots.size());
     VkCommandBufferAllocateInfo allocInfo = {};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
     allocInfo.commandPool = m_computeCommandPool;
-    allocInfo.commandBufferCount = 1;
-    VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &m_computeCommandBuffer));
+    allocInfo.commandBufferCount = static_cast<uint32_t>(input.commandBuffers.size());
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, input.commandBuffers.data()));
+
+    // images from another queue family (e.g. VK_QUEUE_FAMILY_EXTERNAL for imported memory) are acquired before
+    // the conversion and released back to their producer afterwards
+    const bool transferOwnership = input.info.srcQueueFamily != VK_QUEUE_FAMILY_IGNORED;
+    for (uint32_t slotIx = 0; slotIx < m_slots.size(); slotIx++) {
+        FrameSlot& slot = m_slots[slotIx];
+        const uint32_t timestampQuery = slotIx * TIMESTAMPS_PER_SLOT;
+        VkCommandBuffer cmdBuf = input.commandBuffers[slotIx];
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        VK_CHECK(vkBeginCommandBuffer(cmdBuf, &beginInfo));
+        if (m_timestampQueryPool) {
+            vkCmdResetQueryPool(cmdBuf, m_timestampQueryPool, timestampQuery + TIMESTAMP_CONVERT_BEGIN, 2);
+            vkCmdWriteTimestamp2(cmdBuf, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, m_timestampQueryPool,
+                                 timestampQuery + TIMESTAMP_CONVERT_BEGIN);
+        }
+
+        std::vector<VkImageMemoryBarrier2> barriers;
+        VkImageMemoryBarrier2 imageMemoryBarrier{
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .subresourceRange = {
+                .aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT | VK_IMAGE_ASPECT_PLANE_1_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            }};
+        // transition YCbCr image (luma and chroma planes) to be shader target
+        imageMemoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+        imageMemoryBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+        imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageMemoryBarrier.image = slot.yCbCrImage;
+        imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        if (m_yCbCrPlaneCount >= 3)
+            imageMemoryBarrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_PLANE_2_BIT;
+        barriers.push_back(imageMemoryBarrier);
+        // transition source image to be shader source
+        imageMemoryBarrier.srcStageMask = input.info.srcStageMask;
+        imageMemoryBarrier.srcAccessMask = input.info.srcAccessMask;
+        imageMemoryBarrier.oldLayout = input.info.layout;
+        imageMemoryBarrier.image = input.info.image;
+        imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+        imageMemoryBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        if (transferOwnership) {
+            imageMemoryBarrier.srcQueueFamilyIndex = input.info.srcQueueFamily;
+            imageMemoryBarrier.dstQueueFamilyIndex = m_computeQueueFamily;
+        }
+        barriers.push_back(imageMemoryBarrier);
+        VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
+                                           .imageMemoryBarrierCount = static_cast<uint32_t>(barriers.size()),
+                                           .pImageMemoryBarriers = barriers.data()};
+        vkCmdPipelineBarrier2(cmdBuf, &dependencyInfo);
+
+        // run the RGB->YCbCr conversion shader, one invocation per 2x2 pixels
+        vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_conversionPipeline->pipeline);
+        vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_conversionPipeline->pipelineLayout, 0, 1,
+                                &input.descriptorSets[slotIx], 0, 0);
+        vkCmdPushConstants(cmdBuf, m_conversionPipeline->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                           sizeof(conversionParameters), &conversionParameters);
+        vkCmdDispatch(cmdBuf, (m_width + 31) / 32, (m_height + 31) / 32,
+                      1);  // work item local size = 16x16 blocks
+        if (m_frameDifferencePipeline) {
+            recordFrameDifference(cmdBuf, slotIx);
+        }
+
+        if (transferOwnership) {
+            // release the source image back to the producer in the layout it was handed over in
+            VkImageMemoryBarrier2 releaseBarrier = imageMemoryBarrier;
+            releaseBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+            releaseBarrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+            releaseBarrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+            releaseBarrier.dstAccessMask = VK_ACCESS_2_NONE;
+            releaseBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            releaseBarrier.newLayout = input.info.layout;
+            releaseBarrier.srcQueueFamilyIndex = m_computeQueueFamily;
+            releaseBarrier.dstQueueFamilyIndex = input.info.srcQueueFamily;
+            dependencyInfo.imageMemoryBarrierCount = 1;
+            dependencyInfo.pImageMemoryBarriers = &releaseBarrier;
+            vkCmdPipelineBarrier2(cmdBuf, &dependencyInfo);
+        }
+        if (m_timestampQueryPool) {
+            vkCmdWriteTimestamp2(cmdBuf, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, m_timestampQueryPool,
+                                 timestampQuery + TIMESTAMP_CONVERT_END);
+        }
+
+        VK_CHECK(vkEndCommandBuffer(cmdBuf));
+    }
+}
+
+void VideoEncoder::createFrameDifference() {
+    for (FrameSlot& slot : m_slots) {
+        slot.emphasisMapImage = VK_NULL_HANDLE;
+        slot.emphasisMapImageView = VK_NULL_HANDLE;
+    }
+    m_frameDifferencePipeline = nullptr;
+    if (m_config.maxStaticFrameSkip == 0 && !m_config.emphasisMap) {
+        return;
+    }
+    m_frameDifferencePipeline = &m_encoderDevice->getFrameDifferencePipeline();
+
+    // the luma the frames are compared with stays on the compute queue
+    VkImageCreateInfo imageInfo = {VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO};
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = VK_FORMAT_R8_UNORM;
+    imageInfo.extent = {m_maxWidth, m_maxHeight, 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    VK_CHECK(vmaCreateImage(m_allocator, &imageInfo, &allocInfo, &m_previousLumaImage, &m_previousLumaImageAllocation,
+                            nullptr));
+    VkImageViewCreateInfo viewInfo = {};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = m_previousLumaImage;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = VK_FORMAT_R8_UNORM;
+    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = 1;
+    VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &m_previousLumaImageView));
+
+#ifdef VK_KHR_video_encode_quantization_map
+    // every frame slot gets its own emphasis map, written on the compute queue and read on the encode queue
+    if (m_emphasisMapFormat != VK_FORMAT_UNDEFINED) {
+        uint32_t queueFamilies[] = {m_computeQueueFamily, m_encodeQueueFamily};
+        imageInfo.pNext = &m_videoProfileList;
+        imageInfo.format = m_emphasisMapFormat;
+        imageInfo.extent = {(m_maxWidth + m_differenceBlockSize.width - 1) / m_differenceBlockSize.width,
+                            (m_maxHeight + m_differenceBlockSize.height - 1) / m_differenceBlockSize.height, 1};
+        imageInfo.usage = VK_IMAGE_USAGE_VIDEO_ENCODE_EMPHASIS_MAP_BIT_KHR | VK_IMAGE_USAGE_STORAGE_BIT;
+        if (m_computeQueueFamily != m_encodeQueueFamily) {
+            imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+            imageInfo.queueFamilyIndexCount = 2;
+            imageInfo.pQueueFamilyIndices = queueFamilies;
+        }
+        viewInfo.format = m_emphasisMapFormat;
+        for (FrameSlot& slot : m_slots) {
+            VK_CHECK(vmaCreateImage(m_allocator, &imageInfo, &allocInfo, &slot.emphasisMapImage,
+                                    &slot.emphasisMapImageAllocation, nullptr));
+            viewInfo.image = slot.emphasisMapImage;
+            VK_CHECK(vkCreateImageView(m_device, &viewInfo, nullptr, &slot.emphasisMapImageView));
+        }
+    }
+#endif
+
+    // one changed block count per frame slot, read back by the host
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = m_slots.size() * sizeof(uint32_t);
+    bufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VmaAllocationCreateInfo bufferAllocInfo = {};
+    bufferAllocInfo.usage = VMA_MEMORY_USAGE_GPU_TO_CPU;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &bufferInfo, &bufferAllocInfo, &m_changedBlockBuffer,
+                             &m_changedBlockBufferAllocation, nullptr));
+    VK_CHECK(
+        vmaMapMemory(m_allocator, m_changedBlockBufferAllocation, reinterpret_cast<void**>(&m_changedBlockCounts)));
+
+    // one descriptor set for each frame slot
+    const uint32_t setCount = static_cast<uint32_t>(m_slots.size());
+    std::array<VkDescriptorPoolSize, 2> poolSizes{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSizes[0].descriptorCount = 3 * setCount;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[1].descriptorCount = setCount;
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = (uint32_t)poolSizes.size();
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = setCount;
+    VK_CHECK(vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_frameDifferenceDescriptorPool));
+
+    std::vector<VkDescriptorSetLayout> layouts(setCount, m_frameDifferencePipeline->descriptorSetLayout);
+    VkDescriptorSetAllocateInfo descAllocInfo{};
+    descAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descAllocInfo.descriptorPool = m_frameDifferenceDescriptorPool;
+    descAllocInfo.descriptorSetCount = setCount;
+    descAllocInfo.pSetLayouts = layouts.data();
+    m_frameDifferenceDescriptorSets.resize(setCount);
+    VK_CHECK(vkAllocateDescriptorSets(m_device, &descAllocInfo, m_frameDifferenceDescriptorSets.data()));
+
+    for (uint32_t slotIx = 0; slotIx < setCount; slotIx++) {
+        const FrameSlot& slot = m_slots[slotIx];
+        // without an emphasis map the shader does not write binding 2
+        const std::array<VkDescriptorImageInfo, 3> imageInfos{{
+            {VK_NULL_HANDLE, slot.yCbCrImagePlaneViews[0], VK_IMAGE_LAYOUT_GENERAL},
+            {VK_NULL_HANDLE, m_previousLumaImageView, VK_IMAGE_LAYOUT_GENERAL},
+            {VK_NULL_HANDLE, slot.emphasisMapImageView ? slot.emphasisMapImageView : m_previousLumaImageView,
+             VK_IMAGE_LAYOUT_GENERAL},
+        }};
+        const VkDescriptorBufferInfo counterInfo{m_changedBlockBuffer, 0, VK_WHOLE_SIZE};
+        std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
+        for (uint32_t i = 0; i < descriptorWrites.size(); i++) {
+            descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[i].dstSet = m_frameDifferenceDescriptorSets[slotIx];
+            descriptorWrites[i].dstBinding = i;
+            descriptorWrites[i].dstArrayElement = 0;
+            descriptorWrites[i].descriptorCount = 1;
+            if (i < imageInfos.size()) {
+                descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+                descriptorWrites[i].pImageInfo = &imageInfos[i];
+            } else {
+                descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                descriptorWrites[i].pBufferInfo = &counterInfo;
+            }
+        }
+        vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0,
+                               nullptr);
+    }
+
+    // the previous luma starts black and in the layout of the shader, before the first conversion on the queue
+    VkCommandBufferAllocateInfo cmdAllocInfo = {};
+    cmdAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmdAllocInfo.commandPool = m_computeCommandPool;
+    cmdAllocInfo.commandBufferCount = 1;
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &m_frameDifferenceInitCommandBuffer));
     VkCommandBufferBeginInfo beginInfo = {};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    VK_CHECK(vkBeginCommandBuffer(m_computeCommandBuffer, &beginInfo));
+    VK_CHECK(vkBeginCommandBuffer(m_frameDifferenceInitCommandBuffer, &beginInfo));
+    VkImageMemoryBarrier2 imageMemoryBarrier{.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                                             .srcStageMask = VK_PIPELINE_STAGE_2_NONE,
+                                             .srcAccessMask = VK_ACCESS_2_NONE,
+                                             .dstStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                                             .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                             .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                                             .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                             .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                             .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                             .image = m_previousLumaImage,
+                                             .subresourceRange = viewInfo.subresourceRange};
+    VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
+                                       .imageMemoryBarrierCount = 1,
+                                       .pImageMemoryBarriers = &imageMemoryBarrier};
+    vkCmdPipelineBarrier2(m_frameDifferenceInitCommandBuffer, &dependencyInfo);
+    const VkClearColorValue black{};
+    vkCmdClearColorImage(m_frameDifferenceInitCommandBuffer, m_previousLumaImage,
+                         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &black, 1, &viewInfo.subresourceRange);
+    imageMemoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+    imageMemoryBarrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    imageMemoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    vkCmdPipelineBarrier2(m_frameDifferenceInitCommandBuffer, &dependencyInfo);
+    VK_CHECK(vkEndCommandBuffer(m_frameDifferenceInitCommandBuffer));
+
+    const VkCommandBufferSubmitInfo commandBufferInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                                                      .commandBuffer = m_frameDifferenceInitCommandBuffer};
+    const VkSubmitInfo2 submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                                   .commandBufferInfoCount = 1,
+                                   .pCommandBufferInfos = &commandBufferInfo};
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &m_frameDifferenceInitFence));
+    m_encoderDevice->submitCompute(submitInfo, m_frameDifferenceInitFence);
+}
 
-    std::vector<VkImageMemoryBarrier2> barriers;
-    VkImageMemoryBarrier2 imageMemoryBarrier{
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+void VideoEncoder::destroyFrameDifference() {
+    if (!m_frameDifferencePipeline) {
+        return;
+    }
+    VK_CHECK(vkWaitForFences(m_device, 1, &m_frameDifferenceInitFence, VK_TRUE,
+                             std::numeric_limits<uint64_t>::max()));
+    vkDestroyFence(m_device, m_frameDifferenceInitFence, nullptr);
+    vkFreeCommandBuffers(m_device, m_computeCommandPool, 1, &m_frameDifferenceInitCommandBuffer);
+    vkDestroyDescriptorPool(m_device, m_frameDifferenceDescriptorPool, nullptr);
+    m_frameDifferenceDescriptorSets.clear();
+    vmaUnmapMemory(m_allocator, m_changedBlockBufferAllocation);
+    vmaDestroyBuffer(m_allocator, m_changedBlockBuffer, m_changedBlockBufferAllocation);
+    vkDestroyImageView(m_device, m_previousLumaImageView, nullptr);
+    vmaDestroyImage(m_allocator, m_previousLumaImage, m_previousLumaImageAllocation);
+    for (FrameSlot& slot : m_slots) {
+        if (slot.emphasisMapImage) {
+            vkDestroyImageView(m_device, slot.emphasisMapImageView, nullptr);
+            vmaDestroyImage(m_allocator, slot.emphasisMapImage, slot.emphasisMapImageAllocation);
+            slot.emphasisMapImage = VK_NULL_HANDLE;
+            slot.emphasisMapImageView = VK_NULL_HANDLE;
+        }
+    }
+    m_frameDifferencePipeline = nullptr;
+}
+
+void VideoEncoder::recordFrameDifference(VkCommandBuffer cmdBuf, uint32_t slotIx) {
+    const FrameSlot& slot = m_slots[slotIx];
+    // the shader reads the luma of the conversion and the previous luma of the last frame, the counter is reset
+    vkCmdFillBuffer(cmdBuf, m_changedBlockBuffer, slotIx * sizeof(uint32_t), sizeof(uint32_t), 0);
+    const VkMemoryBarrier2 memoryBarrier{
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+        .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT,
         .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
-        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .subresourceRange = {
-            .aspectMask = VK_IMAGE_ASPECT_PLANE_0_BIT | VK_IMAGE_ASPECT_PLANE_1_BIT,
-            .baseMipLevel = 0,
-            .levelCount = 1,
-            .baseArrayLayer = 0,
-            .layerCount = 1,
-        }};
-    // transition YCbCr image (luma and chroma planes) to be shader target
-    imageMemoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
-    imageMemoryBarrier.srcAccessMask = VK_ACCESS_2_NONE;
-    imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imageMemoryBarrier.image = m_yCbCrImage;
-    imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
-    if (m_yCbCrImagePlaneViews.size() >= 3)
-        imageMemoryBarrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_PLANE_2_BIT;
-    barriers.push_back(imageMemoryBarrier);
-    // transition source image to be shader source
-    imageMemoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
-    imageMemoryBarrier.srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
-    imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    imageMemoryBarrier.image = m_inputImages[currentImageIx];
-    imageMemoryBarrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
-    imageMemoryBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barriers.push_back(imageMemoryBarrier);
+        .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT};
+    // the slot's previous frame is encoded, so its emphasis map can be overwritten
+    const VkImageMemoryBarrier2 emphasisMapBarrier{.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                                                   .srcStageMask = VK_PIPELINE_STAGE_2_NONE,
+                                                   .srcAccessMask = VK_ACCESS_2_NONE,
+                                                   .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                                   .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                                                   .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+                                                   .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+                                                   .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                                   .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                                                   .image = slot.emphasisMapImage,
+                                                   .subresourceRange = {
+                                                       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                                       .baseMipLevel = 0,
+                                                       .levelCount = 1,
+                                                       .baseArrayLayer = 0,
+                                                       .layerCount = 1,
+                                                   }};
     VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
-                                       .imageMemoryBarrierCount = static_cast<uint32_t>(barriers.size()),
-                                       .pImageMemoryBarriers = barriers.data()};
-    vkCmdPipelineBarrier2(m_computeCommandBuffer, &dependencyInfo);
-
-    // run the RGB->YCbCr conversion shader
-    vkCmdBindPipeline(m_computeCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_computePipeline);
-    vkCmdBindDescriptorSets(m_computeCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_computePipelineLayout, 0, 1,
-                            &m_computeDescriptorSets[currentImageIx], 0, 0);
-    vkCmdDispatch(m_computeCommandBuffer, (m_width + 15) / 16, (m_height + 15) / 16,
-                  1);  // work item local size = 16x16
-
-    VK_CHECK(vkEndCommandBuffer(m_computeCommandBuffer));
-    VkPipelineStageFlags dstStageMasks[] = {VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
-    VkSemaphore signalSemaphores[] = {m_interQueueSemaphore, m_interQueueSemaphore3};
-    VkSemaphore waitSemaphores[] = {m_interQueueSemaphore2, m_interQueueSemaphore3};
-    VkSubmitInfo submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                            .commandBufferCount = 1,
-                            .pCommandBuffers = &m_computeCommandBuffer,
-                            .signalSemaphoreCount = 2,
-                            .pSignalSemaphores = signalSemaphores};
-    if (m_frameCount != 0) {
-        submitInfo.waitSemaphoreCount = 2;
-        submitInfo.pWaitSemaphores = waitSemaphores;
-        submitInfo.pWaitDstStageMask = dstStageMasks;
-    }
-    VK_CHECK(vkQueueSubmit(m_computeQueue, 1, &submitInfo, VK_NULL_HANDLE));
-}
-
-void VideoEncoder::encodeVideoFrame() {
-    const uint32_t GOP_LENGTH = 16;
-    const uint32_t gopFrameCount = m_frameCount % GOP_LENGTH;
-    // begin command buffer for video encode
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = m_encodeCommandPool;
-    allocInfo.commandBufferCount = 1;
-    VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &m_encodeCommandBuffer));
+                                       .memoryBarrierCount = 1,
+                                       .pMemoryBarriers = &memoryBarrier,
+                                       .imageMemoryBarrierCount = slot.emphasisMapImage ? 1u : 0u,
+                                       .pImageMemoryBarriers = &emphasisMapBarrier};
+    vkCmdPipelineBarrier2(cmdBuf, &dependencyInfo);
+
+    const EncoderDevice::FrameDifferenceParameters parameters{
+        .extent = {static_cast<int32_t>(m_width), static_cast<int32_t>(m_height)},
+        .blockSize = {static_cast<int32_t>(m_differenceBlockSize.width),
+                      static_cast<int32_t>(m_differenceBlockSize.height)},
+        .threshold = m_config.staticBlockThreshold,
+        .counterIndex = slotIx,
+        .writeEmphasisMap = slot.emphasisMapImage ? 1u : 0u};
+    vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_frameDifferencePipeline->pipeline);
+    vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, m_frameDifferencePipeline->pipelineLayout, 0, 1,
+                            &m_frameDifferenceDescriptorSets[slotIx], 0, 0);
+    vkCmdPushConstants(cmdBuf, m_frameDifferencePipeline->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(parameters), &parameters);
+    // one work group per block
+    vkCmdDispatch(cmdBuf, (m_width + m_differenceBlockSize.width - 1) / m_differenceBlockSize.width,
+                  (m_height + m_differenceBlockSize.height - 1) / m_differenceBlockSize.height, 1);
+
+    // the host reads the counter once the conversion has signaled
+    const VkMemoryBarrier2 hostBarrier{.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                                       .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                       .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                                       .dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                       .dstAccessMask = VK_ACCESS_2_HOST_READ_BIT};
+    const VkDependencyInfoKHR hostDependencyInfo{
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR, .memoryBarrierCount = 1, .pMemoryBarriers = &hostBarrier};
+    vkCmdPipelineBarrier2(cmdBuf, &hostDependencyInfo);
+}
+
+void VideoEncoder::convertRGBtoYCbCr(uint32_t slotIx, uint32_t currentImageIx, VkSemaphore waitSemaphore) {
+    FrameSlot& slot = m_slots[slotIx];
+    // the previous user of this slot's YCbCr image has already finished (it was waited for in finishEncode),
+    // so only the encode queue needs to wait for the conversion
+    const VkCommandBufferSubmitInfo commandBufferInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                                                      .commandBuffer = m_inputs[currentImageIx].commandBuffers[slotIx]};
+    const VkSemaphoreSubmitInfo waitInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                         .semaphore = waitSemaphore,
+                                         .stageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT};
+    const VkSemaphoreSubmitInfo signalInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                           .semaphore = m_computeTimelineSemaphore,
+                                           .value = timelineValue(slot.frameCount),
+                                           .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT};
+    const VkSubmitInfo2 submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                                   .waitSemaphoreInfoCount = waitSemaphore ? 1u : 0u,
+                                   .pWaitSemaphoreInfos = &waitInfo,
+                                   .commandBufferInfoCount = 1,
+                                   .pCommandBufferInfos = &commandBufferInfo,
+                                   .signalSemaphoreInfoCount = 1,
+                                   .pSignalSemaphoreInfos = &signalInfo};
+    m_encoderDevice->submitCompute(submitInfo);
+}
+
+void VideoEncoder::signalYCbCrInput(uint32_t slotIx) {
+    // the signal operation covers all earlier submissions to the queue, i.e. the application's pass
+    const VkSemaphoreSubmitInfo signalInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                           .semaphore = m_computeTimelineSemaphore,
+                                           .value = timelineValue(m_slots[slotIx].frameCount),
+                                           .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT};
+    const VkSubmitInfo2 submitInfo{
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2, .signalSemaphoreInfoCount = 1, .pSignalSemaphoreInfos = &signalInfo};
+    m_encoderDevice->submitCompute(submitInfo);
+}
+
+void VideoEncoder::encodeVideoFrame(uint32_t slotIx) {
+    FrameSlot& slot = m_slots[slotIx];
+    // all frames except B frames and the top temporal layer are reference frames
+    const bool isIdr = slot.pictureType == VideoCodec::PictureType::IDR;
+    const bool isI = isIdr || slot.pictureType == VideoCodec::PictureType::I;
+    const bool isB = slot.pictureType == VideoCodec::PictureType::B;
+    const bool isReference =
+        !isB && (m_config.temporalLayerCount == 1 || slot.temporalId < m_config.temporalLayerCount - 1);
+    // the rolling intra refresh continues across I frames
+    int32_t intraSliceIndex = -1;
+    if (m_config.intraRefreshPeriod > 0) {
+        if (m_intraRefreshRequested.exchange(false)) {
+            m_intraRefreshPosition = 0;
+        }
+        intraSliceIndex = isI ? -1 : static_cast<int32_t>(m_intraRefreshPosition);
+        m_intraRefreshPosition = (m_intraRefreshPosition + 1) % m_config.intraRefreshPeriod;
+    }
+    const bool useConstantQp = m_chosenRateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR;
+    const int32_t setupSlot = m_codec->beginPicture(
+        {.type = slot.pictureType,
+         .isReference = isReference,
+         .markLongTerm = m_config.longTermReferenceCount > 0 &&
+                         slot.framesSinceIdr % m_config.longTermReferenceInterval == 0,
+         .frameIndex = slot.frameCount,
+         .framesSinceIdr = slot.framesSinceIdr,
+         .temporalId = slot.temporalId,
+         .constantQp = useConstantQp ? static_cast<int32_t>(m_config.constantQp) : 0,
+         .sliceCount = m_sliceCount,
+         .intraSliceIndex = intraSliceIndex,
+         .maxL0References = isB ? m_maxBL0References : m_maxL0References,
+         .maxL1References = m_maxL1References});
+    slot.isIdr = isIdr;
+    slot.headerPending = isIdr;
+    slot.header = &m_bitStreamHeaders.back();
+    slot.encodeCount = m_encodeCount++;
+    // begin command buffer for video encode (this implicitly resets the slot's command buffer)
     VkCommandBufferBeginInfo beginInfo = {};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    VK_CHECK(vkBeginCommandBuffer(m_encodeCommandBuffer, &beginInfo));
-    const uint32_t querySlotId = 0;
-    vkCmdResetQueryPool(m_encodeCommandBuffer, m_queryPool, querySlotId, 1);
+    VK_CHECK(vkBeginCommandBuffer(slot.encodeCommandBuffer, &beginInfo));
+    const uint32_t querySlotId = slotIx;
+    vkCmdResetQueryPool(slot.encodeCommandBuffer, m_queryPool, querySlotId, 1);
+    const uint32_t timestampQuery = slotIx * TIMESTAMPS_PER_SLOT;
+    if (m_encodeTimestampMask) {
+        vkCmdResetQueryPool(slot.encodeCommandBuffer, m_timestampQueryPool, timestampQuery + TIMESTAMP_ENCODE_BEGIN,
+                            2);
+    }
+
+    // the reference pictures are written by previous frames, which may still be encoding
+    VkMemoryBarrier2 dpbMemoryBarrier{.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                                      .srcStageMask = VK_PIPELINE_STAGE_2_VIDEO_ENCODE_BIT_KHR,
+                                      .srcAccessMask = VK_ACCESS_2_VIDEO_ENCODE_WRITE_BIT_KHR,
+                                      .dstStageMask = VK_PIPELINE_STAGE_2_VIDEO_ENCODE_BIT_KHR,
+                                      .dstAccessMask = VK_ACCESS_2_VIDEO_ENCODE_READ_BIT_KHR |
+                                                       VK_ACCESS_2_VIDEO_ENCODE_WRITE_BIT_KHR};
+    VkDependencyInfoKHR dpbDependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
+                                          .memoryBarrierCount = 1,
+                                          .pMemoryBarriers = &dpbMemoryBarrier};
+    vkCmdPipelineBarrier2(slot.encodeCommandBuffer, &dpbDependencyInfo);
 
     // start a video encode session
-    // set an image view as DPB (decoded output picture)
-    VkVideoPictureResourceInfoKHR dpbPicResource = {VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR};
-    dpbPicResource.imageViewBinding = m_dpbImageViews[gopFrameCount & 1];
-    dpbPicResource.codedOffset = {0, 0};
-    dpbPicResource.codedExtent = {m_width, m_height};
-    dpbPicResource.baseArrayLayer = 0;
-    // set an image view as reference picture
-    VkVideoPictureResourceInfoKHR refPicResource = {VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR};
-    refPicResource.imageViewBinding = m_dpbImageViews[!(gopFrameCount & 1)];
-    refPicResource.codedOffset = {0, 0};
-    refPicResource.codedExtent = {m_width, m_height};
-    refPicResource.baseArrayLayer = 0;
-
-    const uint32_t MaxPicOrderCntLsb = 1 << (m_sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
-    StdVideoEncodeH264ReferenceInfo dpbRefInfo = {};
-    dpbRefInfo.FrameNum = gopFrameCount;
-    dpbRefInfo.PicOrderCnt = (dpbRefInfo.FrameNum * 2) % MaxPicOrderCntLsb;
-    dpbRefInfo.primary_pic_type =
-        dpbRefInfo.FrameNum == 0 ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P;
-    VkVideoEncodeH264DpbSlotInfoKHR dpbSlotInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_DPB_SLOT_INFO_KHR};
-    dpbSlotInfo.pNext = nullptr;
-    dpbSlotInfo.pStdReferenceInfo = &dpbRefInfo;
-
-    StdVideoEncodeH264ReferenceInfo refRefInfo = {};
-    refRefInfo.FrameNum = gopFrameCount - 1;
-    refRefInfo.PicOrderCnt = (refRefInfo.FrameNum * 2) % MaxPicOrderCntLsb;
-    refRefInfo.primary_pic_type =
-        refRefInfo.FrameNum == 0 ? STD_VIDEO_H264_PICTURE_TYPE_IDR : STD_VIDEO_H264_PICTURE_TYPE_P;
-    VkVideoEncodeH264DpbSlotInfoKHR refSlotInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_DPB_SLOT_INFO_KHR};
-    refSlotInfo.pNext = nullptr;
-    refSlotInfo.pStdReferenceInfo = &refRefInfo;
-
-    VkVideoReferenceSlotInfoKHR referenceSlots[2];
-    referenceSlots[0].sType = VK_STRUCTURE_TYPE_VIDEO_REFERENCE_SLOT_INFO_KHR;
-    referenceSlots[0].pNext = &dpbSlotInfo;
-    referenceSlots[0].slotIndex = -1;
-    referenceSlots[0].pPictureResource = &dpbPicResource;
-    referenceSlots[1].sType = VK_STRUCTURE_TYPE_VIDEO_REFERENCE_SLOT_INFO_KHR;
-    referenceSlots[1].pNext = &refSlotInfo;
-    referenceSlots[1].slotIndex = !(gopFrameCount & 1);
-    referenceSlots[1].pPictureResource = &refPicResource;
+    // the picture being encoded is set up in a free DPB slot (activated with slotIndex -1 in the begin info),
+    // all slots holding references stay bound, the encode info only gets the ones in the reference lists;
+    // B frames are not reconstructed, so they have no setup slot
+    std::vector<VkVideoPictureResourceInfoKHR> dpbPicResources(m_dpbSlotCount,
+                                                               {VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR});
+    std::vector<VkVideoReferenceSlotInfoKHR> beginReferenceSlots;
+    std::vector<VkVideoReferenceSlotInfoKHR> encodeReferenceSlots;
+    VkVideoReferenceSlotInfoKHR setupReferenceSlot;
+    for (uint32_t i = 0; i < m_dpbSlotCount; i++) {
+        const bool isSetupSlot = static_cast<int32_t>(i) == setupSlot;
+        const void* dpbSlotInfo = m_codec->getDpbSlotInfo(i);
+        if (!dpbSlotInfo) {
+            continue;
+        }
+        dpbPicResources[i].imageViewBinding = m_dpbImageView;
+        dpbPicResources[i].codedOffset = {0, 0};
+        dpbPicResources[i].codedExtent = {m_width, m_height};
+        dpbPicResources[i].baseArrayLayer = i;
+        VkVideoReferenceSlotInfoKHR referenceSlot = {VK_STRUCTURE_TYPE_VIDEO_REFERENCE_SLOT_INFO_KHR};
+        referenceSlot.pNext = dpbSlotInfo;
+        referenceSlot.slotIndex = static_cast<int32_t>(i);
+        referenceSlot.pPictureResource = &dpbPicResources[i];
+        if (isSetupSlot) {
+            setupReferenceSlot = referenceSlot;
+            referenceSlot.slotIndex = -1;
+        } else if (m_codec->isReferenced(i)) {
+            encodeReferenceSlots.push_back(referenceSlot);
+        }
+        beginReferenceSlots.push_back(referenceSlot);
+    }
 
     VkVideoBeginCodingInfoKHR encodeBeginInfo = {VK_STRUCTURE_TYPE_VIDEO_BEGIN_CODING_INFO_KHR};
     encodeBeginInfo.pNext = &m_encodeRateControlInfo;
     encodeBeginInfo.videoSession = m_videoSession;
     encodeBeginInfo.videoSessionParameters = m_videoSessionParameters;
-    encodeBeginInfo.referenceSlotCount = gopFrameCount == 0 ? 1 : 2;
-    encodeBeginInfo.pReferenceSlots = referenceSlots;
-    vkCmdBeginVideoCodingKHR(m_encodeCommandBuffer, &encodeBeginInfo);
+    encodeBeginInfo.referenceSlotCount = static_cast<uint32_t>(beginReferenceSlots.size());
+    encodeBeginInfo.pReferenceSlots = beginReferenceSlots.data();
+    vkCmdBeginVideoCodingKHR(slot.encodeCommandBuffer, &encodeBeginInfo);
+
+    {
+        // the begin info above describes the current rate control state, the update applies from this frame on
+        std::lock_guard<std::mutex> lock(m_rateControlMutex);
+        if (m_rateControlPending) {
+            m_averageBitrate = m_pendingAverageBitrate;
+            m_maxBitrate = m_pendingMaxBitrate;
+            m_rateControlFps = m_pendingFps;
+            m_rateControlPending = false;
+            setRateControlLayers();
+            {
+                std::lock_guard<std::mutex> metricsLock(m_metricsMutex);
+                m_metrics.targetBitrate = getTargetBitrate();
+            }
+
+            VkVideoCodingControlInfoKHR codingControlInfo = {VK_STRUCTURE_TYPE_VIDEO_CODING_CONTROL_INFO_KHR};
+            codingControlInfo.flags = VK_VIDEO_CODING_CONTROL_ENCODE_RATE_CONTROL_BIT_KHR;
+            codingControlInfo.pNext = &m_encodeRateControlInfo;
+            vkCmdControlVideoCodingKHR(slot.encodeCommandBuffer, &codingControlInfo);
+        }
+    }
 
     // transition the YCbCr image to be a video encode source
     VkImageMemoryBarrier2 imageMemoryBarrier{
@@ -791,7 +1861,7 @@ void VideoEncoder::encodeVideoFrame() {
         .dstAccessMask = VK_ACCESS_2_VIDEO_ENCODE_READ_BIT_KHR,
         .oldLayout = VK_IMAGE_LAYOUT_GENERAL,
         .newLayout = VK_IMAGE_LAYOUT_VIDEO_ENCODE_SRC_KHR,
-        .image = m_yCbCrImage,
+        .image = slot.yCbCrImage,
         .subresourceRange = {
             .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
             .baseMipLevel = 0,
@@ -799,65 +1869,102 @@ void VideoEncoder::encodeVideoFrame() {
             .baseArrayLayer = 0,
             .layerCount = 1,
         }};
+    std::vector<VkImageMemoryBarrier2> barriers{imageMemoryBarrier};
+#ifdef VK_KHR_video_encode_quantization_map
+    if (slot.emphasisMapImage) {
+        // and the emphasis map written by the frame difference pass
+        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_VIDEO_ENCODE_QUANTIZATION_MAP_KHR;
+        imageMemoryBarrier.image = slot.emphasisMapImage;
+        barriers.push_back(imageMemoryBarrier);
+    }
+#endif
     VkDependencyInfoKHR dependencyInfo{.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR,
-                                       .imageMemoryBarrierCount = 1,
-                                       .pImageMemoryBarriers = &imageMemoryBarrier};
-    vkCmdPipelineBarrier2(m_encodeCommandBuffer, &dependencyInfo);
+                                       .imageMemoryBarrierCount = static_cast<uint32_t>(barriers.size()),
+                                       .pImageMemoryBarriers = barriers.data()};
+    vkCmdPipelineBarrier2(slot.encodeCommandBuffer, &dependencyInfo);
 
     // set the YCbCr image as input picture for the encoder
     VkVideoPictureResourceInfoKHR inputPicResource = {VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR};
-    inputPicResource.imageViewBinding = m_yCbCrImageView;
+    inputPicResource.imageViewBinding = slot.yCbCrImageView;
     inputPicResource.codedOffset = {0, 0};
     inputPicResource.codedExtent = {m_width, m_height};
     inputPicResource.baseArrayLayer = 0;
 
-    // set all the frame parameters
-    h264::FrameInfo frameInfo(gopFrameCount, m_width, m_height, m_sps, m_pps, gopFrameCount,
-                              m_chosenRateControlMode & VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR);
-    VkVideoEncodeH264PictureInfoKHR* encodeH264FrameInfo = frameInfo.getEncodeH264FrameInfo();
-
-    // combine all structures in one control structure
+    // combine all structures in one control structure, the frame parameters come from the codec
     VkVideoEncodeInfoKHR videoEncodeInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_INFO_KHR};
-    videoEncodeInfo.pNext = encodeH264FrameInfo;
+    videoEncodeInfo.pNext = m_codec->getPictureInfo();
     videoEncodeInfo.dstBuffer = m_bitStreamBuffer;
-    videoEncodeInfo.dstBufferOffset = 0;
-    videoEncodeInfo.dstBufferRange = 4 * 1024 * 1024;
+    videoEncodeInfo.dstBufferOffset = slot.bitStreamOffset;
+    videoEncodeInfo.dstBufferRange = m_bitStreamRegionSize;
     videoEncodeInfo.srcPictureResource = inputPicResource;
-    referenceSlots[0].slotIndex = gopFrameCount & 1;
-    videoEncodeInfo.pSetupReferenceSlot = &referenceSlots[0];
-
-    if (gopFrameCount > 0) {
-        videoEncodeInfo.referenceSlotCount = 1;
-        videoEncodeInfo.pReferenceSlots = &referenceSlots[1];
+    videoEncodeInfo.pSetupReferenceSlot = setupSlot >= 0 ? &setupReferenceSlot : nullptr;
+    videoEncodeInfo.referenceSlotCount = static_cast<uint32_t>(encodeReferenceSlots.size());
+    videoEncodeInfo.pReferenceSlots = encodeReferenceSlots.data();
+#ifdef VK_KHR_video_encode_quantization_map
+    VkVideoEncodeQuantizationMapInfoKHR quantizationMapInfo = {
+        VK_STRUCTURE_TYPE_VIDEO_ENCODE_QUANTIZATION_MAP_INFO_KHR};
+    if (slot.emphasisMapImage) {
+        // one texel per block of the coded size
+        quantizationMapInfo.pNext = videoEncodeInfo.pNext;
+        quantizationMapInfo.quantizationMap = slot.emphasisMapImageView;
+        quantizationMapInfo.quantizationMapExtent = {
+            (m_width + m_differenceBlockSize.width - 1) / m_differenceBlockSize.width,
+            (m_height + m_differenceBlockSize.height - 1) / m_differenceBlockSize.height};
+        videoEncodeInfo.pNext = &quantizationMapInfo;
+        videoEncodeInfo.flags |= VK_VIDEO_ENCODE_WITH_EMPHASIS_MAP_BIT_KHR;
     }
+#endif
 
+    if (m_encodeTimestampMask) {
+        vkCmdWriteTimestamp2(slot.encodeCommandBuffer, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, m_timestampQueryPool,
+                             timestampQuery + TIMESTAMP_ENCODE_BEGIN);
+    }
     // prepare the query pool for the resulting bitstream
-    vkCmdBeginQuery(m_encodeCommandBuffer, m_queryPool, querySlotId, VkQueryControlFlags());
+    vkCmdBeginQuery(slot.encodeCommandBuffer, m_queryPool, querySlotId, VkQueryControlFlags());
     // encode the frame as video
-    vkCmdEncodeVideoKHR(m_encodeCommandBuffer, &videoEncodeInfo);
+    vkCmdEncodeVideoKHR(slot.encodeCommandBuffer, &videoEncodeInfo);
     // end the query for the result
-    vkCmdEndQuery(m_encodeCommandBuffer, m_queryPool, querySlotId);
+    vkCmdEndQuery(slot.encodeCommandBuffer, m_queryPool, querySlotId);
+    if (m_encodeTimestampMask) {
+        vkCmdWriteTimestamp2(slot.encodeCommandBuffer, VK_PIPELINE_STAGE_2_VIDEO_ENCODE_BIT_KHR, m_timestampQueryPool,
+                             timestampQuery + TIMESTAMP_ENCODE_END);
+    }
     // finish the video session
     VkVideoEndCodingInfoKHR encodeEndInfo = {VK_STRUCTURE_TYPE_VIDEO_END_CODING_INFO_KHR};
-    vkCmdEndVideoCodingKHR(m_encodeCommandBuffer, &encodeEndInfo);
+    vkCmdEndVideoCodingKHR(slot.encodeCommandBuffer, &encodeEndInfo);
 
     // run the encoding
-    VK_CHECK(vkEndCommandBuffer(m_encodeCommandBuffer));
-    VkPipelineStageFlags dstStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-    VkSubmitInfo submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                            .waitSemaphoreCount = 1,
-                            .pWaitSemaphores = &m_interQueueSemaphore,
-                            .pWaitDstStageMask = &dstStageMask,
-                            .commandBufferCount = 1,
-                            .pCommandBuffers = &m_encodeCommandBuffer,
-                            .signalSemaphoreCount = 1,
-                            .pSignalSemaphores = &m_interQueueSemaphore2};
-    VK_CHECK(vkResetFences(m_device, 1, &m_encodeFinishedFence));
-    VK_CHECK(vkQueueSubmit(m_encodeQueue, 1, &submitInfo, m_encodeFinishedFence));
-}
-
-void VideoEncoder::getOutputVideoPacket(const char*& data, size_t& size) {
-    VK_CHECK(vkWaitForFences(m_device, 1, &m_encodeFinishedFence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+    VK_CHECK(vkEndCommandBuffer(slot.encodeCommandBuffer));
+    const VkCommandBufferSubmitInfo commandBufferInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                                                      .commandBuffer = slot.encodeCommandBuffer};
+    const VkSemaphoreSubmitInfo waitInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                         .semaphore = m_computeTimelineSemaphore,
+                                         .value = timelineValue(slot.frameCount),
+                                         .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT};
+    const VkSemaphoreSubmitInfo signalInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                                           .semaphore = m_encodeTimelineSemaphore,
+                                           .value = timelineValue(slot.encodeCount),
+                                           .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT};
+    const VkSubmitInfo2 submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                                   .waitSemaphoreInfoCount = 1,
+                                   .pWaitSemaphoreInfos = &waitInfo,
+                                   .commandBufferInfoCount = 1,
+                                   .pCommandBufferInfos = &commandBufferInfo,
+                                   .signalSemaphoreInfoCount = 1,
+                                   .pSignalSemaphoreInfos = &signalInfo};
+    m_encoderDevice->submitEncode(m_encodeQueueIx, submitInfo);
+    m_pendingSlots.push_back(slotIx);
+
+    m_codec->endPicture();
+}
+
+bool VideoEncoder::getOutputVideoPacket(uint32_t slotIx, EncodedPacket& packet, bool wait) {
+    FrameSlot& slot = m_slots[slotIx];
+    if (wait) {
+        waitForSlot(slotIx);
+    } else if (!isSlotEncoded(slotIx)) {
+        return false;
+    }
 
     struct videoEncodeStatus {
         uint32_t bitstreamStartOffset;
@@ -867,19 +1974,229 @@ void VideoEncoder::getOutputVideoPacket(const char*& data, size_t& size) {
     // get the resulting bitstream
     videoEncodeStatus encodeResult;  // 2nd slot is non vcl data
     memset(&encodeResult, 0, sizeof(encodeResult));
-    const uint32_t querySlotId = 0;
-    VK_CHECK(vkGetQueryPoolResults(m_device, m_queryPool, querySlotId, 1, sizeof(videoEncodeStatus), &encodeResult,
-                                   sizeof(videoEncodeStatus),
-                                   VK_QUERY_RESULT_WITH_STATUS_BIT_KHR | VK_QUERY_RESULT_WAIT_BIT));
+    const uint32_t querySlotId = slotIx;
+    // the encode timeline semaphore has been signaled, so the result is available without VK_QUERY_RESULT_WAIT_BIT
+    VkResult result = vkGetQueryPoolResults(m_device, m_queryPool, querySlotId, 1, sizeof(videoEncodeStatus),
+                                            &encodeResult, sizeof(videoEncodeStatus),
+                                            VK_QUERY_RESULT_WITH_STATUS_BIT_KHR);
+    if (result == VK_NOT_READY) {
+        return false;
+    }
+    VK_CHECK(result);
 
+    // the offset reported by the query is relative to the region of this slot
+    const VkDeviceSize bitStreamOffset = slot.bitStreamOffset + encodeResult.bitstreamStartOffset;
     //  invalidate host caches
-    vmaInvalidateAllocation(m_allocator, m_bitStreamBufferAllocation, encodeResult.bitstreamStartOffset,
-                            encodeResult.bitstreamSize);
+    vmaInvalidateAllocation(m_allocator, m_bitStreamBufferAllocation, bitStreamOffset, encodeResult.bitstreamSize);
     // return bitstream
-    data = m_bitStreamData + encodeResult.bitstreamStartOffset;
-    size = encodeResult.bitstreamSize;
-    printf("Encoded frame %d, status %d, offset %d, size %zd\n", m_frameCount, encodeResult.status,
-           encodeResult.bitstreamStartOffset, size);
+    {
+        std::lock_guard<std::mutex> lock(m_slotMutex);
+        slot.pinned = true;
+    }
+    packet.m_encoder = this;
+    packet.m_codec = m_config.codec;
+    packet.m_slotIx = slotIx;
+    packet.m_data = m_bitStreamData + bitStreamOffset;
+    packet.m_size = encodeResult.bitstreamSize;
+    packet.m_frameIndex = slot.frameCount;
+    packet.m_pts = slot.frameCount;
+    packet.m_dts = getDts(slot);
+    packet.m_isIdr = slot.isIdr;
+    packet.m_temporalId = slot.temporalId;
+    packet.m_isParameterSet = false;
+    packet.m_status = encodeResult.status;
+    readFrameTimings(slotIx, packet.m_timings);
+    const FrameTimings& timings = packet.m_timings;
+    if (!std::isnan(timings.encodeMs)) {
+        m_encoderDevice->addEncodeTime(m_encodeQueueIx, timings.encodeMs);
+    }
+
+    // failed frames are only counted, the consumer sees their status
+    std::lock_guard<std::mutex> lock(m_metricsMutex);
+    m_metrics.framesEncoded++;
+    m_metrics.idrFrames += slot.isIdr ? 1 : 0;
+    m_metrics.bytesOut += packet.m_size;
+    if (encodeResult.status != VK_QUERY_RESULT_STATUS_COMPLETE_KHR) {
+        m_metrics.encodeFailures++;
+        if (encodeResult.status == VK_QUERY_RESULT_STATUS_INSUFFICIENT_BITSTREAM_BUFFER_RANGE_KHR) {
+            m_metrics.insufficientBufferFailures++;
+        }
+    }
+    addStageDuration(m_metrics.convert, timings.convertMs);
+    addStageDuration(m_metrics.encodeQueueWait, timings.encodeQueueWaitMs);
+    addStageDuration(m_metrics.encode, timings.encodeMs);
+    addStageDuration(m_metrics.submitToPacket,
+                     std::chrono::duration<double, std::milli>(timings.readbackTime - timings.submitTime).count());
+    m_lastPacketTime = timings.readbackTime;
+    addToBitrateWindow(packet.m_dts, packet.m_size);
+    return true;
+}
+
+uint64_t VideoEncoder::getTargetBitrate() const {
+    if (m_chosenRateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR) {
+        return 0;
+    }
+    // CBR encodes at the max bitrate, see setRateControlLayers
+    return m_chosenRateControlMode == VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR ? m_maxBitrate : m_averageBitrate;
+}
+
+void VideoEncoder::addToBitrateWindow(int64_t dts, size_t size) {
+    // a second of the stream in the timestamp units of Config::fps, allocated with the first packet
+    if (m_bitrateWindow.size() != m_config.fps) {
+        m_bitrateWindow.assign(m_config.fps, 0);
+        m_bitrateWindowBytes = 0;
+        m_bitrateWindowFirstDts = dts;
+        m_bitrateWindowLastDts = dts;
+    }
+    const int64_t windowSize = static_cast<int64_t>(m_bitrateWindow.size());
+    auto entry = [&](int64_t entryDts) -> uint64_t& {
+        return m_bitrateWindow[static_cast<size_t>((entryDts % windowSize + windowSize) % windowSize)];
+    };
+    // the frames since the newest packet (e.g. skipped ones) replace the oldest in the window
+    for (int64_t entryDts = std::max(m_bitrateWindowLastDts + 1, dts - windowSize + 1); entryDts <= dts; entryDts++) {
+        m_bitrateWindowBytes -= entry(entryDts);
+        entry(entryDts) = 0;
+    }
+    m_bitrateWindowLastDts = std::max(m_bitrateWindowLastDts, dts);
+    // with B frames a packet may be older than the newest one
+    if (dts > m_bitrateWindowLastDts - windowSize) {
+        entry(dts) += size;
+        m_bitrateWindowBytes += size;
+    }
+    const int64_t coveredFrames = std::min(windowSize, m_bitrateWindowLastDts - m_bitrateWindowFirstDts + 1);
+    m_metrics.bitrate = m_bitrateWindowBytes * 8 * m_config.fps / static_cast<uint64_t>(coveredFrames);
+}
+
+VideoEncoder::Metrics VideoEncoder::getMetrics() const {
+    std::lock_guard<std::mutex> lock(m_metricsMutex);
+    Metrics metrics = m_metrics;
+    metrics.pendingFrames = metrics.framesQueued - metrics.framesEncoded - metrics.framesSkipped;
+    metrics.secondsSinceLastPacket =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - m_lastPacketTime).count();
+    return metrics;
+}
+
+// one sample line, the labels without braces
+static void appendPrometheusSample(std::string& text, const std::string& name, const std::string& labels,
+                                   double value) {
+    char number[32];
+    if (std::isnan(value)) {
+        std::snprintf(number, sizeof(number), "NaN");
+    } else {
+        std::snprintf(number, sizeof(number), "%.17g", value);
+    }
+    text += name;
+    if (!labels.empty()) {
+        text += "{" + labels + "}";
+    }
+    text += " ";
+    text += number;
+    text += "\n";
+}
+
+std::string VideoEncoder::formatPrometheus(const std::vector<std::pair<std::string, Metrics>>& sessions) {
+    struct Family {
+        const char* name;
+        const char* type;
+        const char* help;
+        double (*value)(const Metrics&);
+    };
+    static const std::array<Family, 11> families{{
+        {"video_encoder_frames_queued_total", "counter", "Frames queued for encoding.",
+         [](const Metrics& m) { return double(m.framesQueued); }},
+        {"video_encoder_frames_encoded_total", "counter", "Frame packets handed out, including failed ones.",
+         [](const Metrics& m) { return double(m.framesEncoded); }},
+        {"video_encoder_frames_skipped_total", "counter", "Static frames that were not encoded.",
+         [](const Metrics& m) { return double(m.framesSkipped); }},
+        {"video_encoder_idr_frames_total", "counter", "IDR frames encoded.",
+         [](const Metrics& m) { return double(m.idrFrames); }},
+        {"video_encoder_bytes_total", "counter", "Bytes of the frame and parameter set packets.",
+         [](const Metrics& m) { return double(m.bytesOut); }},
+        {"video_encoder_encode_failures_total", "counter", "Frame packets with an unsuccessful query status.",
+         [](const Metrics& m) { return double(m.encodeFailures); }},
+        {"video_encoder_insufficient_buffer_failures_total", "counter",
+         "Frames that did not fit into their bitstream region.",
+         [](const Metrics& m) { return double(m.insufficientBufferFailures); }},
+        {"video_encoder_pending_frames", "gauge", "Queued frames without a packet yet.",
+         [](const Metrics& m) { return double(m.pendingFrames); }},
+        {"video_encoder_target_bitrate_bits_per_second", "gauge", "Target of the rate control, 0 if disabled.",
+         [](const Metrics& m) { return double(m.targetBitrate); }},
+        {"video_encoder_bitrate_bits_per_second", "gauge", "Bitrate of the last second of the stream.",
+         [](const Metrics& m) { return double(m.bitrate); }},
+        {"video_encoder_seconds_since_last_packet", "gauge", "Time since the last frame packet or init.",
+         [](const Metrics& m) { return m.secondsSinceLastPacket; }},
+    }};
+    std::string text;
+    for (const Family& family : families) {
+        text += std::string("# HELP ") + family.name + " " + family.help + "\n";
+        text += std::string("# TYPE ") + family.name + " " + family.type + "\n";
+        for (const auto& [labels, metrics] : sessions) {
+            appendPrometheusSample(text, family.name, labels, family.value(metrics));
+        }
+    }
+
+    // the stage durations as summaries without quantiles
+    static const std::array<std::pair<const char*, StageDuration Metrics::*>, 4> stages{{
+        {"convert", &Metrics::convert},
+        {"encode_queue_wait", &Metrics::encodeQueueWait},
+        {"encode", &Metrics::encode},
+        {"submit_to_packet", &Metrics::submitToPacket},
+    }};
+    text += "# HELP video_encoder_stage_seconds Duration of the encoder stages, GPU time for all but submit_to_packet."
+            "\n# TYPE video_encoder_stage_seconds summary\n";
+    for (const auto& [labels, metrics] : sessions) {
+        for (const auto& [stage, duration] : stages) {
+            const std::string stageLabels = (labels.empty() ? "" : labels + ",") + "stage=\"" + stage + "\"";
+            appendPrometheusSample(text, "video_encoder_stage_seconds_sum", stageLabels,
+                                   (metrics.*duration).sumMs / 1000.0);
+            appendPrometheusSample(text, "video_encoder_stage_seconds_count", stageLabels,
+                                   double((metrics.*duration).count));
+        }
+    }
+    return text;
+}
+
+void VideoEncoder::readFrameTimings(uint32_t slotIx, FrameTimings& timings) {
+    const FrameSlot& slot = m_slots[slotIx];
+    timings = FrameTimings();
+    timings.submitTime = slot.submitTime;
+    timings.readbackTime = std::chrono::steady_clock::now();
+    if (!m_timestampQueryPool) {
+        return;
+    }
+
+    // direct YCbCr input has no conversion timestamps
+    const bool direct = m_config.directYCbCrInput;
+    if (direct && !m_encodeTimestampMask) {
+        return;
+    }
+
+    // the frame is encoded, so all its timestamps are available
+    std::array<uint64_t, TIMESTAMPS_PER_SLOT> timestamps{};
+    const uint32_t first = direct ? TIMESTAMP_ENCODE_BEGIN : TIMESTAMP_CONVERT_BEGIN;
+    const uint32_t count = m_encodeTimestampMask ? TIMESTAMPS_PER_SLOT - first : TIMESTAMP_CONVERT_END + 1;
+    VK_CHECK(vkGetQueryPoolResults(m_device, m_timestampQueryPool, slotIx * TIMESTAMPS_PER_SLOT + first, count,
+                                   count * sizeof(uint64_t), timestamps.data() + first, sizeof(uint64_t),
+                                   VK_QUERY_RESULT_64_BIT));
+    const double msPerTick = m_timestampPeriod / 1e6;
+    if (!direct) {
+        timings.convertMs =
+            ((timestamps[TIMESTAMP_CONVERT_END] - timestamps[TIMESTAMP_CONVERT_BEGIN]) & m_computeTimestampMask) *
+            msPerTick;
+    }
+    if (m_encodeTimestampMask) {
+        timings.encodeMs =
+            ((timestamps[TIMESTAMP_ENCODE_END] - timestamps[TIMESTAMP_ENCODE_BEGIN]) & m_encodeTimestampMask) *
+            msPerTick;
+        if (direct) {
+            return;
+        }
+        // the encode submission waits for the conversion, clamp small skews between the two queues
+        const uint64_t mask = m_computeTimestampMask & m_encodeTimestampMask;
+        const uint64_t encodeBegin = timestamps[TIMESTAMP_ENCODE_BEGIN] & mask;
+        const uint64_t convertEnd = timestamps[TIMESTAMP_CONVERT_END] & mask;
+        timings.encodeQueueWaitMs = encodeBegin > convertEnd ? (encodeBegin - convertEnd) * msPerTick : 0.0;
+    }
 }
 
 void VideoEncoder::deinit() {
@@ -887,43 +2204,73 @@ void VideoEncoder::deinit() {
         return;
     }
 
-    if (m_running) {
-        const char* data;
-        size_t size;
-        getOutputVideoPacket(data, size);
-        vkFreeCommandBuffers(m_device, m_computeCommandPool, 1, &m_computeCommandBuffer);
-        vkFreeCommandBuffers(m_device, m_encodeCommandPool, 1, &m_encodeCommandBuffer);
+    // wait for all frames still in flight, the held B frames are dropped once their conversion is done
+    while (!m_pendingSlots.empty()) {
+        const uint32_t slotIx = m_pendingSlots.front();
+        waitForSlot(slotIx);
+        m_slots[slotIx].inUse = false;
+        m_pendingSlots.pop_front();
+    }
+    if (!m_reorderSlots.empty() || m_staticCandidateSlot >= 0) {
+        waitForConversion(m_frameCount);
+        m_reorderSlots.clear();
+        if (m_staticCandidateSlot >= 0) {
+            m_slots[std::exchange(m_staticCandidateSlot, -1)].inUse = false;
+        }
+    }
+    // a frame acquired for direct input but never queued has no GPU work
+    m_acquiredSlot = -1;
+    // and for the consumers to release all packets
+    {
+        std::unique_lock<std::mutex> lock(m_slotMutex);
+        m_slotReleased.wait(lock, [&] {
+            return std::none_of(m_slots.begin(), m_slots.end(), [](const FrameSlot& slot) { return slot.pinned; });
+        });
     }
-    vkDestroyFence(m_device, m_encodeFinishedFence, nullptr);
-    vkDestroySemaphore(m_device, m_interQueueSemaphore, nullptr);
-    vkDestroySemaphore(m_device, m_interQueueSemaphore2, nullptr);
-    vkDestroySemaphore(m_device, m_interQueueSemaphore3, nullptr);
-    vkDestroyPipeline(m_device, m_computePipeline, nullptr);
-    vkDestroyPipelineLayout(m_device, m_computePipelineLayout, nullptr);
-    vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
-    vkDestroyDescriptorSetLayout(m_device, m_computeDescriptorSetLayout, nullptr);
+    // the conversions of all queued frames are done
+    for (InputImage& input : m_inputs) {
+        if (input.registered) {
+            destroyInputConversion(input);
+        }
+    }
+    m_inputs.clear();
+    destroyFrameDifference();
+    VK_CHECK(vkWaitForFences(m_device, 1, &m_initFence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+    vkDestroyFence(m_device, m_initFence, nullptr);
+    vkFreeCommandBuffers(m_device, m_encodeCommandPool, 1, &m_initCommandBuffer);
+    for (FrameSlot& slot : m_slots) {
+        vkFreeCommandBuffers(m_device, m_encodeCommandPool, 1, &slot.encodeCommandBuffer);
+    }
+    vkDestroySemaphore(m_device, m_computeTimelineSemaphore, nullptr);
+    vkDestroySemaphore(m_device, m_encodeTimelineSemaphore, nullptr);
 
     vkDestroyVideoSessionParametersKHR(m_device, m_videoSessionParameters, nullptr);
+    destroyRetiredSessionParameters(true);
     vkDestroyQueryPool(m_device, m_queryPool, nullptr);
+    if (m_timestampQueryPool) {
+        vkDestroyQueryPool(m_device, m_timestampQueryPool, nullptr);
+    }
     vmaUnmapMemory(m_allocator, m_bitStreamBufferAllocation);
     vmaDestroyBuffer(m_allocator, m_bitStreamBuffer, m_bitStreamBufferAllocation);
-    for (uint32_t i = 0; i < m_yCbCrImagePlaneViews.size(); i++) {
-        vkDestroyImageView(m_device, m_yCbCrImagePlaneViews[i], nullptr);
-    }
-    m_yCbCrImagePlaneViews.clear();
-    vkDestroyImageView(m_device, m_yCbCrImageView, nullptr);
-    vmaDestroyImage(m_allocator, m_yCbCrImage, m_yCbCrImageAllocation);
-    for (uint32_t i = 0; i < m_dpbImages.size(); i++) {
-        vkDestroyImageView(m_device, m_dpbImageViews[i], nullptr);
-        vmaDestroyImage(m_allocator, m_dpbImages[i], m_dpbImageAllocations[i]);
+    for (FrameSlot& slot : m_slots) {
+        for (uint32_t i = 0; i < slot.yCbCrImagePlaneViews.size(); i++) {
+            vkDestroyImageView(m_device, slot.yCbCrImagePlaneViews[i], nullptr);
+        }
+        vkDestroyImageView(m_device, slot.yCbCrImageView, nullptr);
+        vmaDestroyImage(m_allocator, slot.yCbCrImage, slot.yCbCrImageAllocation);
     }
+    m_slots.clear();
+    vkDestroyImageView(m_device, m_dpbImageView, nullptr);
+    vmaDestroyImage(m_allocator, m_dpbImage, m_dpbImageAllocation);
     vkDestroyVideoSessionKHR(m_device, m_videoSession, nullptr);
     for (VmaAllocation& allocation : m_allocations) {
         vmaFreeMemory(m_allocator, allocation);
     }
     m_allocations.clear();
-    m_bitStreamHeader.clear();
+    m_bitStreamHeaders.clear();
     vkDestroyCommandPool(m_device, m_encodeCommandPool, nullptr);
+    vkDestroyCommandPool(m_device, m_computeCommandPool, nullptr);
+    m_encoderDevice->releaseEncodeQueue(m_encodeQueueIx);
 
     m_initialized = false;
 }
@@ -19,107 +19,567 @@
 #include <vma/vk_mem_alloc.h>
 #include <volk/volk.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
-#include "h264parameterset.hpp"
+#include "encoderdevice.hpp"
+#include "h264bitstream.hpp"
+#include "h265bitstream.hpp"
+#include "videocodec.hpp"
+
+class VideoEncoder;
+
+// timing of one frame inside the encoder
+struct FrameTimings {
+    // GPU durations in milliseconds, NAN if the queue does not support timestamps
+    double convertMs{NAN};
+    double encodeMs{NAN};
+    double encodeQueueWaitMs{NAN};  // from the end of the conversion to the start of the encoding
+    // host side
+    std::chrono::steady_clock::time_point submitTime;    // queueEncode
+    std::chrono::steady_clock::time_point readbackTime;  // packet handed out by finishEncode/tryFinishEncode
+};
+
+// One encoded access unit (or the parameter set header) pointing directly into the mapped bitstream buffer.
+// The packet keeps its bitstream region from being reused until it is released or destroyed,
+// so it can be moved to another thread without copying the data.
+// It has to be released before its encoder is deinitialized.
+class EncodedPacket {
+   public:
+    EncodedPacket() = default;
+    EncodedPacket(const EncodedPacket&) = delete;
+    EncodedPacket& operator=(const EncodedPacket&) = delete;
+    EncodedPacket(EncodedPacket&& other) noexcept { *this = std::move(other); }
+    EncodedPacket& operator=(EncodedPacket&& other) noexcept {
+        if (this != &other) {
+            release();
+            m_encoder = std::exchange(other.m_encoder, nullptr);
+            m_codec = other.m_codec;
+            m_slotIx = other.m_slotIx;
+            m_data = std::exchange(other.m_data, nullptr);
+            m_size = std::exchange(other.m_size, 0);
+            m_frameIndex = other.m_frameIndex;
+            m_pts = other.m_pts;
+            m_dts = other.m_dts;
+            m_isIdr = other.m_isIdr;
+            m_temporalId = other.m_temporalId;
+            m_isParameterSet = other.m_isParameterSet;
+            m_status = other.m_status;
+            m_timings = other.m_timings;
+        }
+        return *this;
+    }
+    ~EncodedPacket() { release(); }
+
+    // hands the bitstream region back to the encoder, the data must not be accessed afterwards
+    void release();
+
+    explicit operator bool() const { return m_data != nullptr; }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    // index of the frame in the order of queueEncode, the header belongs to the first frame after it
+    uint32_t frameIndex() const { return m_frameIndex; }
+    // presentation timestamp in units of 1 / fps
+    uint64_t pts() const { return m_pts; }
+    // decoding timestamp in units of 1 / fps, packets are returned in decoding order; with B frames it lags one
+    // frame behind to stay below the pts (-1 for the first frame)
+    int64_t dts() const { return m_dts; }
+    bool isIdr() const { return m_isIdr; }
+    // temporal layer, receivers of the layers up to n can drop all packets above n (0 for the parameter sets)
+    uint32_t temporalId() const { return m_temporalId; }
+    // true for the SPS/PPS (H.265 also VPS) header, which is not part of a frame slot
+    bool isParameterSet() const { return m_isParameterSet; }
+    Codec codec() const { return m_codec; }
+    VkQueryResultStatusKHR status() const { return m_status; }
+    const FrameTimings& timings() const { return m_timings; }
+    // NAL units of the packet, with Config::mbRowsPerSlice each slice is a NAL unit of its own which can be sent
+    // as soon as the packet is available (the implementation reports no per slice feedback, so this parses the data)
+    std::vector<h264::NalUnit> nalUnits() const {
+        return h264::splitNalUnits(reinterpret_cast<const uint8_t*>(m_data), m_size);
+    }
+    // the same with the H.265 NAL unit header fields, for Codec::H265 packets
+    std::vector<h265::NalUnit> h265NalUnits() const {
+        return h265::splitNalUnits(reinterpret_cast<const uint8_t*>(m_data), m_size);
+    }
+
+   private:
+    friend class VideoEncoder;
+
+    VideoEncoder* m_encoder{nullptr};  // only set if the packet pins a frame slot
+    Codec m_codec{Codec::H264};
+    uint32_t m_slotIx{0};
+    const char* m_data{nullptr};
+    size_t m_size{0};
+    uint32_t m_frameIndex{0};
+    uint64_t m_pts{0};
+    int64_t m_dts{0};
+    bool m_isIdr{false};
+    uint32_t m_temporalId{0};
+    bool m_isParameterSet{false};
+    VkQueryResultStatusKHR m_status{VK_QUERY_RESULT_STATUS_COMPLETE_KHR};
+    FrameTimings m_timings;
+};
 
 class VideoEncoder {
    public:
-    void init(VkPhysicalDevice physicalDevice, VkDevice device, VmaAllocator allocator, uint32_t computeQueueFamily,
-              VkQueue computeQueue, VkCommandPool computeCommandPool, uint32_t encodeQueueFamily, VkQueue encodeQueue,
-              const std::vector<VkImage>& inputImages, const std::vector<VkImageView>& inputImageViews, uint32_t width,
-              uint32_t height, uint32_t fps);
-    void queueEncode(uint32_t currentImageIx);
-    void finishEncode(const char*& data, size_t& size);
+    // for gopLength and idrPeriod
+    static const uint32_t INFINITE_GOP = UINT32_MAX;
+    static const uint32_t MAX_TEMPORAL_LAYERS = VideoCodec::MAX_TEMPORAL_LAYERS;
+
+    // Tuning of the implementation: DEFAULT passes no usage hints and uses quality level 0, LOW_LATENCY hints streaming
+    // with low latency tuning on the lowest quality level, HIGH_QUALITY recording with high quality tuning on the
+    // highest one. With a preset the rate control mode recommended for the quality level is used if it is one of
+    // Config::rateControlModes.
+    enum class Preset { DEFAULT, LOW_LATENCY, HIGH_QUALITY };
+    // "default", "low-latency" or "high-quality", returns false for any other name
+    static bool parsePreset(const std::string& name, Preset& preset);
+    // "h264" or "h265", returns false for any other name
+    static bool parseCodec(const std::string& name, Codec& codec);
+
+    // Encoder parameters, validated against the capabilities of the implementation in init.
+    // The defaults are a compromise, e.g. low latency streaming would use CBR, a short virtual buffer and an
+    // infinite GOP, archival VBR and a long GOP.
+    struct Config {
+        uint32_t fps{30};
+        uint32_t pipelineDepth{2};  // frames in flight
+        // the first mode in this list supported by the implementation is used
+        std::vector<VkVideoEncodeRateControlModeFlagBitsKHR> rateControlModes{
+            VK_VIDEO_ENCODE_RATE_CONTROL_MODE_VBR_BIT_KHR, VK_VIDEO_ENCODE_RATE_CONTROL_MODE_CBR_BIT_KHR,
+            VK_VIDEO_ENCODE_RATE_CONTROL_MODE_DISABLED_BIT_KHR};
+        uint64_t averageBitrate{5000000};  // bits per second, CBR uses maxBitrate
+        uint64_t maxBitrate{20000000};
+        uint32_t virtualBufferSizeInMs{200};
+        uint32_t initialVirtualBufferSizeInMs{100};
+        uint32_t constantQp{26};  // used if rate control is disabled
+        uint32_t gopLength{16};   // distance of I frames
+        uint32_t idrPeriod{16};   // distance of IDR frames, a multiple of gopLength or INFINITE_GOP
+        // frames of one rolling intra refresh cycle, 0 disables it: P frames are split into this many slices and one
+        // slice per frame is coded as I slice, so the picture is refreshed without the bitrate spike of an IDR frame
+        uint32_t intraRefreshPeriod{0};
+        // block rows (macroblocks of 16 lines, H.265 coding tree blocks of up to 64 lines) per slice, 0 for one
+        // slice per frame (or one per intra refresh frame); with intra refresh the resulting slice count has to be
+        // the intra refresh period
+        uint32_t mbRowsPerSlice{0};
+        // reference frames kept in the DPB (SPS max_num_ref_frames), P frames reference as many of them as the
+        // implementation supports
+        uint32_t referenceFrameCount{1};
+        // every longTermReferenceInterval frames a frame is kept as long-term reference, up to
+        // longTermReferenceCount (< referenceFrameCount, 0 disables it, H.264 only), so requestRecovery can go back
+        // further
+        uint32_t longTermReferenceCount{0};
+        uint32_t longTermReferenceInterval{0};
+        // B frames between two I or P frames, for archival encodes: they are held back until the following I/P
+        // frame is queued (so they need pipelineDepth > bFrameCount) and are no references themselves
+        uint32_t bFrameCount{0};
+        // dyadic temporal layers (up to MAX_TEMPORAL_LAYERS, no B frames): each layer doubles the frame rate of the
+        // layers below and only references them, the top layer is no reference, so a receiver can drop the upper
+        // layers (EncodedPacket::temporalId); needs referenceFrameCount >= 2^(temporalLayerCount - 2) and a GOP
+        // length which is a multiple of 2^(temporalLayerCount - 1)
+        uint32_t temporalLayerCount{1};
+        // percent of the bitrates used by the layers up to layer i, increasing up to 100, empty for an even split
+        std::vector<uint32_t> temporalLayerBitratePercent;
+        // largest size resize may switch to, 0 for the init size: the session and all images are allocated for it
+        uint32_t maxWidth{0};
+        uint32_t maxHeight{0};
+        // the application writes the YCbCr source images itself (acquireYCbCrInputFrame), instead of the RGB input
+        // images being converted by the encoder
+        bool directYCbCrInput{false};
+        // YCbCr conversion of the RGB input (BT.601 or BT.709), signaled in the VUI
+        VkSamplerYcbcrModelConversion yCbCrModel{VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709};
+        VkSamplerYcbcrRange yCbCrRange{VK_SAMPLER_YCBCR_RANGE_ITU_NARROW};
+        // the encode extension of the codec has to be enabled on the device
+        Codec codec{Codec::H264};
+        StdVideoH264ProfileIdc profileIdc{STD_VIDEO_H264_PROFILE_IDC_MAIN};
+        StdVideoH264LevelIdc levelIdc{STD_VIDEO_H264_LEVEL_IDC_4_1};
+        StdVideoH265ProfileIdc h265ProfileIdc{STD_VIDEO_H265_PROFILE_IDC_MAIN};
+        StdVideoH265LevelIdc h265LevelIdc{STD_VIDEO_H265_LEVEL_IDC_4_1};
+        Preset preset{Preset::DEFAULT};
+        // in [0, maxQualityLevels) of the implementation, higher is slower with better quality; -1 for the preset's
+        int32_t qualityLevel{-1};
+        // Content adaptive encoding (RGB input only): after the conversion a compute pass compares the luma of every
+        // block with the previous frame. With maxStaticFrameSkip > 0 (no B frames) up to that many frames in a row
+        // without a changed block are not encoded, they get no packet and leave a gap in the pts; a frame that may be
+        // skipped is held back until the next frame is queued, when its frame difference result is ready.
+        uint32_t maxStaticFrameSkip{0};
+        // a block has changed if the sum of its absolute 8 bit luma differences is above this
+        uint32_t staticBlockThreshold{0};
+        // the same pass writes an emphasis map, so the rate control (CBR or VBR) spends the bits on the changed
+        // blocks; needs VK_KHR_video_encode_quantization_map enabled on the device
+        bool emphasisMap{false};
+
+        bool operator==(const Config&) const = default;
+    };
+
+    // source image of one frame for Config::directYCbCrInput
+    struct YCbCrInputFrame {
+        uint32_t index;  // of the image in [0, pipelineDepth), e.g. for descriptor sets per image
+        VkImage image;
+        // storage views of the planes: R8 luma and RG8 CbCr, or R8 luma, Cb and Cr
+        std::vector<VkImageView> planeViews;
+    };
+
+    // RGB source image of the conversion, e.g. imported with EncoderDevice::importImage. The view needs storage
+    // usage. All writes of the producer are done before the frame is queued: on the compute queue, or signaled by
+    // the wait semaphore of queueEncode.
+    struct InputImageInfo {
+        VkImage image;
+        VkImageView imageView;
+        // state the producer leaves the image in
+        VkImageLayout layout{VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+        VkPipelineStageFlags2 srcStageMask{VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT};
+        VkAccessFlags2 srcAccessMask{VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT};
+        // e.g. VK_QUEUE_FAMILY_EXTERNAL or VK_QUEUE_FAMILY_FOREIGN_EXT: the image is acquired from this family
+        // before each conversion and released back to it in the original layout afterwards
+        uint32_t srcQueueFamily{VK_QUEUE_FAMILY_IGNORED};
+    };
+
+    // count and sum in milliseconds of one stage over the frames that measured it
+    struct StageDuration {
+        uint64_t count{0};
+        double sumMs{0};
+    };
+    // Counters of the session since init, for monitoring many sessions (e.g. alerting on stalls and bitrate drift)
+    // without per frame logging. Packets count when they are handed out by finishEncode/tryFinishEncode.
+    struct Metrics {
+        uint64_t framesQueued{0};
+        uint64_t framesEncoded{0};  // frame packets, including failed ones
+        uint64_t framesSkipped{0};  // static frames, see Config::maxStaticFrameSkip
+        uint64_t idrFrames{0};
+        uint64_t bytesOut{0};  // of the frames and parameter sets
+        // frame packets with a status other than VK_QUERY_RESULT_STATUS_COMPLETE_KHR, and the ones of them that did
+        // not fit into their bitstream region
+        uint64_t encodeFailures{0};
+        uint64_t insufficientBufferFailures{0};
+        uint64_t pendingFrames{0};  // queued frames without a packet yet
+        uint64_t targetBitrate{0};  // of the current rate control in bits per second, 0 if disabled
+        uint64_t bitrate{0};        // of the packets of the last second of the stream, by decode time
+        StageDuration convert;
+        StageDuration encodeQueueWait;
+        StageDuration encode;
+        StageDuration submitToPacket;
+        double secondsSinceLastPacket{0};  // or since init, a stall if frames are pending
+    };
+    // Prometheus text exposition format of the metrics of several sessions, each with the labels of its samples
+    // (e.g. `session="0"`, empty for none), so every metric family is described once.
+    static std::string formatPrometheus(const std::vector<std::pair<std::string, Metrics>>& sessions);
+
+    // the session uses the queues and conversion pipelines of encoderDevice, which has to outlive it;
+    // the input images are registered with default InputImageInfo at the indices [0, inputImages.size()),
+    // with Config::directYCbCrInput there are no input images
+    void init(EncoderDevice& encoderDevice, const std::vector<VkImage>& inputImages,
+              const std::vector<VkImageView>& inputImageViews, uint32_t width, uint32_t height, const Config& config);
+    // Changes the coded size from the next queued frame on, up to Config::maxWidth x maxHeight, without
+    // reallocating anything: the held B frames are encoded at the old size, the next frame is an IDR frame with new
+    // SPS/PPS. Blocks until the conversions of the queued frames are done. The input images may keep their size:
+    // the conversion writes the whole coded size, repeating the last column/row of smaller input images.
+    void resize(uint32_t width, uint32_t height);
+    uint32_t getWidth() const { return m_width; }
+    uint32_t getHeight() const { return m_height; }
+    // Returns the index of the image for queueEncode, reusing the ones of unregistered images. The conversion
+    // command buffers of the image are recorded here, so it can be called again whenever the producer rotates
+    // its buffers, but not per frame.
+    uint32_t registerInputImage(const InputImageInfo& info);
+    // blocks until the last queued conversion from the image is done, the image may be destroyed afterwards
+    void unregisterInputImage(uint32_t inputIx);
+    // Input image pool: returns a registered image that is neither acquired nor read by a queued conversion, so the
+    // producer may write it. Blocks only if every image is still being converted, until the first of them is done.
+    // The image returns to the pool when its conversion is done after queueEncode, or with releaseInputImage.
+    uint32_t acquireInputImage();
+    // returns an acquired image to the pool without encoding it
+    void releaseInputImage(uint32_t inputIx);
+    // Blocks while the packets of all free slots are still held by a consumer. The conversion waits for the binary
+    // waitSemaphore if given, e.g. a sync fd of the producer imported with vkImportSemaphoreFdKHR.
+    void queueEncode(uint32_t currentImageIx, VkSemaphore waitSemaphore = VK_NULL_HANDLE);
+    // Direct YCbCr input: reserves the source image of the next frame, blocks like queueEncode. The application
+    // writes it through the plane views or with copy commands in VK_IMAGE_LAYOUT_GENERAL (the previous content is
+    // undefined) in a pass submitted with EncoderDevice::submitCompute, then queues it with queueYCbCrEncode.
+    YCbCrInputFrame acquireYCbCrInputFrame();
+    void queueYCbCrEncode();
+    // 2 or 3, the planes of the source images
+    uint32_t getYCbCrPlaneCount() const { return m_yCbCrPlaneCount; }
+    // Encodes the B frames held back for the next I/P frame, the last one becomes a P frame.
+    // Called by finishEncode when no other frame is left, e.g. at the end of the stream.
+    void flush();
+    // returns false if no frame is in flight
+    bool finishEncode(EncodedPacket& packet);
+    // returns false instead of blocking if the oldest frame is not encoded yet
+    bool tryFinishEncode(EncodedPacket& packet);
     void deinit();
 
+    // Changes the rate control of the running session from the next queued frame on, without a session reset or an
+    // IDR frame. May be called from any thread. The per frame size must stay within the one of the initial config.
+    // fps only changes the frame rate the rate control assumes, the timestamps stay in units of 1 / Config::fps.
+    void setRateControl(uint64_t averageBitrate, uint64_t maxBitrate, uint32_t fps);
+    // The next queued frame is encoded as IDR frame preceded by SPS/PPS, e.g. after the receiver lost a packet.
+    // May be called from any thread.
+    void requestKeyframe() { m_keyframeRequested = true; }
+    // Restarts the intra refresh cycle with the next queued frame, requests a keyframe if intra refresh is disabled.
+    void requestIntraRefresh();
+    // Loss feedback: the receiver has decoded all frames up to frameIndex. May be called from any thread.
+    void acknowledgeFrame(uint32_t frameIndex);
+    // The next queued frame only references the newest acknowledged frame still in the DPB (and older ones),
+    // so the receiver can recover without an IDR frame. Without such a reference a keyframe is sent instead.
+    // May be called from any thread.
+    void requestRecovery() { m_recoveryRequested = true; }
+
+    // true if all frame slots are in flight or held back: finishEncode has to be called before the next queueEncode
+    bool isPipelineFull() const { return getPendingFrameCount() == m_slots.size(); }
+    size_t getPendingFrameCount() const {
+        return m_pendingSlots.size() + m_reorderSlots.size() + (m_staticCandidateSlot >= 0 ? 1 : 0);
+    }
+
+    // frames are counted from 0 in the order of queueEncode
+    uint32_t getQueuedFrameCount() const { return m_frameCount; }
+    // blocks until the GPU has finished encoding the given frame, flushes it if it is held back
+    void waitForFrame(uint32_t frameIndex);
+    bool isFrameEncoded(uint32_t frameIndex);
+    // snapshot of the counters, may be called from any thread
+    Metrics getMetrics() const;
+
     ~VideoEncoder() { deinit(); }
 
    private:
-    void createEncodeCommandPool();
+    // resources needed by one frame while it is in flight
+    struct FrameSlot {
+        VkImage yCbCrImage;
+        VmaAllocation yCbCrImageAllocation;
+        VkImageView yCbCrImageView;
+        std::vector<VkImageView> yCbCrImagePlaneViews;
+        // written by the frame difference pass, VK_NULL_HANDLE without Config::emphasisMap
+        VkImage emphasisMapImage;
+        VmaAllocation emphasisMapImageAllocation;
+        VkImageView emphasisMapImageView;
+        VkDeviceSize bitStreamOffset;
+        VkCommandBuffer encodeCommandBuffer;
+        uint32_t frameCount;
+        uint32_t encodeCount;  // index in the order of encoding
+        bool inUse;            // queued and not yet handed out by finishEncode
+        VideoCodec::PictureType pictureType;
+        uint32_t framesSinceIdr;
+        uint32_t temporalId;
+        bool isIdr;
+        bool headerPending;  // SPS/PPS have to be returned before the frame (IDR frames)
+        const std::vector<char>* header;  // of the size the frame is encoded at
+        std::chrono::steady_clock::time_point submitTime;
+        bool pinned;  // an EncodedPacket still points into the bitstream region, guarded by m_slotMutex
+    };
+
+    // conversion resources of a registered input image
+    struct InputImage {
+        InputImageInfo info;
+        bool registered{false};
+        bool acquired{false};  // by the producer, see acquireInputImage
+        VkDescriptorPool descriptorPool;
+        std::vector<VkDescriptorSet> descriptorSets;  // one per frame slot
+        std::vector<VkCommandBuffer> commandBuffers;  // pre-recorded, one per frame slot
+        uint32_t queuedFrameCount;                    // frames queued up to the last one converted from it
+    };
+
+    friend class EncodedPacket;
+    void releaseSlot(uint32_t slotIx);
+
+    void createCommandPools();
+    void allocateEncodeCommandBuffers();
     void createVideoSession();
+    void validateConfig(const VkVideoCapabilitiesKHR& capabilities,
+                        const VkVideoEncodeCapabilitiesKHR& encodeCapabilities, const VideoCodec::Limits& limits,
+                        const EncoderDevice::QualityLevelProperties* qualityLevelProperties);
     void allocateVideoSessionMemory();
-    void createVideoSessionParameters(uint32_t fps);
+    void createVideoSessionParameters();
+    void updateSliceCount();
+    void destroyRetiredSessionParameters(bool all);
     void readBitstreamHeader();
     void allocateOutputBitStream();
-    void allocateReferenceImages(uint32_t count);
-    void allocateIntermediateImage();
+    void allocateReferenceImages();
+    void allocateIntermediateImages();
     void createOutputQueryPool();
-    void createYCbCrConversionPipeline(const std::vector<VkImageView>& inputImageViews);
-    void initRateControl(VkCommandBuffer cmdBuf, uint32_t fps);
+    void createInputConversion(InputImage& input);
+    void destroyInputConversion(InputImage& input);
+    void initRateControl(VkCommandBuffer cmdBuf);
+    void setRateControlLayers();
+    VkDeviceSize getBitStreamRegionSize(uint64_t maxBitrate, uint32_t fps) const;
     void transitionImagesInitial(VkCommandBuffer cmdBuf);
+    void recordConversionCommandBuffers(InputImage& input);
+    void createFrameDifference();
+    void destroyFrameDifference();
+    void recordFrameDifference(VkCommandBuffer cmdBuf, uint32_t slotIx);
+    // skips the frame of m_staticCandidateSlot if it has no changed block, otherwise schedules it
+    void decideStaticCandidate();
 
-    void convertRGBtoYCbCr(uint32_t currentImageIx);
-    void encodeVideoFrame();
-    void getOutputVideoPacket(const char*& data, size_t& size);
+    uint32_t acquireSlot();
+    void queueSlot(uint32_t slotIx);
+    // assigns the GOP position of a queued frame and encodes it, or holds it back as B frame
+    void scheduleSlot(uint32_t slotIx);
+    void convertRGBtoYCbCr(uint32_t slotIx, uint32_t currentImageIx, VkSemaphore waitSemaphore);
+    void signalYCbCrInput(uint32_t slotIx);
+    void encodeVideoFrame(uint32_t slotIx);
+    void encodeAnchorFrame(uint32_t slotIx);
+    bool finishOldestFrame(EncodedPacket& packet, bool wait);
+    bool getOutputVideoPacket(uint32_t slotIx, EncodedPacket& packet, bool wait);
+    uint32_t getTemporalId(uint32_t framesSinceIdr) const;
+    int32_t findSlot(uint32_t frameIndex) const;
+    void waitForSlot(uint32_t slotIx);
+    bool isSlotEncoded(uint32_t slotIx);
+    // blocks until the conversions of the first frameCount frames are done
+    void waitForConversion(uint32_t frameCount);
+    static uint64_t timelineValue(uint32_t frameIndex) { return static_cast<uint64_t>(frameIndex) + 1; }
+    // the first P frame after B frames is decoded one frame before it is presented; without B frames the decoding
+    // time is the presentation time, so the gaps of skipped frames stay in the timestamps
+    int64_t getDts(const FrameSlot& slot) const {
+        return m_config.bFrameCount > 0 ? static_cast<int64_t>(slot.encodeCount) - 1 : slot.frameCount;
+    }
+    void readFrameTimings(uint32_t slotIx, FrameTimings& timings);
+    uint64_t getTargetBitrate() const;
+    // adds a packet to Metrics::bitrate, called with m_metricsMutex held
+    void addToBitrateWindow(int64_t dts, size_t size);
 
     bool m_initialized{false};
-    bool m_running{false};
+    EncoderDevice* m_encoderDevice;
+    uint32_t m_encodeQueueIx;  // of m_encoderDevice
     VkPhysicalDevice m_physicalDevice;
     VkDevice m_device;
     VmaAllocator m_allocator;
-    VkQueue m_computeQueue;
-    VkQueue m_encodeQueue;
     uint32_t m_computeQueueFamily;
     uint32_t m_encodeQueueFamily;
+    // per session, as command pools need external synchronization
     VkCommandPool m_computeCommandPool;
     VkCommandPool m_encodeCommandPool;
-    std::vector<VkImage> m_inputImages;
-    uint32_t m_width;
+    std::vector<InputImage> m_inputs;
+    uint32_t m_width;  // coded size
     uint32_t m_height;
+    uint32_t m_maxWidth;  // allocated size
+    uint32_t m_maxHeight;
+    VkExtent2D m_minCodedExtent;
+    Config m_config;
 
+    std::unique_ptr<VideoCodec> m_codec;
     VkVideoSessionKHR m_videoSession;
     std::vector<VmaAllocation> m_allocations;
-    StdVideoH264SequenceParameterSetVui m_vui;
-    StdVideoH264SequenceParameterSet m_sps;
-    StdVideoH264PictureParameterSet m_pps;
     VkVideoSessionParametersKHR m_videoSessionParameters;
-    VkVideoEncodeH264ProfileInfoKHR m_encodeH264ProfileInfoExt;
+    // parameters of previous sizes, destroyed when the frames encoded before resize
+    // (up to the given m_encodeCount) are done
+    std::vector<std::pair<VkVideoSessionParametersKHR, uint32_t>> m_retiredSessionParameters;
+    VkVideoEncodeUsageInfoKHR m_encodeUsageInfo;
     VkVideoProfileInfoKHR m_videoProfile;
     VkVideoProfileListInfoKHR m_videoProfileList;
 
+    uint32_t m_qualityLevel;
     VkVideoEncodeRateControlModeFlagBitsKHR m_chosenRateControlMode;
     VkFormat m_chosenSrcImageFormat;
     VkFormat m_chosenDpbImageFormat;
 
-    VkVideoEncodeH264RateControlLayerInfoKHR m_encodeH264RateControlLayerInfo = {
-        VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_RATE_CONTROL_LAYER_INFO_KHR};
-    VkVideoEncodeRateControlLayerInfoKHR m_encodeRateControlLayerInfo = {
-        VK_STRUCTURE_TYPE_VIDEO_ENCODE_RATE_CONTROL_LAYER_INFO_KHR};
-    VkVideoEncodeH264RateControlInfoKHR m_encodeH264RateControlInfo = {
-        VK_STRUCTURE_TYPE_VIDEO_ENCODE_H264_RATE_CONTROL_INFO_KHR};
+    // one rate control layer per temporal layer, the codec specific structures are chained from m_codec
+    std::array<VkVideoEncodeRateControlLayerInfoKHR, MAX_TEMPORAL_LAYERS> m_encodeRateControlLayerInfos;
     VkVideoEncodeRateControlInfoKHR m_encodeRateControlInfo = {VK_STRUCTURE_TYPE_VIDEO_ENCODE_RATE_CONTROL_INFO_KHR};
+    uint64_t m_maxSupportedBitrate;
+    // current rate control, the one of m_config until setRateControl changes it
+    uint64_t m_averageBitrate;
+    uint64_t m_maxBitrate;
+    uint32_t m_rateControlFps;
+    // set by setRateControl, applied with the next encoded frame
+    std::mutex m_rateControlMutex;
+    bool m_rateControlPending{false};
+    uint64_t m_pendingAverageBitrate;
+    uint64_t m_pendingMaxBitrate;
+    uint32_t m_pendingFps;
+
+    const EncoderDevice::ConversionPipeline* m_conversionPipeline;  // owned by m_encoderDevice
 
-    VkDescriptorSetLayout m_computeDescriptorSetLayout;
-    VkPipelineLayout m_computePipelineLayout;
-    VkPipeline m_computePipeline;
-    VkDescriptorPool m_descriptorPool;
-    std::vector<VkDescriptorSet> m_computeDescriptorSets;
+    // frame difference pass of Config::maxStaticFrameSkip and Config::emphasisMap, m_frameDifferencePipeline is
+    // null without them
+    const EncoderDevice::ConversionPipeline* m_frameDifferencePipeline;  // owned by m_encoderDevice
+    VkImage m_previousLumaImage;  // R8, compute queue only, the luma of the last converted frame
+    VmaAllocation m_previousLumaImageAllocation;
+    VkImageView m_previousLumaImageView;
+    VkBuffer m_changedBlockBuffer;  // host visible, one count per frame slot
+    VmaAllocation m_changedBlockBufferAllocation;
+    uint32_t* m_changedBlockCounts;
+    VkDescriptorPool m_frameDifferenceDescriptorPool;
+    std::vector<VkDescriptorSet> m_frameDifferenceDescriptorSets;  // one per frame slot
+    // clears the previous luma, on the compute queue before the first conversion
+    VkCommandBuffer m_frameDifferenceInitCommandBuffer;
+    VkFence m_frameDifferenceInitFence;
+    VkExtent2D m_differenceBlockSize;  // the emphasis map texel size or 16x16
+    VkFormat m_emphasisMapFormat;      // VK_FORMAT_UNDEFINED without Config::emphasisMap
+    uint32_t m_staticFrameCount;       // skipped in a row
 
-    VkSemaphore m_interQueueSemaphore;
-    VkSemaphore m_interQueueSemaphore2;
-    VkSemaphore m_interQueueSemaphore3;
+    // updated by the encoding thread, read by getMetrics
+    mutable std::mutex m_metricsMutex;
+    Metrics m_metrics;
+    std::chrono::steady_clock::time_point m_lastPacketTime;
+    // bytes per decode time of the last fps frames, indexed by dts modulo fps
+    std::vector<uint64_t> m_bitrateWindow;
+    uint64_t m_bitrateWindowBytes;
+    int64_t m_bitrateWindowFirstDts;  // of the first packet since the window was (re)started
+    int64_t m_bitrateWindowLastDts;
 
     VkQueryPool m_queryPool;
+    // per frame slot: conversion begin/end and encode begin/end
+    enum { TIMESTAMP_CONVERT_BEGIN, TIMESTAMP_CONVERT_END, TIMESTAMP_ENCODE_BEGIN, TIMESTAMP_ENCODE_END,
+           TIMESTAMPS_PER_SLOT };
+    VkQueryPool m_timestampQueryPool;  // VK_NULL_HANDLE if the compute queue has no timestamps
+    uint64_t m_computeTimestampMask;   // valid bits of the timestamps, 0 if not supported
+    uint64_t m_encodeTimestampMask;
+    float m_timestampPeriod;  // nanoseconds per timestamp tick
     VkBuffer m_bitStreamBuffer;
     VmaAllocation m_bitStreamBufferAllocation;
-    std::vector<char> m_bitStreamHeader;
-    bool m_bitStreamHeaderPending;
+    VkDeviceSize m_bitStreamRegionSize;  // sized for the worst case frame at the maximum resolution and bitrate
+    VkDeviceSize m_minBitstreamBufferOffsetAlignment;
+    VkDeviceSize m_minBitstreamBufferSizeAlignment;
+    // parameter sets of every size since init, the newest one is current; a deque keeps the headers of packets in place
+    std::deque<std::vector<char>> m_bitStreamHeaders;
 
     char* m_bitStreamData;
 
-    VkImage m_yCbCrImage;
-    VmaAllocation m_yCbCrImageAllocation;
-    VkImageView m_yCbCrImageView;
-    std::vector<VkImageView> m_yCbCrImagePlaneViews;
+    uint32_t m_yCbCrPlaneCount;
 
-    std::vector<VkImage> m_dpbImages;
-    std::vector<VmaAllocation> m_dpbImageAllocations;
-    std::vector<VkImageView> m_dpbImageViews;
+    // one array layer per DPB slot
+    VkImage m_dpbImage;
+    VmaAllocation m_dpbImageAllocation;
+    VkImageView m_dpbImageView;
 
     uint32_t m_frameCount;
+    uint32_t m_encodeCount;  // frames submitted to the encode queue
+    // position in the GOP structure of the next frame
+    uint32_t m_framesSinceIdr;
+    uint32_t m_sliceCount;
+    uint32_t m_maxSliceCount;  // of the implementation
+    uint32_t m_blockSize;      // lines of the block rows slices consist of
+    uint32_t m_intraRefreshPosition;  // index of the next I slice
+    std::atomic<bool> m_keyframeRequested{false};
+    std::atomic<bool> m_intraRefreshRequested{false};
+    std::atomic<uint32_t> m_acknowledgedFrameCount{0};  // frames decoded by the receiver
+    std::atomic<bool> m_recoveryRequested{false};
+    uint32_t m_dpbSlotCount;
+    uint32_t m_maxActiveReferences;  // of the video session
+    uint32_t m_maxL0References;      // of P frames
+    uint32_t m_maxBL0References;     // of B frames
+    uint32_t m_maxL1References;
+
+    // frame n signals the value n + 1 when its conversion (compute) is done,
+    // the n-th encoded frame (in decoding order) the value n + 1 when its encoding (encode) is done
+    VkSemaphore m_computeTimelineSemaphore;
+    VkSemaphore m_encodeTimelineSemaphore;
+    // rate control reset and initial layouts, ordered before the first frame on the encode queue
+    VkCommandBuffer m_initCommandBuffer;
+    VkFence m_initFence;
 
-    VkFence m_encodeFinishedFence;
-    VkCommandBuffer m_computeCommandBuffer;
-    VkCommandBuffer m_encodeCommandBuffer;
+    std::vector<FrameSlot> m_slots;
+    std::deque<uint32_t> m_pendingSlots;  // slots submitted to the GPU, oldest first
+    std::deque<uint32_t> m_reorderSlots;  // converted B frames waiting for the next I/P frame, in display order
+    int32_t m_acquiredSlot{-1};           // reserved by acquireYCbCrInputFrame, -1 for none
+    // converted frame that may be skipped as static, decided when the next frame is queued or with flush; -1 for none
+    int32_t m_staticCandidateSlot{-1};
+    // packets may be released from any thread
+    std::mutex m_slotMutex;
+    std::condition_variable m_slotReleased;
 };
@@ -0,0 +1,284 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#include "vulkancontext.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#define VK_NO_PROTOTYPES
+#define VMA_STATIC_VULKAN_FUNCTIONS 0
+#define VMA_DYNAMIC_VULKAN_FUNCTIONS 1
+#define VMA_IMPLEMENTATION
+#include <vma/vk_mem_alloc.h>
+#define VOLK_IMPLEMENTATION
+#include <volk/volk.h>
+
+#include "utility.hpp"
+
+const std::vector<const char *> deviceExtensions = {
+    VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME, VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
+    VK_KHR_VIDEO_ENCODE_QUEUE_EXTENSION_NAME, VK_KHR_VIDEO_ENCODE_H264_EXTENSION_NAME};
+// enabled if supported, for importing input images of other processes and APIs (EncoderDevice::importImage)
+const std::vector<const char *> optionalDeviceExtensions = {
+    VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME, VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME,
+    VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME, VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+    VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME};
+// enabled if supported, for VideoEncoder::Config::codec Codec::H265
+const std::vector<const char *> optionalCodecExtensions = {VK_KHR_VIDEO_ENCODE_H265_EXTENSION_NAME};
+
+void VulkanContext::init() {
+    volkInitialize();
+    createInstance();
+    volkLoadInstance(instance);
+    pickPhysicalDevice();
+    createLogicalDevice();
+    volkLoadDevice(device);
+    createAllocator();
+    createCommandPool();
+}
+
+void VulkanContext::deinit() {
+    vkDestroyCommandPool(device, commandPool, nullptr);
+    vmaDestroyAllocator(allocator);
+    vkDestroyDevice(device, nullptr);
+    vkDestroyInstance(instance, nullptr);
+}
+
+void VulkanContext::createInstance() {
+    const VkApplicationInfo appInfo{.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+                                    .pApplicationName = "Vulkan Sample",
+                                    .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
+                                    .pEngineName = "No Engine",
+                                    .engineVersion = VK_MAKE_VERSION(1, 0, 0),
+                                    .apiVersion = VK_API_VERSION_1_3};
+
+    auto extensions = getRequiredExtensions();
+    const VkInstanceCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+                                          .pApplicationInfo = &appInfo,
+                                          .enabledExtensionCount = static_cast<uint32_t>(extensions.size()),
+                                          .ppEnabledExtensionNames = extensions.data()};
+
+    VK_CHECK(vkCreateInstance(&createInfo, nullptr, &instance));
+}
+
+void VulkanContext::pickPhysicalDevice() {
+    uint32_t deviceCount = 0;
+    vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
+
+    if (deviceCount == 0) {
+        throw std::runtime_error("failed to find GPUs with Vulkan support!");
+    }
+
+    std::vector<VkPhysicalDevice> devices(deviceCount);
+    vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
+
+    for (const auto &device : devices) {
+        if (isDeviceSuitable(device)) {
+            physicalDevice = device;
+            break;
+        }
+    }
+
+    if (physicalDevice == VK_NULL_HANDLE) {
+        throw std::runtime_error("failed to find a suitable GPU!");
+    }
+    queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    std::cout << "Using device: " << properties.deviceName << "\n";
+}
+
+void VulkanContext::createLogicalDevice() {
+    const QueueFamilyIndices &indices = queueFamilyIndices;
+    const std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(),
+                                                    indices.videoEncodeFamily.value()};
+    // all queues of the encode family, so that sessions can be spread over several encoder engines
+    const std::vector<float> queuePriorities(std::max(indices.videoEncodeQueueCount, 1u), 1.0f);
+    std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+    for (uint32_t queueFamily : uniqueQueueFamilies) {
+        const uint32_t queueCount =
+            queueFamily == indices.videoEncodeFamily.value() ? static_cast<uint32_t>(queuePriorities.size()) : 1;
+        const VkDeviceQueueCreateInfo queueCreateInfo{.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                                                      .queueFamilyIndex = queueFamily,
+                                                      .queueCount = queueCount,
+                                                      .pQueuePriorities = queuePriorities.data()};
+        queueCreateInfos.push_back(queueCreateInfo);
+    }
+
+    const VkPhysicalDeviceFeatures deviceFeatures{};
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES, .timelineSemaphore = VK_TRUE};
+
+    VkPhysicalDeviceSynchronization2Features synchronization2_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+        .pNext = &timeline_semaphore_features,
+        .synchronization2 = VK_TRUE};
+
+    VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR,
+        .pNext = &synchronization2_features,
+        .dynamicRendering = VK_TRUE};
+
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, availableExtensions.data());
+    std::set<std::string> available;
+    for (const auto &extension : availableExtensions) {
+        available.insert(extension.extensionName);
+    }
+    std::vector<const char *> extensions = deviceExtensions;
+    for (const char *extension : optionalDeviceExtensions) {
+        if (available.count(extension)) {
+            extensions.push_back(extension);
+        }
+    }
+    for (const char *extension : optionalCodecExtensions) {
+        if (available.count(extension)) {
+            extensions.push_back(extension);
+        }
+    }
+    externalMemoryFdSupported = available.count(VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME) > 0;
+    dmaBufSupported = externalMemoryFdSupported && available.count(VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME) &&
+                      available.count(VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME);
+    externalSemaphoreFdSupported = available.count(VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME) > 0;
+    queueFamilyForeignSupported = available.count(VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME) > 0;
+    videoEncodeH265Supported = available.count(VK_KHR_VIDEO_ENCODE_H265_EXTENSION_NAME) > 0;
+
+    const void *featureChain = &dynamic_rendering_features;
+#ifdef VK_KHR_video_encode_quantization_map
+    // enabled if supported, for VideoEncoder::Config::emphasisMap
+    VkPhysicalDeviceVideoEncodeQuantizationMapFeaturesKHR quantization_map_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_ENCODE_QUANTIZATION_MAP_FEATURES_KHR};
+    if (available.count(VK_KHR_VIDEO_ENCODE_QUANTIZATION_MAP_EXTENSION_NAME)) {
+        VkPhysicalDeviceFeatures2 features{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+                                           .pNext = &quantization_map_features};
+        vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+        if (quantization_map_features.videoEncodeQuantizationMap) {
+            extensions.push_back(VK_KHR_VIDEO_ENCODE_QUANTIZATION_MAP_EXTENSION_NAME);
+            quantization_map_features.pNext = &dynamic_rendering_features;
+            featureChain = &quantization_map_features;
+            videoEncodeQuantizationMapSupported = true;
+        }
+    }
+#endif
+
+    const VkDeviceCreateInfo createInfo{.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+                                        .pNext = featureChain,
+                                        .queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size()),
+                                        .pQueueCreateInfos = queueCreateInfos.data(),
+                                        .enabledLayerCount = 0,
+                                        .enabledExtensionCount = static_cast<unsigned int>(extensions.size()),
+                                        .ppEnabledExtensionNames = extensions.data(),
+                                        .pEnabledFeatures = &deviceFeatures};
+
+    VK_CHECK(vkCreateDevice(physicalDevice, &createInfo, nullptr, &device));
+
+    vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
+    videoEncodeQueues.resize(queuePriorities.size());
+    for (uint32_t i = 0; i < videoEncodeQueues.size(); i++) {
+        vkGetDeviceQueue(device, indices.videoEncodeFamily.value(), i, &videoEncodeQueues[i]);
+    }
+    videoEncodeQueue = videoEncodeQueues[0];
+    std::cout << "Using " << videoEncodeQueues.size() << " video encode queue(s)\n";
+}
+
+void VulkanContext::createAllocator() {
+    const VmaVulkanFunctions vulkanFunctions = {.vkGetInstanceProcAddr = vkGetInstanceProcAddr,
+                                                .vkGetDeviceProcAddr = vkGetDeviceProcAddr};
+
+    const VmaAllocatorCreateInfo allocatorInfo{.physicalDevice = physicalDevice,
+                                               .device = device,
+                                               .pVulkanFunctions = &vulkanFunctions,
+                                               .instance = instance,
+                                               .vulkanApiVersion = VK_API_VERSION_1_3};
+
+    VK_CHECK(vmaCreateAllocator(&allocatorInfo, &allocator));
+}
+
+void VulkanContext::createCommandPool() {
+    const VkCommandPoolCreateInfo poolInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                                           .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+                                           .queueFamilyIndex = queueFamilyIndices.graphicsFamily.value()};
+
+    VK_CHECK(vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool));
+}
+
+bool VulkanContext::isDeviceSuitable(VkPhysicalDevice device) {
+    QueueFamilyIndices indices = findQueueFamilies(device);
+
+    bool extensionsSupported = checkDeviceExtensionSupport(device);
+
+    return indices.isComplete() && extensionsSupported;
+}
+
+bool VulkanContext::checkDeviceExtensionSupport(VkPhysicalDevice device) {
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+
+    std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+
+    std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+
+    for (const auto &extension : availableExtensions) {
+        requiredExtensions.erase(extension.extensionName);
+    }
+
+    return requiredExtensions.empty();
+}
+
+QueueFamilyIndices VulkanContext::findQueueFamilies(VkPhysicalDevice device) {
+    QueueFamilyIndices indices;
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
+
+    int i = 0;
+    for (const auto &queueFamily : queueFamilies) {
+        if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            indices.graphicsFamily = i;
+        }
+
+        if (queueFamily.queueFlags & VK_QUEUE_VIDEO_ENCODE_BIT_KHR) {
+            indices.videoEncodeFamily = i;
+            indices.videoEncodeQueueCount = queueFamily.queueCount;
+        }
+
+        if (indices.isComplete()) {
+            break;
+        }
+
+        i++;
+    }
+
+    return indices;
+}
+
+std::vector<const char *> VulkanContext::getRequiredExtensions() {
+    std::vector<const char *> extensions;
+
+    return extensions;
+}
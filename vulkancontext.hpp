@@ -0,0 +1,68 @@
+/*
+ * Vulkan Video Encode Extension - Simple Example
+ *
+ * Copyright (c) 2024 Bernhard C. Schrenk <clemy@clemy.org>
+ *   University of Vienna
+ *   https://www.univie.ac.at/
+ * developed during the courses "Cloud Gaming" & "Practical Course 1"
+ *   supervised by Univ.-Prof. Dipl.-Ing. Dr. Helmut Hlavacs <helmut.hlavacs@univie.ac.at>
+ *     University of Vienna
+ *     Research Group "EDEN - Education, Didactics and Entertainment Computing"
+ *     https://eden.cs.univie.ac.at/
+ *
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+#define VK_NO_PROTOTYPES
+#include <vma/vk_mem_alloc.h>
+#include <volk/volk.h>
+
+#include <optional>
+#include <vector>
+
+struct QueueFamilyIndices {
+    std::optional<uint32_t> graphicsFamily;
+    std::optional<uint32_t> videoEncodeFamily;
+    uint32_t videoEncodeQueueCount = 0;  // queues exposed by the encode family, e.g. one per encoder engine
+
+    bool isComplete() { return graphicsFamily.has_value() && videoEncodeFamily.has_value(); }
+};
+
+// Instance, device, queues and allocator shared by the sample application and the benchmark.
+class VulkanContext {
+   public:
+    void init();
+    void deinit();
+
+    VkInstance instance;
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    VkDevice device;
+    VmaAllocator allocator;
+    QueueFamilyIndices queueFamilyIndices;
+    VkQueue graphicsQueue;
+    VkQueue videoEncodeQueue;               // videoEncodeQueues[0]
+    std::vector<VkQueue> videoEncodeQueues;  // every queue of the encode family
+    VkCommandPool commandPool;  // graphics queue, individually resettable command buffers
+    // optional extensions for importing input images and semaphores, see EncoderDevice::importImage
+    bool externalMemoryFdSupported = false;     // VK_KHR_external_memory_fd
+    bool dmaBufSupported = false;               // and VK_EXT_external_memory_dma_buf, VK_EXT_image_drm_format_modifier
+    bool externalSemaphoreFdSupported = false;  // VK_KHR_external_semaphore_fd
+    bool queueFamilyForeignSupported = false;   // VK_EXT_queue_family_foreign
+    // optional codecs besides H.264
+    bool videoEncodeH265Supported = false;  // VK_KHR_video_encode_h265
+    // VK_KHR_video_encode_quantization_map with its feature, needs headers that define it
+    bool videoEncodeQuantizationMapSupported = false;
+
+   private:
+    void createInstance();
+    void pickPhysicalDevice();
+    void createLogicalDevice();
+    void createAllocator();
+    void createCommandPool();
+    bool isDeviceSuitable(VkPhysicalDevice device);
+    bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+    QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
+    std::vector<const char *> getRequiredExtensions();
+};